@@ -0,0 +1,406 @@
+#define _GNU_SOURCE
+
+// HTTP load generator for the bench suite. Each thread drives its share
+// of the connections from an epoll loop, timing every response, and the
+// run is summarised as one JSON object on stdout.
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#define HEAD_MAX 8192
+#define READ_CHUNK (64 << 10)
+#define UPLOAD_SIZE (64 << 10)
+#define BOUNDARY "benchBoundary7d9c29a"
+
+// Log-linear latency buckets, as in the server's metrics: 16 per power
+// of two of nanoseconds up to 2^36 (about 69 s).
+#define SUB_BITS 4
+#define SUB_COUNT (1 << SUB_BITS)
+#define MAX_EXP 36
+#define NBUCKETS (SUB_COUNT + (MAX_EXP - SUB_BITS) * SUB_COUNT)
+
+typedef struct {
+    const char *name;
+    int close;          // a new connection per request
+    int depth;          // requests written back to back (pipelining)
+    const char *path;
+    int upload;         // POST a multipart body instead of GET
+} scenario_t;
+
+static const scenario_t scenarios[] = {
+    { "keepalive", 0, 1, "/index.html", 0 },
+    { "close", 1, 1, "/index.html", 0 },
+    { "pipeline", 0, 16, "/index.html", 0 },
+    { "large", 0, 1, "/_bench/large.bin", 0 },
+    { "upload", 0, 1, "/upload", 1 },
+    { "idle", 0, 1, "/index.html", 0 },
+};
+
+typedef struct {
+    int fd;
+    int connecting;
+    size_t wpos;        // bytes of the request batch written
+    int inflight;       // responses still expected for the batch
+    uint64_t sent_at;
+    char head[HEAD_MAX];
+    size_t head_len;
+    long long body_left; // -1 while reading a response head
+    int server_close;   // the response said Connection: close
+} lconn_t;
+
+typedef struct {
+    pthread_t thread;
+    int nconns;
+    unsigned long requests;
+    unsigned long errors;
+    unsigned long long bytes;
+    unsigned long buckets[NBUCKETS];
+    uint64_t max_ns;
+} worker_t;
+
+static struct sockaddr_in target;
+static const scenario_t *sc;
+static char *request;       // one batch: depth requests
+static size_t request_len;
+static atomic_int stop;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int bucket_of(uint64_t ns) {
+    if (ns < SUB_COUNT) return (int)ns;
+    int exp = 63 - __builtin_clzll(ns);
+    if (exp >= MAX_EXP) return NBUCKETS - 1;
+    int sub = (int)(ns >> (exp - SUB_BITS)) - SUB_COUNT;
+    return SUB_COUNT + (exp - SUB_BITS) * SUB_COUNT + sub;
+}
+
+static uint64_t bucket_end(int i) {
+    if (i < SUB_COUNT) return (uint64_t)i + 1;
+    int exp = SUB_BITS + (i - SUB_COUNT) / SUB_COUNT;
+    uint64_t sub = (i - SUB_COUNT) % SUB_COUNT;
+    return (SUB_COUNT + sub + 1) << (exp - SUB_BITS);
+}
+
+static void build_request(const char *host) {
+    char one[1024];
+    size_t body_len = 0;
+    char *body = NULL;
+    int n;
+    if (sc->upload) {
+        static const char pre[] = "--" BOUNDARY "\r\n"
+            "Content-Disposition: form-data; name=\"f\"; filename=\"bench.bin\"\r\n"
+            "Content-Type: application/octet-stream\r\n\r\n";
+        static const char post[] = "\r\n--" BOUNDARY "--\r\n";
+        body_len = sizeof(pre) - 1 + UPLOAD_SIZE + sizeof(post) - 1;
+        body = malloc(body_len);
+        memcpy(body, pre, sizeof(pre) - 1);
+        memset(body + sizeof(pre) - 1, 'x', UPLOAD_SIZE);
+        memcpy(body + sizeof(pre) - 1 + UPLOAD_SIZE, post, sizeof(post) - 1);
+        n = snprintf(one, sizeof(one),
+                     "POST %s HTTP/1.1\r\nHost: %s\r\n"
+                     "Content-Type: multipart/form-data; boundary=" BOUNDARY "\r\n"
+                     "Content-Length: %zu\r\n%s\r\n",
+                     sc->path, host, body_len, sc->close ? "Connection: close\r\n" : "");
+    } else {
+        n = snprintf(one, sizeof(one), "GET %s HTTP/1.1\r\nHost: %s\r\n%s\r\n", sc->path,
+                     host, sc->close ? "Connection: close\r\n" : "");
+    }
+    size_t one_len = n + body_len;
+    request_len = one_len * sc->depth;
+    request = malloc(request_len);
+    for (int i = 0; i < sc->depth; i++) {
+        memcpy(request + i * one_len, one, n);
+        if (body) memcpy(request + i * one_len + n, body, body_len);
+    }
+    free(body);
+}
+
+static int conn_open(int epfd, lconn_t *c) {
+    c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (c->fd < 0) return -1;
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    c->connecting = 1;
+    c->wpos = 0;
+    c->inflight = 0;
+    c->head_len = 0;
+    c->body_left = -1;
+    c->server_close = 0;
+    c->sent_at = now_ns();
+    if (connect(c->fd, (struct sockaddr *)&target, sizeof(target)) < 0 && errno != EINPROGRESS) {
+        close(c->fd);
+        c->fd = -1;
+        return -1;
+    }
+    struct epoll_event ev = { .events = EPOLLOUT, .data.ptr = c };
+    return epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev);
+}
+
+static void conn_close(lconn_t *c) {
+    if (c->fd >= 0) close(c->fd);
+    c->fd = -1;
+}
+
+static void set_events(int epfd, lconn_t *c, uint32_t events) {
+    struct epoll_event ev = { .events = events, .data.ptr = c };
+    epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+// Start (or continue) writing the request batch.
+static int conn_send(int epfd, lconn_t *c) {
+    if (c->wpos == 0) {
+        if (!c->connecting || !sc->close) c->sent_at = now_ns();
+        c->inflight = sc->depth;
+    }
+    c->connecting = 0;
+    while (c->wpos < request_len) {
+        ssize_t w = send(c->fd, request + c->wpos, request_len - c->wpos, MSG_NOSIGNAL);
+        if (w < 0) {
+            if (errno == EAGAIN) {
+                set_events(epfd, c, EPOLLOUT);
+                return 0;
+            }
+            return -1;
+        }
+        c->wpos += w;
+    }
+    set_events(epfd, c, EPOLLIN);
+    return 0;
+}
+
+static int parse_head(lconn_t *c) {
+    int status = 0;
+    if (sscanf(c->head, "HTTP/1.%*d %d", &status) != 1) return -1;
+    c->body_left = 0;
+    for (char *line = strstr(c->head, "\r\n"); line; line = strstr(line + 2, "\r\n")) {
+        if (strncasecmp(line + 2, "Content-Length:", 15) == 0)
+            c->body_left = strtoll(line + 17, NULL, 10);
+        else if (strncasecmp(line + 2, "Connection: close", 17) == 0)
+            c->server_close = 1;
+    }
+    return status >= 200 && status < 300 ? 0 : -1;
+}
+
+// Consume response bytes; returns -1 on a malformed or failed response.
+static int conn_feed(worker_t *w, lconn_t *c, const char *data, size_t len) {
+    while (len > 0) {
+        if (c->body_left < 0) {
+            size_t take = len < HEAD_MAX - 1 - c->head_len ? len : HEAD_MAX - 1 - c->head_len;
+            size_t before = c->head_len;
+            memcpy(c->head + c->head_len, data, take);
+            c->head_len += take;
+            c->head[c->head_len] = '\0';
+            char *end = strstr(c->head, "\r\n\r\n");
+            if (!end) {
+                if (c->head_len == HEAD_MAX - 1) return -1;
+                data += take;
+                len -= take;
+                continue;
+            }
+            size_t used = end + 4 - c->head - before;
+            end[2] = '\0';
+            data += used;
+            len -= used;
+            c->head_len = 0;
+            if (parse_head(c) < 0) return -1;
+        }
+        size_t take = (unsigned long long)c->body_left < len ? (size_t)c->body_left : len;
+        c->body_left -= take;
+        data += take;
+        len -= take;
+        if (c->body_left == 0) {
+            uint64_t ns = now_ns() - c->sent_at;
+            w->buckets[bucket_of(ns)]++;
+            if (ns > w->max_ns) w->max_ns = ns;
+            w->requests++;
+            c->inflight--;
+            c->body_left = -1;
+        }
+    }
+    return 0;
+}
+
+// Read what is available; returns 1 once the batch is answered, 0 to
+// wait for more, -1 on error.
+static int conn_recv(worker_t *w, lconn_t *c) {
+    static _Thread_local char buf[READ_CHUNK];
+    for (;;) {
+        ssize_t r = recv(c->fd, buf, sizeof(buf), 0);
+        if (r < 0) return errno == EAGAIN ? 0 : -1;
+        if (r == 0) return -1;
+        w->bytes += r;
+        if (conn_feed(w, c, buf, r) < 0) return -1;
+        if (c->inflight == 0) return 1;
+    }
+}
+
+static void *run(void *arg) {
+    worker_t *w = arg;
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    lconn_t *conns = calloc(w->nconns, sizeof(*conns));
+    if (epfd < 0 || !conns) {
+        perror("worker");
+        exit(1);
+    }
+    for (int i = 0; i < w->nconns; i++) {
+        if (conn_open(epfd, &conns[i]) < 0) w->errors++;
+    }
+
+    struct epoll_event events[256];
+    while (!atomic_load(&stop)) {
+        int n = epoll_wait(epfd, events, 256, 100);
+        for (int i = 0; i < n; i++) {
+            lconn_t *c = events[i].data.ptr;
+            int rc;
+            if (c->connecting || c->wpos < request_len) {
+                int err = 0;
+                socklen_t len = sizeof(err);
+                if (c->connecting) getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                rc = err ? -1 : conn_send(epfd, c);
+            } else {
+                rc = conn_recv(w, c);
+            }
+            if (rc == 0) continue;
+            if (rc < 0) w->errors++;
+            if (rc < 0 || sc->close || c->server_close) {
+                conn_close(c);
+                if (conn_open(epfd, c) < 0) w->errors++;
+            } else {
+                c->wpos = 0;
+                if (conn_send(epfd, c) < 0) w->errors++;
+            }
+        }
+    }
+    for (int i = 0; i < w->nconns; i++) conn_close(&conns[i]);
+    free(conns);
+    close(epfd);
+    return NULL;
+}
+
+// Connections that make one request and then sit idle for the whole run.
+static int open_idle(int count, int *fds) {
+    static const char req[] = "GET /index.html HTTP/1.1\r\nHost: bench\r\n\r\n";
+    char buf[READ_CHUNK];
+    for (int i = 0; i < count; i++) {
+        fds[i] = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fds[i] < 0 || connect(fds[i], (struct sockaddr *)&target, sizeof(target)) < 0 ||
+            send(fds[i], req, sizeof(req) - 1, MSG_NOSIGNAL) < 0 ||
+            recv(fds[i], buf, sizeof(buf), 0) <= 0) {
+            perror("idle connection");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static double percentile(const unsigned long *buckets, unsigned long total, double q) {
+    unsigned long rank = (unsigned long)(q * total);
+    if (rank == 0) rank = 1;
+    unsigned long cum = 0;
+    int i = 0;
+    while (i < NBUCKETS - 1 && (cum += buckets[i]) < rank) i++;
+    return (bucket_end(i) - 1) / 1e3;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s -s scenario [-p port] [-c conns] [-t threads] [-d secs] [-i idle]\n"
+                    "scenarios: keepalive close pipeline large upload idle\n", prog);
+}
+
+int main(int argc, char **argv) {
+    int port = 8080, conns = 64, threads = 2, idle = 1000;
+    double duration = 5;
+    const char *name = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:p:c:t:d:i:h")) != -1) {
+        switch (opt) {
+        case 's': name = optarg; break;
+        case 'p': port = atoi(optarg); break;
+        case 'c': conns = atoi(optarg); break;
+        case 't': threads = atoi(optarg); break;
+        case 'd': duration = atof(optarg); break;
+        case 'i': idle = atoi(optarg); break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    for (size_t i = 0; name && i < sizeof(scenarios) / sizeof(scenarios[0]); i++) {
+        if (strcmp(scenarios[i].name, name) == 0) sc = &scenarios[i];
+    }
+    if (!sc || conns < 1 || threads < 1 || duration <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (threads > conns) threads = conns;
+    if (strcmp(sc->name, "idle") != 0) idle = 0;
+
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    target.sin_family = AF_INET;
+    target.sin_port = htons(port);
+    target.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    build_request("bench");
+
+    int *idle_fds = calloc(idle ? idle : 1, sizeof(int));
+    if (!idle_fds || open_idle(idle, idle_fds) < 0) return 1;
+
+    worker_t *workers = calloc(threads, sizeof(*workers));
+    uint64_t start = now_ns();
+    for (int i = 0; i < threads; i++) {
+        workers[i].nconns = conns / threads + (i < conns % threads);
+        pthread_create(&workers[i].thread, NULL, run, &workers[i]);
+    }
+    struct timespec ts = { (time_t)duration, (long)((duration - (time_t)duration) * 1e9) };
+    nanosleep(&ts, NULL);
+    atomic_store(&stop, 1);
+    uint64_t elapsed = now_ns() - start;
+
+    worker_t total = {0};
+    for (int i = 0; i < threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        total.requests += workers[i].requests;
+        total.errors += workers[i].errors;
+        total.bytes += workers[i].bytes;
+        if (workers[i].max_ns > total.max_ns) total.max_ns = workers[i].max_ns;
+        for (int b = 0; b < NBUCKETS; b++) total.buckets[b] += workers[i].buckets[b];
+    }
+    for (int i = 0; i < idle; i++) close(idle_fds[i]);
+
+    double secs = elapsed / 1e9;
+    printf("{\"scenario\": \"%s\", \"connections\": %d, \"idle_connections\": %d, "
+           "\"threads\": %d, \"pipeline_depth\": %d, \"duration_s\": %.3f, "
+           "\"requests\": %lu, \"errors\": %lu, \"rps\": %.1f, \"received_mb_per_s\": %.2f, "
+           "\"latency_us\": {\"p50\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f}}\n",
+           sc->name, conns, idle, threads, sc->depth, secs, total.requests, total.errors,
+           total.requests / secs, total.bytes / secs / (1 << 20),
+           total.requests ? percentile(total.buckets, total.requests, 0.5) : 0,
+           total.requests ? percentile(total.buckets, total.requests, 0.99) : 0,
+           total.requests ? percentile(total.buckets, total.requests, 0.999) : 0,
+           total.max_ns / 1e3);
+    free(workers);
+    free(idle_fds);
+    free(request);
+    return 0;
+}
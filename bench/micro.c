@@ -0,0 +1,154 @@
+#define _GNU_SOURCE
+
+// Microbenchmarks for the request hot path, linked against the server's
+// own objects. Each benchmark runs for at least MIN_TIME_NS and prints its
+// cost per operation; the whole run is one JSON object on stdout.
+
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "arena.h"
+#include "http.h"
+#include "router.h"
+#include "threadpool.h"
+
+#define MIN_TIME_NS 300000000ULL
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Keeps results alive so the compiler cannot drop the work.
+static volatile uintptr_t sink;
+
+static const char small_request[] =
+    "GET /index.html HTTP/1.1\r\n"
+    "Host: localhost:8080\r\n"
+    "User-Agent: curl/8.5.0\r\n"
+    "Accept: */*\r\n"
+    "\r\n";
+
+static const char browser_request[] =
+    "GET /static/app.js?v=1718&lang=en HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "Connection: keep-alive\r\n"
+    "sec-ch-ua: \"Chromium\";v=\"124\", \"Google Chrome\";v=\"124\"\r\n"
+    "sec-ch-ua-mobile: ?0\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) "
+    "Chrome/124.0.0.0 Safari/537.36\r\n"
+    "sec-ch-ua-platform: \"Linux\"\r\n"
+    "Accept: */*\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Sec-Fetch-Mode: no-cors\r\n"
+    "Sec-Fetch-Dest: script\r\n"
+    "Referer: https://www.example.com/\r\n"
+    "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+    "Accept-Language: en-US,en;q=0.9\r\n"
+    "Cookie: session=8f14e45fceea167a5a36dedd4bea2543; theme=dark; consent=1\r\n"
+    "If-None-Match: \"1a2b-3c4d-5e6f\"\r\n"
+    "\r\n";
+
+typedef struct {
+    const char *text;
+    size_t len;
+    char buf[2048];
+    http_parser_t parser;
+    http_request_t req;
+    arena_t arena;
+} parse_ctx_t;
+
+// The parser terminates fields in place, so every round starts from a
+// fresh copy of the request.
+static void bench_parse(void *arg, unsigned long n) {
+    parse_ctx_t *c = arg;
+    for (unsigned long i = 0; i < n; i++) {
+        memcpy(c->buf, c->text, c->len);
+        http_parser_init(&c->parser);
+        sink += parse_http_request(&c->parser, c->buf, c->len, &c->req);
+        arena_reset(&c->arena);
+    }
+}
+
+static const char *const mime_paths[] = {
+    "/index.html", "/css/site.css", "/js/app.js", "/img/logo.png", "/img/photo.jpeg",
+    "/fonts/inter.woff2", "/data/feed.json", "/docs/manual.pdf", "/favicon.ico",
+    "/download/archive.tar.gz", "/README", "/icons/sprite.svg",
+};
+#define NMIME (sizeof(mime_paths) / sizeof(mime_paths[0]))
+
+static void bench_mime(void *arg, unsigned long n) {
+    (void)arg;
+    for (unsigned long i = 0; i < n; i++) sink += (uintptr_t)guess_mime(mime_paths[i % NMIME]);
+}
+
+static atomic_ulong done;
+
+static void noop_task(void *arg) {
+    (void)arg;
+    atomic_fetch_add_explicit(&done, 1, memory_order_relaxed);
+}
+
+// Hand n tasks through the pool's queues and wait until they have run:
+// the path an accepted connection takes in select mode.
+static void bench_queue(void *arg, unsigned long n) {
+    threadpool_t *pool = arg;
+    atomic_store(&done, 0);
+    for (unsigned long i = 0; i < n; i++) {
+        while (threadpool_add(pool, noop_task, NULL) < 0) sched_yield();
+    }
+    while (atomic_load(&done) < n) sched_yield();
+}
+
+// Grow the iteration count until a run takes MIN_TIME_NS, then report
+// that run.
+static void run(const char *name, void (*fn)(void *, unsigned long), void *arg, int first) {
+    unsigned long n = 1;
+    uint64_t t;
+    for (;;) {
+        uint64_t start = now_ns();
+        fn(arg, n);
+        t = now_ns() - start;
+        if (t >= MIN_TIME_NS) break;
+        unsigned long next = t ? n * (MIN_TIME_NS * 12 / 10) / t : n * 100;
+        n = next > n * 100 ? n * 100 : next > n ? next : n + 1;
+    }
+    printf("%s\n    {\"name\": \"%s\", \"iterations\": %lu, \"ns_per_op\": %.2f, "
+           "\"ops_per_s\": %.0f}",
+           first ? "" : ",", name, n, (double)t / n, n / (t / 1e9));
+    fflush(stdout);
+}
+
+int main(void) {
+    static parse_ctx_t small, browser;
+    small.text = small_request;
+    small.len = sizeof(small_request) - 1;
+    small.arena = (arena_t)ARENA_INIT;
+    small.req.arena = &small.arena;
+    browser.text = browser_request;
+    browser.len = sizeof(browser_request) - 1;
+    browser.arena = (arena_t)ARENA_INIT;
+    browser.req.arena = &browser.arena;
+
+    threadpool_t *pool = threadpool_create(2, 1024);
+    if (!pool) {
+        perror("threadpool_create");
+        return 1;
+    }
+
+    printf("{\"benchmarks\": [");
+    run("parse_http_request/small", bench_parse, &small, 1);
+    run("parse_http_request/browser", bench_parse, &browser, 0);
+    run("guess_mime", bench_mime, NULL, 0);
+    run("threadpool_queue", bench_queue, pool, 0);
+    printf("\n]}\n");
+
+    threadpool_destroy(pool);
+    arena_free(&small.arena);
+    arena_free(&browser.arena);
+    return 0;
+}
@@ -0,0 +1,43 @@
+#!/bin/sh
+# Start a server on its own port, run every load scenario against it and
+# then the microbenchmarks, and write the results as one JSON document.
+# Tunables: BENCH_PORT, BENCH_DURATION (seconds per scenario), BENCH_CONNS,
+# BENCH_THREADS, BENCH_OUT, and BENCH_MODE (the server's -m event loop).
+set -e
+cd "$(dirname "$0")/.."
+
+PORT=${BENCH_PORT:-18080}
+DURATION=${BENCH_DURATION:-5}
+CONNS=${BENCH_CONNS:-64}
+THREADS=${BENCH_THREADS:-2}
+OUT=${BENCH_OUT:-bench/results.json}
+MODE=${BENCH_MODE:+-m $BENCH_MODE}
+SCENARIOS="keepalive close pipeline large upload idle"
+
+mkdir -p www/_bench
+head -c 8388608 /dev/urandom > www/_bench/large.bin
+# No per-address cap: every bench connection comes from 127.0.0.1.
+./server -p "$PORT" -l 0 -L /dev/null $MODE 2>/dev/null &
+SERVER=$!
+trap 'kill $SERVER 2>/dev/null; rm -rf www/_bench www/uploads/bench.bin' EXIT INT TERM
+sleep 0.5
+
+{
+    printf '{\n  "commit": "%s",\n' "$(git rev-parse --short HEAD 2>/dev/null || echo unknown)"
+    printf '  "date": "%s",\n' "$(date -u +%Y-%m-%dT%H:%M:%SZ)"
+    printf '  "cpus": %s,\n' "$(nproc)"
+    printf '  "mode": "%s",\n' "${BENCH_MODE:-default}"
+    printf '  "load": [\n'
+    sep=""
+    for s in $SCENARIOS; do
+        printf '%s    ' "$sep"
+        bench/load -s "$s" -p "$PORT" -c "$CONNS" -t "$THREADS" -d "$DURATION" | tr -d '\n'
+        sep=",
+"
+    done
+    printf '\n  ],\n  "micro": '
+    bench/micro
+    printf '}\n'
+} > "$OUT.tmp"
+mv "$OUT.tmp" "$OUT"
+cat "$OUT"
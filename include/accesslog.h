@@ -0,0 +1,49 @@
+#ifndef ACCESSLOG_H
+#define ACCESSLOG_H
+
+#include <stdint.h>
+#include "http.h"
+
+// Asynchronous access log. A request is noted in its response when the
+// handler starts and logged once the response is finished (or abandoned
+// with the connection), with the status, bytes sent and latency. Records
+// go into a lock-free ring owned by the finishing thread; a background
+// thread formats them and writes them out in batches, so no worker ever
+// blocks on the log file. Lines look like the Common Log Format with the
+// latency in microseconds appended:
+//
+//   127.0.0.1 - - [18/Oct/2026:02:24:36 +0000] "GET /index.html HTTP/1.1" 200 1234 87
+//
+// SIGUSR1 reopens the file, after it has been renamed for rotation.
+
+// Longest request target kept; longer ones are truncated.
+#define ACCESSLOG_TARGET_MAX 128
+
+// What to do when a thread's ring is full: drop the record (counted in
+// the metrics) or wait for the writer to catch up.
+enum { ACCESSLOG_DROP, ACCESSLOG_BLOCK };
+
+typedef struct {
+    uint64_t start;     // metrics_clock() at the handler; 0 when unset
+    uint32_t peer;      // client address, network order
+    char method[8];     // not NUL-terminated when full
+    char version[8];
+    uint8_t target_len;
+    char target[ACCESSLOG_TARGET_MAX];
+} access_entry_t;
+
+// Open `path` ("-" for stderr) and start the writer thread. Blocks SIGUSR1
+// in the calling thread, so call this before any other thread is created;
+// they inherit the mask and the writer alone receives it.
+int accesslog_init(const char *path, int policy);
+
+// Write out every line queued so far and stop the writer; lines queued
+// after this are lost.
+void accesslog_close(void);
+
+// Note a request about to be handled.
+void accesslog_begin(access_entry_t *e, const http_request_t *req);
+// Queue the log line of a noted request and clear e.
+void accesslog_end(access_entry_t *e, int status, uint64_t bytes);
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+// Bump allocator for objects that live exactly as long as one request
+// (the parsed request, its body). Nothing is freed individually; the
+// arena is reset once the request is answered. Standard-sized chunks are
+// recycled through a per-thread spare list, so a connection can give its
+// memory back while idle and the next request still needs no malloc.
+#define ARENA_CHUNK 16384
+
+typedef struct arena_chunk arena_chunk_t;
+
+typedef struct {
+    arena_chunk_t *head;    // current chunk; earlier ones follow
+} arena_t;
+
+#define ARENA_INIT { NULL }
+
+// Returns NULL on allocation failure. Alignment is that of max_align_t.
+void *arena_alloc(arena_t *a, size_t n);
+// Grow p (of size old) to n bytes, in place when p is the latest
+// allocation and its chunk has room.
+void *arena_realloc(arena_t *a, void *p, size_t old, size_t n);
+// Forget every allocation, keeping one chunk for the next request.
+void arena_reset(arena_t *a);
+// Give every chunk back.
+void arena_free(arena_t *a);
+// Free the calling thread's spare chunks, before it exits.
+void arena_trim(void);
+
+// Heap traffic behind request handling, summed over all threads. The
+// *_mallocs counters stay flat once the server reaches a steady state.
+typedef struct {
+    unsigned long arena_mallocs;    // chunks allocated
+    unsigned long arena_reuses;     // chunks taken from a spare list
+    unsigned long buffer_mallocs;   // buffers allocated or grown
+    unsigned long buffer_reuses;
+    unsigned long conn_mallocs;     // connection objects allocated
+    unsigned long conn_reuses;
+} alloc_stats_t;
+
+enum {
+    ALLOC_ARENA_MALLOC,
+    ALLOC_ARENA_REUSE,
+    ALLOC_BUFFER_MALLOC,
+    ALLOC_BUFFER_REUSE,
+    ALLOC_CONN_MALLOC,
+    ALLOC_CONN_REUSE,
+    ALLOC_NCOUNTERS,
+};
+
+// Bump one of the calling thread's counters. No locks or atomic
+// read-modify-write: each thread only ever writes its own.
+void alloc_count(int counter);
+void alloc_stats(alloc_stats_t *out);
+
+#endif
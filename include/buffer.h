@@ -0,0 +1,22 @@
+#ifndef BUFFER_H
+#define BUFFER_H
+
+#include <stddef.h>
+
+// Growable byte buffer used for connection input and response output.
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} buffer_t;
+
+int buf_reserve(buffer_t *b, size_t extra);
+int buf_append(buffer_t *b, const void *data, size_t n);
+int buf_appendf(buffer_t *b, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+void buf_consume(buffer_t *b, size_t n);
+void buf_free(buffer_t *b);
+// Free the calling thread's spare buffers, before it exits.
+void buf_trim(void);
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef CGI_H
+#define CGI_H
+
+#include "config.h"
+#include "http.h"
+#include "response.h"
+
+#define CGI_PREFIX "/cgi-bin/"
+
+// Dynamic handlers under /cgi-bin/. Plain scripts run once per request
+// (CGI/1.1): the body is handed over on stdin and stdout is streamed back
+// to the client as it is produced. Executables named *.fcgi are FastCGI
+// responders instead, started once at boot as a pool of persistent workers
+// that serve requests over local sockets without a fork per request.
+//
+// Each script may run at most cfg->cgi_max requests at once (a FastCGI app
+// as many as it has workers); beyond that the client gets 503. A request
+// still running after cfg->cgi_timeout seconds is killed, so a stuck
+// script never holds a connection or an event loop.
+
+// Start the FastCGI pools found in root/cgi-bin and the watchdog thread.
+int cgi_init(const char *root, const server_config_t *cfg);
+// Kill the scripts still running and stop the FastCGI workers.
+void cgi_shutdown(void);
+
+// Set res up to stream the handler's response. Returns 0, or an HTTP
+// status (403, 404, 500, 503) for the caller to answer instead.
+int cgi_handle(const http_request_t *req, response_t *res);
+
+#endif
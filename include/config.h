@@ -0,0 +1,80 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define PROXY_MOUNTS 8          // proxied path prefixes
+#define PROXY_UPSTREAMS 16      // servers behind each
+
+// A path prefix forwarded to a set of upstream HTTP servers.
+typedef struct {
+    char prefix[256];       // "/api": that path and everything below it
+    int hash;               // consistent hashing on the request URI, else least connections
+    int nupstreams;
+    struct {
+        uint32_t addr;      // IPv4, network order
+        int port;
+    } upstreams[PROXY_UPSTREAMS];
+} proxy_mount_t;
+
+typedef struct {
+    uint32_t listen_addr;   // network order; INADDR_ANY by default
+    int port;
+    int backlog;
+    int threads;        // reactors or workers; 0 = one per online CPU
+    int pin_cpus;       // pin reactor i to CPU i % ncpu
+    int use_select;     // legacy select() dispatcher + worker pool
+    int use_uring;      // reactors on io_uring (built with URING=1), else epoll
+    char root[PATH_MAX];    // document root; CGI and uploads live under it
+    size_t queue_cap;   // select mode: connections queued per worker
+    size_t read_buffer; // bytes an event loop reads at a time
+    size_t cache_bytes;     // static file cache budget, 0 disables it
+    size_t cache_max_file;  // larger files are always sent with sendfile
+    size_t fd_cache_entries; // open descriptors kept for sendfile, 0 disables
+    unsigned fd_cache_ttl;  // seconds before a cached descriptor is re-stat()ed
+    size_t max_body;    // larger request bodies are refused with 413
+    int gzip_level;     // on-the-fly gzip of cached text files, 0 disables
+    int cgi_timeout;    // seconds before a CGI/FastCGI request is killed
+    int cgi_max;        // concurrent requests per CGI script
+    int fcgi_workers;   // processes per FastCGI application
+    // Connection timeouts in seconds. The head must arrive in full within
+    // header_timeout (which also covers a new connection's first byte);
+    // body and write timeouts restart whenever data moves.
+    int header_timeout;
+    int body_timeout;
+    int write_timeout;
+    int keepalive_timeout;  // idle between requests
+    int max_conns_per_ip;   // 0 = unlimited
+    int http2;              // HTTP/2: h2c (prior knowledge, Upgrade) and h2 via ALPN
+    // Reverse proxy mounts, and the settings they share.
+    proxy_mount_t proxies[PROXY_MOUNTS];
+    int nproxies;
+    int proxy_timeout;      // seconds an upstream may stall a connect, read or write
+    int proxy_keepalive;    // idle connections kept per upstream, 0 = none
+    int proxy_max_fails;    // failures in a row that take an upstream out
+    int proxy_fail_timeout; // seconds it then stays out before it is tried again
+    // Seconds a worker replaced by a reload, or stopped, waits for its
+    // requests in flight before exiting anyway.
+    int drain_timeout;
+    char access_log[PATH_MAX];  // file path, or "-" for stderr
+    int access_log_block;   // wait for the log writer instead of dropping lines
+    // HTTPS listener (built with TLS=1), next to the plain one.
+    uint32_t tls_addr;
+    int tls_port;           // 0 = none
+    char tls_cert[PATH_MAX];    // PEM certificate chain
+    char tls_key[PATH_MAX];     // PEM private key
+    int tls_tickets;        // session tickets, shared across reloads
+    int tls_ktls;           // hand records to kernel TLS where available
+} server_config_t;
+
+extern server_config_t g_config;
+
+// Apply the settings in the file at path on top of cfg. Each line is a
+// setting name and its value; '#' starts a comment. Sizes take a k, m or
+// g suffix, switches on or off. The first bad line is reported on stderr
+// as "path:line: ..." and fails the whole file, leaving cfg partly set.
+int config_load(server_config_t *cfg, const char *path);
+
+#endif
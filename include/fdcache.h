@@ -0,0 +1,42 @@
+#ifndef FDCACHE_H
+#define FDCACHE_H
+
+#include <stddef.h>
+#include <sys/stat.h>
+
+// Shared cache of open read-only descriptors and their stat data, keyed by
+// resolved path. Descriptors are only used with explicit offsets
+// (sendfile/pread), so one open file serves every concurrent download.
+// An entry is trusted for `ttl` seconds, then revalidated with stat() and
+// reopened if the file was replaced or modified. Lookups that ask for it
+// cache missing paths too, under the same TTL.
+typedef struct fdcache_entry {
+    int fd;
+    struct stat st;
+} fdcache_entry_t;
+
+typedef struct {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long revalidations;
+    unsigned long evictions;
+    unsigned long entries;
+} fdcache_stats_t;
+
+// max_entries 0 disables the cache.
+void fdcache_init(size_t max_entries, unsigned ttl);
+
+// Returns a referenced entry for path, opening it on a miss, or NULL if it
+// cannot be opened. Release it once the descriptor is no longer in use.
+// cache_missing remembers that path does not exist, for probes that mostly
+// fail, such as for precompressed siblings; other lookups see a file as
+// soon as it is created.
+const fdcache_entry_t *fdcache_get(const char *path, int cache_missing);
+void fdcache_release(void *entry);
+// Drop path's entry, for a file the server itself deleted or rewrote.
+// Descriptors already handed out stay valid until released.
+void fdcache_invalidate(const char *path);
+
+void fdcache_stats(fdcache_stats_t *out);
+
+#endif
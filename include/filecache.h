@@ -0,0 +1,54 @@
+#ifndef FILECACHE_H
+#define FILECACHE_H
+
+#include <stddef.h>
+#include <time.h>
+#include "http.h"
+#include "router.h"
+
+// In-memory cache of small static files, keyed by resolved path. Each
+// entry holds the file contents and pre-serialized 200 response headers,
+// so a hit is answered with one gathered send and no syscalls on the file.
+// Entries are revalidated against inode, size and mtime at most once a
+// second and evicted LRU per shard once the byte budget is exceeded.
+//
+// Text entries also carry a gzip variant, compressed once at load time.
+// It lives and dies with its parent entry, so holding a reference to the
+// parent keeps both alive.
+typedef struct filecache_entry {
+    const char *data;
+    size_t size;
+    // 200 status line through Last-Modified; Date, Connection and the
+    // blank line vary per response and are added when it is sent.
+    const char *headers;
+    size_t headers_len;
+    const char *mime;
+    const char *encoding;       // Content-Encoding, NULL for identity
+    int vary;                   // negotiated type: send Vary: Accept-Encoding
+    const struct filecache_entry *gzip;
+    time_t mtime;
+    char etag[STATIC_ETAG_MAX];
+    char last_modified[HTTP_DATE_MAX];
+} filecache_entry_t;
+
+// budget 0 disables the cache. Files larger than max_file are never cached.
+// gzip_level 0 turns off the gzip variants.
+void filecache_init(size_t budget, size_t max_file, int gzip_level);
+
+// Returns a referenced entry for path, or NULL on a miss. Release it with
+// filecache_release() once the response is written.
+const filecache_entry_t *filecache_get(const char *path);
+// Read an already open file into the cache and return it referenced, or
+// NULL if it is too large to cache. The file is fstat()ed afresh so a
+// descriptor from the fd cache never yields stale contents. `encoding` is
+// set for precompressed files, whose type is that of the original.
+const filecache_entry_t *filecache_load(const char *path, int fd,
+                                        const char *mime, const char *encoding);
+void filecache_release(void *entry);
+// Drop path's entry, for a file the server itself deleted or rewrote.
+void filecache_invalidate(const char *path);
+// Whether a file of this size would be admitted; lets callers skip
+// filecache_load() for large files without a syscall.
+int filecache_fits(size_t size);
+
+#endif
@@ -0,0 +1,78 @@
+#ifndef H2_H
+#define H2_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "http.h"
+#include "response.h"
+
+// HTTP/2 (RFC 9113) for the event loops: h2c started with the connection
+// preface ("prior knowledge") or by upgrading an HTTP/1.1 request, and h2
+// negotiated with ALPN over TLS. Many requests share one connection as
+// streams. Each stream's request is turned back into an HTTP/1.1 head,
+// parsed and routed like any other, and its response is re-framed as it
+// goes out: the head as a HEADERS frame (HPACK), the body as DATA frames
+// within the peer's flow control windows. Body parts stay what they are,
+// so cached files are still sent from memory and others with sendfile().
+//
+// A session reads frames from the connection's input buffer and writes
+// its frames as responses on the connection's queue; sending them is left
+// to whichever loop and transport own the connection.
+
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN 24
+
+typedef struct h2 h2_t;
+typedef struct h2_stream h2_stream_t;
+
+// 1 if buf starts with the client preface, 0 if it does not, -1 if the
+// len bytes there so far still could.
+int h2_preface(const char *buf, size_t len);
+// Whether an HTTP/1.1 request asks to continue as h2c. Only requests
+// without a body are taken up on it.
+int h2_upgrade_wanted(const http_request_t *req);
+
+// A session for a connection from peer (network order); over TLS its
+// DATA frames are sized to fill whole records. The first input it expects
+// is the client preface.
+h2_t *h2_new(uint32_t peer, int tls);
+// Take req, which asked for h2c, as stream 1, and put the 101 response
+// into res. Returns -1 if its HTTP2-Settings cannot be used.
+int h2_upgrade(h2_t *s, const http_request_t *req, response_t *res);
+// Streams still sending keep going until the queue lets go of them.
+void h2_free(h2_t *s);
+
+// Handle the complete frames at the start of buf, running the handlers of
+// requests that are complete. Returns the bytes used, or -1 once the
+// connection has failed: a GOAWAY is queued and nothing more is read.
+ssize_t h2_feed(h2_t *s, char *buf, size_t len);
+// Whether h2_feed() takes input now; not while control frames back up.
+int h2_wants_input(const h2_t *s);
+// Queue frames as responses on q: control frames first, then, once q has
+// drained, response headers and data as flow control allows. Returns 1 if
+// more is ready to go out after q drains again, 0 if not.
+int h2_output(h2_t *s, response_queue_t *q);
+
+// Stop taking new streams (GOAWAY); the connection is done once the
+// streams already open have been answered.
+void h2_shutdown(h2_t *s);
+// Nothing left to send and no streams open after a GOAWAY either way.
+int h2_done(const h2_t *s);
+
+// What the session waits on with nothing to send, for the connection's
+// deadline: no streams, request data, the peer's flow control window, or
+// only streamed bodies' sources.
+enum { H2_IDLE, H2_READING, H2_BLOCKED, H2_SOURCE };
+int h2_waiting(const h2_t *s);
+
+// Streamed bodies waiting on a source (see response_t.produce) that is not
+// watched yet: fn is called for each, and the stream counts as watched
+// until h2_stream_woken(). Returns -1 if fn failed.
+typedef int (*h2_watch_fn)(void *arg, h2_stream_t *st, int fd, short events);
+int h2_sources(h2_t *s, h2_watch_fn fn, void *arg);
+// For one-shot watches: keep st alive until the watch completes, then
+// report it with h2_stream_woken(), which drops that hold.
+void h2_stream_hold(h2_stream_t *st);
+void h2_stream_woken(h2_stream_t *st);
+
+#endif
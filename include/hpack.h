@@ -0,0 +1,60 @@
+#ifndef HPACK_H
+#define HPACK_H
+
+#include <stddef.h>
+#include "buffer.h"
+
+// HPACK (RFC 7541), the header compression of HTTP/2. Each direction of
+// a connection keeps a dynamic table of recently sent fields, so a header
+// that repeats across requests or responses shrinks to an index of a
+// byte or two. String literals may be Huffman coded; the decoder takes
+// either, the encoder picks whichever is shorter.
+
+// The dynamic table size both sides start with (SETTINGS_HEADER_TABLE_SIZE).
+#define HPACK_TABLE_SIZE 4096
+// Every entry costs its name and value plus 32 bytes.
+#define HPACK_ENTRIES (HPACK_TABLE_SIZE / 32)
+
+typedef struct {
+    char *name;         // name and value in one allocation
+    size_t name_len;
+    char *value;
+    size_t value_len;
+} hpack_entry_t;
+
+typedef struct {
+    hpack_entry_t ring[HPACK_ENTRIES];
+    unsigned first;     // newest entry
+    unsigned count;
+    size_t size;        // summed entry sizes
+    size_t max;         // current limit, at most HPACK_TABLE_SIZE
+    int resized;        // encoder: announce max at the start of the next block
+} hpack_table_t;
+
+void hpack_init(hpack_table_t *t);
+void hpack_free(hpack_table_t *t);
+
+// A decoded field. Neither string is NUL-terminated; both are only valid
+// during the call. Returning -1 stops the decoding.
+typedef int (*hpack_field_fn)(void *arg, const char *name, size_t name_len,
+                              const char *value, size_t value_len);
+// Decode a complete header block into t's fields. Returns 0, or -1 if the
+// block is malformed (a COMPRESSION_ERROR) or fn failed.
+int hpack_decode(hpack_table_t *t, const unsigned char *in, size_t len,
+                 hpack_field_fn fn, void *arg);
+
+// How hpack_encode() may treat a field that is not in a table yet.
+enum {
+    HPACK_INDEX,        // add it to the table for the next block
+    HPACK_NO_INDEX,     // a value unlikely to repeat
+    HPACK_NEVER_INDEX,  // sensitive: intermediaries must not index it either
+};
+
+// The peer's SETTINGS_HEADER_TABLE_SIZE; values above HPACK_TABLE_SIZE
+// are not used.
+void hpack_set_max(hpack_table_t *t, size_t max);
+// Append one field to the block being built in out; name is lowercase.
+int hpack_encode(hpack_table_t *t, buffer_t *out, const char *name, size_t name_len,
+                 const char *value, size_t value_len, int mode);
+
+#endif
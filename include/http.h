@@ -1,50 +1,169 @@
-#ifndef HTTP_H
-#define HTTP_H
-
-#include <unistd.h>
-#include <stddef.h>
-#include <ctype.h>    // for isspace
-#include <strings.h>  // for strcasecmp
-
-#define MAX_COOKIES 16
-#define MAX_HEADERS 32
-#define MAX_QUERY_PARAMS 32
-
-typedef struct {
-    char name[64];
-    char value[256];
-} cookie_t;
-
-typedef struct {
-    char method[16];
-    char path[1024];
-    char version[16];
-
-    struct {
-        char name[64];
-        char value[256];
-    } headers[MAX_HEADERS];
-    int header_count;
-
-    struct {
-        char key[64];
-        char value[256];
-    } query[MAX_QUERY_PARAMS];
-    int query_count;
-
-    cookie_t cookies[MAX_COOKIES];
-    int cookie_count;
-
-    char *body;
-    size_t body_len;
-} http_request_t;
-
-ssize_t read_until_double_crlf(int fd, char *buf, size_t cap);
-int parse_http_request(int fd, http_request_t *req);
-
-void send_400(int fd);
-void send_404(int fd);
-void send_500(int fd);
-void send_set_cookie(int fd, const char *name, const char *value);
-
-#endif
+#ifndef HTTP_H
+#define HTTP_H
+
+#include <unistd.h>
+#include <time.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <ctype.h>    // for isspace
+#include <strings.h>  // for strcasecmp
+#include "arena.h"
+#include "buffer.h"
+
+#define MAX_COOKIES 16
+#define MAX_HEADERS 64
+#define MAX_QUERY_PARAMS 32
+
+// Largest request line + header block accepted, and the read size used to
+// fill a connection's input buffer.
+#define HTTP_MAX_HEAD 16384
+#define HTTP_READ_CHUNK 16384
+// Piece size for bodies streamed to a consumer instead of buffered.
+#define HTTP_BODY_CHUNK 65536
+
+// "Sun, 06 Nov 1994 08:49:37 GMT" plus the terminating NUL.
+#define HTTP_DATE_MAX 30
+
+// A (pointer, length) view into the connection's input buffer.
+typedef struct {
+    const char *ptr;
+    size_t len;
+} http_slice_t;
+
+typedef struct {
+    http_slice_t name;
+    http_slice_t value;
+} http_field_t;
+
+typedef http_field_t cookie_t;
+
+// Every slice points into the buffer the request was parsed from and is
+// valid until those bytes are consumed. method, path, version and header
+// names/values are also NUL-terminated in place; query and cookie slices
+// are not.
+typedef struct {
+    http_slice_t method;
+    http_slice_t path;
+    http_slice_t version;
+    http_slice_t query_string;
+
+    http_field_t headers[MAX_HEADERS];
+    int header_count;
+
+    http_field_t query[MAX_QUERY_PARAMS];
+    int query_count;
+
+    cookie_t cookies[MAX_COOKIES];
+    int cookie_count;
+
+    size_t head_len;    // request line + headers + blank line
+    int chunked;        // Transfer-Encoding: chunked; body_len grows as decoded
+    char *body;
+    size_t body_len;
+    arena_t *arena;     // owns body; set by the caller, kept across parses
+    uint32_t peer;      // client IPv4 address, network order; set by the caller
+} http_request_t;
+
+// Resumable request-head parser. Bytes already examined are not scanned
+// again when more data arrives; positions are kept as offsets so the
+// buffer may be reallocated between calls.
+typedef struct {
+    int state;
+    size_t pos;
+    size_t mark;
+    size_t line[3][2];          // method, target, version: offset, length
+    int header_count;
+    struct {
+        size_t name_off, name_len;
+        size_t value_off, value_len;
+    } fields[MAX_HEADERS];
+    uint64_t elapsed;           // ns spent parsing so far, for metrics
+} http_parser_t;
+
+enum {
+    HTTP_TIMEOUT = -3,      // blocking readers only
+    HTTP_PARSE_TOO_LARGE = -2,
+    HTTP_PARSE_ERROR = -1,
+    HTTP_PARSE_AGAIN = 0,
+    HTTP_PARSE_DONE = 1,
+};
+
+void http_parser_init(http_parser_t *p);
+// Parse the request head at the start of buf[0..len). On HTTP_PARSE_DONE
+// req is filled in and req->head_len says where the body starts; further
+// calls keep returning HTTP_PARSE_DONE until http_parser_init().
+int parse_http_request(http_parser_t *p, char *buf, size_t len, http_request_t *req);
+// Time limits for the blocking readers in milliseconds; 0 waits forever.
+typedef struct {
+    int idle;           // for the first byte of a request
+    int head;           // for the rest of the head, in total
+    int body;           // for each read of the body
+} http_timeouts_t;
+
+// Blocking read + parse of a request head on fd for the worker path,
+// continuing from the state in `p` (initialise it per request). `in`
+// carries buffered bytes between requests on the same connection; the
+// caller consumes req->head_len bytes once done with the request. Returns
+// 1 for a request, 0 if the client closed or stayed idle between
+// requests, HTTP_TIMEOUT if the head stalled partway, -1 on error.
+int read_http_request(int fd, buffer_t *in, http_parser_t *p, http_request_t *req,
+                      const http_timeouts_t *t);
+
+// Consumer for bodies that are streamed rather than buffered.
+typedef void (*http_body_fn)(void *arg, const char *data, size_t len);
+
+// Allocate req->body from req->arena and move any body bytes already
+// sitting in `in` into it. The head stays at the front of `in`. Returns
+// bytes moved or (size_t)-1 on allocation failure.
+size_t http_take_body(buffer_t *in, http_request_t *req);
+// Like http_take_body(), but hand the buffered body bytes to fn instead.
+size_t http_stream_body(buffer_t *in, http_request_t *req, http_body_fn fn, void *arg);
+
+// buf_reserve() for a buffer that req was parsed from: if the data moves,
+// the request's slices are moved along with it.
+int http_reserve(buffer_t *in, http_request_t *req, size_t extra);
+
+// Resumable decoder for a chunked request body.
+typedef struct {
+    int state;
+    int digits;
+    size_t size;        // bytes left in the current chunk
+    size_t total;       // decoded so far
+    size_t limit;
+    size_t cap;         // allocated size of req->body when buffering
+    size_t trailer;
+} http_chunked_t;
+
+void http_chunked_init(http_chunked_t *d, size_t limit);
+// Decode the chunked body bytes sitting in `in` after the head, passing the
+// data to fn, or appending it to req->body / req->body_len when fn is NULL,
+// and remove them from `in`. Returns HTTP_PARSE_DONE after the last chunk
+// and trailers, HTTP_PARSE_AGAIN for more input, HTTP_PARSE_ERROR, or
+// HTTP_PARSE_TOO_LARGE once the body exceeds `limit`.
+int http_chunked_feed(http_chunked_t *d, buffer_t *in, http_request_t *req,
+                      http_body_fn fn, void *arg);
+// The same for chunked data that is not behind a request head in a buffer
+// (a proxied response): decode data[0..len) to fn, which must be set, and
+// store the bytes used in *used. Bytes after the end of the body are left.
+int http_chunked_decode(http_chunked_t *d, const char *data, size_t len, size_t *used,
+                        http_body_fn fn, void *arg);
+
+// Blocking read of the rest of the body after read_http_request(): into
+// req->body when fn is NULL, otherwise to fn (in HTTP_BODY_CHUNK pieces for
+// Content-Length bodies). Chunked bodies are limited to `limit` bytes.
+// Returns 0, HTTP_PARSE_TOO_LARGE, HTTP_TIMEOUT, or -1 on error / early EOF.
+int read_http_body(int fd, buffer_t *in, http_request_t *req, size_t limit,
+                   http_body_fn fn, void *arg, const http_timeouts_t *t);
+
+const char *http_get_header(const http_request_t *req, const char *name);
+int http_keep_alive(const http_request_t *req);
+int http_slice_eq(http_slice_t s, const char *lit);
+int http_slice_caseeq(http_slice_t s, const char *lit);
+
+// IMF-fixdate formatting and parsing for Date / Last-Modified style
+// headers. http_parse_date() also accepts the obsolete RFC 850 and asctime
+// forms and returns -1 if none match.
+void http_format_date(time_t t, char out[HTTP_DATE_MAX]);
+int http_parse_date(const char *s, time_t *out);
+
+#endif
@@ -0,0 +1,19 @@
+#ifndef IPLIMIT_H
+#define IPLIMIT_H
+
+#include <stdint.h>
+
+// Open connections per client IPv4 address, counted across every thread,
+// so a single host cannot exhaust the descriptors or the event loops.
+// Addresses are in network byte order, as accept() returns them.
+
+// At most `max` connections per address; 0 disables the check.
+void iplimit_init(int max);
+// Count a new connection: returns 1 if it was counted, 0 if limits are
+// off, or -1 if the address is already at the limit. Only a counted
+// connection is passed to iplimit_release(), which keeps the counts right
+// should the limit change while connections are open.
+int iplimit_acquire(uint32_t addr);
+void iplimit_release(uint32_t addr);
+
+#endif
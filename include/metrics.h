@@ -0,0 +1,61 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include "buffer.h"
+
+// Server metrics. Every thread updates a block of its own, allocated on
+// first use and aligned to cache lines, with plain relaxed loads and
+// stores: no locks or atomic read-modify-write on the request path, and no
+// line shared with another thread. A scrape sums the blocks.
+//
+// Latencies go into log-linear (HDR-style) histograms: 16 linear buckets
+// per power of two of nanoseconds, so any recorded value is known to
+// within 1/16 up to about a minute.
+
+enum {
+    METRIC_BYTES_IN,
+    METRIC_BYTES_OUT,
+    METRIC_CONNS_OPENED,
+    METRIC_CONNS_CLOSED,
+    METRIC_CACHE_HITS,      // in-memory file cache
+    METRIC_CACHE_MISSES,
+    METRIC_LOG_DROPPED,     // access log records lost to a full ring
+    METRIC_TLS_FULL,        // TLS handshakes, by outcome
+    METRIC_TLS_RESUMED,
+    METRIC_TLS_FAILED,
+    METRIC_TLS_KTLS,        // TLS connections sending through the kernel
+    METRIC_H2_CONNS,        // connections that switched to HTTP/2
+    METRIC_H2_STREAMS,      // requests on them
+    METRIC_UPSTREAM_NEW,    // proxy connections to upstreams: opened
+    METRIC_UPSTREAM_REUSED, // taken from the pool
+    METRIC_UPSTREAM_FAILED, // failed before a response
+    METRIC_NCOUNTERS,
+};
+
+enum {
+    PHASE_PARSE,    // CPU time parsing the request head
+    PHASE_HANDLE,   // routing and building the response
+    PHASE_WRITE,    // from the handler returning to the last byte sent
+    PHASE_COUNT,
+};
+
+void metrics_add(int counter, unsigned long n);
+// A request, by its ROUTE_* method bit (0 for an unknown method).
+void metrics_request(unsigned method);
+// A finished response, by status code.
+void metrics_response(int status);
+
+// Monotonic nanoseconds for phase timings.
+uint64_t metrics_clock(void);
+void metrics_observe(int phase, uint64_t ns);
+
+// Gauges owned elsewhere, sampled when metrics are rendered.
+typedef struct {
+    long threadpool_queued;     // -1 outside select mode
+} metrics_gauges_t;
+
+// Append every metric in the Prometheus text exposition format.
+int metrics_render(buffer_t *out, const metrics_gauges_t *g);
+
+#endif
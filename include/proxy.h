@@ -0,0 +1,61 @@
+#ifndef PROXY_H
+#define PROXY_H
+
+#include <sys/types.h>
+#include "config.h"
+#include "http.h"
+#include "response.h"
+
+// Reverse proxy: the path prefixes in cfg->proxies are forwarded to sets
+// of upstream HTTP/1.1 servers. Each request goes to one upstream, picked
+// by least connections (fewest requests in flight, ties taken in turn) or
+// by consistent hashing of the request URI over a ring of virtual nodes,
+// so that adding or losing a server only moves the URIs that were on it.
+// Connections to an upstream are kept alive once a response is complete
+// and pooled for the next request to it, from any thread.
+//
+// Health is checked passively: an upstream whose connections fail
+// proxy_max_fails times in a row (refused or stalled past proxy_timeout,
+// or closed before a response) is left out for proxy_fail_timeout
+// seconds, and then gets requests again. A failed request moves on to
+// another upstream as long as nothing of it can have been acted on yet.
+//
+// Bodies are streamed both ways instead of buffered. The response goes
+// out as it arrives, through a pipe with splice() where the client's
+// socket allows it. On the event loops' HTTP/1 connections the request
+// body is forwarded as the client sends it (see proxy_body_t), spliced
+// from a plain socket as well; elsewhere it has been read in full first.
+
+typedef struct proxy_group proxy_group_t;
+typedef struct proxy_body proxy_body_t;
+
+// Set up the upstreams of cfg's mounts and start the watchdog that cuts
+// stalled upstream connections and closes long-idle pooled ones.
+int proxy_init(const server_config_t *cfg);
+// The upstreams of cfg->proxies[i], for its route.
+proxy_group_t *proxy_group(int i);
+
+// Set res up to stream the response of an upstream to req. With body NULL
+// the request body is req->body; otherwise it is still to be read, and
+// *body gets the sink it is to be fed into. Returns 0, or an HTTP status
+// for the caller to answer instead.
+int proxy_handle(proxy_group_t *g, const http_request_t *req, response_t *res,
+                 proxy_body_t **body);
+
+// Feeding a request body in as it arrives. The sink holds a bounded
+// amount; the response's produce() hook sends it upstream. Bodies the
+// upstream no longer wants (it answered, or failed) are taken and dropped.
+//
+// Whether the sink takes more now.
+int proxy_body_room(const proxy_body_t *b);
+// An http_body_fn copying data in.
+void proxy_body_fn(void *arg, const char *data, size_t len);
+// Move up to len bytes from the socket fd into the sink without copying
+// them. Returns the bytes moved, 0 if fd has nothing more for now or the
+// sink is full (proxy_body_room()), -1 on EOF or error.
+ssize_t proxy_body_splice(proxy_body_t *b, int fd, size_t len);
+// The body is complete, or never will be (complete = 0: the client went
+// away). The sink is not to be used after this.
+void proxy_body_end(proxy_body_t *b, int complete);
+
+#endif
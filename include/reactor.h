@@ -0,0 +1,24 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include "config.h"
+
+// Start cfg->threads event loops, each with its own epoll set or io_uring
+// and connection table, reactor i accepting on listeners[i]: sockets of
+// one SO_REUSEPORT group, bound by the caller. tls_listeners, NULL if
+// there are none, is a second such group whose connections speak TLS.
+int reactor_start(const server_config_t *cfg, const int *listeners, const int *tls_listeners);
+
+// Stop accepting and close idle keep-alive connections; each loop exits
+// once its last connection has closed.
+void reactor_drain(void);
+// Wait up to timeout_secs (<= 0: no limit) for the loops to exit. Returns
+// -1 if some are still running.
+int reactor_wait(int timeout_secs);
+
+// Drop fd from the calling thread's epoll set, if it is a loop's and fd
+// was watched there as a streamed body's source: for a descriptor that
+// lives on after the response, such as a pooled upstream connection.
+void reactor_forget(int fd);
+
+#endif
@@ -0,0 +1,152 @@
+#ifndef RESPONSE_H
+#define RESPONSE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "accesslog.h"
+#include "buffer.h"
+
+// Responses queued on one connection before a flush; bounds how far the
+// server reads ahead of a pipelining client.
+#define RESPONSE_QUEUE_MAX 16
+// Parts held inside the response itself; only longer lists (multi-range
+// bodies) go to the heap.
+#define RESPONSE_INLINE_PARTS 4
+
+enum { PART_OWNED, PART_BORROWED, PART_FILE, PART_PIPE };
+
+// Return values of a response's produce() hook.
+enum { RESPONSE_MORE = 0, RESPONSE_DONE = 1, RESPONSE_WAIT = 2 };
+
+// One piece of a response body on the wire: bytes copied into the
+// response's own buffer, memory borrowed from elsewhere (e.g. a cached
+// file), a region of file_fd sent with sendfile, or bytes waiting in the
+// pipe file_fd, moved to the socket with splice (only where res->splice).
+typedef struct {
+    int kind;
+    const char *ptr;    // PART_BORROWED
+    off_t off;          // PART_OWNED: offset into buf; PART_FILE: file offset
+    size_t len;
+} response_part_t;
+
+// A response is an ordered list of parts. Writes are resumable so the same
+// response can be flushed from a blocking worker or from the non-blocking
+// event loop.
+typedef struct response {
+    buffer_t buf;
+    response_part_t *parts;
+    int nparts;
+    int cap_parts;
+    int cur;            // first part not fully written
+    size_t cur_sent;    // bytes of parts[cur] already written
+    int file_fd;
+    int file_owned;     // close file_fd on reset (else release() owns it)
+    int splice;         // set by writers on plain sockets: PART_PIPE may be used
+    // Called on reset to drop whatever keeps borrowed parts alive.
+    void (*release)(void *arg);
+    void *release_arg;
+    // Streamed bodies: called once everything queued so far has been
+    // written, with the parts cleared. It appends the next piece and
+    // returns RESPONSE_MORE, RESPONSE_DONE after the last one, or -1. With
+    // nothing available yet it sets wait_fd / wait_events (poll bits) and
+    // returns RESPONSE_WAIT; it is called again once that fd is ready.
+    int (*produce)(struct response *res, void *arg);
+    void *produce_arg;
+    int wait_fd;
+    short wait_events;
+    int chunked;        // response_chunk() frames its data
+    int keep_alive;
+    int head;           // answering HEAD: response_error() sends no body
+    int status;         // for metrics, set by response_status()
+    uint64_t ready_at;  // metrics_clock() when the handler finished, or 0
+    uint64_t sent;      // bytes written so far
+    // Logged when the response is reset: finished, or dropped with the
+    // connection.
+    access_entry_t access;
+    response_part_t inline_parts[RESPONSE_INLINE_PARTS];
+} response_t;
+
+// In-order responses for pipelined requests. The in-memory parts of
+// consecutive responses go out in a single gathered send.
+typedef struct {
+    response_t items[RESPONSE_QUEUE_MAX];
+    unsigned first;
+    unsigned count;
+} response_queue_t;
+
+void response_init(response_t *res);
+void response_reset(response_t *res);
+// Reset, and give back the buffers a reset keeps for reuse.
+void response_free(response_t *res);
+
+// Copy bytes into the response.
+int response_append(response_t *res, const void *data, size_t len);
+int response_printf(response_t *res, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+// Append borrowed bytes; they must stay valid until `release` runs.
+int response_add_segment(response_t *res, const void *data, size_t len);
+// Append [off, off + len) of res->file_fd.
+int response_add_file(response_t *res, off_t off, size_t len);
+// Append the next len bytes of the pipe res->file_fd.
+int response_add_pipe(response_t *res, size_t len);
+
+// Header builder. Nothing here formats with printf: status lines and
+// error pages are prebuilt per status code, and the Date line is cached
+// per thread and rebuilt once a second.
+//
+// Status line followed by the Date header.
+int response_status(response_t *res, int code);
+// "Date: ...\r\n" on its own, for header blocks that were built earlier.
+int response_date(response_t *res);
+int response_header(response_t *res, const char *name, const char *value);
+int response_content_length(response_t *res, size_t len);
+// Connection (from res->keep_alive) and the blank line ending the head.
+int response_end_headers(response_t *res);
+// A complete error response with a small HTML body (none for HEAD).
+int response_error(response_t *res, int code);
+
+// Body data of unknown total length. With res->chunked set (after sending
+// "Transfer-Encoding: chunked") each call is framed as one chunk, copied
+// into the response; otherwise the data is appended as is and the body
+// must end with the connection. response_chunk_end() writes the last chunk.
+int response_chunk(response_t *res, const void *data, size_t len);
+int response_chunk_end(response_t *res);
+
+// Ask a streamed response for its next piece once the last one is out,
+// as the queue does. Returns 1 with parts to send (or after the last
+// one, when produce is cleared), 0 if it is waiting on wait_fd, -1 on
+// error.
+int response_produce(response_t *res);
+
+void response_queue_init(response_queue_t *q);
+// Next free slot, reset and ready to fill, or NULL if the queue is full.
+response_t *response_queue_push(response_queue_t *q);
+// Release buffers held by idle slots (and close any pending files).
+void response_queue_free(response_queue_t *q);
+
+// Returns 1 once every queued response is written, 0 if the socket would
+// block or a streamed response is waiting for input, and -1 on error.
+int response_queue_write(int fd, response_queue_t *q);
+// After response_queue_write() returned 0: the fd a streamed response is
+// waiting on (and the poll events in *events), or -1 if it is the socket.
+int response_queue_waiting(const response_queue_t *q, short *events);
+
+// Writing the queue with asynchronous sends (io_uring). Each step either
+// yields iov[0..*n) for the caller to send, and response_queue_sent() then
+// takes the number of bytes that went out; or says a file or pipe part is
+// next, which response_queue_write() sends with sendfile() or splice(); or
+// that a streamed body waits on its source (response_queue_waiting()); or
+// that the queue is empty. Returns -1 if a streamed body failed.
+enum { RESPONSE_IO_DONE, RESPONSE_IO_SEND, RESPONSE_IO_FILE, RESPONSE_IO_WAIT };
+// *flags of a send: a file part follows (send with MSG_MORE), or the
+// iovecs are all that is left in the queue.
+enum { RESPONSE_IO_MORE = 1, RESPONSE_IO_LAST = 2 };
+int response_queue_next(response_queue_t *q, struct iovec *iov, int max, int *n, int *flags);
+void response_queue_sent(response_queue_t *q, size_t len);
+// After RESPONSE_IO_FILE, for writers that cannot hand the socket to
+// sendfile() (TLS): the file and the range left to send. Report what went
+// out with response_queue_sent() as well.
+int response_queue_file(const response_queue_t *q, off_t *off, size_t *len);
+
+#endif
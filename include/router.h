@@ -1,7 +1,78 @@
-#ifndef ROUTER_H
-#define ROUTER_H
-
-int serve_static(int fd, const char *root, const char *path, int is_head);
-const char* guess_mime(const char *path);
-
-#endif
+#ifndef ROUTER_H
+#define ROUTER_H
+
+#include <stddef.h>
+#include <sys/stat.h>
+#include "http.h"
+#include "response.h"
+
+#define STATIC_ETAG_MAX 64
+#define ROUTE_MAX_PARAMS 8
+
+// Method bits for router_add().
+enum {
+    ROUTE_GET = 1 << 0,
+    ROUTE_HEAD = 1 << 1,
+    ROUTE_POST = 1 << 2,
+    ROUTE_PUT = 1 << 3,
+    ROUTE_DELETE = 1 << 4,
+    ROUTE_OPTIONS = 1 << 5,
+    ROUTE_PATCH = 1 << 6,
+};
+
+typedef struct route_match route_match_t;
+typedef void (*route_fn)(http_request_t *req, response_t *res, const route_match_t *m);
+
+// Result of a lookup. Values are slices of the path that was matched.
+struct route_match {
+    route_fn fn;
+    void *arg;
+    const char *rest;       // prefix routes: the path from the slash before '*'
+    unsigned allowed;       // methods any route matching the path accepts
+    int nparams;
+    struct {
+        const char *name;
+        http_slice_t value;
+    } params[ROUTE_MAX_PARAMS];
+};
+
+// Routes are compiled into a radix trie keyed on the path, with a method
+// bitmask per route, so a lookup walks the path once and allocates
+// nothing. Patterns are "/exact", "/users/:id/posts" (one segment per
+// parameter) or "/prefix/*" (the path and everything below it). Static
+// edges win over parameters, and parameters over prefixes; the longest
+// prefix wins among prefixes. All routes are added at startup: the trie
+// is read-only, and so shared between threads, once serving begins.
+typedef struct router router_t;
+
+router_t *router_new(void);
+// Returns -1 for a malformed pattern or one that overlaps an existing
+// route on some method.
+int router_add(router_t *r, unsigned methods, const char *pattern, route_fn fn, void *arg);
+// Method bit for a request method, or 0 if routes cannot name it.
+unsigned route_method(http_slice_t method);
+// Returns 0 and fills m on a match, 405 when routes match the path but
+// not the method (m->allowed lists the ones they take), or 404.
+int router_match(const router_t *r, unsigned method, const char *path, route_match_t *m);
+// The value of parameter `name`, or an empty slice.
+http_slice_t route_param(const route_match_t *m, const char *name);
+// "GET, HEAD, ..." for an Allow header.
+void route_allow(unsigned methods, char *out, size_t cap);
+
+// Queue the response for root + path on res, choosing a precompressed
+// .br/.gz sibling or the cached gzip variant when Accept-Encoding allows:
+// 200, 206 for Range requests
+// (multipart/byteranges for several ranges), 304 when the client's
+// validators still match, or 416. HEAD gets headers only. The Connection
+// header follows res->keep_alive. Returns -1 if the file does not exist or
+// is not a regular file.
+int serve_static(response_t *res, const http_request_t *req, const char *root, const char *path);
+const char* guess_mime(const char *path);
+// Reject "." and ".." path segments so requests can't climb out of root.
+int path_is_safe(const char *path);
+// Text-like types worth compressing; only these negotiate Accept-Encoding.
+int mime_compressible(const char *mime);
+// Strong validator derived from inode, size and mtime.
+void static_etag(const struct stat *st, char *out, size_t cap);
+
+#endif
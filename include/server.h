@@ -0,0 +1,39 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "config.h"
+#include "http.h"
+#include "proxy.h"
+#include "response.h"
+#include "upload.h"
+
+// Set once this worker process starts draining, after which every
+// response closes its connection.
+extern _Atomic int g_draining;
+
+// Build the response for a fully read request. Shared by the blocking
+// worker path and the event loop.
+void handle_request(http_request_t *req, response_t *res);
+void respond_bad_request(response_t *res);
+// 408 for a client that stopped sending partway through a request.
+void respond_timeout(response_t *res);
+
+// Bodies over the configured limit are refused from the head alone with a
+// 413, after which the connection closes.
+int request_too_large(const http_request_t *req);
+void respond_too_large(response_t *res);
+// Multipart uploads are streamed to disk as the body arrives instead of
+// being buffered. Returns NULL for every other request.
+upload_t *request_upload(const http_request_t *req);
+// Answer a streamed upload once its whole body has been fed in; closes up.
+void handle_upload(http_request_t *req, upload_t *up, response_t *res);
+// Proxied requests with a body are answered from the head, on the event
+// loops, and their body forwarded as it is read. handle_proxied() returns
+// the sink to feed it into, or NULL after queueing an error that closes
+// the connection.
+int request_proxied(const http_request_t *req);
+proxy_body_t *handle_proxied(http_request_t *req, response_t *res);
+
+void handle_connection(int fd, uint32_t peer);
+
+#endif
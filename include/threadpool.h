@@ -1,17 +1,23 @@
-#ifndef THREADPOOL_H
-#define THREADPOOL_H
-
-#include <stddef.h>
-
-typedef struct threadpool threadpool_t;
-
-// Create a thread pool with `num_threads` threads
-threadpool_t *threadpool_create(size_t num_threads);
-
-// Add a task: a function with `arg`
-int threadpool_add(threadpool_t *pool, void (*func)(void*), void *arg);
-
-// Destroy the pool and wait for threads to finish
-void threadpool_destroy(threadpool_t *pool);
-
-#endif
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <stddef.h>
+
+typedef struct threadpool threadpool_t;
+
+// Create a thread pool with `num_threads` threads, each queueing up to
+// `queue_cap` tasks (rounded up to a power of two)
+threadpool_t *threadpool_create(size_t num_threads, size_t queue_cap);
+
+// Add a task: a function with `arg`. Never blocks; returns -1 when every
+// worker queue is full so the caller can shed load.
+int threadpool_add(threadpool_t *pool, void (*func)(void*), void *arg);
+
+// Tasks queued and not yet started, summed over the workers' rings. A
+// lock-free snapshot, so only approximate while producers are running.
+size_t threadpool_queued(threadpool_t *pool);
+
+// Destroy the pool and wait for threads to finish
+void threadpool_destroy(threadpool_t *pool);
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef TLS_H
+#define TLS_H
+
+#include <sys/types.h>
+#include "config.h"
+#include "response.h"
+
+// TLS termination on OpenSSL (built with TLS=1). A session works on the
+// connection's non-blocking socket: reads and writes return as soon as
+// they would block, telling the event loop which readiness to wait for,
+// so handshakes and data are driven the same way. Session tickets let
+// returning clients skip the full handshake. Where the kernel supports it
+// (kTLS), records are encrypted in the kernel after the handshake and file
+// bodies keep going out with sendfile().
+
+typedef struct tls tls_t;
+
+// Ticket encryption keys. Made once, in the supervising process, so every
+// worker it forks shares them and tickets survive a reload.
+int tls_keys_init(void);
+// Load cfg's certificate and key into the context sessions are made from.
+int tls_init(const server_config_t *cfg);
+
+// A server session on an accepted socket, or NULL.
+tls_t *tls_new(int fd);
+// Sends close_notify when it can; the socket itself stays open.
+void tls_free(tls_t *t);
+
+// Returns bytes read, 0 if the session would block (tls_want() says on
+// what) and -1 on EOF or error. The handshake runs inside the first reads.
+ssize_t tls_read(tls_t *t, void *buf, size_t cap);
+// Write the queue through the session; returns like response_queue_write().
+int tls_write_queue(tls_t *t, response_queue_t *q);
+// POLLIN or POLLOUT: what the last operation that would block waits for.
+short tls_want(const tls_t *t);
+
+#endif
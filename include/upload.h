@@ -0,0 +1,44 @@
+#ifndef UPLOAD_H
+#define UPLOAD_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// Streaming multipart/form-data parser. Body bytes are fed in whatever
+// pieces they arrive in; file parts are written straight to disk, so an
+// upload never has to fit in memory. Form fields without a filename are
+// discarded.
+typedef struct upload upload_t;
+
+// Parse the boundary out of a multipart/form-data Content-Type and start an
+// upload into dir. Returns NULL if there is no usable boundary.
+upload_t *upload_open(const char *content_type, const char *dir);
+
+// Feed the next piece of the body. Once the body turns out to be malformed
+// or a write fails, further input is discarded and upload_close() reports
+// the error.
+void upload_write(upload_t *up, const char *data, size_t len);
+// Adapter for http_stream_body() / read_http_body().
+void upload_body_fn(void *up, const char *data, size_t len);
+
+// Where an upload's file writes go: write() by default, or an event loop
+// that queues them as asynchronous file I/O.
+typedef struct {
+    // Queue len bytes for offset off of fd; data is only valid during the
+    // call. Returns -1 if the write cannot be queued.
+    int (*write)(void *arg, int fd, const char *data, size_t len, off_t off);
+    // Close fd behind the writes queued on it.
+    void (*close)(void *arg, int fd);
+    void *arg;
+} upload_io_t;
+
+// Route file writes through io, which must outlive the upload.
+void upload_set_io(upload_t *up, const upload_io_t *io);
+// A queued write failed: the upload fails as if write() had.
+void upload_fail(upload_t *up);
+
+// Free the upload. Returns the number of files saved, or -1 if the body
+// was malformed or ended early, in which case the partial file is removed.
+int upload_close(upload_t *up);
+
+#endif
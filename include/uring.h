@@ -0,0 +1,60 @@
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Minimal io_uring plumbing over the raw system calls: ring setup, SQE and
+// CQE access, and provided buffer rings. Like the event loops that use it,
+// a ring belongs to one thread.
+
+typedef struct {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned sq_entries;
+    unsigned sqe_tail;          // SQEs handed out, not all submitted yet
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+} uring_t;
+
+// Returns -1 with errno set if io_uring is unavailable or lacks what the
+// server needs (single mmap, EXT_ARG timeouts, no CQ drops).
+int uring_init(uring_t *u, unsigned entries);
+void uring_free(uring_t *u);
+
+// A zeroed SQE to fill in. When the queue is full, what is queued is
+// submitted first to make room.
+struct io_uring_sqe *uring_sqe(uring_t *u);
+// Make room for n SQEs that must go in together, such as a linked chain,
+// submitting what is queued if need be. Returns -1 if there is none.
+int uring_reserve(uring_t *u, unsigned n);
+// Submit everything queued and wait up to timeout_ms (-1 forever) for at
+// least one completion.
+int uring_submit_wait(uring_t *u, int timeout_ms);
+// Next completion, or NULL; uring_cqe_seen() releases it.
+struct io_uring_cqe *uring_cqe(uring_t *u);
+void uring_cqe_seen(uring_t *u);
+
+// A provided buffer ring: `count` buffers of `size` bytes that recv
+// operations with IOSQE_BUFFER_SELECT fill in, the CQE naming the buffer.
+typedef struct {
+    struct io_uring_buf_ring *ring;
+    char *mem;
+    unsigned count;
+    unsigned size;
+    uint16_t group;
+} uring_bufs_t;
+
+int uring_bufs_init(uring_t *u, uring_bufs_t *b, uint16_t group, unsigned count, unsigned size);
+// Unmap the ring and free the buffers, once the ring they were registered
+// with is gone.
+void uring_bufs_free(uring_bufs_t *b);
+char *uring_buf(const uring_bufs_t *b, uint16_t id);
+// Hand buffer id back to the kernel.
+void uring_buf_put(uring_bufs_t *b, uint16_t id);
+
+#endif
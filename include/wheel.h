@@ -0,0 +1,46 @@
+#ifndef WHEEL_H
+#define WHEEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Hierarchical timing wheel for connection deadlines: arming, re-arming
+// and cancelling a timer are O(1), and advancing costs one slot per tick
+// plus an occasional cascade from the coarser levels. Each event loop owns
+// one wheel; nothing here is thread-safe.
+//
+// Four levels of 64 slots at WHEEL_TICK_MS cover about 19 days; later
+// deadlines are clamped to that.
+#define WHEEL_TICK_MS 100
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+
+typedef struct wheel_timer {
+    struct wheel_timer *next;
+    struct wheel_timer **pprev; // NULL while not armed
+    uint64_t expires;           // in ticks
+    void (*fn)(struct wheel_timer *t);
+} wheel_timer_t;
+
+typedef struct {
+    wheel_timer_t *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+    uint64_t tick;              // last tick processed
+    size_t count;               // armed timers
+} timer_wheel_t;
+
+// Monotonic milliseconds, from the coarse clock.
+uint64_t wheel_now(void);
+
+void wheel_init(timer_wheel_t *w, uint64_t now);
+void wheel_timer_init(wheel_timer_t *t, void (*fn)(wheel_timer_t *t));
+// Arm t to fire at `when` (ms, wheel_now() scale), moving it if armed.
+void wheel_add(timer_wheel_t *w, wheel_timer_t *t, uint64_t when);
+void wheel_cancel(timer_wheel_t *w, wheel_timer_t *t);
+// Milliseconds until the wheel next needs advancing, for epoll_wait(); -1
+// when nothing is armed.
+int wheel_timeout(const timer_wheel_t *w, uint64_t now);
+// Fire every timer due by `now`. Callbacks may arm or cancel any timer.
+void wheel_advance(timer_wheel_t *w, uint64_t now);
+
+#endif
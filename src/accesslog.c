@@ -0,0 +1,268 @@
+#define _GNU_SOURCE
+
+#include "accesslog.h"
+#include "metrics.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Records per thread, a power of two.
+#define RING_SIZE 2048
+// Formatted bytes collected before each write().
+#define BATCH_MAX (64 << 10)
+// The writer polls the rings, backing off up to this long while idle.
+#define IDLE_MAX_MS 20
+
+typedef struct {
+    access_entry_t e;
+    int status;
+    uint64_t bytes;
+    uint64_t usec;
+    time_t when;
+} record_t;
+
+// Single-producer single-consumer: the owning thread fills slots at the
+// tail, the writer empties them at the head.
+typedef struct ring {
+    _Alignas(64) _Atomic size_t head;
+    _Alignas(64) _Atomic size_t tail;
+    _Alignas(64) struct ring *next;
+    record_t slots[RING_SIZE];
+} ring_t;
+
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static ring_t *all_rings;
+static _Thread_local ring_t *mine;
+
+static const char *log_path;
+static int log_fd = -1;
+static int full_policy;
+// Set once the writer is up; read by every thread that logs.
+static _Atomic int running;
+static pthread_t writer_thread;
+static _Atomic int stopping;
+
+static ring_t *my_ring(void) {
+    if (mine) return mine;
+    ring_t *r = aligned_alloc(64, sizeof(ring_t));
+    if (!r) return NULL;
+    atomic_init(&r->head, 0);
+    atomic_init(&r->tail, 0);
+    pthread_mutex_lock(&rings_lock);
+    r->next = all_rings;
+    all_rings = r;
+    pthread_mutex_unlock(&rings_lock);
+    return mine = r;
+}
+
+static void copy_slice(char *dst, size_t cap, http_slice_t s) {
+    size_t n = s.len < cap ? s.len : cap;
+    memcpy(dst, s.ptr, n);
+    if (n < cap) dst[n] = '\0';
+}
+
+void accesslog_begin(access_entry_t *e, const http_request_t *req) {
+    e->start = metrics_clock();
+    e->peer = req->peer;
+    copy_slice(e->method, sizeof(e->method), req->method);
+    copy_slice(e->version, sizeof(e->version), req->version);
+
+    size_t n = req->path.len < ACCESSLOG_TARGET_MAX ? req->path.len : ACCESSLOG_TARGET_MAX;
+    memcpy(e->target, req->path.ptr, n);
+    if (req->query_string.len && n < ACCESSLOG_TARGET_MAX) {
+        e->target[n++] = '?';
+        size_t q = req->query_string.len;
+        if (q > ACCESSLOG_TARGET_MAX - n) q = ACCESSLOG_TARGET_MAX - n;
+        memcpy(e->target + n, req->query_string.ptr, q);
+        n += q;
+    }
+    e->target_len = (uint8_t)n;
+}
+
+void accesslog_end(access_entry_t *e, int status, uint64_t bytes) {
+    if (!e->start) return;
+    ring_t *r = atomic_load_explicit(&running, memory_order_acquire) ? my_ring() : NULL;
+    if (r) {
+        size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        int room = 1;
+        while (tail - atomic_load_explicit(&r->head, memory_order_acquire) >= RING_SIZE) {
+            if (full_policy == ACCESSLOG_DROP) {
+                metrics_add(METRIC_LOG_DROPPED, 1);
+                room = 0;
+                break;
+            }
+            nanosleep(&(struct timespec){ .tv_nsec = 100000 }, NULL);
+        }
+        if (room) {
+            struct timespec now;
+            clock_gettime(CLOCK_REALTIME_COARSE, &now);
+            record_t *rec = &r->slots[tail & (RING_SIZE - 1)];
+            memcpy(&rec->e, e, offsetof(access_entry_t, target) + e->target_len);
+            rec->status = status;
+            rec->bytes = bytes;
+            rec->usec = (metrics_clock() - e->start) / 1000;
+            rec->when = now.tv_sec;
+            atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+        }
+    }
+    e->start = 0;
+}
+
+// ---- writer ----
+
+static char batch[BATCH_MAX];
+static size_t batch_len;
+
+static void flush_batch(void) {
+    size_t off = 0;
+    while (off < batch_len) {
+        ssize_t w = write(log_fd, batch + off, batch_len - off);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) break; // nowhere to put it; the lines are lost
+        off += w;
+    }
+    batch_len = 0;
+}
+
+// Field text, with quotes, backslashes and control bytes escaped so a
+// crafted request cannot forge log lines.
+static char *put_escaped(char *p, const char *s, size_t len) {
+    static const char hex[] = "0123456789abcdef";
+    for (size_t i = 0; i < len && s[i]; i++) {
+        unsigned char c = s[i];
+        if (c < 0x20 || c >= 0x7f || c == '"' || c == '\\') {
+            *p++ = '\\';
+            *p++ = 'x';
+            *p++ = hex[c >> 4];
+            *p++ = hex[c & 15];
+        } else {
+            *p++ = c;
+        }
+    }
+    return p;
+}
+
+// Longest formatted line: every target byte escaped to four.
+#define LINE_MAX_LEN (4 * (ACCESSLOG_TARGET_MAX + 16) + 128)
+
+static void format_record(const record_t *rec) {
+    static time_t stamp_sec = -1;
+    static char stamp[32];
+    if (rec->when != stamp_sec) {
+        struct tm tm;
+        gmtime_r(&rec->when, &tm);
+        strftime(stamp, sizeof(stamp), "%d/%b/%Y:%H:%M:%S +0000", &tm);
+        stamp_sec = rec->when;
+    }
+
+    if (batch_len + LINE_MAX_LEN > BATCH_MAX) flush_batch();
+    char *p = batch + batch_len;
+    const unsigned char *ip = (const unsigned char *)&rec->e.peer;
+    p += sprintf(p, "%u.%u.%u.%u - - [%s] \"", ip[0], ip[1], ip[2], ip[3], stamp);
+    p = put_escaped(p, rec->e.method, sizeof(rec->e.method));
+    *p++ = ' ';
+    p = put_escaped(p, rec->e.target, rec->e.target_len);
+    *p++ = ' ';
+    p = put_escaped(p, rec->e.version, sizeof(rec->e.version));
+    p += sprintf(p, "\" %d %llu %llu\n", rec->status, (unsigned long long)rec->bytes,
+                 (unsigned long long)rec->usec);
+    batch_len = p - batch;
+}
+
+// Format everything queued so far; returns the number of records.
+static size_t drain(void) {
+    pthread_mutex_lock(&rings_lock);
+    ring_t *first = all_rings;
+    pthread_mutex_unlock(&rings_lock);
+
+    size_t n = 0;
+    for (ring_t *r = first; r; r = r->next) {
+        size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+        size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+        for (; head != tail; head++, n++) {
+            format_record(&r->slots[head & (RING_SIZE - 1)]);
+            // Hand slots back as we go so a blocked producer resumes early.
+            if ((head & 63) == 63)
+                atomic_store_explicit(&r->head, head + 1, memory_order_release);
+        }
+        atomic_store_explicit(&r->head, head, memory_order_release);
+    }
+    if (batch_len) flush_batch();
+    return n;
+}
+
+static int open_log(const char *path) {
+    if (strcmp(path, "-") == 0) return STDERR_FILENO;
+    return open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+}
+
+// Drains the rings until accesslog_close(), sleeping between passes while
+// there is nothing to write. SIGUSR1 arrives here as a wakeup.
+static void *writer(void *arg) {
+    (void)arg;
+    sigset_t usr1;
+    sigemptyset(&usr1);
+    sigaddset(&usr1, SIGUSR1);
+    int idle_ms = 1;
+    for (;;) {
+        if (atomic_load(&stopping)) {
+            drain();
+            break;
+        }
+        if (drain()) {
+            idle_ms = 1;
+            continue;
+        }
+        struct timespec ts = { .tv_nsec = idle_ms * 1000000L };
+        if (sigtimedwait(&usr1, NULL, &ts) == SIGUSR1 && log_fd != STDERR_FILENO) {
+            drain();
+            int fd = open_log(log_path);
+            if (fd < 0) {
+                fprintf(stderr, "access log %s: %s\n", log_path, strerror(errno));
+            } else {
+                close(log_fd);
+                log_fd = fd;
+            }
+        }
+        if (idle_ms < IDLE_MAX_MS) idle_ms *= 2;
+    }
+    return NULL;
+}
+
+int accesslog_init(const char *path, int policy) {
+    int fd = open_log(path);
+    if (fd < 0) return -1;
+    log_path = path;
+    log_fd = fd;
+    full_policy = policy;
+
+    sigset_t usr1;
+    sigemptyset(&usr1);
+    sigaddset(&usr1, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &usr1, NULL);
+
+    int err = pthread_create(&writer_thread, NULL, writer, NULL);
+    if (err) {
+        if (fd != STDERR_FILENO) close(fd);
+        errno = err;
+        return -1;
+    }
+    atomic_store_explicit(&running, 1, memory_order_release);
+    return 0;
+}
+
+void accesslog_close(void) {
+    if (!atomic_load_explicit(&running, memory_order_acquire)) return;
+    atomic_store(&stopping, 1);
+    pthread_join(writer_thread, NULL);
+    atomic_store_explicit(&running, 0, memory_order_release);
+    if (log_fd != STDERR_FILENO) close(log_fd);
+    log_fd = -1;
+}
@@ -0,0 +1,155 @@
+#include "arena.h"
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SPARE_CHUNKS 64     // per thread
+
+struct arena_chunk {
+    arena_chunk_t *next;
+    size_t cap;
+    size_t used;
+    alignas(max_align_t) char data[];
+};
+
+static _Thread_local arena_chunk_t *spare;
+static _Thread_local int nspare;
+
+static size_t align_up(size_t n) {
+    return (n + alignof(max_align_t) - 1) & ~(alignof(max_align_t) - 1);
+}
+
+static arena_chunk_t *chunk_get(size_t n) {
+    arena_chunk_t *c;
+    if (n <= ARENA_CHUNK && spare) {
+        c = spare;
+        spare = c->next;
+        nspare--;
+        alloc_count(ALLOC_ARENA_REUSE);
+    } else {
+        size_t cap = n > ARENA_CHUNK ? n : ARENA_CHUNK;
+        if (!(c = malloc(sizeof(*c) + cap))) return NULL;
+        c->cap = cap;
+        alloc_count(ALLOC_ARENA_MALLOC);
+    }
+    c->used = 0;
+    return c;
+}
+
+static void chunk_put(arena_chunk_t *c) {
+    if (c->cap == ARENA_CHUNK && nspare < SPARE_CHUNKS) {
+        c->next = spare;
+        spare = c;
+        nspare++;
+    } else {
+        free(c);
+    }
+}
+
+void *arena_alloc(arena_t *a, size_t n) {
+    n = align_up(n ? n : 1);
+    arena_chunk_t *c = a->head;
+    if (!c || c->cap - c->used < n) {
+        if (!(c = chunk_get(n))) return NULL;
+        c->next = a->head;
+        a->head = c;
+    }
+    void *p = c->data + c->used;
+    c->used += n;
+    return p;
+}
+
+void *arena_realloc(arena_t *a, void *p, size_t old, size_t n) {
+    arena_chunk_t *c = a->head;
+    if (!p) return arena_alloc(a, n);
+    old = align_up(old);
+    size_t want = align_up(n);
+    if (c && (char *)p + old == c->data + c->used && c->cap - c->used + old >= want) {
+        c->used = c->used - old + want;
+        return p;
+    }
+    void *q = arena_alloc(a, n);
+    if (q) memcpy(q, p, old < n ? old : n);
+    return q;
+}
+
+void arena_reset(arena_t *a) {
+    // Keep a standard chunk; oversized ones were for one large body.
+    arena_chunk_t *keep = NULL;
+    arena_chunk_t *c = a->head;
+    while (c) {
+        arena_chunk_t *next = c->next;
+        if (!keep && c->cap == ARENA_CHUNK) keep = c;
+        else chunk_put(c);
+        c = next;
+    }
+    if (keep) {
+        keep->next = NULL;
+        keep->used = 0;
+    }
+    a->head = keep;
+}
+
+void arena_free(arena_t *a) {
+    arena_chunk_t *c = a->head;
+    while (c) {
+        arena_chunk_t *next = c->next;
+        chunk_put(c);
+        c = next;
+    }
+    a->head = NULL;
+}
+
+void arena_trim(void) {
+    while (spare) {
+        arena_chunk_t *c = spare;
+        spare = c->next;
+        free(c);
+    }
+    nspare = 0;
+}
+
+// ---- stats ----
+
+// One block per thread, on the heap so a thread's counts outlive it.
+typedef struct counters {
+    _Atomic unsigned long v[ALLOC_NCOUNTERS];
+    struct counters *next;
+} counters_t;
+
+static pthread_mutex_t counters_lock = PTHREAD_MUTEX_INITIALIZER;
+static counters_t *all_counters;
+static _Thread_local counters_t *mine;
+
+void alloc_count(int counter) {
+    if (!mine) {
+        counters_t *c = calloc(1, sizeof(*c));
+        if (!c) return;
+        pthread_mutex_lock(&counters_lock);
+        c->next = all_counters;
+        all_counters = c;
+        pthread_mutex_unlock(&counters_lock);
+        mine = c;
+    }
+    _Atomic unsigned long *v = &mine->v[counter];
+    atomic_store_explicit(v, atomic_load_explicit(v, memory_order_relaxed) + 1,
+                          memory_order_relaxed);
+}
+
+void alloc_stats(alloc_stats_t *out) {
+    unsigned long sum[ALLOC_NCOUNTERS] = {0};
+    pthread_mutex_lock(&counters_lock);
+    for (counters_t *c = all_counters; c; c = c->next) {
+        for (int i = 0; i < ALLOC_NCOUNTERS; i++)
+            sum[i] += atomic_load_explicit(&c->v[i], memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&counters_lock);
+    out->arena_mallocs = sum[ALLOC_ARENA_MALLOC];
+    out->arena_reuses = sum[ALLOC_ARENA_REUSE];
+    out->buffer_mallocs = sum[ALLOC_BUFFER_MALLOC];
+    out->buffer_reuses = sum[ALLOC_BUFFER_REUSE];
+    out->conn_mallocs = sum[ALLOC_CONN_MALLOC];
+    out->conn_reuses = sum[ALLOC_CONN_REUSE];
+}
@@ -0,0 +1,87 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "buffer.h"
+#include "arena.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Freed buffers up to SPARE_MAX bytes are kept per thread and handed to
+// the next buffer that starts out empty, so connections can drop their
+// buffers between requests without costing a malloc on the next one.
+#define SPARE_BUFFERS 64
+#define SPARE_MAX (64 << 10)
+
+typedef struct {
+    char *data;
+    size_t cap;
+} spare_t;
+
+static _Thread_local spare_t spare[SPARE_BUFFERS];
+static _Thread_local int nspare;
+
+int buf_reserve(buffer_t *b, size_t extra) {
+    if (b->len + extra <= b->cap) return 0;
+    if (!b->data && nspare > 0) {
+        spare_t *s = &spare[--nspare];
+        b->data = s->data;
+        b->cap = s->cap;
+        alloc_count(ALLOC_BUFFER_REUSE);
+        if (b->len + extra <= b->cap) return 0;
+    }
+    size_t cap = b->cap ? b->cap : 1024;
+    while (cap < b->len + extra) cap *= 2;
+    char *p = realloc(b->data, cap);
+    if (!p) return -1;
+    b->data = p;
+    b->cap = cap;
+    alloc_count(ALLOC_BUFFER_MALLOC);
+    return 0;
+}
+
+int buf_append(buffer_t *b, const void *data, size_t n) {
+    if (buf_reserve(b, n) < 0) return -1;
+    memcpy(b->data + b->len, data, n);
+    b->len += n;
+    return 0;
+}
+
+int buf_appendf(buffer_t *b, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(b->data ? b->data + b->len : NULL, b->cap - b->len, fmt, ap);
+    va_end(ap);
+    if (n < 0) return -1;
+    if ((size_t)n >= b->cap - b->len) {
+        if (buf_reserve(b, n + 1) < 0) return -1;
+        va_start(ap, fmt);
+        vsnprintf(b->data + b->len, b->cap - b->len, fmt, ap);
+        va_end(ap);
+    }
+    b->len += n;
+    return 0;
+}
+
+// Drop the first n bytes, keeping whatever follows them.
+void buf_consume(buffer_t *b, size_t n) {
+    if (n >= b->len) {
+        b->len = 0;
+        return;
+    }
+    memmove(b->data, b->data + n, b->len - n);
+    b->len -= n;
+}
+
+void buf_free(buffer_t *b) {
+    if (b->data && b->cap <= SPARE_MAX && nspare < SPARE_BUFFERS)
+        spare[nspare++] = (spare_t){ b->data, b->cap };
+    else
+        free(b->data);
+    b->data = NULL;
+    b->len = b->cap = 0;
+}
+
+void buf_trim(void) {
+    while (nspare > 0) free(spare[--nspare].data);
+}
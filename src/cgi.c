@@ -0,0 +1,766 @@
+#define _GNU_SOURCE
+
+#include "cgi.h"
+#include "metrics.h"
+#include "router.h"
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#define CGI_MAX_HEAD 16384      // response header block from the script
+#define CGI_READ_CHUNK 16384
+#define CGI_MAX_BATCH 65536     // output gathered before handing it to the socket
+#define MAX_POOLS 32
+
+// FastCGI record types and the one role we speak.
+enum {
+    FCGI_BEGIN_REQUEST = 1,
+    FCGI_END_REQUEST = 3,
+    FCGI_PARAMS = 4,
+    FCGI_STDIN = 5,
+    FCGI_STDOUT = 6,
+    FCGI_STDERR = 7,
+};
+#define FCGI_RESPONDER 1
+#define FCGI_REQUEST_ID 1       // one request per connection
+#define FCGI_MAX_CONTENT 65528  // largest multiple of 8 that fits a record
+
+// Requests running per script, for the concurrency limit.
+typedef struct handler {
+    char *name;
+    int active;
+    struct handler *next;
+} handler_t;
+
+typedef struct {
+    pid_t pid;              // 0 while down; the watchdog respawns it
+    int listen_fd;          // kept across respawns so queued connects survive
+    struct sockaddr_un addr;
+    socklen_t addr_len;
+    int busy;
+} fcgi_worker_t;
+
+typedef struct {
+    char *name;             // request path, e.g. /cgi-bin/app.fcgi
+    char *file;
+    int nworkers;
+    fcgi_worker_t *workers;
+} fcgi_pool_t;
+
+enum { OUT_HEAD, OUT_BODY, OUT_DONE };
+
+typedef struct cgi {
+    int fd;                 // child's stdout, or the FastCGI connection
+    pid_t pid;              // child, or the FastCGI worker
+    _Atomic int eof;        // output fully read
+    handler_t *handler;
+    fcgi_pool_t *pool;
+    int worker;
+    int ended;              // FCGI_END_REQUEST seen
+    buffer_t pending;       // FastCGI request records not yet written
+    size_t pending_off;
+    unsigned char rec[8];   // FastCGI record header being read
+    size_t rec_have;
+    size_t rec_left;        // content bytes left in the current record
+    size_t rec_pad;
+    buffer_t head;          // the script's response header block
+    int out_state;
+    int is_head;
+    int no_body;
+    int http11;
+    // Watchdog list, under watch_lock.
+    time_t deadline;
+    _Atomic int timed_out;
+    struct cgi *prev, *next;
+} cgi_t;
+
+static const server_config_t *config;
+static char cgi_dir[PATH_MAX];
+
+static pthread_mutex_t handlers_lock = PTHREAD_MUTEX_INITIALIZER;
+static handler_t *handlers;
+
+static pthread_mutex_t pools_lock = PTHREAD_MUTEX_INITIALIZER;
+static fcgi_pool_t pools[MAX_POOLS];
+static int npools;
+
+static pthread_mutex_t watch_lock = PTHREAD_MUTEX_INITIALIZER;
+static cgi_t *watched;
+
+static time_t now_coarse(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+// posix_spawn() path in dir with the given stdin/stdout, as the leader of
+// its own process group so a timeout can kill everything it started. The
+// server ignores SIGPIPE and SIGCHLD; the child gets the defaults back.
+static int spawn(pid_t *pid, const char *path, const char *dir, int in, int out, char **envp) {
+    posix_spawn_file_actions_t fa;
+    posix_spawnattr_t attr;
+    sigset_t def, mask;
+    sigemptyset(&def);
+    sigaddset(&def, SIGPIPE);
+    sigaddset(&def, SIGCHLD);
+    sigemptyset(&mask);
+
+    posix_spawn_file_actions_init(&fa);
+    posix_spawn_file_actions_adddup2(&fa, in, 0);
+    posix_spawn_file_actions_adddup2(&fa, out, 1);
+    posix_spawn_file_actions_addchdir_np(&fa, dir);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigdefault(&attr, &def);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    posix_spawnattr_setpgroup(&attr, 0);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK |
+                                    POSIX_SPAWN_SETPGROUP);
+
+    char *argv[] = { (char *)path, NULL };
+    int err = posix_spawn(pid, path, &fa, &attr, argv, envp);
+    posix_spawn_file_actions_destroy(&fa);
+    posix_spawnattr_destroy(&attr);
+    return err;
+}
+
+// ---- environment ----
+
+// "NAME=value" strings, NUL-separated.
+typedef struct {
+    buffer_t buf;
+    int count;
+} env_t;
+
+__attribute__((format(printf, 2, 3)))
+static void env_add(env_t *e, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if (n < 0 || buf_reserve(&e->buf, n + 1) < 0) return;
+    va_start(ap, fmt);
+    vsnprintf(e->buf.data + e->buf.len, n + 1, fmt, ap);
+    va_end(ap);
+    e->buf.len += n + 1;
+    e->count++;
+}
+
+// RFC 3875 meta-variables plus HTTP_* for the request headers.
+static void build_env(env_t *e, const http_request_t *req, const char *name,
+                      const char *path_info) {
+    env_add(e, "GATEWAY_INTERFACE=CGI/1.1");
+    env_add(e, "SERVER_SOFTWARE=httpwebserver");
+    env_add(e, "SERVER_PROTOCOL=%s", req->version.ptr);
+    env_add(e, "SERVER_PORT=%d", config->port);
+    env_add(e, "REQUEST_METHOD=%s", req->method.ptr);
+    env_add(e, "REQUEST_URI=%s%s%.*s", req->path.ptr, req->query_string.ptr ? "?" : "",
+            (int)req->query_string.len, req->query_string.ptr ? req->query_string.ptr : "");
+    env_add(e, "SCRIPT_NAME=%s", name);
+    env_add(e, "SCRIPT_FILENAME=%s/%s", cgi_dir, name + strlen(CGI_PREFIX));
+    if (*path_info) env_add(e, "PATH_INFO=%s", path_info);
+    env_add(e, "QUERY_STRING=%.*s", (int)req->query_string.len,
+            req->query_string.ptr ? req->query_string.ptr : "");
+    env_add(e, "REDIRECT_STATUS=200");
+    env_add(e, "PATH=/usr/local/bin:/usr/bin:/bin");
+    if (req->body_len > 0 || http_get_header(req, "Content-Length"))
+        env_add(e, "CONTENT_LENGTH=%zu", req->body_len);
+    const char *ctype = http_get_header(req, "Content-Type");
+    if (ctype) env_add(e, "CONTENT_TYPE=%s", ctype);
+
+    for (int i = 0; i < req->header_count; i++) {
+        http_slice_t n = req->headers[i].name;
+        if (http_slice_caseeq(n, "Content-Type") || http_slice_caseeq(n, "Content-Length") ||
+            http_slice_caseeq(n, "Proxy"))  // httpoxy
+            continue;
+        char var[128];
+        if (n.len + 6 > sizeof(var)) continue;
+        size_t j = 0;
+        memcpy(var, "HTTP_", 5);
+        for (; j < n.len; j++) {
+            unsigned char ch = n.ptr[j];
+            // Underscores would make "A-B" and "A_B" indistinguishable.
+            if (ch == '_') break;
+            var[5 + j] = ch == '-' ? '_' : toupper(ch);
+        }
+        if (j < n.len) continue;
+        var[5 + j] = '\0';
+        env_add(e, "%s=%s", var, req->headers[i].value.ptr);
+    }
+}
+
+static char **env_array(env_t *e) {
+    char **envp = malloc((e->count + 1) * sizeof(*envp));
+    if (!envp) return NULL;
+    char *p = e->buf.data;
+    for (int i = 0; i < e->count; i++) {
+        envp[i] = p;
+        p += strlen(p) + 1;
+    }
+    envp[e->count] = NULL;
+    return envp;
+}
+
+// ---- concurrency and timeouts ----
+
+static handler_t *handler_get(const char *name) {
+    pthread_mutex_lock(&handlers_lock);
+    handler_t *h = handlers;
+    while (h && strcmp(h->name, name) != 0) h = h->next;
+    if (!h && (h = calloc(1, sizeof(*h))) != NULL) {
+        if ((h->name = strdup(name)) != NULL) {
+            h->next = handlers;
+            handlers = h;
+        } else {
+            free(h);
+            h = NULL;
+        }
+    }
+    if (h && h->active >= config->cgi_max) h = NULL;
+    if (h) h->active++;
+    pthread_mutex_unlock(&handlers_lock);
+    return h;
+}
+
+static void handler_put(handler_t *h) {
+    if (!h) return;
+    pthread_mutex_lock(&handlers_lock);
+    h->active--;
+    pthread_mutex_unlock(&handlers_lock);
+}
+
+static void watch(cgi_t *g) {
+    g->deadline = now_coarse() + config->cgi_timeout;
+    pthread_mutex_lock(&watch_lock);
+    g->prev = NULL;
+    g->next = watched;
+    if (watched) watched->prev = g;
+    watched = g;
+    pthread_mutex_unlock(&watch_lock);
+}
+
+static void unwatch(cgi_t *g) {
+    pthread_mutex_lock(&watch_lock);
+    if (g->prev) g->prev->next = g->next; else watched = g->next;
+    if (g->next) g->next->prev = g->prev;
+    pthread_mutex_unlock(&watch_lock);
+}
+
+static void spawn_worker(fcgi_pool_t *pool, fcgi_worker_t *w) {
+    static char *envp[] = { "PATH=/usr/local/bin:/usr/bin:/bin", NULL };
+    int devnull = open("/dev/null", O_RDWR | O_CLOEXEC);
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", pool->file);
+    *strrchr(dir, '/') = '\0';
+    pid_t pid;
+    int err = spawn(&pid, pool->file, dir, w->listen_fd, devnull, envp);
+    if (devnull >= 0) close(devnull);
+    if (err) {
+        fprintf(stderr, "fastcgi %s: %s\n", pool->name, strerror(err));
+        w->pid = 0;
+    } else {
+        w->pid = pid;
+    }
+}
+
+// Kills requests past their deadline and restarts FastCGI workers that died.
+static void *watchdog(void *arg) {
+    (void)arg;
+    for (;;) {
+        sleep(1);
+        time_t now = now_coarse();
+        pthread_mutex_lock(&watch_lock);
+        for (cgi_t *g = watched; g; g = g->next) {
+            if (g->timed_out || now < g->deadline || g->eof || g->pid <= 0) continue;
+            g->timed_out = 1;
+            kill(-g->pid, SIGKILL);
+        }
+        pthread_mutex_unlock(&watch_lock);
+
+        pthread_mutex_lock(&pools_lock);
+        for (int i = 0; i < npools; i++) {
+            for (int j = 0; j < pools[i].nworkers; j++) {
+                fcgi_worker_t *w = &pools[i].workers[j];
+                if (w->pid <= 0 || (kill(w->pid, 0) < 0 && errno == ESRCH))
+                    spawn_worker(&pools[i], w);
+            }
+        }
+        pthread_mutex_unlock(&pools_lock);
+    }
+    return NULL;
+}
+
+static int pool_init(fcgi_pool_t *pool, const char *entry, int index) {
+    char name[PATH_MAX], file[PATH_MAX];
+    if (snprintf(name, sizeof(name), CGI_PREFIX "%s", entry) >= (int)sizeof(name) ||
+        snprintf(file, sizeof(file), "%s/%s", cgi_dir, entry) >= (int)sizeof(file))
+        return -1;
+    pool->name = strdup(name);
+    pool->file = strdup(file);
+    pool->nworkers = config->fcgi_workers;
+    pool->workers = calloc(pool->nworkers, sizeof(*pool->workers));
+    if (!pool->name || !pool->file || !pool->workers) return -1;
+
+    for (int i = 0; i < pool->nworkers; i++) {
+        fcgi_worker_t *w = &pool->workers[i];
+        // Abstract socket: nothing on disk to clean up.
+        w->addr.sun_family = AF_UNIX;
+        int n = snprintf(w->addr.sun_path + 1, sizeof(w->addr.sun_path) - 1,
+                         "httpwebserver-fcgi-%d-%d-%d", (int)getpid(), index, i);
+        w->addr_len = offsetof(struct sockaddr_un, sun_path) + 1 + n;
+        w->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (w->listen_fd < 0 ||
+            bind(w->listen_fd, (struct sockaddr *)&w->addr, w->addr_len) < 0 ||
+            listen(w->listen_fd, 64) < 0) {
+            perror("fastcgi socket");
+            return -1;
+        }
+        spawn_worker(pool, w);
+    }
+    fprintf(stderr, "FastCGI %s: %d workers\n", pool->name, pool->nworkers);
+    return 0;
+}
+
+int cgi_init(const char *root, const server_config_t *cfg) {
+    config = cfg;
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s%s", root, CGI_PREFIX);
+    if (!realpath(dir, cgi_dir)) snprintf(cgi_dir, sizeof(cgi_dir), "%s", dir);
+
+    // Children are never waited for; let the kernel reap them.
+    signal(SIGCHLD, SIG_IGN);
+
+    DIR *d = opendir(cgi_dir);
+    if (d) {
+        struct dirent *ent;
+        while ((ent = readdir(d)) != NULL && npools < MAX_POOLS) {
+            size_t len = strlen(ent->d_name);
+            if (len <= 5 || strcmp(ent->d_name + len - 5, ".fcgi") != 0) continue;
+            if (pool_init(&pools[npools], ent->d_name, npools) == 0) npools++;
+        }
+        closedir(d);
+    }
+
+    pthread_t t;
+    if (pthread_create(&t, NULL, watchdog, NULL) != 0) return -1;
+    pthread_detach(t);
+    return 0;
+}
+
+void cgi_shutdown(void) {
+    pthread_mutex_lock(&watch_lock);
+    for (cgi_t *g = watched; g; g = g->next)
+        if (!g->eof && g->pid > 0 && !g->pool) kill(-g->pid, SIGKILL);
+    pthread_mutex_unlock(&watch_lock);
+
+    // With the pools gone the watchdog has nothing left to restart.
+    pthread_mutex_lock(&pools_lock);
+    for (int i = 0; i < npools; i++) {
+        for (int j = 0; j < pools[i].nworkers; j++) {
+            fcgi_worker_t *w = &pools[i].workers[j];
+            if (w->pid > 0) kill(-w->pid, SIGTERM);
+            w->pid = 0;
+        }
+    }
+    npools = 0;
+    pthread_mutex_unlock(&pools_lock);
+}
+
+// ---- output ----
+
+static int gateway_error(response_t *res, cgi_t *g, int status) {
+    response_error(res, status);
+    g->out_state = OUT_DONE;
+    return RESPONSE_DONE;
+}
+
+// Translate the script's header block (RFC 3875 section 6) into our
+// status line and headers. Framing headers are ours to choose.
+static int emit_headers(response_t *res, cgi_t *g, char *block, size_t len) {
+    int status = 200;
+    const char *reason = "OK";
+    int location = 0;
+    int date = 0;
+    buffer_t pass = {0};
+
+    char *line = block;
+    char *end = block + len;
+    while (line < end) {
+        char *nl = memchr(line, '\n', end - line);
+        char *eol = nl ? nl : end;
+        char *next = nl ? nl + 1 : end;
+        if (eol > line && eol[-1] == '\r') eol--;
+        *eol = '\0';
+        char *colon = strchr(line, ':');
+        if (!colon || colon == line) {
+            buf_free(&pass);
+            return -1;
+        }
+        *colon = '\0';
+        char *value = colon + 1;
+        while (*value == ' ' || *value == '\t') value++;
+
+        if (strcasecmp(line, "Status") == 0) {
+            char *rest;
+            status = strtol(value, &rest, 10);
+            if (status < 100 || status > 599) {
+                buf_free(&pass);
+                return -1;
+            }
+            while (*rest == ' ') rest++;
+            reason = *rest ? rest : "";
+        } else if (strcasecmp(line, "Content-Length") != 0 &&
+                   strcasecmp(line, "Transfer-Encoding") != 0 &&
+                   strcasecmp(line, "Connection") != 0) {
+            if (strcasecmp(line, "Location") == 0) location = 1;
+            if (strcasecmp(line, "Date") == 0) date = 1;
+            buf_appendf(&pass, "%s: %s\r\n", line, value);
+        }
+        line = next;
+    }
+    if (location && status == 200) {
+        status = 302;
+        reason = "Found";
+    }
+
+    g->no_body = g->is_head || status < 200 || status == 204 || status == 304;
+    res->chunked = !g->no_body && g->http11;
+    // The script may choose its own reason phrase, so no prebuilt line.
+    response_printf(res, "HTTP/1.1 %d %s\r\n", status, reason);
+    res->status = status;
+    // Time spent waiting on the script is not write time.
+    res->ready_at = metrics_clock();
+    if (!date) response_date(res);
+    if (pass.len) response_append(res, pass.data, pass.len);
+    if (res->chunked) response_header(res, "Transfer-Encoding", "chunked");
+    response_end_headers(res);
+    buf_free(&pass);
+    return 0;
+}
+
+// Script output: the header block first, then body data.
+static int cgi_output(response_t *res, cgi_t *g, const char *data, size_t n) {
+    if (g->out_state == OUT_BODY) {
+        if (!g->no_body) response_chunk(res, data, n);
+        return 0;
+    }
+    if (g->out_state != OUT_HEAD) return 0;
+
+    size_t scan = g->head.len > 2 ? g->head.len - 2 : 0;
+    if (buf_append(&g->head, data, n) < 0) return -1;
+    char *h = g->head.data;
+    for (size_t i = scan; i < g->head.len; i++) {
+        if (h[i] != '\n') continue;
+        size_t j = i + 1;
+        if (j < g->head.len && h[j] == '\r') j++;
+        if (j >= g->head.len || h[j] != '\n') continue;
+
+        // Header block ends at i; the body starts after the blank line.
+        if (emit_headers(res, g, h, i) < 0) return -1;
+        g->out_state = OUT_BODY;
+        if (j + 1 < g->head.len && !g->no_body)
+            response_chunk(res, h + j + 1, g->head.len - j - 1);
+        buf_free(&g->head);
+        return 0;
+    }
+    return g->head.len > CGI_MAX_HEAD ? -1 : 0;
+}
+
+// Split FastCGI records, passing STDOUT on and STDERR to our log.
+static int fcgi_input(response_t *res, cgi_t *g, const char *data, size_t n) {
+    while (n > 0 && !g->ended) {
+        size_t take;
+        if (g->rec_have < sizeof(g->rec)) {
+            take = sizeof(g->rec) - g->rec_have;
+            if (take > n) take = n;
+            memcpy(g->rec + g->rec_have, data, take);
+            g->rec_have += take;
+            if (g->rec_have == sizeof(g->rec)) {
+                if (g->rec[0] != 1) return -1;
+                g->rec_left = (size_t)g->rec[4] << 8 | g->rec[5];
+                g->rec_pad = g->rec[6];
+            }
+        } else if (g->rec_left > 0) {
+            take = g->rec_left < n ? g->rec_left : n;
+            if (g->rec[1] == FCGI_STDOUT && cgi_output(res, g, data, take) < 0) return -1;
+            if (g->rec[1] == FCGI_STDERR) fwrite(data, 1, take, stderr);
+            g->rec_left -= take;
+        } else {
+            take = g->rec_pad < n ? g->rec_pad : n;
+            g->rec_pad -= take;
+        }
+        data += take;
+        n -= take;
+
+        if (g->rec_have == sizeof(g->rec) && g->rec_left == 0 && g->rec_pad == 0) {
+            if (g->rec[1] == FCGI_END_REQUEST) g->ended = 1;
+            g->rec_have = 0;
+        }
+    }
+    return 0;
+}
+
+// The script is done (EOF, or FCGI_END_REQUEST).
+static int cgi_end(response_t *res, cgi_t *g) {
+    int clean = g->pool ? g->ended : !g->timed_out;
+    if (g->out_state == OUT_HEAD)
+        return gateway_error(res, g, g->timed_out ? 504 : 502);
+    if (!clean) return -1;  // headers are out; cutting the connection is all we can do
+    if (!g->no_body) response_chunk_end(res);
+    g->out_state = OUT_DONE;
+    return RESPONSE_DONE;
+}
+
+static int cgi_fail(response_t *res, cgi_t *g) {
+    return g->out_state == OUT_HEAD ? gateway_error(res, g, 502) : -1;
+}
+
+static int cgi_produce(response_t *res, void *arg) {
+    cgi_t *g = arg;
+    if (g->out_state == OUT_DONE) return RESPONSE_DONE;
+
+    // A FastCGI request goes out before its response is read.
+    while (g->pending_off < g->pending.len) {
+        ssize_t w = send(g->fd, g->pending.data + g->pending_off,
+                         g->pending.len - g->pending_off, MSG_NOSIGNAL);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                res->wait_fd = g->fd;
+                res->wait_events = POLLOUT;
+                return RESPONSE_WAIT;
+            }
+            return cgi_fail(res, g);
+        }
+        g->pending_off += w;
+        if (g->pending_off == g->pending.len) buf_free(&g->pending);
+    }
+
+    char buf[CGI_READ_CHUNK];
+    while (res->buf.len < CGI_MAX_BATCH) {
+        ssize_t r = read(g->fd, buf, sizeof(buf));
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) return cgi_fail(res, g);
+            if (res->nparts > 0) return RESPONSE_MORE;
+            res->wait_fd = g->fd;
+            res->wait_events = POLLIN;
+            return RESPONSE_WAIT;
+        }
+        if (r == 0) {
+            g->eof = 1;
+            return cgi_end(res, g);
+        }
+        int rc = g->pool ? fcgi_input(res, g, buf, r) : cgi_output(res, g, buf, r);
+        if (rc < 0) return cgi_fail(res, g);
+        if (g->ended) return cgi_end(res, g);
+    }
+    return RESPONSE_MORE;
+}
+
+static void cgi_release(void *arg) {
+    cgi_t *g = arg;
+    if (g->deadline) unwatch(g);
+    if (g->fd >= 0) close(g->fd);
+    if (g->pool) {
+        pthread_mutex_lock(&pools_lock);
+        fcgi_worker_t *w = &g->pool->workers[g->worker];
+        // A worker abandoned mid-request is replaced rather than trusted.
+        if (!g->ended && w->pid > 0 && w->pid == g->pid) {
+            kill(-w->pid, SIGKILL);
+            w->pid = 0;
+        }
+        w->busy = 0;
+        pthread_mutex_unlock(&pools_lock);
+    } else if (!g->eof && g->pid > 0) {
+        kill(-g->pid, SIGKILL);
+    }
+    handler_put(g->handler);
+    buf_free(&g->pending);
+    buf_free(&g->head);
+    free(g);
+}
+
+// ---- starting a request ----
+
+static int spawn_error(int err) {
+    return err == ENOENT || err == ENOTDIR ? 404 : err == EACCES ? 403 : 500;
+}
+
+static int start_process(cgi_t *g, const http_request_t *req, const char *name, env_t *env) {
+    char **envp = env_array(env);
+    int in = memfd_create("cgi-stdin", MFD_CLOEXEC);
+    int out[2] = { -1, -1 };
+    int status = 500;
+    if (!envp || in < 0 || pipe2(out, O_CLOEXEC) < 0) goto done;
+
+    // The body goes in through memory, so the child can never block us.
+    for (size_t off = 0; off < req->body_len; ) {
+        ssize_t w = write(in, req->body + off, req->body_len - off);
+        if (w < 0 && errno != EINTR) goto done;
+        if (w > 0) off += w;
+    }
+    lseek(in, 0, SEEK_SET);
+    fcntl(out[0], F_SETFL, O_NONBLOCK);
+
+    char file[PATH_MAX];
+    snprintf(file, sizeof(file), "./%s", name + strlen(CGI_PREFIX));
+    int err = spawn(&g->pid, file, cgi_dir, in, out[1], envp);
+    if (err) {
+        status = spawn_error(err);
+        goto done;
+    }
+    g->fd = out[0];
+    out[0] = -1;
+    status = 0;
+
+done:
+    free(envp);
+    if (in >= 0) close(in);
+    if (out[0] >= 0) close(out[0]);
+    if (out[1] >= 0) close(out[1]);
+    return status;
+}
+
+static void fcgi_record(buffer_t *b, int type, const char *data, size_t len) {
+    unsigned char pad = (8 - len % 8) % 8;
+    unsigned char hdr[8] = { 1, type, 0, FCGI_REQUEST_ID, len >> 8, len & 0xff, pad, 0 };
+    static const char zeros[8];
+    buf_append(b, hdr, sizeof(hdr));
+    if (len > 0) buf_append(b, data, len);
+    buf_append(b, zeros, pad);
+}
+
+// A stream is a run of records closed by an empty one.
+static void fcgi_stream(buffer_t *b, int type, const char *data, size_t len) {
+    while (len > 0) {
+        size_t n = len < FCGI_MAX_CONTENT ? len : FCGI_MAX_CONTENT;
+        fcgi_record(b, type, data, n);
+        data += n;
+        len -= n;
+    }
+    fcgi_record(b, type, NULL, 0);
+}
+
+static void fcgi_length(buffer_t *b, size_t n) {
+    if (n < 128) {
+        unsigned char c = n;
+        buf_append(b, &c, 1);
+    } else {
+        unsigned char c[4] = { 0x80 | (n >> 24), n >> 16, n >> 8, n };
+        buf_append(b, c, 4);
+    }
+}
+
+static int start_fastcgi(cgi_t *g, fcgi_pool_t *pool, const http_request_t *req, env_t *env) {
+    pthread_mutex_lock(&pools_lock);
+    int idx = -1;
+    for (int i = 0; i < pool->nworkers && idx < 0; i++) {
+        if (!pool->workers[i].busy && pool->workers[i].pid > 0) idx = i;
+    }
+    if (idx >= 0) {
+        pool->workers[idx].busy = 1;
+        g->pid = pool->workers[idx].pid;
+    }
+    pthread_mutex_unlock(&pools_lock);
+    if (idx < 0) return 503;
+    g->pool = pool;
+    g->worker = idx;
+
+    fcgi_worker_t *w = &pool->workers[idx];
+    g->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (g->fd < 0 || connect(g->fd, (struct sockaddr *)&w->addr, w->addr_len) < 0)
+        return errno == EAGAIN ? 503 : 500;
+
+    static const char begin[8] = { 0, FCGI_RESPONDER, 0 };
+    fcgi_record(&g->pending, FCGI_BEGIN_REQUEST, begin, sizeof(begin));
+    buffer_t params = {0};
+    const char *p = env->buf.data;
+    for (int i = 0; i < env->count; i++) {
+        const char *eq = strchr(p, '=');
+        size_t len = strlen(p);
+        fcgi_length(&params, eq - p);
+        fcgi_length(&params, len - (eq - p) - 1);
+        buf_append(&params, p, eq - p);
+        buf_append(&params, eq + 1, len - (eq - p) - 1);
+        p += len + 1;
+    }
+    fcgi_stream(&g->pending, FCGI_PARAMS, params.data, params.len);
+    buf_free(&params);
+    fcgi_stream(&g->pending, FCGI_STDIN, req->body, req->body_len);
+    return 0;
+}
+
+int cgi_handle(const http_request_t *req, response_t *res) {
+    // /cgi-bin/name/extra: the first segment names the script, the rest is
+    // PATH_INFO.
+    const char *path = req->path.ptr;
+    const char *script = path + strlen(CGI_PREFIX);
+    const char *path_info = strchr(script, '/');
+    if (!path_info) path_info = script + strlen(script);
+    if (path_info == script || !path_is_safe(path)) return 404;
+    char name[PATH_MAX];
+    if ((size_t)(path_info - path) >= sizeof(name)) return 404;
+    memcpy(name, path, path_info - path);
+    name[path_info - path] = '\0';
+
+    fcgi_pool_t *pool = NULL;
+    for (int i = 0; i < npools && !pool; i++) {
+        if (strcmp(pools[i].name, name) == 0) pool = &pools[i];
+    }
+
+    // Only scripts that exist get a concurrency slot entry.
+    char file[PATH_MAX];
+    struct stat st;
+    if (!pool && (snprintf(file, sizeof(file), "%s/%s", cgi_dir, name + strlen(CGI_PREFIX))
+                      >= (int)sizeof(file) ||
+                  stat(file, &st) < 0 || !S_ISREG(st.st_mode)))
+        return 404;
+
+    cgi_t *g = calloc(1, sizeof(*g));
+    if (!g) return 500;
+    g->fd = -1;
+    if (!pool && !(g->handler = handler_get(name))) {
+        free(g);
+        return 503;
+    }
+
+    env_t env = {0};
+    build_env(&env, req, name, path_info);
+    int status = pool ? start_fastcgi(g, pool, req, &env) : start_process(g, req, name, &env);
+    buf_free(&env.buf);
+    if (status) {
+        g->ended = 1;   // nothing was started that needs killing
+        g->eof = 1;
+        cgi_release(g);
+        return status;
+    }
+
+    g->is_head = http_slice_eq(req->method, "HEAD");
+    g->http11 = http_slice_eq(req->version, "HTTP/1.1");
+    res->keep_alive = res->keep_alive && g->http11;
+    res->produce = cgi_produce;
+    res->produce_arg = g;
+    res->release = cgi_release;
+    res->release_arg = g;
+    watch(g);
+    return 0;
+}
@@ -0,0 +1,242 @@
+#define _GNU_SOURCE
+
+#include "config.h"
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+enum { OPT_INT, OPT_UINT, OPT_SIZE, OPT_BOOL, OPT_PATH, OPT_LISTEN, OPT_MODE, OPT_PROXY };
+
+typedef struct {
+    const char *name;
+    int type;
+    size_t off;
+    unsigned long long min, max;
+} option_t;
+
+#define OPT(name, type, field, min, max) \
+    { name, type, offsetof(server_config_t, field), min, max }
+
+#define DAY 86400
+
+static const option_t options[] = {
+    OPT("listen", OPT_LISTEN, port, 1, 65535),
+    OPT("backlog", OPT_INT, backlog, 1, 65535),
+    OPT("threads", OPT_INT, threads, 0, 1024),
+    OPT("pin_cpus", OPT_BOOL, pin_cpus, 0, 1),
+    OPT("mode", OPT_MODE, use_select, 0, 0),
+    OPT("root", OPT_PATH, root, 0, 0),
+    OPT("queue_cap", OPT_SIZE, queue_cap, 1, 1 << 20),
+    OPT("read_buffer", OPT_SIZE, read_buffer, 1 << 10, 16 << 20),
+    OPT("cache", OPT_SIZE, cache_bytes, 0, SIZE_MAX),
+    OPT("cache_max_file", OPT_SIZE, cache_max_file, 0, SIZE_MAX),
+    OPT("fd_cache", OPT_SIZE, fd_cache_entries, 0, 1 << 20),
+    OPT("fd_cache_ttl", OPT_UINT, fd_cache_ttl, 0, DAY),
+    OPT("gzip", OPT_INT, gzip_level, 0, 9),
+    OPT("max_body", OPT_SIZE, max_body, 0, SIZE_MAX),
+    OPT("header_timeout", OPT_INT, header_timeout, 0, DAY),
+    OPT("body_timeout", OPT_INT, body_timeout, 0, DAY),
+    OPT("write_timeout", OPT_INT, write_timeout, 0, DAY),
+    OPT("keepalive_timeout", OPT_INT, keepalive_timeout, 0, DAY),
+    OPT("drain_timeout", OPT_INT, drain_timeout, 0, DAY),
+    OPT("max_conns_per_ip", OPT_INT, max_conns_per_ip, 0, INT_MAX),
+    OPT("http2", OPT_BOOL, http2, 0, 1),
+    OPT("proxy", OPT_PROXY, nproxies, 0, 0),
+    OPT("proxy_timeout", OPT_INT, proxy_timeout, 1, DAY),
+    OPT("proxy_keepalive", OPT_INT, proxy_keepalive, 0, 4096),
+    OPT("proxy_max_fails", OPT_INT, proxy_max_fails, 1, 1000),
+    OPT("proxy_fail_timeout", OPT_INT, proxy_fail_timeout, 0, DAY),
+    OPT("cgi_timeout", OPT_INT, cgi_timeout, 1, DAY),
+    OPT("cgi_max", OPT_INT, cgi_max, 1, 65536),
+    OPT("fcgi_workers", OPT_INT, fcgi_workers, 1, 256),
+    OPT("access_log", OPT_PATH, access_log, 0, 0),
+    OPT("access_log_block", OPT_BOOL, access_log_block, 0, 1),
+    OPT("tls_listen", OPT_LISTEN, tls_port, 1, 65535),
+    OPT("tls_cert", OPT_PATH, tls_cert, 0, 0),
+    OPT("tls_key", OPT_PATH, tls_key, 0, 0),
+    OPT("tls_tickets", OPT_BOOL, tls_tickets, 0, 1),
+    OPT("tls_ktls", OPT_BOOL, tls_ktls, 0, 1),
+};
+#define NOPTIONS (sizeof(options) / sizeof(options[0]))
+
+// A decimal number, with a k, m or g suffix (powers of 1024) if allowed.
+static int parse_number(const char *s, int suffix, unsigned long long *out) {
+    if (!isdigit((unsigned char)*s)) return -1;
+    char *end;
+    errno = 0;
+    unsigned long long v = strtoull(s, &end, 10);
+    if (errno) return -1;
+    int shift = 0;
+    if (suffix) {
+        switch (tolower((unsigned char)*end)) {
+        case 'k': shift = 10; break;
+        case 'm': shift = 20; break;
+        case 'g': shift = 30; break;
+        }
+        if (shift) end++;
+    }
+    if (*end || v > ULLONG_MAX >> shift) return -1;
+    *out = v << shift;
+    return 0;
+}
+
+// "[addr:]port", addr an IPv4 address or "*" for all of them.
+static const char *parse_listen(const char *value, uint32_t *addr_out, int *port_out) {
+    const char *colon = strrchr(value, ':');
+    const char *port = colon ? colon + 1 : value;
+    uint32_t addr = htonl(INADDR_ANY);
+    if (colon) {
+        char host[INET_ADDRSTRLEN];
+        size_t len = colon - value;
+        if (len >= sizeof(host)) return "bad address";
+        memcpy(host, value, len);
+        host[len] = '\0';
+        if (strcmp(host, "*") != 0 && inet_pton(AF_INET, host, &addr) != 1)
+            return "bad address";
+    }
+    unsigned long long n;
+    if (parse_number(port, 0, &n) < 0 || n < 1 || n > 65535) return "bad port";
+    *addr_out = addr;
+    *port_out = (int)n;
+    return NULL;
+}
+
+// "prefix [least_conn|hash] addr:port...", one mount per line.
+static const char *parse_proxy(server_config_t *cfg, const char *value) {
+    if (cfg->nproxies == PROXY_MOUNTS) return "too many proxy mounts";
+    proxy_mount_t *m = &cfg->proxies[cfg->nproxies];
+    char copy[PATH_MAX + 64];
+    snprintf(copy, sizeof(copy), "%s", value);
+    char *save;
+    char *prefix = strtok_r(copy, " \t", &save);
+    size_t len = strlen(prefix);
+    while (len > 1 && prefix[len - 1] == '/') prefix[--len] = '\0';
+    if (prefix[0] != '/' || strpbrk(prefix, "*:")) return "expected a path prefix";
+    if (len == 1) return "cannot proxy / itself";
+    if (len >= sizeof(m->prefix)) return "prefix too long";
+    memcpy(m->prefix, prefix, len + 1);
+
+    m->hash = 0;
+    m->nupstreams = 0;
+    char *tok = strtok_r(NULL, " \t", &save);
+    if (tok && (strcmp(tok, "least_conn") == 0 || strcmp(tok, "hash") == 0)) {
+        m->hash = tok[0] == 'h';
+        tok = strtok_r(NULL, " \t", &save);
+    }
+    for (; tok; tok = strtok_r(NULL, " \t", &save)) {
+        if (m->nupstreams == PROXY_UPSTREAMS) return "too many upstreams";
+        if (!strchr(tok, ':') || tok[0] == '*') return "expected upstreams as address:port";
+        const char *err = parse_listen(tok, &m->upstreams[m->nupstreams].addr,
+                                       &m->upstreams[m->nupstreams].port);
+        if (err) return err;
+        m->nupstreams++;
+    }
+    if (m->nupstreams == 0) return "no upstreams";
+    cfg->nproxies++;
+    return NULL;
+}
+
+// Returns NULL, or why the value is not accepted.
+static const char *apply(server_config_t *cfg, const option_t *o, const char *value) {
+    void *field = (char *)cfg + o->off;
+    unsigned long long n;
+
+    switch (o->type) {
+    case OPT_LISTEN:
+        if (o->off == offsetof(server_config_t, port))
+            return parse_listen(value, &cfg->listen_addr, &cfg->port);
+#ifndef HAVE_TLS
+        return "TLS support is not built in (make TLS=1)";
+#endif
+        if (strcmp(value, "off") == 0) {
+            cfg->tls_port = 0;
+            return NULL;
+        }
+        return parse_listen(value, &cfg->tls_addr, &cfg->tls_port);
+    case OPT_MODE:
+        if (strcmp(value, "select") == 0) {
+            cfg->use_select = 1;
+            cfg->use_uring = 0;
+        } else if (strcmp(value, "epoll") == 0) {
+            cfg->use_select = 0;
+            cfg->use_uring = 0;
+        } else if (strcmp(value, "uring") == 0) {
+#ifndef HAVE_IO_URING
+            return "io_uring support is not built in (make URING=1)";
+#endif
+            cfg->use_select = 0;
+            cfg->use_uring = 1;
+        } else {
+            return "expected uring, epoll or select";
+        }
+        return NULL;
+    case OPT_PATH:
+        if (strlen(value) >= PATH_MAX) return "path too long";
+        strcpy(field, value);
+        return NULL;
+    case OPT_PROXY:
+        return parse_proxy(cfg, value);
+    case OPT_BOOL:
+        if (strcmp(value, "on") == 0) *(int *)field = 1;
+        else if (strcmp(value, "off") == 0) *(int *)field = 0;
+        else return "expected on or off";
+        return NULL;
+    }
+
+    if (parse_number(value, o->type == OPT_SIZE, &n) < 0 || n < o->min || n > o->max)
+        return "out of range or not a number";
+    if (o->type == OPT_INT) *(int *)field = (int)n;
+    else if (o->type == OPT_UINT) *(unsigned *)field = (unsigned)n;
+    else *(size_t *)field = (size_t)n;
+    return NULL;
+}
+
+int config_load(server_config_t *cfg, const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    char line[PATH_MAX + 64];
+    int lineno = 0, rc = 0;
+    while (rc == 0 && fgets(line, sizeof(line), f)) {
+        lineno++;
+        size_t len = strlen(line);
+        if (len == sizeof(line) - 1 && line[len - 1] != '\n' && !feof(f)) {
+            fprintf(stderr, "%s:%d: line too long\n", path, lineno);
+            rc = -1;
+            break;
+        }
+        char *hash = strchr(line, '#');
+        if (hash) *hash = '\0';
+
+        char *name = line;
+        while (isspace((unsigned char)*name)) name++;
+        if (!*name) continue;
+        char *value = name;
+        while (*value && !isspace((unsigned char)*value)) value++;
+        if (*value) *value++ = '\0';
+        while (isspace((unsigned char)*value)) value++;
+        char *end = value + strlen(value);
+        while (end > value && isspace((unsigned char)end[-1])) *--end = '\0';
+
+        const option_t *o = NULL;
+        for (size_t i = 0; i < NOPTIONS && !o; i++)
+            if (strcmp(options[i].name, name) == 0) o = &options[i];
+        const char *err = !o ? "unknown setting" : !*value ? "missing value" : apply(cfg, o, value);
+        if (err) {
+            fprintf(stderr, "%s:%d: %s: %s\n", path, lineno, name, err);
+            rc = -1;
+        }
+    }
+    if (rc == 0 && ferror(f)) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        rc = -1;
+    }
+    fclose(f);
+    return rc;
+}
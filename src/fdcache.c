@@ -0,0 +1,213 @@
+#define _GNU_SOURCE
+
+#include "fdcache.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SHARDS 16
+#define BUCKETS 64      // per shard, power of two
+
+typedef struct entry {
+    fdcache_entry_t pub;        // must stay first
+    char *path;
+    uint64_t hash;
+    time_t expires;             // coarse monotonic seconds
+    _Atomic int refs;           // one for the cache while linked, one per user
+    struct entry *hnext;
+    struct entry *prev, *next;  // LRU list, most recent first
+} entry_t;
+
+typedef struct {
+    _Alignas(64) pthread_mutex_t lock;
+    entry_t *buckets[BUCKETS];
+    entry_t *lru_head, *lru_tail;
+    size_t count;
+    unsigned long hits, misses, revalidations, evictions;
+} shard_t;
+
+static shard_t shards[SHARDS];
+static size_t shard_max;
+static unsigned entry_ttl;
+
+static uint64_t hash_path(const char *s) {
+    uint64_t h = 1469598103934665603ULL; // FNV-1a
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// The shard takes the hash modulo SHARDS, so the bucket uses the bits above.
+static entry_t **bucket_of(shard_t *s, uint64_t hash) {
+    return &s->buckets[(hash / SHARDS) & (BUCKETS - 1)];
+}
+
+static time_t now_coarse(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+void fdcache_init(size_t max_entries, unsigned ttl) {
+    shard_max = (max_entries + SHARDS - 1) / SHARDS;
+    entry_ttl = ttl;
+    for (int i = 0; i < SHARDS; i++) {
+        pthread_mutex_init(&shards[i].lock, NULL);
+    }
+}
+
+void fdcache_release(void *entry) {
+    entry_t *e = entry;
+    if (atomic_fetch_sub(&e->refs, 1) == 1) {
+        if (e->pub.fd >= 0) close(e->pub.fd);
+        free(e->path);
+        free(e);
+    }
+}
+
+static void lru_unlink(shard_t *s, entry_t *e) {
+    if (e->prev) e->prev->next = e->next; else s->lru_head = e->next;
+    if (e->next) e->next->prev = e->prev; else s->lru_tail = e->prev;
+    e->prev = e->next = NULL;
+}
+
+static void lru_push_front(shard_t *s, entry_t *e) {
+    e->prev = NULL;
+    e->next = s->lru_head;
+    if (s->lru_head) s->lru_head->prev = e;
+    s->lru_head = e;
+    if (!s->lru_tail) s->lru_tail = e;
+}
+
+// Unlink e from the shard and drop the cache's reference. Lock held.
+static void shard_remove(shard_t *s, entry_t *e) {
+    entry_t **pp = bucket_of(s, e->hash);
+    while (*pp != e) pp = &(*pp)->hnext;
+    *pp = e->hnext;
+    lru_unlink(s, e);
+    s->count--;
+    fdcache_release(e);
+}
+
+static entry_t *shard_find(shard_t *s, const char *path, uint64_t hash) {
+    entry_t *e = *bucket_of(s, hash);
+    while (e && (e->hash != hash || strcmp(e->path, path) != 0)) e = e->hnext;
+    return e;
+}
+
+static int same_file(const struct stat *a, const struct stat *b) {
+    return a->st_dev == b->st_dev && a->st_ino == b->st_ino &&
+           a->st_size == b->st_size &&
+           a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+           a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+// A path that does not exist gets a negative entry (fd -1) if missing is
+// set, so repeated probes, e.g. for precompressed siblings, cost no
+// syscalls either.
+static entry_t *entry_open(const char *path, uint64_t hash, int missing) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 && (errno != ENOENT || !missing)) return NULL;
+    entry_t *e = calloc(1, sizeof(*e));
+    if (!e || (fd >= 0 && fstat(fd, &e->pub.st) < 0) || !(e->path = strdup(path))) {
+        free(e);
+        if (fd >= 0) close(fd);
+        return NULL;
+    }
+    e->pub.fd = fd;
+    e->hash = hash;
+    e->expires = now_coarse() + entry_ttl;
+    atomic_init(&e->refs, 1);
+    return e;
+}
+
+const fdcache_entry_t *fdcache_get(const char *path, int cache_missing) {
+    uint64_t hash = hash_path(path);
+    if (shard_max == 0) {
+        entry_t *e = entry_open(path, hash, 0);
+        return e ? &e->pub : NULL;
+    }
+
+    shard_t *s = &shards[hash % SHARDS];
+    time_t now = now_coarse();
+
+    pthread_mutex_lock(&s->lock);
+    entry_t *e = shard_find(s, path, hash);
+    // A negative entry left by a probe is checked at once for any other
+    // lookup.
+    if (e && (now >= e->expires || (e->pub.fd < 0 && !cache_missing))) {
+        struct stat st;
+        s->revalidations++;
+        int rc = stat(path, &st);
+        if (e->pub.fd < 0 ? rc < 0 && errno == ENOENT
+                          : rc == 0 && same_file(&st, &e->pub.st)) {
+            e->expires = now + entry_ttl;
+        } else {
+            shard_remove(s, e);
+            e = NULL;
+        }
+    }
+    if (e) {
+        s->hits++;
+        lru_unlink(s, e);
+        lru_push_front(s, e);
+        if (e->pub.fd < 0) e = NULL;
+        else atomic_fetch_add(&e->refs, 1);
+        pthread_mutex_unlock(&s->lock);
+        return e ? &e->pub : NULL;
+    }
+    s->misses++;
+    pthread_mutex_unlock(&s->lock);
+
+    // Open outside the lock; a racing opener's entry is simply replaced.
+    e = entry_open(path, hash, cache_missing);
+    if (!e) return NULL;
+
+    pthread_mutex_lock(&s->lock);
+    entry_t *dup = shard_find(s, path, hash);
+    if (dup) shard_remove(s, dup);
+    while (s->count >= shard_max && s->lru_tail) {
+        shard_remove(s, s->lru_tail);
+        s->evictions++;
+    }
+    e->hnext = *bucket_of(s, hash);
+    *bucket_of(s, hash) = e;
+    lru_push_front(s, e);
+    s->count++;
+    if (e->pub.fd < 0) e = NULL;
+    else atomic_fetch_add(&e->refs, 1);
+    pthread_mutex_unlock(&s->lock);
+    return e ? &e->pub : NULL;
+}
+
+void fdcache_invalidate(const char *path) {
+    if (shard_max == 0) return;
+    uint64_t hash = hash_path(path);
+    shard_t *s = &shards[hash % SHARDS];
+    pthread_mutex_lock(&s->lock);
+    entry_t *e = shard_find(s, path, hash);
+    if (e) shard_remove(s, e);
+    pthread_mutex_unlock(&s->lock);
+}
+
+void fdcache_stats(fdcache_stats_t *out) {
+    memset(out, 0, sizeof(*out));
+    for (int i = 0; i < SHARDS; i++) {
+        shard_t *s = &shards[i];
+        pthread_mutex_lock(&s->lock);
+        out->hits += s->hits;
+        out->misses += s->misses;
+        out->revalidations += s->revalidations;
+        out->evictions += s->evictions;
+        out->entries += s->count;
+        pthread_mutex_unlock(&s->lock);
+    }
+}
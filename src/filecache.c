@@ -0,0 +1,309 @@
+#define _GNU_SOURCE
+
+#include "filecache.h"
+#include "metrics.h"
+#include "router.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#define SHARDS 16
+#define BUCKETS 256     // per shard, power of two
+#define GZIP_MIN 256    // smaller files are not worth compressing
+
+typedef struct entry {
+    filecache_entry_t pub;      // must stay first
+    char *path;
+    uint64_t hash;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    time_t checked;             // last revalidation, coarse monotonic seconds
+    size_t charge;              // bytes counted against the budget
+    _Atomic int refs;           // one for the cache while linked, one per user
+    struct entry *hnext;        // bucket chain
+    struct entry *prev, *next;  // LRU list, most recent first
+} entry_t;
+
+typedef struct {
+    _Alignas(64) pthread_mutex_t lock;
+    entry_t *buckets[BUCKETS];
+    entry_t *lru_head, *lru_tail;
+    size_t bytes;
+} shard_t;
+
+static shard_t shards[SHARDS];
+static size_t shard_budget;
+static size_t max_file_size;
+static int gzip_level;
+
+static uint64_t hash_path(const char *s) {
+    uint64_t h = 1469598103934665603ULL; // FNV-1a
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// The shard takes the hash modulo SHARDS, so the bucket uses the bits above.
+static entry_t **bucket_of(shard_t *s, uint64_t hash) {
+    return &s->buckets[(hash / SHARDS) & (BUCKETS - 1)];
+}
+
+static time_t now_coarse(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+void filecache_init(size_t budget, size_t max_file, int level) {
+    shard_budget = budget / SHARDS;
+    gzip_level = level;
+    max_file_size = max_file < shard_budget ? max_file : shard_budget;
+    for (int i = 0; i < SHARDS; i++) {
+        pthread_mutex_init(&shards[i].lock, NULL);
+    }
+}
+
+int filecache_fits(size_t size) {
+    return shard_budget > 0 && size <= max_file_size;
+}
+
+static void pub_free(const filecache_entry_t *pub) {
+    free((char *)pub->data);
+    free((char *)pub->headers);
+}
+
+static void entry_free(entry_t *e) {
+    pub_free(&e->pub);
+    if (e->pub.gzip) {
+        pub_free(e->pub.gzip);
+        free((void *)e->pub.gzip);
+    }
+    free(e->path);
+    free(e);
+}
+
+void filecache_release(void *entry) {
+    entry_t *e = entry;
+    if (atomic_fetch_sub(&e->refs, 1) == 1) entry_free(e);
+}
+
+static void lru_unlink(shard_t *s, entry_t *e) {
+    if (e->prev) e->prev->next = e->next; else s->lru_head = e->next;
+    if (e->next) e->next->prev = e->prev; else s->lru_tail = e->prev;
+    e->prev = e->next = NULL;
+}
+
+static void lru_push_front(shard_t *s, entry_t *e) {
+    e->prev = NULL;
+    e->next = s->lru_head;
+    if (s->lru_head) s->lru_head->prev = e;
+    s->lru_head = e;
+    if (!s->lru_tail) s->lru_tail = e;
+}
+
+// Unlink e from the shard and drop the cache's reference. Lock held.
+static void shard_remove(shard_t *s, entry_t *e) {
+    entry_t **pp = bucket_of(s, e->hash);
+    while (*pp != e) pp = &(*pp)->hnext;
+    *pp = e->hnext;
+    lru_unlink(s, e);
+    s->bytes -= e->charge;
+    filecache_release(e);
+}
+
+static int same_file(const entry_t *e, const struct stat *st) {
+    return e->dev == st->st_dev && e->ino == st->st_ino &&
+           (size_t)st->st_size == e->pub.size &&
+           e->mtime.tv_sec == st->st_mtim.tv_sec &&
+           e->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+// The per-request headers (Date, Connection) and the blank line are
+// appended by the caller.
+static int build_headers(filecache_entry_t *pub) {
+    char buf[512];
+    int n = snprintf(buf, sizeof(buf),
+                     "HTTP/1.1 200 OK\r\n"
+                     "Content-Length: %zu\r\n"
+                     "Content-Type: %s\r\n"
+                     "%s%s%s"
+                     "%s"
+                     "Accept-Ranges: bytes\r\n"
+                     "ETag: %s\r\n"
+                     "Last-Modified: %s\r\n",
+                     pub->size, pub->mime,
+                     pub->encoding ? "Content-Encoding: " : "",
+                     pub->encoding ? pub->encoding : "",
+                     pub->encoding ? "\r\n" : "",
+                     pub->vary ? "Vary: Accept-Encoding\r\n" : "",
+                     pub->etag, pub->last_modified);
+    if (n < 0 || n >= (int)sizeof(buf)) return -1;
+    pub->headers_len = n;
+    pub->headers = strndup(buf, n);
+    return pub->headers ? 0 : -1;
+}
+
+// Compress e's contents into its gzip variant if that saves anything.
+static void build_gzip(entry_t *e) {
+    const filecache_entry_t *src = &e->pub;
+    z_stream zs = {0};
+    if (deflateInit2(&zs, gzip_level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return;
+    size_t cap = deflateBound(&zs, src->size);
+    char *out = malloc(cap);
+    zs.next_in = (Bytef *)src->data;
+    zs.avail_in = src->size;
+    zs.next_out = (Bytef *)out;
+    zs.avail_out = cap;
+    int rc = out ? deflate(&zs, Z_FINISH) : Z_MEM_ERROR;
+    size_t n = zs.total_out;
+    deflateEnd(&zs);
+
+    filecache_entry_t *gz = NULL;
+    if (rc != Z_STREAM_END || n >= src->size || !(gz = calloc(1, sizeof(*gz)))) {
+        free(out);
+        return;
+    }
+    *gz = *src;
+    gz->data = out;
+    gz->size = n;
+    gz->encoding = "gzip";
+    gz->gzip = NULL;
+    // Same version, different bytes: the validator must differ too.
+    size_t elen = strlen(src->etag);
+    snprintf(gz->etag, sizeof(gz->etag), "%.*s-gz\"", (int)elen - 1, src->etag);
+    if (build_headers(gz) < 0) {
+        pub_free(gz);
+        free(gz);
+        return;
+    }
+    e->pub.gzip = gz;
+}
+
+// Copy an open file into a new entry. Returns NULL if it is not cacheable.
+static entry_t *entry_load(const char *path, int fd, const struct stat *st, uint64_t hash,
+                           const char *mime, const char *encoding) {
+    if (!S_ISREG(st->st_mode) || (size_t)st->st_size > max_file_size) return NULL;
+
+    entry_t *e = calloc(1, sizeof(*e));
+    char *data = malloc(st->st_size ? st->st_size : 1);
+    size_t got = 0;
+    while (e && data && got < (size_t)st->st_size) {
+        ssize_t r = pread(fd, data + got, st->st_size - got, got);
+        if (r <= 0) break;
+        got += r;
+    }
+    if (!e || !data || got != (size_t)st->st_size) {
+        free(data);
+        free(e);
+        return NULL;
+    }
+
+    e->pub.data = data;
+    e->pub.size = got;
+    e->pub.mime = mime;
+    e->pub.encoding = encoding;
+    e->pub.vary = mime_compressible(mime);
+    e->pub.mtime = st->st_mtime;
+    static_etag(st, e->pub.etag, sizeof(e->pub.etag));
+    http_format_date(st->st_mtime, e->pub.last_modified);
+    e->path = strdup(path);
+    if (build_headers(&e->pub) < 0 || !e->path) {
+        entry_free(e);
+        return NULL;
+    }
+    if (gzip_level > 0 && !encoding && e->pub.vary && got >= GZIP_MIN)
+        build_gzip(e);
+    e->hash = hash;
+    e->dev = st->st_dev;
+    e->ino = st->st_ino;
+    e->mtime = st->st_mtim;
+    e->checked = now_coarse();
+    e->charge = got + e->pub.headers_len + sizeof(*e);
+    if (e->pub.gzip) {
+        const filecache_entry_t *gz = e->pub.gzip;
+        e->charge += gz->size + gz->headers_len + sizeof(*gz);
+    }
+    atomic_init(&e->refs, 1);
+    return e;
+}
+
+const filecache_entry_t *filecache_get(const char *path) {
+    if (shard_budget == 0) return NULL;
+
+    uint64_t hash = hash_path(path);
+    shard_t *s = &shards[hash % SHARDS];
+    time_t now = now_coarse();
+
+    pthread_mutex_lock(&s->lock);
+    entry_t *e = *bucket_of(s, hash);
+    while (e && (e->hash != hash || strcmp(e->path, path) != 0)) e = e->hnext;
+    if (e && e->checked != now) {
+        struct stat st;
+        if (stat(path, &st) == 0 && same_file(e, &st)) {
+            e->checked = now;
+        } else {
+            shard_remove(s, e);
+            e = NULL;
+        }
+    }
+    if (e) {
+        lru_unlink(s, e);
+        lru_push_front(s, e);
+        atomic_fetch_add(&e->refs, 1);
+        pthread_mutex_unlock(&s->lock);
+        metrics_add(METRIC_CACHE_HITS, 1);
+        return &e->pub;
+    }
+    pthread_mutex_unlock(&s->lock);
+    metrics_add(METRIC_CACHE_MISSES, 1);
+    return NULL;
+}
+
+void filecache_invalidate(const char *path) {
+    if (shard_budget == 0) return;
+    uint64_t hash = hash_path(path);
+    shard_t *s = &shards[hash % SHARDS];
+    pthread_mutex_lock(&s->lock);
+    entry_t *e = *bucket_of(s, hash);
+    while (e && (e->hash != hash || strcmp(e->path, path) != 0)) e = e->hnext;
+    if (e) shard_remove(s, e);
+    pthread_mutex_unlock(&s->lock);
+}
+
+const filecache_entry_t *filecache_load(const char *path, int fd,
+                                        const char *mime, const char *encoding) {
+    struct stat st;
+    if (shard_budget == 0 || fstat(fd, &st) < 0) return NULL;
+
+    // Read the file without holding the shard lock.
+    uint64_t hash = hash_path(path);
+    shard_t *s = &shards[hash % SHARDS];
+    entry_t *e = entry_load(path, fd, &st, hash, mime, encoding);
+    if (!e) return NULL;
+
+    pthread_mutex_lock(&s->lock);
+    entry_t *dup = *bucket_of(s, hash);
+    while (dup && (dup->hash != hash || strcmp(dup->path, path) != 0)) dup = dup->hnext;
+    if (dup) shard_remove(s, dup); // another thread loaded it meanwhile
+
+    while (s->bytes + e->charge > shard_budget && s->lru_tail)
+        shard_remove(s, s->lru_tail);
+    e->hnext = *bucket_of(s, hash);
+    *bucket_of(s, hash) = e;
+    lru_push_front(s, e);
+    s->bytes += e->charge;
+    atomic_fetch_add(&e->refs, 1);
+    pthread_mutex_unlock(&s->lock);
+    return &e->pub;
+}
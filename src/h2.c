@@ -0,0 +1,1079 @@
+#define _GNU_SOURCE
+
+#include "h2.h"
+#include "arena.h"
+#include "buffer.h"
+#include "config.h"
+#include "hpack.h"
+#include "metrics.h"
+#include "server.h"
+#include "upload.h"
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#define FRAME_HEADER 9
+// SETTINGS_MAX_FRAME_SIZE both ways: the default, which is kept.
+#define FRAME_MAX 16384
+// Over TLS a DATA frame and its header fill one 16 KB record.
+#define FRAME_MAX_TLS (16384 - FRAME_HEADER)
+#define MAX_STREAMS 128         // SETTINGS_MAX_CONCURRENT_STREAMS
+#define WINDOW (1 << 20)        // receive window per stream and for the connection
+#define DEFAULT_WINDOW 65535
+#define WINDOW_MAX 0x7fffffff
+// Response bytes queued by one h2_output(), spread over the streams.
+#define OUTPUT_BUDGET (256 << 10)
+// Control frames owed to the peer before its input stops being read.
+#define CTL_MAX 65536
+// Largest response head re-framed, and header block accepted.
+#define HEAD_MAX 65536
+
+enum {
+    F_DATA, F_HEADERS, F_PRIORITY, F_RST_STREAM, F_SETTINGS, F_PUSH_PROMISE, F_PING,
+    F_GOAWAY, F_WINDOW_UPDATE, F_CONTINUATION,
+};
+enum { FL_END_STREAM = 0x1, FL_ACK = 0x1, FL_END_HEADERS = 0x4, FL_PADDED = 0x8, FL_PRIORITY = 0x20 };
+enum {
+    E_NO_ERROR, E_PROTOCOL, E_INTERNAL, E_FLOW_CONTROL, E_SETTINGS_TIMEOUT, E_STREAM_CLOSED,
+    E_FRAME_SIZE, E_REFUSED_STREAM, E_CANCEL, E_COMPRESSION, E_CONNECT, E_ENHANCE_YOUR_CALM,
+};
+enum {
+    S_HEADER_TABLE_SIZE = 1, S_ENABLE_PUSH, S_MAX_CONCURRENT_STREAMS, S_INITIAL_WINDOW_SIZE,
+    S_MAX_FRAME_SIZE, S_MAX_HEADER_LIST_SIZE,
+};
+
+// Where a stream's response is.
+enum { OUT_WAIT, OUT_HEAD, OUT_BODY, OUT_DONE };
+
+struct h2_stream {
+    uint32_t id;
+    // The session's while the stream is open, and one per queued response
+    // or watch that refers to it; the last one frees it.
+    int refs;
+    int recv_done;      // the request has ended (END_STREAM)
+    int discard;        // answered early: the rest of the request is dropped
+    int out;            // OUT_*
+    int rst;            // error code to reset the stream with, or -1
+    int waiting;        // produce() waits on the response's wait_fd
+    int watched;        // ... and the event loop watches watch_fd for it
+    int watch_fd;
+    int64_t send_window;
+    int64_t recv_window;
+    size_t received;    // request body bytes
+    int has_length;     // the request gave a Content-Length
+    arena_t arena;      // the request head and its http_request_t
+    http_request_t *req;
+    buffer_t body;
+    upload_t *upload;
+    buffer_t head;      // the response head, collected for a HEADERS frame
+    response_t res;
+};
+
+struct h2 {
+    uint32_t peer;
+    int tls;
+    int preface;        // the client preface has been read
+    int failed;         // a connection error: GOAWAY queued, input ignored
+    int goaway;         // GOAWAY sent: no new streams
+    int peer_goaway;
+    buffer_t ctl;       // control frames not queued yet
+    hpack_table_t decoder;
+    hpack_table_t encoder;
+    buffer_t block;     // header block so far, until END_HEADERS
+    uint32_t block_stream;  // its stream; 0 when none is in progress
+    int block_flags;
+    buffer_t encoded;   // a response header block
+    uint32_t last_stream;   // highest stream the client opened
+    h2_stream_t *streams[MAX_STREAMS];
+    int nstreams;
+    int next;           // stream the next output round starts with
+    int64_t send_window;
+    int64_t recv_window;
+    int64_t peer_window;    // SETTINGS_INITIAL_WINDOW_SIZE
+    response_t *tail;       // response this h2_output() appends to
+};
+
+// File data read for a frame over TLS.
+static _Thread_local char scratch[FRAME_MAX_TLS];
+
+static uint32_t get32(const unsigned char *p) {
+    return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static void put32(unsigned char *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static void frame_header(unsigned char *h, size_t len, int type, int flags, uint32_t id) {
+    h[0] = len >> 16;
+    h[1] = len >> 8;
+    h[2] = len;
+    h[3] = type;
+    h[4] = flags;
+    put32(h + 5, id);
+}
+
+static void ctl_frame(h2_t *s, int type, int flags, uint32_t id, const void *payload, size_t len) {
+    unsigned char h[FRAME_HEADER];
+    frame_header(h, len, type, flags, id);
+    buf_append(&s->ctl, h, sizeof(h));
+    if (len) buf_append(&s->ctl, payload, len);
+}
+
+static void ctl_u32(h2_t *s, int type, uint32_t id, uint32_t v) {
+    unsigned char p[4];
+    put32(p, v);
+    ctl_frame(s, type, 0, id, p, sizeof(p));
+}
+
+static void goaway(h2_t *s, int code) {
+    unsigned char p[8];
+    put32(p, s->last_stream);
+    put32(p + 4, code);
+    ctl_frame(s, F_GOAWAY, 0, 0, p, sizeof(p));
+    s->goaway = 1;
+}
+
+// A connection error: the peer is told why and nothing more is read.
+static int conn_error(h2_t *s, int code) {
+    if (!s->failed) goaway(s, code);
+    s->failed = 1;
+    return -1;
+}
+
+// ---- streams ----
+
+static void stream_unref(void *arg) {
+    h2_stream_t *st = arg;
+    if (--st->refs > 0) return;
+    // Logs the request and lets go of what the body borrowed.
+    response_free(&st->res);
+    if (st->upload) upload_close(st->upload);
+    buf_free(&st->body);
+    buf_free(&st->head);
+    arena_free(&st->arena);
+    free(st);
+}
+
+void h2_stream_hold(h2_stream_t *st) {
+    st->refs++;
+}
+
+void h2_stream_woken(h2_stream_t *st) {
+    st->watched = 0;
+    stream_unref(st);
+}
+
+static h2_stream_t *stream_new(h2_t *s, uint32_t id) {
+    h2_stream_t *st = malloc(sizeof(*st));
+    if (!st) return NULL;
+    st->id = id;
+    st->refs = 1;
+    st->recv_done = 0;
+    st->discard = 0;
+    st->out = OUT_WAIT;
+    st->rst = -1;
+    st->waiting = 0;
+    st->watched = 0;
+    st->watch_fd = -1;
+    st->send_window = s->peer_window;
+    st->recv_window = WINDOW;
+    st->received = 0;
+    st->has_length = 0;
+    st->arena = (arena_t)ARENA_INIT;
+    st->req = NULL;
+    st->body = (buffer_t){0};
+    st->upload = NULL;
+    st->head = (buffer_t){0};
+    response_init(&st->res);
+    s->streams[s->nstreams++] = st;
+    s->last_stream = id;
+    metrics_add(METRIC_H2_STREAMS, 1);
+    return st;
+}
+
+static int stream_index(const h2_t *s, uint32_t id) {
+    for (int i = 0; i < s->nstreams; i++)
+        if (s->streams[i]->id == id) return i;
+    return -1;
+}
+
+static h2_stream_t *stream_find(const h2_t *s, uint32_t id) {
+    int i = stream_index(s, id);
+    return i < 0 ? NULL : s->streams[i];
+}
+
+static void stream_close(h2_t *s, int i) {
+    h2_stream_t *st = s->streams[i];
+    memmove(&s->streams[i], &s->streams[i + 1], (s->nstreams - i - 1) * sizeof(*s->streams));
+    s->nstreams--;
+    if (s->next > i) s->next--;
+    stream_unref(st);
+}
+
+// A stream error: reset it and forget it.
+static void stream_reset(h2_t *s, h2_stream_t *st, int code) {
+    ctl_u32(s, F_RST_STREAM, st->id, code);
+    stream_close(s, stream_index(s, st->id));
+}
+
+// Answer before the request is in, e.g. with 413: the rest of it is
+// dropped, and once the response is out the stream is reset.
+static void stream_answer(h2_stream_t *st) {
+    st->out = OUT_HEAD;
+    st->discard = 1;
+    buf_free(&st->body);
+    if (st->upload) {
+        upload_close(st->upload);
+        st->upload = NULL;
+    }
+}
+
+// ---- requests ----
+
+// The request is complete: route it.
+static void stream_handle(h2_t *s, h2_stream_t *st) {
+    http_request_t *req = st->req;
+    if (st->has_length && req->body_len != st->received) {
+        stream_reset(s, st, E_PROTOCOL);
+        return;
+    }
+    st->out = OUT_HEAD;
+    if (st->upload) {
+        handle_upload(req, st->upload, &st->res);
+        st->upload = NULL;
+        return;
+    }
+    req->body = st->body.data;
+    req->body_len = st->body.len;
+    handle_request(req, &st->res);
+}
+
+static void stream_end(h2_t *s, h2_stream_t *st) {
+    st->recv_done = 1;
+    if (st->out == OUT_WAIT) stream_handle(s, st);
+}
+
+// Parse the HTTP/1.1 head a request was turned into, head[0..len) in the
+// stream's arena, and route it if it has no body to wait for.
+static void stream_start(h2_t *s, h2_stream_t *st, char *head, size_t len) {
+    http_parser_t parser;
+    http_parser_init(&parser);
+    http_request_t *req = arena_alloc(&st->arena, sizeof(*req));
+    if (!req) {
+        stream_reset(s, st, E_INTERNAL);
+        return;
+    }
+    req->arena = &st->arena;
+    req->peer = s->peer;
+    req->body = NULL;
+    st->req = req;
+    if (parse_http_request(&parser, head, len, req) != HTTP_PARSE_DONE) {
+        respond_bad_request(&st->res);
+        stream_answer(st);
+        return;
+    }
+    req->version = (http_slice_t){ "HTTP/2.0", 8 };
+    st->has_length = http_get_header(req, "Content-Length") != NULL;
+    if (request_too_large(req)) {
+        respond_too_large(&st->res);
+        stream_answer(st);
+        return;
+    }
+    if (st->recv_done) stream_handle(s, st);
+    else st->upload = request_upload(req);
+}
+
+// A request header block as it is decoded: the pseudo-header fields kept
+// apart, the rest already as HTTP/1.1 header lines.
+typedef struct {
+    h2_stream_t *st;    // NULL: decoded only to keep the table in step
+    buffer_t fields;
+    http_slice_t method, path, authority;
+    size_t size;        // header list size, as SETTINGS_MAX_HEADER_LIST_SIZE counts
+    int regular;        // a regular field came: no more pseudo-fields
+    int host;
+    int malformed;
+} block_t;
+
+static int name_is(const char *name, size_t len, const char *lit) {
+    return strlen(lit) == len && memcmp(name, lit, len) == 0;
+}
+
+static int on_field(void *arg, const char *name, size_t name_len,
+                    const char *value, size_t value_len) {
+    block_t *b = arg;
+    b->size += name_len + value_len + 32;
+    if (!b->st || b->malformed || b->size > HTTP_MAX_HEAD) return 0;
+
+    // Field names are lowercase in HTTP/2, and values must not smuggle in
+    // lines of their own once the head is HTTP/1.1 again.
+    int bad = name_len == 0;
+    for (size_t i = 0; i < name_len && !bad; i++)
+        bad = isupper((unsigned char)name[i]) || name[i] == '\r' || name[i] == '\n';
+    for (size_t i = 0; i < value_len && !bad; i++)
+        bad = value[i] == '\0' || value[i] == '\r' || value[i] == '\n';
+    if (bad) {
+        b->malformed = 1;
+        return 0;
+    }
+
+    if (name[0] == ':') {
+        http_slice_t *dst = name_is(name, name_len, ":method") ? &b->method :
+                            name_is(name, name_len, ":path") ? &b->path :
+                            name_is(name, name_len, ":authority") ? &b->authority : NULL;
+        if (b->regular || (!dst && !name_is(name, name_len, ":scheme")) || (dst && dst->ptr)) {
+            b->malformed = 1;
+            return 0;
+        }
+        if (!dst) return 0;
+        char *copy = arena_alloc(&b->st->arena, value_len + 1);
+        if (!copy) return -1;
+        memcpy(copy, value, value_len);
+        copy[value_len] = '\0';
+        *dst = (http_slice_t){ copy, value_len };
+        return 0;
+    }
+
+    // Connection-specific fields have no place in HTTP/2.
+    b->regular = 1;
+    if (name_is(name, name_len, "connection") || name_is(name, name_len, "keep-alive") ||
+        name_is(name, name_len, "proxy-connection") ||
+        name_is(name, name_len, "transfer-encoding") || name_is(name, name_len, "upgrade") ||
+        (name_is(name, name_len, "te") && !(value_len == 8 && memcmp(value, "trailers", 8) == 0))) {
+        b->malformed = 1;
+        return 0;
+    }
+    if (name_is(name, name_len, "host")) b->host = 1;
+    if (buf_append(&b->fields, name, name_len) < 0 || buf_append(&b->fields, ": ", 2) < 0 ||
+        buf_append(&b->fields, value, value_len) < 0 || buf_append(&b->fields, "\r\n", 2) < 0)
+        return -1;
+    return 0;
+}
+
+// "<method> <path> HTTP/1.1", Host from :authority, then the fields.
+static void stream_request(h2_t *s, h2_stream_t *st, block_t *b) {
+    if (b->size > HTTP_MAX_HEAD) {
+        response_error(&st->res, 431);
+        stream_answer(st);
+        return;
+    }
+    if (b->malformed || !b->method.ptr || !b->path.ptr) {
+        stream_reset(s, st, E_PROTOCOL);
+        return;
+    }
+    int host = b->authority.ptr && !b->host;
+    size_t len = b->method.len + 1 + b->path.len + 11 +
+                 (host ? 6 + b->authority.len + 2 : 0) + b->fields.len + 2;
+    char *head = arena_alloc(&st->arena, len + 1);
+    if (!head) {
+        stream_reset(s, st, E_INTERNAL);
+        return;
+    }
+    char *p = head;
+    memcpy(p, b->method.ptr, b->method.len);
+    p += b->method.len;
+    *p++ = ' ';
+    memcpy(p, b->path.ptr, b->path.len);
+    p += b->path.len;
+    memcpy(p, " HTTP/1.1\r\n", 11);
+    p += 11;
+    if (host) {
+        memcpy(p, "Host: ", 6);
+        memcpy(p + 6, b->authority.ptr, b->authority.len);
+        memcpy(p + 6 + b->authority.len, "\r\n", 2);
+        p += 6 + b->authority.len + 2;
+    }
+    if (b->fields.len) memcpy(p, b->fields.data, b->fields.len);
+    p += b->fields.len;
+    memcpy(p, "\r\n", 2);
+    stream_start(s, st, head, len);
+}
+
+// END_HEADERS: a new request, its trailers, or a block for a stream that
+// is gone, which still has to go through the decoder.
+static int block_done(h2_t *s) {
+    uint32_t id = s->block_stream;
+    int end_stream = s->block_flags & FL_END_STREAM;
+    s->block_stream = 0;
+
+    h2_stream_t *st = stream_find(s, id);
+    block_t b = { 0 };
+    int opened = 0, refused = 0;
+    if (!st && id > s->last_stream) {
+        if (!(id & 1)) return conn_error(s, E_PROTOCOL);
+        if (s->goaway) {
+            s->last_stream = id;
+        } else if (s->nstreams == MAX_STREAMS) {
+            s->last_stream = id;
+            refused = 1;
+        } else {
+            if (!(st = stream_new(s, id))) return conn_error(s, E_INTERNAL);
+            opened = 1;
+            b.st = st;
+        }
+    }
+    int rc = hpack_decode(&s->decoder, (unsigned char *)s->block.data, s->block.len, on_field, &b);
+    s->block.len = 0;
+    if (rc < 0) {
+        buf_free(&b.fields);
+        return conn_error(s, E_COMPRESSION);
+    }
+
+    if (refused) {
+        ctl_u32(s, F_RST_STREAM, id, E_REFUSED_STREAM);
+    } else if (opened) {
+        st->recv_done = end_stream;
+        stream_request(s, st, &b);
+    } else if (st) {
+        // Trailers end the request; their fields are not used.
+        if (!end_stream || st->recv_done) stream_reset(s, st, E_PROTOCOL);
+        else stream_end(s, st);
+    }
+    buf_free(&b.fields);
+    return 0;
+}
+
+// Strip a padded frame's padding. Returns -1 if it is malformed.
+static int unpad(int flags, const unsigned char **p, size_t *len) {
+    if (!(flags & FL_PADDED)) return 0;
+    if (*len < 1) return -1;
+    size_t pad = (*p)[0];
+    if (pad >= *len) return -1;
+    (*p)++;
+    *len -= 1 + pad;
+    return 0;
+}
+
+static int on_headers(h2_t *s, int flags, uint32_t id, const unsigned char *p, size_t len) {
+    if (!id || unpad(flags, &p, &len) < 0) return conn_error(s, E_PROTOCOL);
+    if (flags & FL_PRIORITY) {
+        if (len < 5) return conn_error(s, E_FRAME_SIZE);
+        p += 5;
+        len -= 5;
+    }
+    s->block.len = 0;
+    if (buf_append(&s->block, p, len) < 0) return conn_error(s, E_INTERNAL);
+    s->block_stream = id;
+    s->block_flags = flags;
+    return flags & FL_END_HEADERS ? block_done(s) : 0;
+}
+
+static int on_continuation(h2_t *s, int flags, uint32_t id, const unsigned char *p, size_t len) {
+    if (!s->block_stream || id != s->block_stream) return conn_error(s, E_PROTOCOL);
+    if (s->block.len + len > HEAD_MAX) return conn_error(s, E_ENHANCE_YOUR_CALM);
+    if (buf_append(&s->block, p, len) < 0) return conn_error(s, E_INTERNAL);
+    return flags & FL_END_HEADERS ? block_done(s) : 0;
+}
+
+// Received data is taken in at once, so the windows are topped up as soon
+// as half of them has been used.
+static void replenish(h2_t *s, h2_stream_t *st) {
+    if (s->recv_window < WINDOW / 2) {
+        ctl_u32(s, F_WINDOW_UPDATE, 0, WINDOW - s->recv_window);
+        s->recv_window = WINDOW;
+    }
+    if (st && !st->recv_done && st->recv_window < WINDOW / 2) {
+        ctl_u32(s, F_WINDOW_UPDATE, st->id, WINDOW - st->recv_window);
+        st->recv_window = WINDOW;
+    }
+}
+
+static int on_data(h2_t *s, int flags, uint32_t id, const unsigned char *p, size_t len) {
+    if (!id) return conn_error(s, E_PROTOCOL);
+    // Flow control counts the padding too.
+    size_t flow = len;
+    s->recv_window -= flow;
+    if (s->recv_window < 0) return conn_error(s, E_FLOW_CONTROL);
+    if (unpad(flags, &p, &len) < 0) return conn_error(s, E_PROTOCOL);
+
+    h2_stream_t *st = stream_find(s, id);
+    if (!st || st->recv_done) {
+        if (id > s->last_stream) return conn_error(s, E_PROTOCOL);
+        // Data still in flight to a stream that was reset.
+        if (st) stream_reset(s, st, E_STREAM_CLOSED);
+        replenish(s, NULL);
+        return 0;
+    }
+    st->recv_window -= flow;
+    if (st->recv_window < 0) {
+        stream_reset(s, st, E_FLOW_CONTROL);
+        replenish(s, NULL);
+        return 0;
+    }
+    if (!st->discard) {
+        st->received += len;
+        // Uploads are held to the same limits as buffered bodies, before
+        // anything reaches the disk.
+        if (st->has_length && st->received > st->req->body_len) {
+            stream_reset(s, st, E_PROTOCOL);
+            replenish(s, NULL);
+            return 0;
+        }
+        if (st->received > g_config.max_body) {
+            respond_too_large(&st->res);
+            stream_answer(st);
+        } else if (st->upload) {
+            upload_write(st->upload, (const char *)p, len);
+        } else if (buf_append(&st->body, p, len) < 0) {
+            stream_reset(s, st, E_INTERNAL);
+            replenish(s, NULL);
+            return 0;
+        }
+    }
+    if (flags & FL_END_STREAM) stream_end(s, st);
+    replenish(s, stream_find(s, id));
+    return 0;
+}
+
+// A SETTINGS payload, from a frame or from an upgrade's HTTP2-Settings.
+static int apply_settings(h2_t *s, const unsigned char *p, size_t len) {
+    for (; len >= 6; p += 6, len -= 6) {
+        uint32_t v = get32(p + 2);
+        switch (p[0] << 8 | p[1]) {
+        case S_HEADER_TABLE_SIZE:
+            hpack_set_max(&s->encoder, v);
+            break;
+        case S_ENABLE_PUSH:
+            if (v > 1) return conn_error(s, E_PROTOCOL);
+            break;
+        case S_INITIAL_WINDOW_SIZE: {
+            if (v > WINDOW_MAX) return conn_error(s, E_FLOW_CONTROL);
+            // Applies to the windows of open streams too, by the difference.
+            int64_t delta = (int64_t)v - s->peer_window;
+            for (int i = 0; i < s->nstreams; i++) {
+                s->streams[i]->send_window += delta;
+                if (s->streams[i]->send_window > WINDOW_MAX) return conn_error(s, E_FLOW_CONTROL);
+            }
+            s->peer_window = v;
+            break;
+        }
+        case S_MAX_FRAME_SIZE:
+            // Frames stay at the default size whatever the peer takes.
+            if (v < FRAME_MAX || v > 0xffffff) return conn_error(s, E_PROTOCOL);
+            break;
+        }
+    }
+    return 0;
+}
+
+static int on_window_update(h2_t *s, uint32_t id, const unsigned char *p, size_t len) {
+    if (len != 4) return conn_error(s, E_FRAME_SIZE);
+    uint32_t inc = get32(p) & 0x7fffffff;
+    if (!id) {
+        if (!inc) return conn_error(s, E_PROTOCOL);
+        s->send_window += inc;
+        return s->send_window > WINDOW_MAX ? conn_error(s, E_FLOW_CONTROL) : 0;
+    }
+    h2_stream_t *st = stream_find(s, id);
+    if (!st) return id > s->last_stream ? conn_error(s, E_PROTOCOL) : 0;
+    if (!inc) {
+        stream_reset(s, st, E_PROTOCOL);
+    } else {
+        st->send_window += inc;
+        if (st->send_window > WINDOW_MAX) stream_reset(s, st, E_FLOW_CONTROL);
+    }
+    return 0;
+}
+
+static int on_frame(h2_t *s, int type, int flags, uint32_t id, const unsigned char *p, size_t len) {
+    // Nothing may come between a header block's frames.
+    if (s->block_stream && type != F_CONTINUATION) return conn_error(s, E_PROTOCOL);
+    switch (type) {
+    case F_DATA:
+        return on_data(s, flags, id, p, len);
+    case F_HEADERS:
+        return on_headers(s, flags, id, p, len);
+    case F_CONTINUATION:
+        return on_continuation(s, flags, id, p, len);
+    case F_PRIORITY:
+        // Streams are served round robin; priorities are not used.
+        if (!id) return conn_error(s, E_PROTOCOL);
+        return len == 5 ? 0 : conn_error(s, E_FRAME_SIZE);
+    case F_RST_STREAM: {
+        if (!id || id > s->last_stream) return conn_error(s, E_PROTOCOL);
+        if (len != 4) return conn_error(s, E_FRAME_SIZE);
+        int i = stream_index(s, id);
+        if (i >= 0) stream_close(s, i);
+        return 0;
+    }
+    case F_SETTINGS:
+        if (id) return conn_error(s, E_PROTOCOL);
+        if (flags & FL_ACK) return len ? conn_error(s, E_FRAME_SIZE) : 0;
+        if (len % 6) return conn_error(s, E_FRAME_SIZE);
+        if (apply_settings(s, p, len) < 0) return -1;
+        ctl_frame(s, F_SETTINGS, FL_ACK, 0, NULL, 0);
+        return 0;
+    case F_PING:
+        if (id) return conn_error(s, E_PROTOCOL);
+        if (len != 8) return conn_error(s, E_FRAME_SIZE);
+        if (!(flags & FL_ACK)) ctl_frame(s, F_PING, FL_ACK, 0, p, len);
+        return 0;
+    case F_GOAWAY:
+        if (id) return conn_error(s, E_PROTOCOL);
+        if (len < 8) return conn_error(s, E_FRAME_SIZE);
+        s->peer_goaway = 1;
+        return 0;
+    case F_WINDOW_UPDATE:
+        return on_window_update(s, id, p, len);
+    case F_PUSH_PROMISE:
+        return conn_error(s, E_PROTOCOL);
+    default:
+        return 0;   // unknown frame types are ignored
+    }
+}
+
+// ---- session ----
+
+int h2_preface(const char *buf, size_t len) {
+    size_t n = len < H2_PREFACE_LEN ? len : H2_PREFACE_LEN;
+    if (memcmp(buf, H2_PREFACE, n) != 0) return 0;
+    return len >= H2_PREFACE_LEN ? 1 : -1;
+}
+
+h2_t *h2_new(uint32_t peer, int tls) {
+    h2_t *s = calloc(1, sizeof(*s));
+    if (!s) return NULL;
+    s->peer = peer;
+    s->tls = tls;
+    hpack_init(&s->decoder);
+    hpack_init(&s->encoder);
+    s->send_window = DEFAULT_WINDOW;
+    s->recv_window = WINDOW;
+    s->peer_window = DEFAULT_WINDOW;
+
+    // The server preface, and the connection window opened as wide as the
+    // streams'. Server push is never used.
+    static const uint16_t ids[] = {
+        S_MAX_CONCURRENT_STREAMS, S_INITIAL_WINDOW_SIZE, S_MAX_HEADER_LIST_SIZE, S_ENABLE_PUSH,
+    };
+    const uint32_t values[] = { MAX_STREAMS, WINDOW, HTTP_MAX_HEAD, 0 };
+    unsigned char p[6 * 4];
+    for (int i = 0; i < 4; i++) {
+        p[6 * i] = ids[i] >> 8;
+        p[6 * i + 1] = ids[i];
+        put32(p + 6 * i + 2, values[i]);
+    }
+    ctl_frame(s, F_SETTINGS, 0, 0, p, sizeof(p));
+    ctl_u32(s, F_WINDOW_UPDATE, 0, WINDOW - DEFAULT_WINDOW);
+    metrics_add(METRIC_H2_CONNS, 1);
+    return s;
+}
+
+void h2_free(h2_t *s) {
+    while (s->nstreams > 0) stream_close(s, s->nstreams - 1);
+    hpack_free(&s->decoder);
+    hpack_free(&s->encoder);
+    buf_free(&s->ctl);
+    buf_free(&s->block);
+    buf_free(&s->encoded);
+    free(s);
+}
+
+// Whether a comma-separated header value lists token.
+static int has_token(const char *value, const char *token) {
+    size_t n = strlen(token);
+    for (const char *p = value; *p;) {
+        while (*p == ' ' || *p == '\t' || *p == ',') p++;
+        const char *start = p;
+        while (*p && *p != ',' && *p != ' ' && *p != '\t') p++;
+        if ((size_t)(p - start) == n && strncasecmp(start, token, n) == 0) return 1;
+    }
+    return 0;
+}
+
+int h2_upgrade_wanted(const http_request_t *req) {
+    const char *upgrade = http_get_header(req, "Upgrade");
+    return upgrade && has_token(upgrade, "h2c") && http_get_header(req, "HTTP2-Settings") &&
+           http_slice_eq(req->version, "HTTP/1.1") && !req->chunked && req->body_len == 0;
+}
+
+// base64url without padding, as HTTP2-Settings carries a SETTINGS payload.
+static int base64url_decode(const char *in, unsigned char *out, size_t cap, size_t *len) {
+    uint32_t acc = 0;
+    int bits = 0;
+    size_t n = 0;
+    for (; *in && *in != '='; in++) {
+        int c = *in;
+        int v = c >= 'A' && c <= 'Z' ? c - 'A' : c >= 'a' && c <= 'z' ? c - 'a' + 26 :
+                c >= '0' && c <= '9' ? c - '0' + 52 : c == '-' ? 62 : c == '_' ? 63 : -1;
+        if (v < 0) return -1;
+        acc = acc << 6 | v;
+        if ((bits += 6) >= 8) {
+            if (n == cap) return -1;
+            bits -= 8;
+            out[n++] = acc >> bits;
+        }
+    }
+    *len = n;
+    return 0;
+}
+
+int h2_upgrade(h2_t *s, const http_request_t *req, response_t *res) {
+    unsigned char settings[256];
+    size_t len;
+    if (base64url_decode(http_get_header(req, "HTTP2-Settings"), settings, sizeof(settings),
+                         &len) < 0 || len % 6 || apply_settings(s, settings, len) < 0)
+        return -1;
+
+    static const char switching[] = "Connection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+    response_status(res, 101);
+    response_append(res, switching, sizeof(switching) - 1);
+
+    // The request becomes stream 1, already half-closed, minus the fields
+    // that were about the upgrade.
+    h2_stream_t *st = stream_new(s, 1);
+    if (!st) return -1;
+    st->recv_done = 1;
+    buffer_t head = {0};
+    buf_appendf(&head, "%s %s%s%.*s HTTP/1.1\r\n", req->method.ptr, req->path.ptr,
+                req->query_string.ptr ? "?" : "", (int)req->query_string.len,
+                req->query_string.ptr ? req->query_string.ptr : "");
+    for (int i = 0; i < req->header_count; i++) {
+        http_slice_t name = req->headers[i].name;
+        if (http_slice_caseeq(name, "Connection") || http_slice_caseeq(name, "Upgrade") ||
+            http_slice_caseeq(name, "HTTP2-Settings") || http_slice_caseeq(name, "Keep-Alive"))
+            continue;
+        buf_appendf(&head, "%s: %s\r\n", name.ptr, req->headers[i].value.ptr);
+    }
+    buf_append(&head, "\r\n", 2);
+    char *copy = arena_alloc(&st->arena, head.len + 1);
+    if (copy) memcpy(copy, head.data, head.len);
+    size_t head_len = head.len;
+    buf_free(&head);
+    if (!copy) {
+        stream_reset(s, st, E_INTERNAL);
+        return 0;
+    }
+    stream_start(s, st, copy, head_len);
+    return 0;
+}
+
+ssize_t h2_feed(h2_t *s, char *buf, size_t len) {
+    size_t pos = 0;
+    if (!s->preface) {
+        int p = h2_preface(buf, len);
+        if (p == 0) return conn_error(s, E_PROTOCOL);
+        if (p < 0) return 0;
+        s->preface = 1;
+        pos = H2_PREFACE_LEN;
+    }
+    while (h2_wants_input(s) && len - pos >= FRAME_HEADER) {
+        const unsigned char *h = (const unsigned char *)buf + pos;
+        size_t flen = (size_t)h[0] << 16 | h[1] << 8 | h[2];
+        if (flen > FRAME_MAX) return conn_error(s, E_FRAME_SIZE);
+        if (len - pos < FRAME_HEADER + flen) break;
+        on_frame(s, h[3], h[4], get32(h + 5) & 0x7fffffff, h + FRAME_HEADER, flen);
+        pos += FRAME_HEADER + flen;
+    }
+    return s->failed ? -1 : (ssize_t)pos;
+}
+
+int h2_wants_input(const h2_t *s) {
+    return !s->failed && s->ctl.len < CTL_MAX;
+}
+
+void h2_shutdown(h2_t *s) {
+    if (!s->goaway) goaway(s, E_NO_ERROR);
+}
+
+int h2_done(const h2_t *s) {
+    if (s->ctl.len) return 0;
+    return s->failed || ((s->goaway || s->peer_goaway) && s->nstreams == 0);
+}
+
+int h2_waiting(const h2_t *s) {
+    int w = s->block_stream ? H2_READING : H2_IDLE;
+    for (int i = 0; i < s->nstreams && w != H2_READING; i++) {
+        const h2_stream_t *st = s->streams[i];
+        if (!st->recv_done) w = H2_READING;
+        else if (!st->waiting) w = H2_BLOCKED;
+        else if (w == H2_IDLE) w = H2_SOURCE;
+    }
+    return w;
+}
+
+int h2_sources(h2_t *s, h2_watch_fn fn, void *arg) {
+    for (int i = 0; i < s->nstreams; i++) {
+        h2_stream_t *st = s->streams[i];
+        if (!st->waiting || (st->watched && st->watch_fd == st->res.wait_fd)) continue;
+        st->watched = 1;
+        st->watch_fd = st->res.wait_fd;
+        if (fn(arg, st, st->res.wait_fd, st->res.wait_events) < 0) return -1;
+    }
+    return 0;
+}
+
+// ---- responses ----
+
+// The response this output round appends to. Parts that refer to a
+// stream's memory or file keep the stream alive until they are sent, so a
+// queued response refers to one stream at most, and holds it.
+static response_t *out_get(h2_t *s, response_queue_t *q, h2_stream_t *ref) {
+    response_t *out = s->tail;
+    if (out && ref && out->release_arg && out->release_arg != ref) out = NULL;
+    if (!out) {
+        if (!(out = response_queue_push(q))) return NULL;
+        s->tail = out;
+    }
+    if (ref && !out->release_arg) {
+        out->release = stream_unref;
+        out->release_arg = ref;
+        ref->refs++;
+        out->file_fd = ref->res.file_fd;
+        out->file_owned = 0;
+    }
+    return out;
+}
+
+static int flush_ctl(h2_t *s, response_queue_t *q) {
+    if (!s->ctl.len) return 0;
+    response_t *out = out_get(s, q, NULL);
+    if (!out) return -1;
+    response_append(out, s->ctl.data, s->ctl.len);
+    s->ctl.len = 0;
+    return 0;
+}
+
+static void out_frame(response_t *out, size_t len, int type, int flags, uint32_t id) {
+    unsigned char h[FRAME_HEADER];
+    frame_header(h, len, type, flags, id);
+    response_append(out, h, sizeof(h));
+}
+
+static int stream_fail(h2_stream_t *st) {
+    st->out = OUT_DONE;
+    st->rst = E_INTERNAL;
+    return 0;
+}
+
+// The response is all queued: counted as an HTTP/1 one is once written.
+static void stream_sent(h2_stream_t *st) {
+    st->out = OUT_DONE;
+    if (st->res.status) metrics_response(st->res.status);
+    if (st->res.ready_at) metrics_observe(PHASE_WRITE, metrics_clock() - st->res.ready_at);
+}
+
+static int stream_produce(h2_stream_t *st) {
+    int r = response_produce(&st->res);
+    st->waiting = r == 0;
+    return r;
+}
+
+// Take the response's bytes up to the blank line ending its head. Returns
+// 1 once the head is complete, 0 while a streamed response has no more
+// yet, -1 if the response is not one.
+static int collect_head(h2_stream_t *st) {
+    response_t *res = &st->res;
+    for (;;) {
+        if (res->cur == res->nparts) {
+            if (!res->produce) return -1;
+            int r = stream_produce(st);
+            if (r <= 0) return r;
+            continue;
+        }
+        response_part_t *part = &res->parts[res->cur];
+        if (part->kind == PART_FILE) return -1;
+        const char *p = (part->kind == PART_OWNED ? res->buf.data + part->off : part->ptr) +
+                        res->cur_sent;
+        size_t n = part->len - res->cur_sent;
+        size_t from = st->head.len > 3 ? st->head.len - 3 : 0;
+        if (buf_append(&st->head, p, n) < 0) return -1;
+        char *end = memmem(st->head.data + from, st->head.len - from, "\r\n\r\n", 4);
+        size_t used = n;
+        if (end) {
+            size_t head_len = end + 4 - st->head.data;
+            used -= st->head.len - head_len;
+            st->head.len = head_len;
+        }
+        res->cur_sent += used;
+        if (res->cur_sent == part->len) {
+            res->cur++;
+            res->cur_sent = 0;
+        }
+        if (end) return 1;
+        if (st->head.len > HEAD_MAX) return -1;
+    }
+}
+
+// Fields that only make sense for one response are not worth a table slot.
+static int field_mode(const char *name, size_t len) {
+    if (name_is(name, len, "set-cookie")) return HPACK_NEVER_INDEX;
+    if (name_is(name, len, "content-length") || name_is(name, len, "etag") ||
+        name_is(name, len, "last-modified") || name_is(name, len, "content-range"))
+        return HPACK_NO_INDEX;
+    return HPACK_INDEX;
+}
+
+// The HTTP/1.1 head as an HPACK block in s->encoded.
+static int encode_head(h2_t *s, h2_stream_t *st) {
+    buffer_t *blk = &s->encoded;
+    blk->len = 0;
+    const char *p = st->head.data;
+    const char *end = p + st->head.len - 2;     // at the blank line
+    if (st->head.len < 14 || memcmp(p, "HTTP/1.", 7) != 0) return -1;
+    if (hpack_encode(&s->encoder, blk, ":status", 7, p + 9, 3, HPACK_INDEX) < 0) return -1;
+    p = memchr(p, '\n', end - p) + 1;
+    while (p < end) {
+        const char *eol = memchr(p, '\r', end - p);
+        const char *colon = memchr(p, ':', eol - p);
+        if (!colon) return -1;
+        char name[128];
+        size_t name_len = colon - p;
+        if (name_len == 0 || name_len > sizeof(name)) return -1;
+        for (size_t i = 0; i < name_len; i++) name[i] = tolower((unsigned char)p[i]);
+        const char *value = colon + 1;
+        while (value < eol && (*value == ' ' || *value == '\t')) value++;
+        if (!name_is(name, name_len, "connection") && !name_is(name, name_len, "keep-alive") &&
+            !name_is(name, name_len, "transfer-encoding") && !name_is(name, name_len, "upgrade") &&
+            hpack_encode(&s->encoder, blk, name, name_len, value, eol - value,
+                         field_mode(name, name_len)) < 0)
+            return -1;
+        p = eol + 2;
+    }
+    return 0;
+}
+
+static int stream_head(h2_t *s, response_queue_t *q, h2_stream_t *st, size_t *budget) {
+    response_t *out = out_get(s, q, NULL);
+    if (!out) return -1;
+    int r = collect_head(st);
+    if (r == 0) return 0;
+    if (r < 0 || encode_head(s, st) < 0) return stream_fail(st);
+    buf_free(&st->head);
+
+    response_t *res = &st->res;
+    int end_stream = res->cur == res->nparts && !res->produce;
+    const char *blk = s->encoded.data;
+    size_t left = s->encoded.len;
+    int type = F_HEADERS;
+    do {
+        size_t n = left < FRAME_MAX ? left : FRAME_MAX;
+        int flags = (n == left ? FL_END_HEADERS : 0) |
+                    (type == F_HEADERS && end_stream ? FL_END_STREAM : 0);
+        out_frame(out, n, type, flags, st->id);
+        response_append(out, blk, n);
+        blk += n;
+        left -= n;
+        type = F_CONTINUATION;
+    } while (left);
+    res->sent += s->encoded.len;
+    *budget -= s->encoded.len < *budget ? s->encoded.len : *budget;
+    if (end_stream) stream_sent(st);
+    else st->out = OUT_BODY;
+    return 1;
+}
+
+// One DATA frame of the body, from the front part, as far as the windows
+// and the budget allow.
+static int stream_body(h2_t *s, response_queue_t *q, h2_stream_t *st, size_t *budget) {
+    response_t *res = &st->res;
+    if (res->cur == res->nparts && res->produce) {
+        int r = stream_produce(st);
+        if (r < 0) return stream_fail(st);
+        if (r == 0) return 0;
+    }
+    if (res->cur == res->nparts) {
+        if (res->produce) return 0;
+        // A streamed body ended with nothing left to send.
+        response_t *out = out_get(s, q, NULL);
+        if (!out) return -1;
+        out_frame(out, 0, F_DATA, FL_END_STREAM, st->id);
+        stream_sent(st);
+        return 1;
+    }
+
+    int64_t window = s->send_window < st->send_window ? s->send_window : st->send_window;
+    if (window <= 0) return 0;
+    size_t max = s->tls ? FRAME_MAX_TLS : FRAME_MAX;
+    if ((int64_t)max > window) max = window;
+    if (max > *budget) max = *budget;
+    response_part_t *part = &res->parts[res->cur];
+    size_t n = part->len - res->cur_sent;
+    if (n > max) n = max;
+    off_t off = part->off + res->cur_sent;
+    int last = res->cur_sent + n == part->len && res->cur + 1 == res->nparts && !res->produce;
+
+    // Borrowed memory of a finished response and file parts are passed on
+    // as they are; over TLS file data is read into the frame, so that
+    // header and data go out as one record.
+    int ref = part->kind == PART_FILE ? !s->tls : part->kind == PART_BORROWED && !res->produce;
+    response_t *out = out_get(s, q, ref ? st : NULL);
+    if (!out) return -1;
+    if (part->kind == PART_FILE && !ref && pread(res->file_fd, scratch, n, off) != (ssize_t)n)
+        return stream_fail(st);
+    out_frame(out, n, F_DATA, last ? FL_END_STREAM : 0, st->id);
+    switch (part->kind) {
+    case PART_OWNED:
+        response_append(out, res->buf.data + off, n);
+        break;
+    case PART_BORROWED:
+        if (ref) response_add_segment(out, part->ptr + res->cur_sent, n);
+        else response_append(out, part->ptr + res->cur_sent, n);
+        break;
+    case PART_FILE:
+        if (ref) response_add_file(out, off, n);
+        else response_append(out, scratch, n);
+        break;
+    }
+    res->cur_sent += n;
+    if (res->cur_sent == part->len) {
+        res->cur++;
+        res->cur_sent = 0;
+    }
+    s->send_window -= n;
+    st->send_window -= n;
+    *budget -= n;
+    res->sent += n;
+    if (last) stream_sent(st);
+    return 1;
+}
+
+// Streams whose response is out leave the session; one whose request was
+// not read to the end is reset, so the client stops sending it.
+static void sweep(h2_t *s) {
+    for (int i = s->nstreams - 1; i >= 0; i--) {
+        h2_stream_t *st = s->streams[i];
+        if (st->out != OUT_DONE) continue;
+        if (st->rst >= 0) ctl_u32(s, F_RST_STREAM, st->id, st->rst);
+        else if (!st->recv_done) ctl_u32(s, F_RST_STREAM, st->id, E_NO_ERROR);
+        stream_close(s, i);
+    }
+}
+
+int h2_output(h2_t *s, response_queue_t *q) {
+    s->tail = NULL;
+    // Response data only follows once what was queued before is sent,
+    // which paces it to the socket; control frames go out regardless.
+    int idle = q->count == 0;
+    if (flush_ctl(s, q) < 0 || !idle) return 1;
+
+    // Round robin, a frame per stream and turn, starting after the stream
+    // that went last before.
+    size_t budget = OUTPUT_BUDGET;
+    int more = 0;
+    for (int progress = 1; progress && !more;) {
+        progress = 0;
+        int n = s->nstreams;
+        for (int k = 0; k < n; k++) {
+            int i = (s->next + k) % n;
+            h2_stream_t *st = s->streams[i];
+            int r = st->out == OUT_HEAD ? stream_head(s, q, st, &budget) :
+                    st->out == OUT_BODY ? stream_body(s, q, st, &budget) : 0;
+            if (r > 0) progress = 1;
+            if (r < 0 || budget == 0) {
+                s->next = (i + 1) % n;
+                more = 1;
+                break;
+            }
+        }
+        sweep(s);
+    }
+    if (flush_ctl(s, q) < 0) return 1;
+    return more;
+}
@@ -0,0 +1,483 @@
+#include "hpack.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// ---- tables (RFC 7541 appendices A and B) ----
+
+typedef struct {
+    const char *name;
+    size_t name_len;
+    const char *value;
+    size_t value_len;
+} static_field_t;
+
+#define FIELD(n, v) { n, sizeof(n) - 1, v, sizeof(v) - 1 }
+#define STATIC_COUNT 61
+
+// Index 0 is unused: HPACK counts from 1.
+static const static_field_t static_table[STATIC_COUNT + 1] = {
+    FIELD("", ""),
+    FIELD(":authority", ""),
+    FIELD(":method", "GET"),
+    FIELD(":method", "POST"),
+    FIELD(":path", "/"),
+    FIELD(":path", "/index.html"),
+    FIELD(":scheme", "http"),
+    FIELD(":scheme", "https"),
+    FIELD(":status", "200"),
+    FIELD(":status", "204"),
+    FIELD(":status", "206"),
+    FIELD(":status", "304"),
+    FIELD(":status", "400"),
+    FIELD(":status", "404"),
+    FIELD(":status", "500"),
+    FIELD("accept-charset", ""),
+    FIELD("accept-encoding", "gzip, deflate"),
+    FIELD("accept-language", ""),
+    FIELD("accept-ranges", ""),
+    FIELD("accept", ""),
+    FIELD("access-control-allow-origin", ""),
+    FIELD("age", ""),
+    FIELD("allow", ""),
+    FIELD("authorization", ""),
+    FIELD("cache-control", ""),
+    FIELD("content-disposition", ""),
+    FIELD("content-encoding", ""),
+    FIELD("content-language", ""),
+    FIELD("content-length", ""),
+    FIELD("content-location", ""),
+    FIELD("content-range", ""),
+    FIELD("content-type", ""),
+    FIELD("cookie", ""),
+    FIELD("date", ""),
+    FIELD("etag", ""),
+    FIELD("expect", ""),
+    FIELD("expires", ""),
+    FIELD("from", ""),
+    FIELD("host", ""),
+    FIELD("if-match", ""),
+    FIELD("if-modified-since", ""),
+    FIELD("if-none-match", ""),
+    FIELD("if-range", ""),
+    FIELD("if-unmodified-since", ""),
+    FIELD("last-modified", ""),
+    FIELD("link", ""),
+    FIELD("location", ""),
+    FIELD("max-forwards", ""),
+    FIELD("proxy-authenticate", ""),
+    FIELD("proxy-authorization", ""),
+    FIELD("range", ""),
+    FIELD("referer", ""),
+    FIELD("refresh", ""),
+    FIELD("retry-after", ""),
+    FIELD("server", ""),
+    FIELD("set-cookie", ""),
+    FIELD("strict-transport-security", ""),
+    FIELD("transfer-encoding", ""),
+    FIELD("user-agent", ""),
+    FIELD("vary", ""),
+    FIELD("via", ""),
+    FIELD("www-authenticate", ""),
+};
+
+// Huffman code of each symbol, 256 being EOS, and its length in bits.
+static const uint32_t huff_code[257] = {
+    0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5,
+    0xfffffe6, 0xfffffe7, 0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9,
+    0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec, 0xfffffed, 0xfffffee,
+    0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+    0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9,
+    0xffffffa, 0xffffffb, 0x14, 0x3f8, 0x3f9, 0xffa,
+    0x1ff9, 0x15, 0xf8, 0x7fa, 0x3fa, 0x3fb,
+    0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+    0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b,
+    0x1c, 0x1d, 0x1e, 0x1f, 0x5c, 0xfb,
+    0x7ffc, 0x20, 0xffb, 0x3fc, 0x1ffa, 0x21,
+    0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+    0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+    0x69, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e,
+    0x6f, 0x70, 0x71, 0x72, 0xfc, 0x73,
+    0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+    0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5,
+    0x25, 0x26, 0x27, 0x6, 0x74, 0x75,
+    0x28, 0x29, 0x2a, 0x7, 0x2b, 0x76,
+    0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+    0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd,
+    0x1ffd, 0xffffffc, 0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8,
+    0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9, 0x3fffd6, 0x7fffda,
+    0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+    0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1,
+    0x7fffe2, 0x7fffe3, 0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5,
+    0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef, 0x3fffda, 0x1fffdd,
+    0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+    0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf,
+    0x7fffeb, 0x7fffec, 0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2,
+    0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef, 0xfffea, 0x3fffe2,
+    0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+    0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2,
+    0x3fffe8, 0x1ffffec, 0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde,
+    0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed, 0x7fff2, 0x1fffe3,
+    0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+    0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3,
+    0x7ffffe4, 0x7ffffe5, 0xfffec, 0xfffff3, 0xfffed, 0x1fffe6,
+    0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3, 0x3fffea, 0x3fffeb,
+    0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+    0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8,
+    0x7ffffe9, 0x7ffffea, 0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed,
+    0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee, 0x3fffffff,
+};
+static const uint8_t huff_len[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30,
+};
+
+// The code is canonical: the codes of one length are consecutive numbers,
+// so decoding keeps the first code and the count of every length, and the
+// symbols in code order.
+static const uint16_t huff_sym[257] = {
+    48, 49, 50, 97, 99, 101, 105, 111, 115, 116, 32, 37,
+    45, 46, 47, 51, 52, 53, 54, 55, 56, 57, 61, 65,
+    95, 98, 100, 102, 103, 104, 108, 109, 110, 112, 114, 117,
+    58, 66, 67, 68, 69, 70, 71, 72, 73, 74, 75, 76,
+    77, 78, 79, 80, 81, 82, 83, 84, 85, 86, 87, 89,
+    106, 107, 113, 118, 119, 120, 121, 122, 38, 42, 44, 59,
+    88, 90, 33, 34, 40, 41, 63, 39, 43, 124, 35, 62,
+    0, 36, 64, 91, 93, 126, 94, 125, 60, 96, 123, 92,
+    195, 208, 128, 130, 131, 162, 184, 194, 224, 226, 153, 161,
+    167, 172, 176, 177, 179, 209, 216, 217, 227, 229, 230, 129,
+    132, 133, 134, 136, 146, 154, 156, 160, 163, 164, 169, 170,
+    173, 178, 181, 185, 186, 187, 189, 190, 196, 198, 228, 232,
+    233, 1, 135, 137, 138, 139, 140, 141, 143, 147, 149, 150,
+    151, 152, 155, 157, 158, 165, 166, 168, 174, 175, 180, 182,
+    183, 188, 191, 197, 231, 239, 9, 142, 144, 145, 148, 159,
+    171, 206, 215, 225, 236, 237, 199, 207, 234, 235, 192, 193,
+    200, 201, 202, 205, 210, 213, 218, 219, 238, 240, 242, 243,
+    255, 203, 204, 211, 212, 214, 221, 222, 223, 241, 244, 245,
+    246, 247, 248, 250, 251, 252, 253, 254, 2, 3, 4, 5,
+    6, 7, 8, 11, 12, 14, 15, 16, 17, 18, 19, 20,
+    21, 23, 24, 25, 26, 27, 28, 29, 30, 31, 127, 220,
+    249, 10, 13, 22, 256,
+};
+static const uint32_t huff_first[31] = {
+    0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x14, 0x5c,
+    0xf8, 0x0, 0x3f8, 0x7fa, 0xffa, 0x1ff8, 0x3ffc, 0x7ffc,
+    0x0, 0x0, 0x0, 0x7fff0, 0xfffe6, 0x1fffdc, 0x3fffd2, 0x7fffd8,
+    0xffffea, 0x1ffffec, 0x3ffffe0, 0x7ffffde, 0xfffffe2, 0x0, 0x3ffffffc,
+};
+static const uint32_t huff_count[31] = {
+    0, 0, 0, 0, 0, 10, 26, 32,
+    6, 0, 5, 3, 2, 6, 2, 3,
+    0, 0, 0, 3, 8, 13, 26, 29,
+    12, 4, 15, 19, 29, 0, 4,
+};
+static const uint32_t huff_off[31] = {
+    0, 0, 0, 0, 0, 0, 10, 36,
+    68, 0, 74, 79, 82, 84, 90, 92,
+    0, 0, 0, 95, 98, 106, 119, 145,
+    174, 186, 190, 205, 224, 0, 253,
+};
+
+// ---- dynamic table ----
+
+static hpack_entry_t *entry_at(hpack_table_t *t, unsigned i) {
+    return &t->ring[(t->first + i) % HPACK_ENTRIES];
+}
+
+// Drop the oldest entries until the table fits in max.
+static void evict(hpack_table_t *t, size_t max) {
+    while (t->count > 0 && t->size > max) {
+        hpack_entry_t *e = entry_at(t, t->count - 1);
+        t->size -= e->name_len + e->value_len + 32;
+        free(e->name);
+        e->name = NULL;
+        t->count--;
+    }
+}
+
+// The name may be that of an entry about to be evicted, so it is copied
+// first. An entry larger than the whole table just empties it.
+static int table_add(hpack_table_t *t, const char *name, size_t name_len,
+                     const char *value, size_t value_len) {
+    size_t size = name_len + value_len + 32;
+    if (size > t->max) {
+        evict(t, 0);
+        return 0;
+    }
+    char *copy = malloc(name_len + value_len + 1);
+    if (!copy) return -1;
+    memcpy(copy, name, name_len);
+    memcpy(copy + name_len, value, value_len);
+    evict(t, t->max - size);
+    t->first = (t->first + HPACK_ENTRIES - 1) % HPACK_ENTRIES;
+    t->count++;
+    hpack_entry_t *e = entry_at(t, 0);
+    e->name = copy;
+    e->name_len = name_len;
+    e->value = copy + name_len;
+    e->value_len = value_len;
+    t->size += size;
+    return 0;
+}
+
+void hpack_init(hpack_table_t *t) {
+    t->first = 0;
+    t->count = 0;
+    t->size = 0;
+    t->max = HPACK_TABLE_SIZE;
+    t->resized = 0;
+}
+
+void hpack_free(hpack_table_t *t) {
+    evict(t, 0);
+}
+
+void hpack_set_max(hpack_table_t *t, size_t max) {
+    if (max > HPACK_TABLE_SIZE) max = HPACK_TABLE_SIZE;
+    if (max == t->max) return;
+    t->max = max;
+    evict(t, max);
+    t->resized = 1;
+}
+
+// Static entries first, then the dynamic table from its newest entry.
+static int lookup(hpack_table_t *t, size_t index, const char **name, size_t *name_len,
+                  const char **value, size_t *value_len) {
+    if (index == 0) return -1;
+    if (index <= STATIC_COUNT) {
+        const static_field_t *f = &static_table[index];
+        *name = f->name;
+        *name_len = f->name_len;
+        *value = f->value;
+        *value_len = f->value_len;
+        return 0;
+    }
+    index -= STATIC_COUNT + 1;
+    if (index >= t->count) return -1;
+    hpack_entry_t *e = entry_at(t, index);
+    *name = e->name;
+    *name_len = e->name_len;
+    *value = e->value;
+    *value_len = e->value_len;
+    return 0;
+}
+
+// ---- decoding ----
+
+// An integer with an n-bit prefix in the first byte.
+static int get_int(const unsigned char **p, const unsigned char *end, int n, size_t *out) {
+    if (*p == end) return -1;
+    size_t mask = (1u << n) - 1;
+    size_t v = *(*p)++ & mask;
+    if (v == mask) {
+        for (int shift = 0;; shift += 7) {
+            if (*p == end || shift > 28) return -1;
+            unsigned char b = *(*p)++;
+            v += (size_t)(b & 0x7f) << shift;
+            if (!(b & 0x80)) break;
+        }
+    }
+    *out = v;
+    return 0;
+}
+
+static int huff_decode(const unsigned char *in, size_t n, buffer_t *out) {
+    // The shortest code is 5 bits.
+    if (buf_reserve(out, n * 8 / 5 + 1) < 0) return -1;
+    char *d = out->data + out->len;
+    uint32_t code = 0;
+    int len = 0;
+    for (size_t i = 0; i < n; i++) {
+        for (int bit = 7; bit >= 0; bit--) {
+            code = code << 1 | (in[i] >> bit & 1);
+            if (++len < 5) continue;
+            if (len > 30) return -1;
+            if (code >= huff_first[len] && code - huff_first[len] < huff_count[len]) {
+                unsigned sym = huff_sym[huff_off[len] + code - huff_first[len]];
+                if (sym == 256) return -1;  // EOS must not appear
+                *d++ = (char)sym;
+                code = 0;
+                len = 0;
+            }
+        }
+    }
+    // What is left is padding: under a byte of the EOS code's leading ones.
+    if (len > 7 || code != (1u << len) - 1) return -1;
+    out->len = d - out->data;
+    return 0;
+}
+
+// A string literal: a view of the input, or decoded into scratch, where it
+// is kept as an offset until every string of the field is in.
+typedef struct {
+    const char *ptr;    // NULL when in scratch
+    size_t off;
+    size_t len;
+} literal_t;
+
+static int get_string(const unsigned char **p, const unsigned char *end, buffer_t *scratch,
+                      literal_t *s) {
+    if (*p == end) return -1;
+    int huffman = **p & 0x80;
+    size_t n;
+    if (get_int(p, end, 7, &n) < 0 || n > (size_t)(end - *p)) return -1;
+    if (huffman) {
+        s->ptr = NULL;
+        s->off = scratch->len;
+        if (huff_decode(*p, n, scratch) < 0) return -1;
+        s->len = scratch->len - s->off;
+    } else {
+        s->ptr = (const char *)*p;
+        s->len = n;
+    }
+    *p += n;
+    return 0;
+}
+
+static const char *literal_ptr(const literal_t *s, const buffer_t *scratch) {
+    return s->ptr ? s->ptr : scratch->data + s->off;
+}
+
+int hpack_decode(hpack_table_t *t, const unsigned char *in, size_t len,
+                 hpack_field_fn fn, void *arg) {
+    const unsigned char *p = in, *end = in + len;
+    buffer_t scratch = {0};
+    int fields = 0;
+    while (p < end) {
+        unsigned char b = *p;
+        size_t index;
+        const char *name, *value;
+        size_t name_len, value_len;
+
+        if ((b & 0xe0) == 0x20) {
+            // Dynamic table size update, only ahead of the fields.
+            if (fields || get_int(&p, end, 5, &index) < 0 || index > HPACK_TABLE_SIZE) goto fail;
+            t->max = index;
+            evict(t, index);
+            continue;
+        }
+        fields++;
+        if (b & 0x80) {
+            if (get_int(&p, end, 7, &index) < 0 ||
+                lookup(t, index, &name, &name_len, &value, &value_len) < 0 ||
+                fn(arg, name, name_len, value, value_len) < 0)
+                goto fail;
+            continue;
+        }
+
+        // A literal, added to the table (01), or not (0000 / 0001, never).
+        int indexing = b & 0x40;
+        literal_t ln, lv;
+        if (get_int(&p, end, indexing ? 6 : 4, &index) < 0) goto fail;
+        scratch.len = 0;
+        if (index) {
+            const char *unused;
+            size_t unused_len;
+            if (lookup(t, index, &name, &name_len, &unused, &unused_len) < 0) goto fail;
+            ln = (literal_t){ name, 0, name_len };
+        } else if (get_string(&p, end, &scratch, &ln) < 0) {
+            goto fail;
+        }
+        if (get_string(&p, end, &scratch, &lv) < 0) goto fail;
+        name = literal_ptr(&ln, &scratch);
+        value = literal_ptr(&lv, &scratch);
+        if (fn(arg, name, ln.len, value, lv.len) < 0) goto fail;
+        if (indexing && table_add(t, name, ln.len, value, lv.len) < 0) goto fail;
+    }
+    buf_free(&scratch);
+    return 0;
+
+fail:
+    buf_free(&scratch);
+    return -1;
+}
+
+// ---- encoding ----
+
+static int put_int(buffer_t *out, unsigned char first, int n, size_t v) {
+    unsigned char b[16];
+    size_t len = 0;
+    size_t mask = (1u << n) - 1;
+    if (v < mask) {
+        b[len++] = first | v;
+    } else {
+        b[len++] = first | mask;
+        for (v -= mask; v >= 0x80; v >>= 7) b[len++] = (v & 0x7f) | 0x80;
+        b[len++] = v;
+    }
+    return buf_append(out, b, len);
+}
+
+static size_t huff_length(const char *s, size_t n) {
+    size_t bits = 0;
+    for (size_t i = 0; i < n; i++) bits += huff_len[(unsigned char)s[i]];
+    return (bits + 7) / 8;
+}
+
+// Huffman coded when that is shorter.
+static int put_string(buffer_t *out, const char *s, size_t n) {
+    size_t h = huff_length(s, n);
+    if (h >= n) return put_int(out, 0, 7, n) < 0 ? -1 : buf_append(out, s, n);
+    if (put_int(out, 0x80, 7, h) < 0 || buf_reserve(out, h) < 0) return -1;
+    unsigned char *d = (unsigned char *)out->data + out->len;
+    uint64_t acc = 0;
+    int bits = 0;
+    for (size_t i = 0; i < n; i++) {
+        unsigned char c = s[i];
+        acc = acc << huff_len[c] | huff_code[c];
+        for (bits += huff_len[c]; bits >= 8; bits -= 8) *d++ = acc >> (bits - 8);
+    }
+    // Padded with ones, the start of EOS.
+    if (bits) *d++ = (acc << (8 - bits)) | (0xff >> bits);
+    out->len += h;
+    return 0;
+}
+
+int hpack_encode(hpack_table_t *t, buffer_t *out, const char *name, size_t name_len,
+                 const char *value, size_t value_len, int mode) {
+    if (t->resized) {
+        if (put_int(out, 0x20, 5, t->max) < 0) return -1;
+        t->resized = 0;
+    }
+
+    // A whole field already in a table is one index; else reuse a name.
+    size_t name_index = 0;
+    for (size_t i = 1; i <= STATIC_COUNT; i++) {
+        const static_field_t *f = &static_table[i];
+        if (f->name_len != name_len || memcmp(f->name, name, name_len) != 0) continue;
+        if (!name_index) name_index = i;
+        if (mode != HPACK_NEVER_INDEX && f->value_len == value_len &&
+            memcmp(f->value, value, value_len) == 0)
+            return put_int(out, 0x80, 7, i);
+    }
+    for (unsigned i = 0; i < t->count; i++) {
+        hpack_entry_t *e = entry_at(t, i);
+        if (e->name_len != name_len || memcmp(e->name, name, name_len) != 0) continue;
+        if (!name_index) name_index = STATIC_COUNT + 1 + i;
+        if (mode != HPACK_NEVER_INDEX && e->value_len == value_len &&
+            memcmp(e->value, value, value_len) == 0)
+            return put_int(out, 0x80, 7, STATIC_COUNT + 1 + i);
+    }
+
+    int rc = mode == HPACK_INDEX ? put_int(out, 0x40, 6, name_index)
+                                 : put_int(out, mode == HPACK_NEVER_INDEX ? 0x10 : 0, 4, name_index);
+    if (rc < 0 || (!name_index && put_string(out, name, name_len) < 0) ||
+        put_string(out, value, value_len) < 0)
+        return -1;
+    return mode == HPACK_INDEX ? table_add(t, name, name_len, value, value_len) : 0;
+}
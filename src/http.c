@@ -1,193 +1,584 @@
-#define _POSIX_C_SOURCE 200809L
-
-#include "http.h"
-#include <limits.h>
-#include <errno.h>
-#include <stdio.h>
-#include <string.h>
-#include <unistd.h>
-#include <stdlib.h>
-#include <ctype.h>
-
-void send_set_cookie(int fd, const char *name, const char *value) {
-    char header[256];
-    int n = snprintf(header, sizeof(header),
-                     "Set-Cookie: %s=%s; Path=/; HttpOnly\r\n", name, value);
-    write_all(fd, header, n);
-}
-
-void parse_query_string(http_request_t *req) {
-    req->query_count = 0;
-    char *q = strchr(req->path, '?');
-    if (!q) return;
-
-    *q = 0; // terminate path before ?
-    q++;
-
-    char *pair = strtok(q, "&");
-    while (pair && req->query_count < MAX_QUERY_PARAMS) {
-        char *eq = strchr(pair, '=');
-        if (!eq) { pair = strtok(NULL, "&"); continue; }
-
-        *eq = 0;
-        strncpy(req->query[req->query_count].key, pair, 63);
-        strncpy(req->query[req->query_count].value, eq + 1, 255);
-        req->query_count++;
-        pair = strtok(NULL, "&");
-    }
-}
-
-ssize_t read_until_double_crlf(int fd, char *buf, size_t cap) {
-    size_t used = 0;
-    while (used < cap - 1) {
-        ssize_t r = read(fd, buf + used, 1);
-        if (r == 0) break; // EOF
-        if (r < 0) {
-            if (errno == EINTR) continue;
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                usleep(1000);
-                continue;
-            }
-            break;
-        }
-        used += r;
-        if (used >= 4 &&
-            buf[used-4] == '\r' && buf[used-3] == '\n' &&
-            buf[used-2] == '\r' && buf[used-1] == '\n') {
-            buf[used] = 0;
-            return used;
-        }
-    }
-    buf[used] = 0;
-    return used;
-}
-
-int parse_http_request(int fd, http_request_t *req) {
-    char buf[8192];
-    ssize_t n = read_until_double_crlf(fd, buf, sizeof(buf));
-    if (n <= 0) return -1;
-
-    char *line = strtok(buf, "\r\n");
-    if (!line) return -1;
-
-    // Parse request line
-    if (sscanf(line, "%15s %1023s %15s", req->method, req->path, req->version) != 3) return -1;
-
-    parse_query_string(req);
-
-    // Parse headers
-    req->header_count = 0;
-    while ((line = strtok(NULL, "\r\n")) && req->header_count < MAX_HEADERS) {
-        char *colon = strchr(line, ':');
-        if (!colon) continue;
-        *colon = 0;
-        // trim spaces
-        char *name = line;
-        while (*name && isspace(*name)) name++;
-        char *value = colon + 1;
-        while (*value && isspace(*value)) value++;
-
-        strncpy(req->headers[req->header_count].name, name, 63);
-        strncpy(req->headers[req->header_count].value, value, 255);
-        req->header_count++;
-    }
-
-    req->cookie_count = 0;
-    for (int i = 0; i < req->header_count; i++) {
-        if (strcasecmp(req->headers[i].name, "Cookie") == 0) {
-            char *cookie_str = req->headers[i].value;
-            char *tok = strtok(cookie_str, ";");
-            while (tok && req->cookie_count < MAX_COOKIES) {
-                while (*tok && isspace(*tok)) tok++; // trim leading spaces
-                char *eq = strchr(tok, '=');
-                if (eq) {
-                    *eq = 0;
-                    strncpy(req->cookies[req->cookie_count].name, tok, 63);
-                    strncpy(req->cookies[req->cookie_count].value, eq + 1, 255);
-                    req->cookie_count++;
-                }
-                tok = strtok(NULL, ";");
-            }
-        }
-    }
-
-    // Check for body (Content-Length)
-    req->body = NULL;
-    req->body_len = 0;
-    for (int i = 0; i < req->header_count; i++) {
-        if (strcasecmp(req->headers[i].name, "Content-Length") == 0) {
-            req->body_len = strtoul(req->headers[i].value, NULL, 10);
-            if (req->body_len > 0) {
-                req->body = malloc(req->body_len + 1);
-                if (!req->body) return -1;
-                size_t received = 0;
-                while (received < req->body_len) {
-                    ssize_t r = read(fd, req->body + received, req->body_len - received);
-                    if (r == 0) break;
-                    if (r < 0) {
-                        if (errno == EINTR) continue;
-                        if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                            usleep(1000);
-                            continue;
-                        }
-                        break;
-                    }
-                    received += r;
-                }
-                req->body[received] = 0;
-                req->body_len = received;
-            }
-            break;
-        }
-    }
-
-    return 0;
-}
-
-void send_400(int fd) {
-    const char *body = "<html><head><title>400 Bad Request</title></head>"
-                       "<body><h1>400 Bad Request</h1></body></html>";
-    char header[256];
-    int n = snprintf(header, sizeof(header),
-                     "HTTP/1.1 400 Bad Request\r\n"
-                     "Content-Length: %ld\r\n"
-                     "Content-Type: text/html\r\n"
-                     "Connection: close\r\n"
-                     "\r\n",
-                     strlen(body));
-    write(fd, header, n);
-    write(fd, body, strlen(body));
-}
-
-
-void send_404(int fd) {
-    const char *body = "<html><head><title>404 Not Found</title></head>"
-                       "<body><h1>404 Not Found</h1></body></html>";
-    char header[256];
-    int n = snprintf(header, sizeof(header),
-                     "HTTP/1.1 404 Not Found\r\n"
-                     "Content-Length: %ld\r\n"
-                     "Content-Type: text/html\r\n"
-                     "Connection: close\r\n"
-                     "\r\n",
-                     strlen(body));
-    write(fd, header, n);
-    write(fd, body, strlen(body));
-}
-
-
-void send_500(int fd) {
-    const char *body = "<html><head><title>500 Internal Server Error</title></head>"
-                       "<body><h1>500 Internal Server Error</h1></body></html>";
-    char header[256];
-    int n = snprintf(header, sizeof(header),
-                     "HTTP/1.1 500 Internal Server Error\r\n"
-                     "Content-Length: %ld\r\n"
-                     "Content-Type: text/html\r\n"
-                     "Connection: close\r\n"
-                     "\r\n",
-                     strlen(body));
-    write(fd, header, n);
-    write(fd, body, strlen(body));
-}
-
+#define _GNU_SOURCE
+
+#include "http.h"
+#include "metrics.h"
+#include <limits.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <poll.h>
+#include <time.h>
+
+int http_slice_eq(http_slice_t s, const char *lit) {
+    size_t n = strlen(lit);
+    return s.len == n && memcmp(s.ptr, lit, n) == 0;
+}
+
+int http_slice_caseeq(http_slice_t s, const char *lit) {
+    size_t n = strlen(lit);
+    return s.len == n && strncasecmp(s.ptr, lit, n) == 0;
+}
+
+const char *http_get_header(const http_request_t *req, const char *name) {
+    for (int i = 0; i < req->header_count; i++) {
+        if (http_slice_caseeq(req->headers[i].name, name))
+            return req->headers[i].value.ptr;
+    }
+    return NULL;
+}
+
+int http_keep_alive(const http_request_t *req) {
+    // HTTP/1.1 connections persist unless the client says "close";
+    // HTTP/1.0 ones only when it asks for "keep-alive".
+    int keep_alive = http_slice_eq(req->version, "HTTP/1.1");
+    for (int i = 0; i < req->header_count; i++) {
+        if (!http_slice_caseeq(req->headers[i].name, "Connection")) continue;
+        const char *p = req->headers[i].value.ptr;
+        const char *end = p + req->headers[i].value.len;
+        while (p < end) {
+            while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+            const char *tok = p;
+            while (p < end && *p != ',' && *p != ' ' && *p != '\t') p++;
+            http_slice_t t = { tok, p - tok };
+            if (http_slice_caseeq(t, "close")) return 0;
+            if (http_slice_caseeq(t, "keep-alive")) keep_alive = 1;
+        }
+    }
+    return keep_alive;
+}
+
+void http_format_date(time_t t, char out[HTTP_DATE_MAX]) {
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    strftime(out, HTTP_DATE_MAX, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+int http_parse_date(const char *s, time_t *out) {
+    static const char *const formats[] = {
+        "%a, %d %b %Y %H:%M:%S GMT",    // IMF-fixdate
+        "%A, %d-%b-%y %H:%M:%S GMT",    // RFC 850
+        "%a %b %e %H:%M:%S %Y",         // asctime
+    };
+    for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+        struct tm tm = {0};
+        const char *end = strptime(s, formats[i], &tm);
+        if (end && *end == '\0') {
+            *out = timegm(&tm);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static void parse_query_string(http_request_t *req) {
+    req->query_count = 0;
+    const char *q = req->query_string.ptr;
+    const char *end = q + req->query_string.len;
+
+    while (q < end && req->query_count < MAX_QUERY_PARAMS) {
+        const char *amp = memchr(q, '&', end - q);
+        const char *pair_end = amp ? amp : end;
+        const char *eq = memchr(q, '=', pair_end - q);
+        if (eq) {
+            http_field_t *f = &req->query[req->query_count++];
+            f->name = (http_slice_t){ q, eq - q };
+            f->value = (http_slice_t){ eq + 1, pair_end - eq - 1 };
+        }
+        q = pair_end + 1;
+    }
+}
+
+static void parse_cookies(http_request_t *req) {
+    req->cookie_count = 0;
+    for (int i = 0; i < req->header_count; i++) {
+        if (!http_slice_caseeq(req->headers[i].name, "Cookie")) continue;
+        const char *c = req->headers[i].value.ptr;
+        const char *end = c + req->headers[i].value.len;
+        while (c < end && req->cookie_count < MAX_COOKIES) {
+            while (c < end && isspace((unsigned char)*c)) c++; // trim leading spaces
+            const char *semi = memchr(c, ';', end - c);
+            const char *tok_end = semi ? semi : end;
+            const char *eq = memchr(c, '=', tok_end - c);
+            if (eq) {
+                cookie_t *ck = &req->cookies[req->cookie_count++];
+                ck->name = (http_slice_t){ c, eq - c };
+                ck->value = (http_slice_t){ eq + 1, tok_end - eq - 1 };
+            }
+            c = tok_end + 1;
+        }
+    }
+}
+
+// RFC 9110 token characters, used for methods and header names.
+static int is_tchar(unsigned char ch) {
+    return isalnum(ch) || (ch && strchr("!#$%&'*+-.^_`|~", ch));
+}
+
+enum {
+    S_METHOD, S_TARGET, S_VERSION, S_LINE_LF,
+    S_FIELD_START, S_NAME, S_VALUE_WS, S_VALUE, S_FIELD_LF, S_HEAD_LF,
+    S_DONE,
+};
+
+void http_parser_init(http_parser_t *p) {
+    p->state = S_METHOD;
+    p->pos = 0;
+    p->mark = 0;
+    p->header_count = 0;
+    p->elapsed = 0;
+}
+
+// Turn the offsets collected by the state machine into slices over buf,
+// NUL-terminating the tokens in place.
+static int finish_request(http_parser_t *p, char *buf, size_t head_len,
+                          http_request_t *req) {
+    p->state = S_DONE;
+    p->pos = head_len;
+    http_slice_t *line[3] = { &req->method, &req->path, &req->version };
+    for (int i = 0; i < 3; i++) {
+        *line[i] = (http_slice_t){ buf + p->line[i][0], p->line[i][1] };
+        buf[p->line[i][0] + p->line[i][1]] = '\0';
+    }
+    if (strncmp(req->version.ptr, "HTTP/1.", 7) != 0) return HTTP_PARSE_ERROR;
+
+    req->query_string = (http_slice_t){ NULL, 0 };
+    char *q = memchr(req->path.ptr, '?', req->path.len);
+    if (q) {
+        req->query_string = (http_slice_t){ q + 1, req->path.len - (q + 1 - req->path.ptr) };
+        req->path.len = q - req->path.ptr;
+        *q = '\0'; // terminate path before ?
+    }
+
+    req->header_count = p->header_count;
+    for (int i = 0; i < p->header_count; i++) {
+        http_field_t *f = &req->headers[i];
+        f->name = (http_slice_t){ buf + p->fields[i].name_off, p->fields[i].name_len };
+        f->value = (http_slice_t){ buf + p->fields[i].value_off, p->fields[i].value_len };
+        buf[p->fields[i].name_off + p->fields[i].name_len] = '\0';
+        buf[p->fields[i].value_off + p->fields[i].value_len] = '\0';
+    }
+
+    parse_query_string(req);
+    parse_cookies(req);
+
+    // Check for body (Content-Length); conflicting values are rejected.
+    req->head_len = head_len;
+    req->body = NULL;
+    req->body_len = 0;
+    int have_len = 0;
+    for (int i = 0; i < req->header_count; i++) {
+        if (!http_slice_caseeq(req->headers[i].name, "Content-Length")) continue;
+        http_slice_t v = req->headers[i].value;
+        if (v.len == 0 || v.len > 18) return HTTP_PARSE_ERROR;
+        size_t n = 0;
+        for (size_t j = 0; j < v.len; j++) {
+            if (!isdigit((unsigned char)v.ptr[j])) return HTTP_PARSE_ERROR;
+            n = n * 10 + (v.ptr[j] - '0');
+        }
+        if (have_len && n != req->body_len) return HTTP_PARSE_ERROR;
+        req->body_len = n;
+        have_len = 1;
+    }
+
+    // Transfer-Encoding: only a lone "chunked" is understood. Together with
+    // Content-Length it is a smuggling vector, so that is refused outright.
+    req->chunked = 0;
+    for (int i = 0; i < req->header_count; i++) {
+        if (!http_slice_caseeq(req->headers[i].name, "Transfer-Encoding")) continue;
+        if (req->chunked || have_len || !http_slice_caseeq(req->headers[i].value, "chunked") ||
+            strcmp(req->version.ptr, "HTTP/1.0") == 0)
+            return HTTP_PARSE_ERROR;
+        req->chunked = 1;
+    }
+    return HTTP_PARSE_DONE;
+}
+
+static int parse_head(http_parser_t *p, char *buf, size_t len, http_request_t *req) {
+    size_t i = p->pos;
+    for (; i < len; i++) {
+        unsigned char ch = buf[i];
+        switch (p->state) {
+        case S_METHOD:
+        case S_TARGET: {
+            int tok = p->state == S_METHOD ? 0 : 1;
+            if (ch == ' ') {
+                if (i == p->mark) return HTTP_PARSE_ERROR;
+                p->line[tok][0] = p->mark;
+                p->line[tok][1] = i - p->mark;
+                p->mark = i + 1;
+                p->state = tok == 0 ? S_TARGET : S_VERSION;
+            } else if (tok == 0 ? !is_tchar(ch) : (ch < 0x21 || ch == 0x7f)) {
+                return HTTP_PARSE_ERROR;
+            }
+            break;
+        }
+        case S_VERSION:
+            if (ch == '\r' || ch == '\n') {
+                p->line[2][0] = p->mark;
+                p->line[2][1] = i - p->mark;
+                p->state = ch == '\r' ? S_LINE_LF : S_FIELD_START;
+            } else if (ch < 0x21 || ch == 0x7f) {
+                return HTTP_PARSE_ERROR;
+            }
+            break;
+        case S_LINE_LF:
+        case S_FIELD_LF:
+            if (ch != '\n') return HTTP_PARSE_ERROR;
+            p->state = S_FIELD_START;
+            break;
+        case S_FIELD_START:
+            if (ch == '\r') {
+                p->state = S_HEAD_LF;
+            } else if (ch == '\n') {
+                return finish_request(p, buf, i + 1, req);
+            } else if (is_tchar(ch)) {
+                // obs-fold continuation lines (leading SP/HT) are rejected here
+                p->mark = i;
+                p->state = S_NAME;
+            } else {
+                return HTTP_PARSE_ERROR;
+            }
+            break;
+        case S_NAME:
+            if (ch == ':') {
+                if (i == p->mark || p->header_count == MAX_HEADERS)
+                    return HTTP_PARSE_ERROR;
+                p->fields[p->header_count].name_off = p->mark;
+                p->fields[p->header_count].name_len = i - p->mark;
+                p->state = S_VALUE_WS;
+            } else if (!is_tchar(ch)) {
+                return HTTP_PARSE_ERROR;
+            }
+            break;
+        case S_VALUE_WS:
+            if (ch == ' ' || ch == '\t') break;
+            p->mark = i;
+            p->state = S_VALUE;
+            /* fall through */
+        case S_VALUE:
+            if (ch == '\r' || ch == '\n') {
+                size_t end = i;
+                while (end > p->mark && (buf[end-1] == ' ' || buf[end-1] == '\t')) end--;
+                p->fields[p->header_count].value_off = p->mark;
+                p->fields[p->header_count].value_len = end - p->mark;
+                p->header_count++;
+                p->state = ch == '\r' ? S_FIELD_LF : S_FIELD_START;
+            } else if ((ch < 0x20 && ch != '\t') || ch == 0x7f) {
+                return HTTP_PARSE_ERROR;
+            }
+            break;
+        case S_HEAD_LF:
+            if (ch != '\n') return HTTP_PARSE_ERROR;
+            return finish_request(p, buf, i + 1, req);
+        case S_DONE:
+            break;
+        }
+    }
+    p->pos = i;
+    return len >= HTTP_MAX_HEAD ? HTTP_PARSE_ERROR : HTTP_PARSE_AGAIN;
+}
+
+int parse_http_request(http_parser_t *p, char *buf, size_t len, http_request_t *req) {
+    if (p->state == S_DONE) return HTTP_PARSE_DONE;
+    uint64_t start = metrics_clock();
+    int rc = parse_head(p, buf, len, req);
+    p->elapsed += metrics_clock() - start;
+    if (rc == HTTP_PARSE_DONE) metrics_observe(PHASE_PARSE, p->elapsed);
+    return rc;
+}
+
+// Remove n body bytes from `in`, closing the gap so the head stays in
+// place and any pipelined bytes follow it directly.
+static void cut_body(buffer_t *in, const http_request_t *req, size_t n) {
+    size_t avail = in->len - req->head_len;
+    memmove(in->data + req->head_len, in->data + req->head_len + n, avail - n);
+    in->len -= n;
+}
+
+static size_t buffered_body(const buffer_t *in, const http_request_t *req) {
+    size_t avail = in->len - req->head_len;
+    return avail < req->body_len ? avail : req->body_len;
+}
+
+size_t http_take_body(buffer_t *in, http_request_t *req) {
+    if (req->body_len == 0) return 0;
+    req->body = arena_alloc(req->arena, req->body_len + 1);
+    if (!req->body) return (size_t)-1;
+    req->body[req->body_len] = 0;
+
+    size_t n = buffered_body(in, req);
+    memcpy(req->body, in->data + req->head_len, n);
+    cut_body(in, req, n);
+    return n;
+}
+
+size_t http_stream_body(buffer_t *in, http_request_t *req, http_body_fn fn, void *arg) {
+    size_t n = buffered_body(in, req);
+    if (n > 0) fn(arg, in->data + req->head_len, n);
+    cut_body(in, req, n);
+    return n;
+}
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Deadline `ms` from now, or 0 for none.
+static uint64_t deadline_in(int ms) {
+    return ms > 0 ? now_ms() + ms : 0;
+}
+
+// Read into dst, waiting until `deadline` (0: forever) if the non-blocking
+// socket is empty. Returns bytes read, 0 on EOF, -1 on error, or
+// HTTP_TIMEOUT.
+static ssize_t read_wait(int fd, char *dst, size_t cap, uint64_t deadline) {
+    for (;;) {
+        ssize_t r = read(fd, dst, cap);
+        if (r >= 0) {
+            metrics_add(METRIC_BYTES_IN, r);
+            return r;
+        }
+        if (errno == EINTR) continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+        int ms = -1;
+        if (deadline) {
+            uint64_t now = now_ms();
+            if (now >= deadline) return HTTP_TIMEOUT;
+            ms = (int)(deadline - now);
+        }
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        poll(&pfd, 1, ms);
+    }
+}
+
+int read_http_request(int fd, buffer_t *in, http_parser_t *p, http_request_t *req,
+                      const http_timeouts_t *t) {
+    req->body = NULL;
+    uint64_t deadline = deadline_in(in->len ? t->head : t->idle);
+    for (;;) {
+        int rc = parse_http_request(p, in->data, in->len, req);
+        if (rc == HTTP_PARSE_ERROR) return -1;
+        if (rc == HTTP_PARSE_DONE) return 1;
+        if (buf_reserve(in, HTTP_READ_CHUNK) < 0) return -1;
+        ssize_t r = read_wait(fd, in->data + in->len, in->cap - in->len, deadline);
+        if (r == HTTP_TIMEOUT) return in->len ? HTTP_TIMEOUT : 0;
+        if (r == 0 && in->len == 0) return 0; // client closed between requests
+        if (r <= 0) return -1;
+        // The head deadline runs from its first byte.
+        if (in->len == 0) deadline = deadline_in(t->head);
+        in->len += r;
+    }
+}
+
+static void rebase(http_slice_t *sl, const char *from, const char *to) {
+    if (sl->ptr) sl->ptr = to + (sl->ptr - from);
+}
+
+int http_reserve(buffer_t *in, http_request_t *req, size_t extra) {
+    const char *from = in->data;
+    if (buf_reserve(in, extra) < 0) return -1;
+    if (in->data == from) return 0;
+
+    rebase(&req->method, from, in->data);
+    rebase(&req->path, from, in->data);
+    rebase(&req->version, from, in->data);
+    rebase(&req->query_string, from, in->data);
+    for (int i = 0; i < req->header_count; i++) {
+        rebase(&req->headers[i].name, from, in->data);
+        rebase(&req->headers[i].value, from, in->data);
+    }
+    for (int i = 0; i < req->query_count; i++) {
+        rebase(&req->query[i].name, from, in->data);
+        rebase(&req->query[i].value, from, in->data);
+    }
+    for (int i = 0; i < req->cookie_count; i++) {
+        rebase(&req->cookies[i].name, from, in->data);
+        rebase(&req->cookies[i].value, from, in->data);
+    }
+    return 0;
+}
+
+enum {
+    C_SIZE, C_EXT, C_SIZE_LF, C_DATA, C_DATA_CR, C_DATA_LF,
+    C_TRAILER_START, C_TRAILER, C_TRAILER_LF, C_END_LF, C_DONE,
+};
+
+void http_chunked_init(http_chunked_t *d, size_t limit) {
+    d->state = C_SIZE;
+    d->digits = 0;
+    d->size = 0;
+    d->total = 0;
+    d->limit = limit;
+    d->cap = 0;
+    d->trailer = 0;
+}
+
+// Append decoded bytes to req->body, keeping it NUL-terminated.
+static int body_append(http_chunked_t *d, http_request_t *req, const char *p, size_t n) {
+    if (req->body_len + n + 1 > d->cap) {
+        size_t cap = d->cap ? d->cap : 4096;
+        while (cap < req->body_len + n + 1) cap *= 2;
+        char *body = arena_realloc(req->arena, req->body, d->cap, cap);
+        if (!body) return -1;
+        req->body = body;
+        d->cap = cap;
+    }
+    memcpy(req->body + req->body_len, p, n);
+    req->body_len += n;
+    req->body[req->body_len] = '\0';
+    return 0;
+}
+
+// Decode from *pp up to end, advancing *pp past what was used.
+static int chunked_run(http_chunked_t *d, const char **pp, const char *end,
+                       http_request_t *req, http_body_fn fn, void *arg) {
+    const char *p = *pp;
+    int rc = HTTP_PARSE_AGAIN;
+
+    while (p < end && rc == HTTP_PARSE_AGAIN) {
+        unsigned char ch = *p;
+        switch (d->state) {
+        case C_SIZE:
+            if (isxdigit(ch)) {
+                if (++d->digits > 15) return HTTP_PARSE_ERROR;
+                d->size = d->size * 16 + (isdigit(ch) ? ch - '0' : (ch | 0x20) - 'a' + 10);
+                p++;
+                break;
+            }
+            if (d->digits == 0) return HTTP_PARSE_ERROR;
+            d->state = C_EXT;
+            /* fall through */
+        case C_EXT:
+            // Chunk extensions are ignored.
+            if (ch == '\r') d->state = C_SIZE_LF;
+            else if (ch == '\n' || (ch < 0x20 && ch != '\t') || ch == 0x7f) return HTTP_PARSE_ERROR;
+            p++;
+            break;
+        case C_SIZE_LF:
+            if (ch != '\n') return HTTP_PARSE_ERROR;
+            p++;
+            if (d->size == 0) {
+                d->state = C_TRAILER_START;
+            } else if (d->size > d->limit - d->total) {
+                return HTTP_PARSE_TOO_LARGE;
+            } else {
+                d->state = C_DATA;
+            }
+            break;
+        case C_DATA: {
+            size_t n = (size_t)(end - p) < d->size ? (size_t)(end - p) : d->size;
+            if (fn) fn(arg, p, n);
+            else if (body_append(d, req, p, n) < 0) return HTTP_PARSE_ERROR;
+            d->size -= n;
+            d->total += n;
+            p += n;
+            if (d->size == 0) d->state = C_DATA_CR;
+            break;
+        }
+        case C_DATA_CR:
+            if (ch != '\r') return HTTP_PARSE_ERROR;
+            d->state = C_DATA_LF;
+            p++;
+            break;
+        case C_DATA_LF:
+            if (ch != '\n') return HTTP_PARSE_ERROR;
+            d->state = C_SIZE;
+            d->digits = 0;
+            p++;
+            break;
+        case C_TRAILER_START:
+        case C_TRAILER:
+            // Trailer fields are read and dropped.
+            if (++d->trailer > HTTP_MAX_HEAD) return HTTP_PARSE_ERROR;
+            if (d->state == C_TRAILER_START && ch == '\r') d->state = C_END_LF;
+            else d->state = ch == '\r' ? C_TRAILER_LF : C_TRAILER;
+            p++;
+            break;
+        case C_TRAILER_LF:
+            if (ch != '\n') return HTTP_PARSE_ERROR;
+            d->state = C_TRAILER_START;
+            p++;
+            break;
+        case C_END_LF:
+            if (ch != '\n') return HTTP_PARSE_ERROR;
+            d->state = C_DONE;
+            p++;
+            rc = HTTP_PARSE_DONE;
+            break;
+        case C_DONE:
+            rc = HTTP_PARSE_DONE;
+            break;
+        }
+    }
+    *pp = p;
+    return d->state == C_DONE ? HTTP_PARSE_DONE : rc;
+}
+
+int http_chunked_feed(http_chunked_t *d, buffer_t *in, http_request_t *req,
+                      http_body_fn fn, void *arg) {
+    char *start = in->data + req->head_len;
+    const char *p = start;
+    int rc = chunked_run(d, &p, in->data + in->len, req, fn, arg);
+    if (rc < 0) return rc;
+    // Decoded bytes leave the buffer; the head stays in front of whatever
+    // follows the body.
+    size_t used = p - start;
+    memmove(start, p, in->data + in->len - p);
+    in->len -= used;
+    return rc;
+}
+
+int http_chunked_decode(http_chunked_t *d, const char *data, size_t len, size_t *used,
+                        http_body_fn fn, void *arg) {
+    const char *p = data;
+    int rc = chunked_run(d, &p, data + len, NULL, fn, arg);
+    *used = p - data;
+    return rc;
+}
+
+int read_http_body(int fd, buffer_t *in, http_request_t *req, size_t limit,
+                   http_body_fn fn, void *arg, const http_timeouts_t *t) {
+    if (req->chunked) {
+        http_chunked_t d;
+        http_chunked_init(&d, limit);
+        for (;;) {
+            int rc = http_chunked_feed(&d, in, req, fn, arg);
+            if (rc != HTTP_PARSE_AGAIN) return rc == HTTP_PARSE_DONE ? 0 : rc;
+            if (http_reserve(in, req, HTTP_READ_CHUNK) < 0) return -1;
+            ssize_t r = read_wait(fd, in->data + in->len, in->cap - in->len,
+                                  deadline_in(t->body));
+            if (r <= 0) return r == HTTP_TIMEOUT ? HTTP_TIMEOUT : -1;
+            in->len += r;
+        }
+    }
+
+    if (!fn) {
+        size_t received = http_take_body(in, req);
+        if (received == (size_t)-1) return -1;
+        while (received < req->body_len) {
+            ssize_t r = read_wait(fd, req->body + received, req->body_len - received,
+                                  deadline_in(t->body));
+            if (r <= 0) return r == HTTP_TIMEOUT ? HTTP_TIMEOUT : -1;
+            received += r;
+        }
+        return 0;
+    }
+
+    size_t received = http_stream_body(in, req, fn, arg);
+    char chunk[HTTP_BODY_CHUNK];
+    while (received < req->body_len) {
+        size_t want = req->body_len - received;
+        ssize_t r = read_wait(fd, chunk, want < sizeof(chunk) ? want : sizeof(chunk),
+                              deadline_in(t->body));
+        if (r <= 0) return r == HTTP_TIMEOUT ? HTTP_TIMEOUT : -1;
+        fn(arg, chunk, r);
+        received += r;
+    }
+    return 0;
+}
@@ -0,0 +1,81 @@
+#include "iplimit.h"
+#include <pthread.h>
+#include <stdlib.h>
+
+#define SHARDS 64
+#define BUCKETS 256     // per shard
+
+typedef struct entry {
+    uint32_t addr;
+    int count;
+    struct entry *next;
+} entry_t;
+
+// Entries are freed onto the shard's spare list when their count drops to
+// zero, so steady churn from the same clients does not hit malloc.
+typedef struct {
+    pthread_mutex_t lock;
+    entry_t *buckets[BUCKETS];
+    entry_t *spare;
+} shard_t;
+
+static shard_t shards[SHARDS];
+static int limit;
+
+void iplimit_init(int max) {
+    limit = max;
+    for (int i = 0; i < SHARDS; i++) pthread_mutex_init(&shards[i].lock, NULL);
+}
+
+static uint32_t hash(uint32_t addr) {
+    return (addr * 2654435761u) >> 8;
+}
+
+int iplimit_acquire(uint32_t addr) {
+    if (limit <= 0) return 0;
+    uint32_t h = hash(addr);
+    shard_t *s = &shards[h % SHARDS];
+    entry_t **b = &s->buckets[(h / SHARDS) % BUCKETS];
+    int rc = 0;
+    pthread_mutex_lock(&s->lock);
+    entry_t *e = *b;
+    while (e && e->addr != addr) e = e->next;
+    if (!e) {
+        if ((e = s->spare)) s->spare = e->next;
+        else e = malloc(sizeof(*e));
+        if (e) {
+            e->addr = addr;
+            e->count = 0;
+            e->next = *b;
+            *b = e;
+        }
+    }
+    // Out of memory: let the connection through uncounted.
+    if (e && e->count >= limit) {
+        rc = -1;
+    } else if (e) {
+        e->count++;
+        rc = 1;
+    }
+    pthread_mutex_unlock(&s->lock);
+    return rc;
+}
+
+void iplimit_release(uint32_t addr) {
+    uint32_t h = hash(addr);
+    shard_t *s = &shards[h % SHARDS];
+    entry_t **b = &s->buckets[(h / SHARDS) % BUCKETS];
+
+    pthread_mutex_lock(&s->lock);
+    for (entry_t **p = b; *p; p = &(*p)->next) {
+        entry_t *e = *p;
+        if (e->addr != addr) continue;
+        if (--e->count == 0) {
+            *p = e->next;
+            e->next = s->spare;
+            s->spare = e;
+        }
+        break;
+    }
+    pthread_mutex_unlock(&s->lock);
+}
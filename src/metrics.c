@@ -0,0 +1,299 @@
+#define _GNU_SOURCE
+
+#include "metrics.h"
+#include "arena.h"
+#include "fdcache.h"
+#include "router.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define CACHE_LINE 64
+#define NMETHODS 8          // ROUTE_* bits, then unknown methods
+#define NSTATUS 600
+
+// Log-linear buckets: values below 16 ns have one each, then every power
+// of two up to 2^36 ns is split into 16.
+#define SUB_BITS 4
+#define SUB_COUNT (1 << SUB_BITS)
+#define MAX_EXP 36
+#define NBUCKETS (SUB_COUNT + (MAX_EXP - SUB_BITS) * SUB_COUNT)
+
+typedef _Atomic unsigned long counter_t;
+
+typedef struct {
+    counter_t sum_ns;
+    counter_t buckets[NBUCKETS];
+} histogram_t;
+
+typedef struct block {
+    counter_t counters[METRIC_NCOUNTERS];
+    counter_t methods[NMETHODS];
+    counter_t status[NSTATUS];
+    histogram_t phases[PHASE_COUNT];
+    struct block *next;
+} block_t;
+
+static pthread_mutex_t blocks_lock = PTHREAD_MUTEX_INITIALIZER;
+static block_t *all_blocks;
+static _Thread_local block_t *mine;
+
+static block_t *my_block(void) {
+    if (mine) return mine;
+    size_t size = (sizeof(block_t) + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+    block_t *b = aligned_alloc(CACHE_LINE, size);
+    if (!b) return NULL;
+    memset(b, 0, size);
+    pthread_mutex_lock(&blocks_lock);
+    b->next = all_blocks;
+    all_blocks = b;
+    pthread_mutex_unlock(&blocks_lock);
+    return mine = b;
+}
+
+// Only the owning thread writes a counter, so load + store is enough.
+static void bump(counter_t *c, unsigned long n) {
+    atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + n,
+                          memory_order_relaxed);
+}
+
+static unsigned long get(const counter_t *c) {
+    return atomic_load_explicit((counter_t *)c, memory_order_relaxed);
+}
+
+void metrics_add(int counter, unsigned long n) {
+    block_t *b = my_block();
+    if (b) bump(&b->counters[counter], n);
+}
+
+void metrics_request(unsigned method) {
+    block_t *b = my_block();
+    if (b) bump(&b->methods[method ? __builtin_ctz(method) : NMETHODS - 1], 1);
+}
+
+void metrics_response(int status) {
+    block_t *b = my_block();
+    if (b && status >= 0 && status < NSTATUS) bump(&b->status[status], 1);
+}
+
+uint64_t metrics_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int bucket_of(uint64_t ns) {
+    if (ns < SUB_COUNT) return (int)ns;
+    int exp = 63 - __builtin_clzll(ns);
+    if (exp >= MAX_EXP) return NBUCKETS - 1;
+    int sub = (int)(ns >> (exp - SUB_BITS)) - SUB_COUNT;
+    return SUB_COUNT + (exp - SUB_BITS) * SUB_COUNT + sub;
+}
+
+// First value past bucket i.
+static uint64_t bucket_end(int i) {
+    if (i < SUB_COUNT) return (uint64_t)i + 1;
+    int exp = SUB_BITS + (i - SUB_COUNT) / SUB_COUNT;
+    uint64_t sub = (i - SUB_COUNT) % SUB_COUNT;
+    return (SUB_COUNT + sub + 1) << (exp - SUB_BITS);
+}
+
+void metrics_observe(int phase, uint64_t ns) {
+    block_t *b = my_block();
+    if (!b) return;
+    histogram_t *h = &b->phases[phase];
+    bump(&h->sum_ns, ns);
+    bump(&h->buckets[bucket_of(ns)], 1);
+}
+
+// ---- exposition ----
+
+typedef struct {
+    unsigned long counters[METRIC_NCOUNTERS];
+    unsigned long methods[NMETHODS];
+    unsigned long status[NSTATUS];
+    struct {
+        unsigned long sum_ns;
+        unsigned long buckets[NBUCKETS];
+    } phases[PHASE_COUNT];
+} totals_t;
+
+static const char *const phase_names[PHASE_COUNT] = { "parse", "handle", "write" };
+
+// Histogram bounds, in nanoseconds, reported to Prometheus.
+static const struct {
+    const char *le;
+    uint64_t ns;
+} bounds[] = {
+    { "1e-05", 10000 }, { "2.5e-05", 25000 }, { "5e-05", 50000 },
+    { "0.0001", 100000 }, { "0.00025", 250000 }, { "0.0005", 500000 },
+    { "0.001", 1000000 }, { "0.0025", 2500000 }, { "0.005", 5000000 },
+    { "0.01", 10000000 }, { "0.025", 25000000 }, { "0.05", 50000000 },
+    { "0.1", 100000000 }, { "0.25", 250000000 }, { "0.5", 500000000 },
+    { "1", 1000000000 }, { "2.5", 2500000000 }, { "5", 5000000000 },
+    { "10", 10000000000 },
+};
+
+static const struct {
+    const char *label;
+    double q;
+} quantiles[] = { { "0.5", 0.5 }, { "0.9", 0.9 }, { "0.99", 0.99 }, { "0.999", 0.999 } };
+
+static void collect(totals_t *t) {
+    memset(t, 0, sizeof(*t));
+    pthread_mutex_lock(&blocks_lock);
+    for (const block_t *b = all_blocks; b; b = b->next) {
+        for (int i = 0; i < METRIC_NCOUNTERS; i++) t->counters[i] += get(&b->counters[i]);
+        for (int i = 0; i < NMETHODS; i++) t->methods[i] += get(&b->methods[i]);
+        for (int i = 0; i < NSTATUS; i++) t->status[i] += get(&b->status[i]);
+        for (int p = 0; p < PHASE_COUNT; p++) {
+            const histogram_t *h = &b->phases[p];
+            t->phases[p].sum_ns += get(&h->sum_ns);
+            for (int i = 0; i < NBUCKETS; i++)
+                t->phases[p].buckets[i] += get(&h->buckets[i]);
+        }
+    }
+    pthread_mutex_unlock(&blocks_lock);
+}
+
+static void family(buffer_t *out, const char *name, const char *type, const char *help) {
+    buf_appendf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+// The count is the sum of the buckets, so the two always agree.
+static void render_phase(buffer_t *out, const char *phase, const unsigned long *buckets,
+                         unsigned long sum_ns) {
+    unsigned long total = 0;
+    for (int i = 0; i < NBUCKETS; i++) total += buckets[i];
+
+    unsigned long cum = 0;
+    int i = 0;
+    for (size_t k = 0; k < sizeof(bounds) / sizeof(bounds[0]); k++) {
+        // Buckets lying wholly at or below the bound.
+        for (; i < NBUCKETS && bucket_end(i) <= bounds[k].ns + 1; i++) cum += buckets[i];
+        buf_appendf(out, "httpd_phase_duration_seconds_bucket{phase=\"%s\",le=\"%s\"} %lu\n",
+                    phase, bounds[k].le, cum);
+    }
+    buf_appendf(out, "httpd_phase_duration_seconds_bucket{phase=\"%s\",le=\"+Inf\"} %lu\n",
+                phase, total);
+    buf_appendf(out, "httpd_phase_duration_seconds_sum{phase=\"%s\"} %.9f\n", phase, sum_ns / 1e9);
+    buf_appendf(out, "httpd_phase_duration_seconds_count{phase=\"%s\"} %lu\n", phase, total);
+}
+
+static void render_quantiles(buffer_t *out, const char *phase, const unsigned long *buckets) {
+    unsigned long total = 0;
+    for (int i = 0; i < NBUCKETS; i++) total += buckets[i];
+    if (total == 0) return;
+    for (size_t k = 0; k < sizeof(quantiles) / sizeof(quantiles[0]); k++) {
+        unsigned long rank = (unsigned long)(quantiles[k].q * total);
+        if (rank == 0) rank = 1;
+        unsigned long cum = 0;
+        int i = 0;
+        while (i < NBUCKETS - 1 && (cum += buckets[i]) < rank) i++;
+        // The highest value the bucket can hold.
+        buf_appendf(out, "httpd_phase_duration_quantile_seconds{phase=\"%s\",quantile=\"%s\"} %.9f\n",
+                    phase, quantiles[k].label, (bucket_end(i) - 1) / 1e9);
+    }
+}
+
+int metrics_render(buffer_t *out, const metrics_gauges_t *g) {
+    totals_t *t = malloc(sizeof(*t));
+    if (!t) return -1;
+    collect(t);
+
+    family(out, "httpd_requests_total", "counter", "Requests received, by method.");
+    for (int i = 0; i < NMETHODS; i++) {
+        char name[16] = "other";
+        if (i < NMETHODS - 1) route_allow(1u << i, name, sizeof(name));
+        buf_appendf(out, "httpd_requests_total{method=\"%s\"} %lu\n", name, t->methods[i]);
+    }
+    family(out, "httpd_responses_total", "counter", "Responses sent, by status code.");
+    for (int i = 0; i < NSTATUS; i++) {
+        if (t->status[i]) buf_appendf(out, "httpd_responses_total{code=\"%d\"} %lu\n", i, t->status[i]);
+    }
+
+    family(out, "httpd_received_bytes_total", "counter", "Bytes read from clients.");
+    buf_appendf(out, "httpd_received_bytes_total %lu\n", t->counters[METRIC_BYTES_IN]);
+    family(out, "httpd_sent_bytes_total", "counter", "Bytes written to clients.");
+    buf_appendf(out, "httpd_sent_bytes_total %lu\n", t->counters[METRIC_BYTES_OUT]);
+
+    unsigned long opened = t->counters[METRIC_CONNS_OPENED];
+    unsigned long closed = t->counters[METRIC_CONNS_CLOSED];
+    family(out, "httpd_connections_total", "counter", "Connections accepted.");
+    buf_appendf(out, "httpd_connections_total %lu\n", opened);
+    family(out, "httpd_connections_active", "gauge", "Connections open now.");
+    buf_appendf(out, "httpd_connections_active %lu\n", opened > closed ? opened - closed : 0);
+    if (g->threadpool_queued >= 0) {
+        family(out, "httpd_threadpool_queued", "gauge", "Connections waiting for a worker.");
+        buf_appendf(out, "httpd_threadpool_queued %ld\n", g->threadpool_queued);
+    }
+
+    family(out, "httpd_file_cache_lookups_total", "counter", "In-memory file cache lookups.");
+    buf_appendf(out, "httpd_file_cache_lookups_total{result=\"hit\"} %lu\n",
+                t->counters[METRIC_CACHE_HITS]);
+    buf_appendf(out, "httpd_file_cache_lookups_total{result=\"miss\"} %lu\n",
+                t->counters[METRIC_CACHE_MISSES]);
+    fdcache_stats_t fs;
+    fdcache_stats(&fs);
+    family(out, "httpd_fd_cache_lookups_total", "counter", "Open descriptor cache lookups.");
+    buf_appendf(out, "httpd_fd_cache_lookups_total{result=\"hit\"} %lu\n", fs.hits);
+    buf_appendf(out, "httpd_fd_cache_lookups_total{result=\"miss\"} %lu\n", fs.misses);
+
+    family(out, "httpd_access_log_dropped_total", "counter",
+           "Access log lines dropped because the writer fell behind.");
+    buf_appendf(out, "httpd_access_log_dropped_total %lu\n", t->counters[METRIC_LOG_DROPPED]);
+
+    family(out, "httpd_tls_handshakes_total", "counter", "TLS handshakes, by outcome.");
+    buf_appendf(out,
+                "httpd_tls_handshakes_total{result=\"full\"} %lu\n"
+                "httpd_tls_handshakes_total{result=\"resumed\"} %lu\n"
+                "httpd_tls_handshakes_total{result=\"failed\"} %lu\n",
+                t->counters[METRIC_TLS_FULL], t->counters[METRIC_TLS_RESUMED],
+                t->counters[METRIC_TLS_FAILED]);
+    family(out, "httpd_tls_ktls_total", "counter",
+           "TLS connections whose records the kernel encrypts (kTLS).");
+    buf_appendf(out, "httpd_tls_ktls_total %lu\n", t->counters[METRIC_TLS_KTLS]);
+
+    family(out, "httpd_http2_connections_total", "counter", "Connections served as HTTP/2.");
+    buf_appendf(out, "httpd_http2_connections_total %lu\n", t->counters[METRIC_H2_CONNS]);
+    family(out, "httpd_http2_streams_total", "counter", "Streams opened on HTTP/2 connections.");
+    buf_appendf(out, "httpd_http2_streams_total %lu\n", t->counters[METRIC_H2_STREAMS]);
+
+    family(out, "httpd_upstream_connections_total", "counter",
+           "Proxy connections to upstreams, opened or reused from the pool.");
+    buf_appendf(out,
+                "httpd_upstream_connections_total{result=\"new\"} %lu\n"
+                "httpd_upstream_connections_total{result=\"reused\"} %lu\n",
+                t->counters[METRIC_UPSTREAM_NEW], t->counters[METRIC_UPSTREAM_REUSED]);
+    family(out, "httpd_upstream_failures_total", "counter",
+           "Proxy connections to upstreams that failed before a response.");
+    buf_appendf(out, "httpd_upstream_failures_total %lu\n", t->counters[METRIC_UPSTREAM_FAILED]);
+
+    alloc_stats_t as;
+    alloc_stats(&as);
+    family(out, "httpd_allocations_total", "counter",
+           "Heap allocations behind request handling, by kind and source.");
+    buf_appendf(out,
+                "httpd_allocations_total{kind=\"arena\",source=\"malloc\"} %lu\n"
+                "httpd_allocations_total{kind=\"arena\",source=\"pool\"} %lu\n"
+                "httpd_allocations_total{kind=\"buffer\",source=\"malloc\"} %lu\n"
+                "httpd_allocations_total{kind=\"buffer\",source=\"pool\"} %lu\n"
+                "httpd_allocations_total{kind=\"conn\",source=\"malloc\"} %lu\n"
+                "httpd_allocations_total{kind=\"conn\",source=\"pool\"} %lu\n",
+                as.arena_mallocs, as.arena_reuses, as.buffer_mallocs,
+                as.buffer_reuses, as.conn_mallocs, as.conn_reuses);
+
+    family(out, "httpd_phase_duration_seconds", "histogram",
+           "Time spent per request in each processing phase.");
+    for (int p = 0; p < PHASE_COUNT; p++)
+        render_phase(out, phase_names[p], t->phases[p].buckets, t->phases[p].sum_ns);
+    family(out, "httpd_phase_duration_quantile_seconds", "gauge",
+           "Phase duration quantiles from the full-resolution histograms.");
+    for (int p = 0; p < PHASE_COUNT; p++)
+        render_quantiles(out, phase_names[p], t->phases[p].buckets);
+
+    free(t);
+    return 0;
+}
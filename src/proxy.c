@@ -0,0 +1,1016 @@
+#define _GNU_SOURCE
+
+#include "proxy.h"
+#include "metrics.h"
+#include "reactor.h"
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+
+#define PROXY_MAX_HEAD HTTP_MAX_HEAD    // upstream response head
+#define PROXY_READ_CHUNK 16384
+#define PROXY_MAX_BATCH 65536   // response data gathered per produce() call
+#define PROXY_SPLICE 65536      // response data moved through the pipe at a time
+#define PROXY_BODY_MAX (256 << 10)  // request body held for a slow upstream
+#define PROXY_VNODES 160        // ring points per upstream
+#define PROXY_IDLE_SECS 60      // pooled connections unused longer are closed
+#define PROXY_CONN_FIELDS 8     // Connection fields looked at per message
+
+typedef struct {
+    int fd;
+    time_t since;
+} idle_conn_t;
+
+typedef struct {
+    struct sockaddr_in addr;
+    char name[INET_ADDRSTRLEN + 6];     // "address:port"
+    int active;             // requests in flight on it
+    int fails;              // failed connections in a row
+    time_t down_until;      // left out until then
+    idle_conn_t *idle;      // pooled connections, the most recent last
+    int nidle;
+} upstream_t;
+
+typedef struct {
+    uint32_t hash;
+    int upstream;
+} ring_point_t;
+
+struct proxy_group {
+    int hash;               // consistent hashing, else least connections
+    int n;
+    upstream_t ups[PROXY_UPSTREAMS];
+    ring_point_t *ring;     // n * PROXY_VNODES points, by hash
+    unsigned next;          // least connections: where ties start
+    pthread_mutex_t lock;   // the upstreams' counts, health and pools
+};
+
+struct proxy_body {
+    buffer_t buf;           // copied in; from off on not sent yet
+    size_t off;
+    int pipe[2];            // spliced in: piped bytes wait in pipe[0]
+    size_t piped;
+    int full;               // the pipe took no more
+    int chunked;            // frame what is fed as chunks
+    int ended;              // proxy_body_end() was called
+    int complete;
+    int broken;             // data was lost (allocation failure)
+    int discard;            // the upstream is done with the body
+    size_t sent;            // bytes that went upstream
+};
+
+enum { RESP_HEAD, RESP_BODY, RESP_DONE };
+// How the upstream's response body ends.
+enum { BODY_NONE, BODY_LENGTH, BODY_CHUNKED, BODY_CLOSE };
+// Steps of proxy_produce(), next to the RESPONSE_* values: the connection
+// failed before a response, try (another) upstream, or none is left.
+enum { STEP_FAILED = 3, STEP_RETRY, STEP_NONE };
+
+typedef struct proxy {
+    int refs;               // the response, and the body sink while it is fed
+    proxy_group_t *group;
+    upstream_t *up;         // the upstream tried now, or NULL
+    int fd;                 // the connection to it, or -1
+    int reused;             // taken from the pool
+    int connecting;
+    int fresh;              // a pooled connection failed: open a new one
+    unsigned tried;         // upstreams that failed this request
+    int failure;            // 502, or 504 if the last of them timed out
+    uint32_t key;           // ring hash of the request URI
+    int idempotent;         // may be sent again after a failure
+    // The request: head, then the body if it was read in full.
+    buffer_t out;
+    size_t out_off;
+    int sent_any;           // some of it went out on this connection
+    int request_done;
+    proxy_body_t *body;     // &sink when the body is streamed, else NULL
+    proxy_body_t sink;
+    // The response.
+    int state;              // RESP_*
+    int got_any;            // some of it arrived
+    buffer_t head;
+    int is_head;
+    int http11;             // the client speaks HTTP/1.1
+    int framing;            // BODY_*
+    size_t left;            // BODY_LENGTH
+    http_chunked_t chunked;
+    int reusable;           // the upstream keeps the connection open
+    int pipe[2];            // upstream -> client, for splice()
+    // Watchdog list, under watch_lock, which fd changes take as well.
+    _Atomic time_t deadline;
+    _Atomic int timed_out;
+    struct proxy *prev, *next;
+} proxy_t;
+
+static const server_config_t *config;
+static proxy_group_t groups[PROXY_MOUNTS];
+static int ngroups;
+
+static pthread_mutex_t watch_lock = PTHREAD_MUTEX_INITIALIZER;
+static proxy_t *watched;
+
+static time_t now_coarse(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+// FNV-1a with a final avalanche, so that similar keys land far apart on
+// the ring.
+static uint32_t hash_bytes(const void *data, size_t len) {
+    const unsigned char *p = data;
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) h = (h ^ p[i]) * 16777619u;
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+// ---- upstreams ----
+
+static int point_cmp(const void *a, const void *b) {
+    uint32_t x = ((const ring_point_t *)a)->hash;
+    uint32_t y = ((const ring_point_t *)b)->hash;
+    return x < y ? -1 : x > y;
+}
+
+static int group_init(proxy_group_t *g, const proxy_mount_t *m) {
+    g->hash = m->hash;
+    g->n = m->nupstreams;
+    g->next = 0;
+    pthread_mutex_init(&g->lock, NULL);
+    for (int i = 0; i < g->n; i++) {
+        upstream_t *u = &g->ups[i];
+        memset(u, 0, sizeof(*u));
+        u->addr.sin_family = AF_INET;
+        u->addr.sin_port = htons(m->upstreams[i].port);
+        u->addr.sin_addr.s_addr = m->upstreams[i].addr;
+        char ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &u->addr.sin_addr, ip, sizeof(ip));
+        snprintf(u->name, sizeof(u->name), "%s:%d", ip, m->upstreams[i].port);
+        if (config->proxy_keepalive &&
+            !(u->idle = calloc(config->proxy_keepalive, sizeof(*u->idle))))
+            return -1;
+    }
+    if (!g->hash) return 0;
+
+    // Each upstream owns the arcs before its points.
+    int npoints = g->n * PROXY_VNODES;
+    if (!(g->ring = malloc(npoints * sizeof(*g->ring)))) return -1;
+    for (int i = 0; i < g->n; i++) {
+        for (int v = 0; v < PROXY_VNODES; v++) {
+            char key[sizeof(g->ups[i].name) + 8];
+            int len = snprintf(key, sizeof(key), "%s-%d", g->ups[i].name, v);
+            g->ring[i * PROXY_VNODES + v] = (ring_point_t){ hash_bytes(key, len), i };
+        }
+    }
+    qsort(g->ring, npoints, sizeof(*g->ring), point_cmp);
+    return 0;
+}
+
+static int usable(const proxy_group_t *g, const proxy_t *p, int i, time_t now) {
+    return !(p->tried & 1u << i) && g->ups[i].down_until <= now;
+}
+
+// The upstream for p among those it has not tried and that are not out.
+// Under g->lock.
+static upstream_t *pick(proxy_group_t *g, const proxy_t *p) {
+    time_t now = now_coarse();
+    if (g->hash) {
+        // The first point at or after the key, then on round the ring.
+        int npoints = g->n * PROXY_VNODES;
+        int lo = 0, hi = npoints;
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (g->ring[mid].hash < p->key) lo = mid + 1;
+            else hi = mid;
+        }
+        for (int i = 0; i < npoints; i++) {
+            int u = g->ring[(lo + i) % npoints].upstream;
+            if (usable(g, p, u, now)) return &g->ups[u];
+        }
+        return NULL;
+    }
+    int best = -1;
+    for (int i = 0; i < g->n; i++) {
+        int u = (g->next + i) % g->n;
+        if (usable(g, p, u, now) && (best < 0 || g->ups[u].active < g->ups[best].active))
+            best = u;
+    }
+    if (best < 0) return NULL;
+    g->next = (best + 1) % g->n;
+    return &g->ups[best];
+}
+
+// A pooled connection to u that still looks open, or -1. Under its
+// group's lock.
+static int pool_take(upstream_t *u) {
+    while (u->nidle > 0) {
+        int fd = u->idle[--u->nidle].fd;
+        // The upstream may have closed it while it sat idle.
+        char c;
+        if (recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0 &&
+            (errno == EAGAIN || errno == EWOULDBLOCK))
+            return fd;
+        close(fd);
+    }
+    return -1;
+}
+
+static void pool_put(proxy_group_t *g, upstream_t *u, int fd) {
+    pthread_mutex_lock(&g->lock);
+    if (u->nidle < config->proxy_keepalive) {
+        u->idle[u->nidle++] = (idle_conn_t){ fd, now_coarse() };
+        fd = -1;
+    }
+    pthread_mutex_unlock(&g->lock);
+    if (fd >= 0) close(fd);
+}
+
+// Under g->lock.
+static void pool_sweep(upstream_t *u, time_t now) {
+    int keep = 0;
+    for (int i = 0; i < u->nidle; i++) {
+        if (now - u->idle[i].since > PROXY_IDLE_SECS) close(u->idle[i].fd);
+        else u->idle[keep++] = u->idle[i];
+    }
+    u->nidle = keep;
+}
+
+// Done with the upstream tried now: outcome > 0 after a response, < 0 for
+// a failure that counts against its health.
+static void leave(proxy_t *p, int outcome) {
+    upstream_t *u = p->up;
+    if (!u) return;
+    proxy_group_t *g = p->group;
+    time_t now = now_coarse();
+    pthread_mutex_lock(&g->lock);
+    u->active--;
+    if (outcome > 0) {
+        u->fails = 0;
+    } else if (outcome < 0 && ++u->fails >= config->proxy_max_fails &&
+               u->down_until <= now && config->proxy_fail_timeout > 0) {
+        u->down_until = now + config->proxy_fail_timeout;
+        fprintf(stderr, "proxy: upstream %s failed %d times, out for %ds\n",
+                u->name, u->fails, config->proxy_fail_timeout);
+    }
+    pthread_mutex_unlock(&g->lock);
+    p->up = NULL;
+}
+
+// ---- timeouts ----
+
+static void touch(proxy_t *p) {
+    p->deadline = now_coarse() + config->proxy_timeout;
+}
+
+static void watch(proxy_t *p) {
+    touch(p);
+    pthread_mutex_lock(&watch_lock);
+    p->prev = NULL;
+    p->next = watched;
+    if (watched) watched->prev = p;
+    watched = p;
+    pthread_mutex_unlock(&watch_lock);
+}
+
+static void unwatch(proxy_t *p) {
+    pthread_mutex_lock(&watch_lock);
+    if (p->prev) p->prev->next = p->next; else watched = p->next;
+    if (p->next) p->next->prev = p->prev;
+    pthread_mutex_unlock(&watch_lock);
+}
+
+static void attach_fd(proxy_t *p, int fd) {
+    pthread_mutex_lock(&watch_lock);
+    p->fd = fd;
+    p->timed_out = 0;
+    touch(p);
+    pthread_mutex_unlock(&watch_lock);
+}
+
+// Take p's connection out of the watchdog's reach before it is closed or
+// pooled, so a descriptor number that is reused is never shut down.
+static int detach_fd(proxy_t *p) {
+    pthread_mutex_lock(&watch_lock);
+    int fd = p->fd;
+    p->fd = -1;
+    pthread_mutex_unlock(&watch_lock);
+    return fd;
+}
+
+// Shuts down upstream connections that stalled past proxy_timeout, which
+// wakes their requests with an error, and closes long-idle pooled ones.
+static void *watchdog(void *arg) {
+    (void)arg;
+    for (;;) {
+        sleep(1);
+        time_t now = now_coarse();
+        pthread_mutex_lock(&watch_lock);
+        for (proxy_t *p = watched; p; p = p->next) {
+            if (p->fd < 0 || p->timed_out || now < p->deadline) continue;
+            p->timed_out = 1;
+            shutdown(p->fd, SHUT_RDWR);
+        }
+        pthread_mutex_unlock(&watch_lock);
+
+        for (int i = 0; i < ngroups; i++) {
+            pthread_mutex_lock(&groups[i].lock);
+            for (int j = 0; j < groups[i].n; j++) pool_sweep(&groups[i].ups[j], now);
+            pthread_mutex_unlock(&groups[i].lock);
+        }
+    }
+    return NULL;
+}
+
+int proxy_init(const server_config_t *cfg) {
+    config = cfg;
+    for (ngroups = 0; ngroups < cfg->nproxies; ngroups++) {
+        if (group_init(&groups[ngroups], &cfg->proxies[ngroups]) < 0) return -1;
+        fprintf(stderr, "proxy %s/: %d upstreams, %s\n", cfg->proxies[ngroups].prefix,
+                groups[ngroups].n, groups[ngroups].hash ? "hash" : "least_conn");
+    }
+    if (ngroups == 0) return 0;
+    pthread_t t;
+    if (pthread_create(&t, NULL, watchdog, NULL) != 0) return -1;
+    pthread_detach(t);
+    return 0;
+}
+
+proxy_group_t *proxy_group(int i) {
+    return &groups[i];
+}
+
+// ---- headers ----
+
+// Fields that only concern one hop, never forwarded.
+static const char *const hop_by_hop[] = {
+    "Connection", "Keep-Alive", "Proxy-Connection", "TE", "Trailer",
+    "Transfer-Encoding", "Upgrade",
+};
+
+// Whether the comma-separated list holds token, in any case.
+static int token_listed(const char *list, const char *token) {
+    size_t n = strlen(token);
+    const char *t = list;
+    while (*t) {
+        while (*t == ' ' || *t == '\t' || *t == ',') t++;
+        const char *end = t;
+        while (*end && *end != ',') end++;
+        const char *e = end;
+        while (e > t && (e[-1] == ' ' || e[-1] == '\t')) e--;
+        if ((size_t)(e - t) == n && strncasecmp(t, token, n) == 0) return 1;
+        t = end;
+    }
+    return 0;
+}
+
+// The standard hop-by-hop fields and those the Connection fields name.
+static int hop_field(const char *name, const char *const *conn, int nconn) {
+    for (size_t i = 0; i < sizeof(hop_by_hop) / sizeof(hop_by_hop[0]); i++)
+        if (strcasecmp(name, hop_by_hop[i]) == 0) return 1;
+    for (int i = 0; i < nconn; i++)
+        if (token_listed(conn[i], name)) return 1;
+    return 0;
+}
+
+// Whether the last coding of a Transfer-Encoding list is chunked.
+static int ends_chunked(const char *list) {
+    const char *comma = strrchr(list, ',');
+    return token_listed(comma ? comma + 1 : list, "chunked");
+}
+
+// ---- response ----
+
+static int gateway_error(response_t *res, proxy_t *p, int status) {
+    response_error(res, status);
+    p->state = RESP_DONE;
+    p->sink.discard = 1;
+    return RESPONSE_DONE;
+}
+
+// Turn the upstream's response head in block[0..len) (a lone status line
+// and fields) into ours. Framing and hop-by-hop fields are ours to choose.
+// Returns 0, 1 for an interim (1xx) response to skip, or -1 if malformed.
+static int emit_head(response_t *res, proxy_t *p, char *block, size_t len) {
+    struct {
+        char *name, *value;
+    } fields[MAX_HEADERS];
+    int nfields = 0;
+    char *status_line = NULL;
+
+    char *line = block;
+    char *end = block + len;
+    while (line < end) {
+        char *nl = memchr(line, '\n', end - line);
+        char *eol = nl ? nl : end;
+        char *next = nl ? nl + 1 : end;
+        if (eol > line && eol[-1] == '\r') eol--;
+        *eol = '\0';
+        if (!status_line) {
+            status_line = line;
+            line = next;
+            continue;
+        }
+        char *colon = strchr(line, ':');
+        if (!colon || colon == line || nfields == MAX_HEADERS) return -1;
+        for (char *c = line; c < colon; c++)
+            if (*c == ' ' || *c == '\t') return -1;  // also rules out folded lines
+        *colon = '\0';
+        char *value = colon + 1;
+        while (*value == ' ' || *value == '\t') value++;
+        char *vend = value + strlen(value);
+        while (vend > value && (vend[-1] == ' ' || vend[-1] == '\t')) *--vend = '\0';
+        fields[nfields].name = line;
+        fields[nfields].value = value;
+        nfields++;
+        line = next;
+    }
+
+    // "HTTP/1.x 200 OK"
+    char *s = status_line;
+    if (!s || strncmp(s, "HTTP/1.", 7) != 0 || !isdigit((unsigned char)s[7]) || s[8] != ' ' ||
+        !isdigit((unsigned char)s[9]) || !isdigit((unsigned char)s[10]) ||
+        !isdigit((unsigned char)s[11]) || (s[12] != ' ' && s[12] != '\0'))
+        return -1;
+    int minor = s[7] - '0';
+    int status = (s[9] - '0') * 100 + (s[10] - '0') * 10 + (s[11] - '0');
+    const char *reason = s[12] ? s + 13 : "";
+    if (status < 100) return -1;
+    if (status < 200) return status == 101 ? -1 : 1;   // Upgrade is never forwarded
+
+    const char *conn[PROXY_CONN_FIELDS];
+    int nconn = 0;
+    int closing = 0, keep_alive = 0, date = 0;
+    const char *te = NULL;
+    long long length = -1;
+    for (int i = 0; i < nfields; i++) {
+        const char *name = fields[i].name, *value = fields[i].value;
+        if (strcasecmp(name, "Connection") == 0) {
+            if (nconn < PROXY_CONN_FIELDS) conn[nconn++] = value;
+            closing |= token_listed(value, "close");
+            keep_alive |= token_listed(value, "keep-alive");
+        } else if (strcasecmp(name, "Transfer-Encoding") == 0) {
+            te = value;
+        } else if (strcasecmp(name, "Content-Length") == 0) {
+            char *rest;
+            if (!isdigit((unsigned char)*value)) return -1;
+            errno = 0;
+            long long n = strtoll(value, &rest, 10);
+            if (errno || *rest || (length >= 0 && n != length)) return -1;
+            length = n;
+        } else if (strcasecmp(name, "Date") == 0) {
+            date = 1;
+        }
+    }
+
+    p->reusable = minor >= 1 ? !closing : keep_alive && !closing;
+    if (p->is_head || status == 204 || status == 304) {
+        p->framing = BODY_NONE;
+    } else if (te) {
+        p->framing = ends_chunked(te) ? BODY_CHUNKED : BODY_CLOSE;
+    } else if (length >= 0) {
+        p->framing = BODY_LENGTH;
+        p->left = (size_t)length;
+    } else {
+        p->framing = BODY_CLOSE;
+    }
+    if (p->framing == BODY_CLOSE) p->reusable = 0;
+    int counted = p->framing == BODY_NONE || p->framing == BODY_LENGTH;
+
+    // Clients other than HTTP/1.1 ones have their connection closed
+    // (HTTP/1.0) or framing of their own (HTTP/2) instead.
+    res->chunked = !counted && p->http11;
+    // The upstream chose its own reason phrase, so no prebuilt line.
+    response_printf(res, "HTTP/1.1 %d %s\r\n", status, reason);
+    res->status = status;
+    // Time spent waiting on the upstream is not write time.
+    res->ready_at = metrics_clock();
+    if (!date) response_date(res);
+    for (int i = 0; i < nfields; i++) {
+        if (hop_field(fields[i].name, conn, nconn) ||
+            (!counted && strcasecmp(fields[i].name, "Content-Length") == 0))
+            continue;
+        response_header(res, fields[i].name, fields[i].value);
+    }
+    if (res->chunked) response_header(res, "Transfer-Encoding", "chunked");
+    response_end_headers(res);
+    if (p->framing == BODY_NONE || (p->framing == BODY_LENGTH && p->left == 0))
+        p->state = RESP_DONE;
+    else
+        p->state = RESP_BODY;
+    return 0;
+}
+
+static void relay_chunk(void *arg, const char *data, size_t len) {
+    response_chunk(arg, data, len);
+}
+
+// Response body bytes. Anything past the end of the body means the
+// connection is not in a state to be used again.
+static int body_input(response_t *res, proxy_t *p, const char *data, size_t n) {
+    switch (p->framing) {
+    case BODY_LENGTH: {
+        size_t take = n < p->left ? n : p->left;
+        if (response_append(res, data, take) < 0) return -1;
+        p->left -= take;
+        if (take < n) p->reusable = 0;
+        if (p->left == 0) p->state = RESP_DONE;
+        return 0;
+    }
+    case BODY_CHUNKED: {
+        size_t used;
+        int rc = http_chunked_decode(&p->chunked, data, n, &used, relay_chunk, res);
+        if (rc == HTTP_PARSE_AGAIN) return 0;
+        if (rc != HTTP_PARSE_DONE) return -1;
+        if (used < n) p->reusable = 0;
+        response_chunk_end(res);
+        p->state = RESP_DONE;
+        return 0;
+    }
+    case BODY_CLOSE:
+        return response_chunk(res, data, n);
+    default:
+        p->reusable = 0;
+        return 0;
+    }
+}
+
+// Bytes of the response head; the body may follow in the same read.
+static int head_input(response_t *res, proxy_t *p, const char *data, size_t n) {
+    size_t scan = p->head.len > 2 ? p->head.len - 2 : 0;
+    if (buf_append(&p->head, data, n) < 0) return -1;
+    for (;;) {
+        char *h = p->head.data;
+        size_t i, j = 0;
+        for (i = scan; i < p->head.len; i++) {
+            if (h[i] != '\n') continue;
+            j = i + 1;
+            if (j < p->head.len && h[j] == '\r') j++;
+            if (j < p->head.len && h[j] == '\n') break;
+        }
+        if (i >= p->head.len) return p->head.len > PROXY_MAX_HEAD ? -1 : 0;
+
+        // The head ends at i; what follows the blank line is body.
+        int rc = emit_head(res, p, h, i);
+        if (rc < 0) return -1;
+        if (rc > 0) {
+            buf_consume(&p->head, j + 1);
+            scan = 0;
+            continue;
+        }
+        // An answer before the whole request went out ends the request.
+        if (!p->request_done) {
+            p->reusable = 0;
+            p->sink.discard = 1;
+        }
+        rc = 0;
+        if (j + 1 < p->head.len) {
+            if (p->state == RESP_DONE) p->reusable = 0;
+            else rc = body_input(res, p, h + j + 1, p->head.len - j - 1);
+        }
+        buf_free(&p->head);
+        return rc;
+    }
+}
+
+// A Content-Length body to a plain socket goes upstream -> pipe -> client
+// without passing through user space, a pipe's worth at a time: produce()
+// is called again once the writer has drained it.
+static int splice_body(response_t *res, proxy_t *p) {
+    size_t want = p->left < PROXY_SPLICE ? p->left : PROXY_SPLICE;
+    for (;;) {
+        ssize_t r = splice(p->fd, NULL, p->pipe[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+            return res->nparts > 0 ? RESPONSE_MORE : RESPONSE_WAIT;
+        }
+        if (r == 0) return -1;  // closed short of the length it announced
+        touch(p);
+        res->file_fd = p->pipe[0];
+        if (response_add_pipe(res, r) < 0) return -1;
+        p->left -= r;
+        if (p->left == 0) p->state = RESP_DONE;
+        return p->state == RESP_DONE ? RESPONSE_DONE : RESPONSE_MORE;
+    }
+}
+
+// Read what the upstream has sent into res. Returns RESPONSE_MORE with
+// parts to send, RESPONSE_DONE after the last one, RESPONSE_WAIT with
+// nothing yet, STEP_FAILED if the connection failed before a response,
+// or -1 if it failed during one.
+static int pull_response(response_t *res, proxy_t *p) {
+    char buf[PROXY_READ_CHUNK];
+    for (;;) {
+        if (p->state == RESP_DONE) return RESPONSE_DONE;
+        if (res->buf.len >= PROXY_MAX_BATCH) return RESPONSE_MORE;
+        if (p->state == RESP_BODY && p->framing == BODY_LENGTH && res->splice) {
+            if (p->pipe[0] >= 0 || pipe2(p->pipe, O_NONBLOCK | O_CLOEXEC) == 0)
+                return splice_body(res, p);
+            res->splice = 0;
+        }
+        ssize_t r = recv(p->fd, buf, sizeof(buf), 0);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return res->nparts > 0 ? RESPONSE_MORE : RESPONSE_WAIT;
+            return p->state == RESP_HEAD ? STEP_FAILED : -1;
+        }
+        if (r == 0) {
+            if (p->state == RESP_HEAD) return STEP_FAILED;
+            if (p->framing != BODY_CLOSE) return -1;    // cut short
+            if (response_chunk_end(res) < 0) return -1;
+            p->state = RESP_DONE;
+            continue;
+        }
+        p->got_any = 1;
+        touch(p);
+        int rc = p->state == RESP_HEAD ? head_input(res, p, buf, r) : body_input(res, p, buf, r);
+        if (rc < 0) return p->state == RESP_HEAD ? STEP_FAILED : -1;
+    }
+}
+
+// ---- request ----
+
+// Send what is ready of the request. Returns 1 once all of it is out, 0
+// if the connection is full (*events gets POLLOUT) or the body is still
+// coming, -1 on error.
+static int push_request(proxy_t *p, short *events) {
+    while (p->out_off < p->out.len) {
+        ssize_t w = send(p->fd, p->out.data + p->out_off, p->out.len - p->out_off, MSG_NOSIGNAL);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+            *events |= POLLOUT;
+            return 0;
+        }
+        p->out_off += w;
+        p->sent_any = 1;
+        touch(p);
+    }
+    proxy_body_t *b = p->body;
+    if (!b) return 1;
+    if (b->broken) return -1;
+    // Bytes copied in come before those spliced in.
+    while (b->off < b->buf.len) {
+        ssize_t w = send(p->fd, b->buf.data + b->off, b->buf.len - b->off, MSG_NOSIGNAL);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+            *events |= POLLOUT;
+            return 0;
+        }
+        b->off += w;
+        b->sent += w;
+        touch(p);
+    }
+    b->buf.len = b->off = 0;
+    while (b->piped > 0) {
+        ssize_t w = splice(b->pipe[0], NULL, p->fd, NULL, b->piped,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+            *events |= POLLOUT;
+            return 0;
+        }
+        if (w == 0) return -1;
+        b->piped -= w;
+        b->sent += w;
+        b->full = 0;
+        touch(p);
+    }
+    if (!b->ended) return 0;
+    return b->complete ? 1 : -1;
+}
+
+// Start on an upstream with a pooled connection to it, or a new one.
+static int attempt(proxy_t *p) {
+    proxy_group_t *g = p->group;
+    pthread_mutex_lock(&g->lock);
+    upstream_t *up = pick(g, p);
+    int fd = -1;
+    if (up) {
+        up->active++;
+        if (!p->fresh) fd = pool_take(up);
+    }
+    pthread_mutex_unlock(&g->lock);
+    if (!up) return STEP_NONE;
+
+    p->up = up;
+    p->reused = fd >= 0;
+    p->connecting = 0;
+    p->out_off = 0;
+    p->sent_any = 0;
+    p->request_done = 0;
+    if (fd >= 0) {
+        metrics_add(METRIC_UPSTREAM_REUSED, 1);
+        attach_fd(p, fd);
+        return STEP_RETRY;
+    }
+
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        leave(p, 0);
+        return STEP_NONE;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    metrics_add(METRIC_UPSTREAM_NEW, 1);
+    attach_fd(p, fd);
+    if (connect(fd, (struct sockaddr *)&up->addr, sizeof(up->addr)) < 0 && errno != EINPROGRESS)
+        return STEP_FAILED;
+    p->connecting = 1;
+    return STEP_RETRY;
+}
+
+// A connect in progress: 1 once it is up, 0 while pending, -1 if it failed.
+static int connect_done(proxy_t *p) {
+    struct pollfd pfd = { .fd = p->fd, .events = POLLOUT };
+    if (poll(&pfd, 1, 0) == 0) return 0;
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(p->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err ||
+        (pfd.revents & (POLLERR | POLLHUP)))
+        return -1;
+    p->connecting = 0;
+    return 1;
+}
+
+// The connection to p->up failed before a response. The request moves on
+// unless the upstream may have acted on it already.
+static int attempt_failed(response_t *res, proxy_t *p) {
+    int timed_out = p->timed_out;
+    // A pooled connection may just have been closed while idle, and a
+    // client that stops sending its body is not the upstream's fault.
+    int stale = p->reused && !timed_out;
+    int stalled = timed_out && p->body && !p->body->ended;
+    int index = (int)(p->up - p->group->ups);
+    close(detach_fd(p));
+    leave(p, stale || stalled ? 0 : -1);
+    metrics_add(METRIC_UPSTREAM_FAILED, 1);
+    if (stale) p->fresh = 1;
+    else p->tried |= 1u << index;
+    p->failure = timed_out ? 504 : 502;
+
+    // A streamed body is not kept once sent, so it can only start over
+    // while none of it has gone; a buffered one is whole in out.
+    int replay = !p->got_any && !stalled &&
+                 (p->body ? p->body->sent == 0 : p->idempotent || !p->sent_any);
+    if (replay) {
+        p->connecting = 0;
+        return STEP_RETRY;
+    }
+    return gateway_error(res, p, p->failure);
+}
+
+// The response is complete: the connection goes back to the pool if
+// both sides left it in a clean state.
+static void finish(proxy_t *p) {
+    upstream_t *up = p->up;
+    int fd = detach_fd(p);
+    leave(p, 1);
+    if (p->reusable && p->request_done && config->proxy_keepalive > 0) {
+        // It may sit in this thread's event loop, which must let go first.
+        reactor_forget(fd);
+        pool_put(p->group, up, fd);
+    } else {
+        close(fd);
+    }
+}
+
+// Push the request and pull the response on the current connection.
+static int exchange(response_t *res, proxy_t *p) {
+    if (p->connecting) {
+        int r = connect_done(p);
+        if (r < 0 || p->timed_out) return STEP_FAILED;
+        if (r == 0) {
+            res->wait_fd = p->fd;
+            res->wait_events = POLLOUT;
+            return RESPONSE_WAIT;
+        }
+        touch(p);
+    }
+
+    short events = POLLIN;
+    int failed = 0;
+    if (!p->request_done && p->state == RESP_HEAD) {
+        int r = push_request(p, &events);
+        if (r > 0) p->request_done = 1;
+        failed = r < 0;
+    }
+    // Read even after a failed send: the upstream may have answered early
+    // and closed.
+    int rc = pull_response(res, p);
+    if (rc == RESPONSE_WAIT) {
+        if (failed) return STEP_FAILED;
+        res->wait_fd = p->fd;
+        res->wait_events = events;
+    }
+    return rc;
+}
+
+static int proxy_produce(response_t *res, void *arg) {
+    proxy_t *p = arg;
+    // Called once the client has taken everything so far: the time it
+    // took is not the upstream's.
+    touch(p);
+    for (;;) {
+        if (p->state == RESP_DONE && p->fd < 0) return RESPONSE_DONE;
+        int rc = p->fd >= 0 ? exchange(res, p) : attempt(p);
+        if (rc == STEP_NONE) return gateway_error(res, p, p->failure ? p->failure : 502);
+        if (rc == STEP_FAILED) rc = attempt_failed(res, p);
+        if (rc == STEP_RETRY) continue;
+        if (rc == RESPONSE_DONE && p->fd >= 0) finish(p);
+        return rc;
+    }
+}
+
+static void proxy_unref(proxy_t *p) {
+    if (--p->refs > 0) return;
+    unwatch(p);
+    if (p->fd >= 0) close(p->fd);
+    leave(p, 0);
+    for (int i = 0; i < 2; i++) {
+        if (p->pipe[i] >= 0) close(p->pipe[i]);
+        if (p->sink.pipe[i] >= 0) close(p->sink.pipe[i]);
+    }
+    buf_free(&p->out);
+    buf_free(&p->head);
+    buf_free(&p->sink.buf);
+    free(p);
+}
+
+// The response is done with, or dropped along with its connection. The
+// body sink may still be fed until the client has sent all of it.
+static void proxy_release(void *arg) {
+    proxy_t *p = arg;
+    if (p->fd >= 0) close(detach_fd(p));
+    leave(p, 0);
+    p->sink.discard = 1;
+    proxy_unref(p);
+}
+
+static int idempotent(http_slice_t method) {
+    static const char *const safe[] = { "GET", "HEAD", "PUT", "DELETE", "OPTIONS", "TRACE" };
+    for (size_t i = 0; i < sizeof(safe) / sizeof(safe[0]); i++)
+        if (http_slice_eq(method, safe[i])) return 1;
+    return 0;
+}
+
+// The request as the upstream gets it: the client's target and fields,
+// less hop-by-hop ones, with X-Forwarded-For added and framing of our own.
+static int build_request(proxy_t *p, const http_request_t *req, int streamed) {
+    buffer_t *o = &p->out;
+    const char *q = req->query_string.ptr;
+    int err = buf_appendf(o, "%s %s%s%.*s HTTP/1.1\r\n", req->method.ptr, req->path.ptr,
+                          q ? "?" : "", q ? (int)req->query_string.len : 0, q ? q : "");
+    if (err < 0) return -1;
+    // The target is hashed as it appears on the request line.
+    size_t target = req->method.len + 1;
+    p->key = hash_bytes(o->data + target, o->len - target - sizeof(" HTTP/1.1\r\n") + 1);
+
+    const char *conn[PROXY_CONN_FIELDS];
+    int nconn = 0;
+    for (int i = 0; i < req->header_count && nconn < PROXY_CONN_FIELDS; i++)
+        if (http_slice_caseeq(req->headers[i].name, "Connection"))
+            conn[nconn++] = req->headers[i].value.ptr;
+    const char *forwarded = NULL;
+    int host = 0;
+    for (int i = 0; i < req->header_count; i++) {
+        const char *name = req->headers[i].name.ptr;
+        if (hop_field(name, conn, nconn) || strcasecmp(name, "Content-Length") == 0 ||
+            strcasecmp(name, "Expect") == 0 || strcasecmp(name, "HTTP2-Settings") == 0)
+            continue;
+        if (strcasecmp(name, "X-Forwarded-For") == 0) {
+            forwarded = req->headers[i].value.ptr;
+            continue;
+        }
+        host |= strcasecmp(name, "Host") == 0;
+        err |= buf_appendf(o, "%s: %s\r\n", name, req->headers[i].value.ptr);
+    }
+    if (!host) err |= buf_appendf(o, "Host: \r\n");
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &req->peer, ip, sizeof(ip));
+    err |= buf_appendf(o, "X-Forwarded-For: %s%s%s\r\n", forwarded ? forwarded : "",
+                       forwarded ? ", " : "", ip);
+    if (streamed && req->chunked)
+        err |= buf_appendf(o, "Transfer-Encoding: chunked\r\n");
+    else if (streamed || req->body_len > 0 || req->chunked || http_get_header(req, "Content-Length"))
+        err |= buf_appendf(o, "Content-Length: %zu\r\n", req->body_len);
+    err |= buf_append(o, "\r\n", 2);
+    if (!streamed && req->body_len > 0) err |= buf_append(o, req->body, req->body_len);
+    return err < 0 ? -1 : 0;
+}
+
+int proxy_handle(proxy_group_t *g, const http_request_t *req, response_t *res,
+                 proxy_body_t **body) {
+    proxy_t *p = calloc(1, sizeof(*p));
+    if (!p) return 500;
+    p->refs = body ? 2 : 1;
+    p->group = g;
+    p->fd = -1;
+    p->pipe[0] = p->pipe[1] = -1;
+    p->sink.pipe[0] = p->sink.pipe[1] = -1;
+    p->state = RESP_HEAD;
+    p->is_head = http_slice_eq(req->method, "HEAD");
+    p->http11 = http_slice_eq(req->version, "HTTP/1.1");
+    p->idempotent = idempotent(req->method);
+    http_chunked_init(&p->chunked, SIZE_MAX);
+    if (body) {
+        p->body = &p->sink;
+        p->sink.chunked = req->chunked;
+    }
+    if (build_request(p, req, body != NULL) < 0) {
+        buf_free(&p->out);
+        free(p);
+        return 500;
+    }
+
+    res->keep_alive = res->keep_alive && p->http11;
+    res->produce = proxy_produce;
+    res->produce_arg = p;
+    res->release = proxy_release;
+    res->release_arg = p;
+    watch(p);
+    if (body) *body = &p->sink;
+    return 0;
+}
+
+// ---- streamed request bodies ----
+
+static proxy_t *sink_owner(const proxy_body_t *b) {
+    return (proxy_t *)((char *)b - offsetof(proxy_t, sink));
+}
+
+int proxy_body_room(const proxy_body_t *b) {
+    return b->discard || (!b->full && b->buf.len - b->off + b->piped < PROXY_BODY_MAX);
+}
+
+void proxy_body_fn(void *arg, const char *data, size_t len) {
+    proxy_body_t *b = arg;
+    if (b->discard || len == 0) return;
+    touch(sink_owner(b));
+    if (b->off == b->buf.len) b->buf.len = b->off = 0;
+    int err = 0;
+    if (b->chunked) err |= buf_appendf(&b->buf, "%zx\r\n", len);
+    err |= buf_append(&b->buf, data, len);
+    if (b->chunked) err |= buf_append(&b->buf, "\r\n", 2);
+    if (err < 0) b->broken = 1;
+}
+
+ssize_t proxy_body_splice(proxy_body_t *b, int fd, size_t len) {
+    if (b->discard) {
+        char junk[PROXY_READ_CHUNK];
+        for (;;) {
+            ssize_t r = read(fd, junk, len < sizeof(junk) ? len : sizeof(junk));
+            if (r > 0) return r;
+            if (r == 0) return -1;
+            if (errno == EINTR) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+    }
+    if (b->pipe[0] < 0 && pipe2(b->pipe, O_NONBLOCK | O_CLOEXEC) < 0) return -1;
+    for (;;) {
+        ssize_t r = splice(fd, NULL, b->pipe[1], NULL, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (r > 0) {
+            b->piped += r;
+            touch(sink_owner(b));
+            return r;
+        }
+        if (r == 0) return -1;
+        if (errno == EINTR) continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+        // Either the socket is drained or the pipe is full.
+        int avail = 0;
+        if (b->piped > 0 && ioctl(fd, FIONREAD, &avail) == 0 && avail > 0) b->full = 1;
+        return 0;
+    }
+}
+
+void proxy_body_end(proxy_body_t *b, int complete) {
+    b->ended = 1;
+    b->complete = complete;
+    if (complete && b->chunked && !b->discard && buf_append(&b->buf, "0\r\n\r\n", 5) < 0)
+        b->broken = 1;
+    proxy_unref(sink_owner(b));
+}
@@ -0,0 +1,1476 @@
+#define _GNU_SOURCE
+
+#include "reactor.h"
+#include "arena.h"
+#include "buffer.h"
+#include "h2.h"
+#include "http.h"
+#include "iplimit.h"
+#include "metrics.h"
+#include "response.h"
+#include "server.h"
+#include "upload.h"
+#include "wheel.h"
+#ifdef HAVE_IO_URING
+#include "uring.h"
+#endif
+#ifdef HAVE_TLS
+#include "tls.h"
+#endif
+#include <errno.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#define MAX_EVENTS 256
+#define CONN_POOL_MAX 256   // closed connection objects kept per reactor
+#define WRITES_MAX 16       // upload file writes in flight per connection (io_uring)
+// While draining, how long a keep-alive connection may still send its next
+// request, answered with Connection: close. Closing it outright would race
+// with requests already on their way.
+#define DRAIN_IDLE_MS 1000
+
+#ifdef HAVE_IO_URING
+#define URING_ENTRIES 1024
+#define URING_BUFS 256      // recv buffers of cfg->read_buffer bytes, a power of two
+#define URING_IOV 64        // iovecs per send, as response_queue_write() gathers
+#endif
+
+enum conn_state {
+    CONN_IDLE,          // keep-alive, nothing buffered
+    CONN_READ_HEADERS,
+    CONN_READ_BODY,
+};
+
+// Which deadline a connection's timer stands for.
+enum {
+    TIMEOUT_NONE,       // waiting on a streamed body's source
+    TIMEOUT_HEAD,
+    TIMEOUT_BODY,
+    TIMEOUT_WRITE,
+    TIMEOUT_IDLE,
+};
+
+typedef struct conn conn_t;
+
+typedef struct reactor {
+    int id;
+    int epfd;
+    int listenfd;
+    int tls_listenfd;   // -1 without a TLS listener
+    int wakefd;         // eventfd: reactor_drain() was called
+    int cpu;            // -1 when not pinned
+    int draining;       // no longer accepting; exits once conn_count is 0
+    size_t conn_count;
+    conn_t *live;       // open connections, walked when draining starts
+    conn_t *dead;       // closed during this epoll batch, freed after it
+    conn_t *free_conns; // pool reused by accept
+    size_t nfree;
+    timer_wheel_t wheel;    // connection deadlines
+    uint64_t now;           // wheel_now() after the last epoll_wait
+    pthread_t thread;
+#ifdef HAVE_IO_URING
+    int uring;              // driven by io_uring completions instead of epoll
+    uring_t ring;
+    uring_bufs_t bufs;      // recv buffers shared by the connections
+    uint64_t wake_count;    // read from wakefd
+    size_t lingering;       // closed, with operations still in flight
+    int accepts;            // multishot accepts armed
+#endif
+} reactor_t;
+
+// Parser and request for the request in flight; only allocated while a
+// request is being read or answered.
+typedef struct {
+    http_parser_t parser;
+    http_request_t req;
+    size_t body_received;
+    upload_t *upload;   // body streamed to disk instead of req.body
+    proxy_body_t *proxy;    // or forwarded upstream as it arrives
+    int keep_alive;         // of the proxied request's response
+    int body_full;          // reading stopped on a full proxy sink
+    http_chunked_t chunked;
+} pending_t;
+
+// What an epoll event's data.ptr points at; the plain listener's is NULL.
+enum { WATCH_CONN = 1, WATCH_SOURCE, WATCH_WAKE, WATCH_TLS_LISTEN };
+
+static const int wake_kind = WATCH_WAKE;
+static const int tls_listen_kind = WATCH_TLS_LISTEN;
+
+struct conn {
+    int kind;           // WATCH_CONN, must stay first
+    int fd;
+    reactor_t *owner;
+    enum conn_state state;
+    int readable;       // edge-triggered: set on EPOLLIN, cleared on EAGAIN
+    int closing;        // a queued response ends the connection
+    buffer_t in;
+    pending_t *rq;
+    response_queue_t out;
+    arena_t arena;      // the request in flight: rq and its body
+    // The input of a streamed response (e.g. a CGI pipe), watched on the
+    // same epoll set; events on it resume the connection.
+    int source_kind;    // WATCH_SOURCE
+    wheel_timer_t timer;
+    int timeout;        // TIMEOUT_*, what the timer is armed for
+    int served;         // a request has been answered
+    uint32_t peer;      // client address, network order
+    int counted;        // holds an iplimit slot
+    h2_t *h2;           // the HTTP/2 session, once the connection switched
+    int dead;
+    conn_t *next;       // on the reactor's dead or free list
+    conn_t *live_prev, *live_next;  // on its live list while open
+#ifdef HAVE_TLS
+    tls_t *tls;         // NULL for plain HTTP
+#endif
+#ifdef HAVE_IO_URING
+    // Operations in flight on the ring. Each keeps the struct alive past
+    // conn_close(); the last one to complete retires it.
+    int ops;
+    int armed;          // URING_RECV etc.: which kinds are in flight
+    int writes;         // upload file writes among them
+    int fd_closing;     // a close of fd is queued
+    // The provided buffer the last recv filled, read from by conn_recv().
+    int rx_id;          // -1 when none is held
+    unsigned rx_off, rx_len;
+    int rx_eof;         // the recv saw EOF or an error
+    int rx_nobufs;      // it found no free buffer: read() the socket directly
+    int source_fd;      // the fd of the last poll on a streamed body's source
+    short source_events;    // and what it waits for
+    upload_io_t upload_io;
+    struct stream_watch *watches;   // polls on HTTP/2 streams' sources
+    struct msghdr msg;  // of the send in flight
+    struct iovec iov[URING_IOV];
+#endif
+};
+
+#ifdef HAVE_IO_URING
+enum { URING_RECV = 1, URING_SEND = 2, URING_POLL = 4, URING_SOURCE = 8 };
+
+// A poll on the source of one HTTP/2 stream's streamed body. A connection
+// can wait on several at once, so these are separate from its own ops.
+typedef struct stream_watch {
+    conn_t *c;
+    h2_stream_t *st;
+    struct stream_watch *next;
+} stream_watch_t;
+
+static int uring_file_write(void *arg, int fd, const char *data, size_t len, off_t off);
+static void uring_file_close(void *arg, int fd);
+static ssize_t uring_recv(conn_t *c, void *dst, size_t cap);
+static int uring_flush(conn_t *c);
+static int uring_watch(conn_t *c);
+static void uring_cancel(conn_t *c, void *p, int op);
+static int uring_watch_stream(void *arg, h2_stream_t *st, int fd, short events);
+#ifdef HAVE_TLS
+static int uring_tls_wait(conn_t *c, short events);
+#endif
+static void uring_close(conn_t *c);
+static void uring_stop_accept(reactor_t *r);
+#endif
+
+static void conn_expired(wheel_timer_t *t);
+
+static conn_t *conn_new(reactor_t *r, int fd, uint32_t peer, int counted) {
+    conn_t *c = r->free_conns;
+    if (c) {
+        r->free_conns = c->next;
+        r->nfree--;
+        alloc_count(ALLOC_CONN_REUSE);
+    } else {
+        if (!(c = malloc(sizeof(*c)))) return NULL;
+        alloc_count(ALLOC_CONN_MALLOC);
+    }
+    // Pooled objects hold no memory of their own; everything is reset.
+    c->kind = WATCH_CONN;
+    c->source_kind = WATCH_SOURCE;
+    c->fd = fd;
+    c->owner = r;
+    c->state = CONN_IDLE;
+    c->readable = 0;
+    c->closing = 0;
+    c->in = (buffer_t){0};
+    c->rq = NULL;
+    c->arena = (arena_t)ARENA_INIT;
+    wheel_timer_init(&c->timer, conn_expired);
+    c->timeout = TIMEOUT_NONE;
+    c->served = 0;
+    c->peer = peer;
+    c->counted = counted;
+    c->h2 = NULL;
+    c->dead = 0;
+    c->next = NULL;
+    c->live_prev = NULL;
+    c->live_next = r->live;
+    if (r->live) r->live->live_prev = c;
+    r->live = c;
+#ifdef HAVE_TLS
+    c->tls = NULL;
+#endif
+#ifdef HAVE_IO_URING
+    c->ops = 0;
+    c->armed = 0;
+    c->writes = 0;
+    c->fd_closing = 0;
+    c->rx_id = -1;
+    c->rx_eof = 0;
+    c->rx_nobufs = 0;
+    c->source_fd = -1;
+    c->upload_io = (upload_io_t){ uring_file_write, uring_file_close, c };
+    c->watches = NULL;
+#endif
+    response_queue_init(&c->out);
+    r->conn_count++;
+    metrics_add(METRIC_CONNS_OPENED, 1);
+    return c;
+}
+
+// The request's memory all lives in the arena, so this is a rewind.
+static void conn_free_request(conn_t *c) {
+    if (!c->rq) return;
+    if (c->rq->upload) upload_close(c->rq->upload);
+    if (c->rq->proxy) proxy_body_end(c->rq->proxy, 0);
+    c->rq = NULL;
+    arena_reset(&c->arena);
+}
+
+// Upload file writes still in flight; only io_uring queues them.
+static int conn_writes(const conn_t *c) {
+#ifdef HAVE_IO_URING
+    return c->writes;
+#else
+    (void)c;
+    return 0;
+#endif
+}
+
+// Events for c may still be pending in the current batch, so the struct
+// itself is only freed once the batch is done; with io_uring, once its
+// operations in flight have completed as well.
+static void conn_close(conn_t *c) {
+    int busy = 0;
+#ifdef HAVE_TLS
+    if (c->tls) {
+        tls_free(c->tls);
+        c->tls = NULL;
+    }
+#endif
+#ifdef HAVE_IO_URING
+    if (c->owner->uring) uring_close(c);
+    else
+#endif
+    close(c->fd); // also drops it from the epoll set
+    wheel_cancel(&c->owner->wheel, &c->timer);
+    if (c->counted) iplimit_release(c->peer);
+    conn_free_request(c);
+    // Streams still being sent are freed with the queue.
+    if (c->h2) {
+        h2_free(c->h2);
+        c->h2 = NULL;
+    }
+#ifdef HAVE_IO_URING
+    busy = c->ops > 0;
+#endif
+    // A send in flight still reads the queued responses.
+    if (!busy) response_queue_free(&c->out); // closes any source fd, dropping it too
+    buf_free(&c->in);
+    arena_free(&c->arena);
+    if (c->live_prev) c->live_prev->live_next = c->live_next;
+    else c->owner->live = c->live_next;
+    if (c->live_next) c->live_next->live_prev = c->live_prev;
+    c->owner->conn_count--;
+    metrics_add(METRIC_CONNS_CLOSED, 1);
+    c->dead = 1;
+    if (busy) {
+#ifdef HAVE_IO_URING
+        c->owner->lingering++;
+#endif
+        return;
+    }
+    c->next = c->owner->dead;
+    c->owner->dead = c;
+}
+
+// A streamed response is waiting on another fd: have its readiness wake
+// the connection. A source that is still registered is left as it is.
+// Returns 1 when waiting on a source, 0 when on the socket, -1 on error.
+static int epoll_watch(conn_t *c, int fd) {
+    struct epoll_event ev = {
+        .events = EPOLLIN | EPOLLOUT | EPOLLET,
+        .data.ptr = &c->source_kind,
+    };
+    if (epoll_ctl(c->owner->epfd, EPOLL_CTL_ADD, fd, &ev) < 0 && errno != EEXIST) {
+        perror("epoll_ctl");
+        return -1;
+    }
+    return 0;
+}
+
+static int conn_watch_source(conn_t *c) {
+#ifdef HAVE_IO_URING
+    if (c->owner->uring) return uring_watch(c);
+#endif
+    short events;
+    int fd = response_queue_waiting(&c->out, &events);
+    if (fd < 0) return 0;
+    return epoll_watch(c, fd) < 0 ? -1 : 1;
+}
+
+static int epoll_watch_stream(void *arg, h2_stream_t *st, int fd, short events) {
+    (void)st;
+    (void)events;
+    return epoll_watch(arg, fd);
+}
+
+// The same for the sources of an HTTP/2 connection's streams, which the
+// session drives itself. Several can be waited on at once.
+static int conn_watch_streams(conn_t *c) {
+#ifdef HAVE_IO_URING
+    if (c->owner->uring) return h2_sources(c->h2, uring_watch_stream, c);
+#endif
+    return h2_sources(c->h2, epoll_watch_stream, c);
+}
+
+// Arm the deadline for what the connection now waits on. The head
+// deadline is not pushed back by progress, so a client trickling a
+// request head in a byte at a time still runs out of time; the others
+// restart on every call, which follows each read or write.
+static void conn_arm(conn_t *c, int kind) {
+    if (kind == TIMEOUT_HEAD && c->timeout == TIMEOUT_HEAD) return;
+    c->timeout = kind;
+    int secs = kind == TIMEOUT_HEAD ? g_config.header_timeout :
+               kind == TIMEOUT_BODY ? g_config.body_timeout :
+               kind == TIMEOUT_WRITE ? g_config.write_timeout :
+               kind == TIMEOUT_IDLE ? g_config.keepalive_timeout : 0;
+    uint64_t ms = secs > 0 ? secs * 1000ull : 0;
+    if (kind == TIMEOUT_IDLE && c->owner->draining && (!ms || ms > DRAIN_IDLE_MS))
+        ms = DRAIN_IDLE_MS;
+    if (ms) wheel_add(&c->owner->wheel, &c->timer, c->owner->now + ms);
+    else wheel_cancel(&c->owner->wheel, &c->timer);
+}
+
+// A client that stalls partway through a request is told so before the
+// connection closes; idle and slow-reading ones are just dropped. An
+// HTTP/2 client gets a GOAWAY either way.
+static void conn_expired(wheel_timer_t *t) {
+    conn_t *c = (conn_t *)((char *)t - offsetof(conn_t, timer));
+    int mid_request = c->timeout == TIMEOUT_BODY ||
+                      (c->timeout == TIMEOUT_HEAD && c->in.len > 0);
+    if ((mid_request || c->h2) && c->out.count == 0) {
+        if (c->h2) {
+            h2_shutdown(c->h2);
+            h2_output(c->h2, &c->out);
+        } else {
+            respond_timeout(response_queue_push(&c->out));
+        }
+#ifdef HAVE_TLS
+        if (c->tls) tls_write_queue(c->tls, &c->out);
+        else
+#endif
+        response_queue_write(c->fd, &c->out);
+    }
+    conn_close(c);
+}
+
+#ifdef HAVE_TLS
+// conn_recv() of a TLS connection, in either kind of loop. The session
+// reads the socket itself and may hold decrypted bytes back, so readable
+// stays set until it would block. A handshake can then be waiting for the
+// socket to take its output: epoll's EPOLLOUT resumes it, as io_uring
+// does with a poll on whichever readiness the session asked for.
+static ssize_t conn_recv_tls(conn_t *c, void *dst, size_t cap) {
+    if (!c->readable) return 0;
+    ssize_t r = tls_read(c->tls, dst, cap);
+    if (r > 0) metrics_add(METRIC_BYTES_IN, r);
+    if (r != 0) return r;
+    short want = tls_want(c->tls);
+#ifdef HAVE_IO_URING
+    if (c->owner->uring) {
+        c->readable = 0;
+        return uring_tls_wait(c, want);
+    }
+#endif
+    c->readable = want == POLLOUT;
+    return 0;
+}
+#endif
+
+// Returns bytes read, 0 if the socket is drained, -1 on EOF or error.
+static ssize_t conn_recv(conn_t *c, void *dst, size_t cap) {
+#ifdef HAVE_TLS
+    if (c->tls) return conn_recv_tls(c, dst, cap);
+#endif
+#ifdef HAVE_IO_URING
+    if (c->owner->uring) return uring_recv(c, dst, cap);
+#endif
+    while (c->readable) {
+        ssize_t r = read(c->fd, dst, cap);
+        if (r > 0) {
+            metrics_add(METRIC_BYTES_IN, r);
+            return r;
+        }
+        if (r == 0) return -1;
+        if (errno == EINTR) continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+        c->readable = 0;
+    }
+    return 0;
+}
+
+static int conn_is_tls(const conn_t *c) {
+#ifdef HAVE_TLS
+    return c->tls != NULL;
+#else
+    (void)c;
+    return 0;
+#endif
+}
+
+// An HTTP/1.1 request asking for h2c on a plain connection: res becomes
+// the 101, and the request stream 1 of the session that follows.
+static int conn_upgrade_h2(conn_t *c, http_request_t *req, response_t *res) {
+    if (!g_config.http2 || conn_is_tls(c) || !h2_upgrade_wanted(req)) return 0;
+    h2_t *s = h2_new(c->peer, 0);
+    if (!s) return 0;
+    if (h2_upgrade(s, req, res) < 0) {
+        h2_free(s);
+        return 0;
+    }
+    c->h2 = s;
+    return 1;
+}
+
+// Up to want bytes of a proxied body into its sink: spliced from a plain
+// socket of an epoll loop, else read and copied. Returns like conn_recv().
+static ssize_t conn_feed_proxy(conn_t *c, proxy_body_t *b, size_t want) {
+    int copy = conn_is_tls(c);
+#ifdef HAVE_IO_URING
+    copy |= c->owner->uring;
+#endif
+    if (copy) {
+        char chunk[HTTP_BODY_CHUNK];
+        ssize_t r = conn_recv(c, chunk, want < sizeof(chunk) ? want : sizeof(chunk));
+        if (r > 0) proxy_body_fn(b, chunk, r);
+        return r;
+    }
+    if (!c->readable) return 0;
+    ssize_t r = proxy_body_splice(b, c->fd, want);
+    if (r > 0) metrics_add(METRIC_BYTES_IN, r);
+    // Drained, unless it stopped on a full sink.
+    else if (r == 0 && proxy_body_room(b)) c->readable = 0;
+    return r;
+}
+
+// PUMP_H2: the connection has switched to HTTP/2.
+enum { PUMP_BLOCKED, PUMP_FULL, PUMP_CLOSED, PUMP_H2 };
+
+// Parse and answer requests until the socket runs dry, the response queue
+// fills up or a response ends the connection. Pipelined requests already
+// in the buffer are answered back to back without a flush in between.
+static int conn_pump(conn_t *c) {
+    for (;;) {
+        if (c->closing) return PUMP_BLOCKED;
+        if (c->out.count == RESPONSE_QUEUE_MAX) return PUMP_FULL;
+
+        switch (c->state) {
+        case CONN_IDLE:
+        case CONN_READ_HEADERS: {
+            int rc = HTTP_PARSE_AGAIN;
+            // A new connection may open with the HTTP/2 preface instead:
+            // h2c with prior knowledge, or h2 as ALPN chose.
+            int h2 = g_config.http2 && !c->served && c->in.len > 0
+                ? h2_preface(c->in.data, c->in.len) : 0;
+            if (h2 > 0) {
+                conn_free_request(c);
+                if (!(c->h2 = h2_new(c->peer, conn_is_tls(c)))) return PUMP_CLOSED;
+                return PUMP_H2;
+            }
+            if (c->in.len > 0 && h2 == 0) {
+                if (!c->rq) {
+                    c->rq = arena_alloc(&c->arena, sizeof(*c->rq));
+                    if (!c->rq) return PUMP_CLOSED;
+                    c->rq->req.body = NULL;
+                    c->rq->req.arena = &c->arena;
+                    c->rq->req.peer = c->peer;
+                    c->rq->upload = NULL;
+                    c->rq->proxy = NULL;
+                    c->rq->body_full = 0;
+                    http_parser_init(&c->rq->parser);
+                }
+                rc = parse_http_request(&c->rq->parser, c->in.data, c->in.len, &c->rq->req);
+            }
+            if (rc == HTTP_PARSE_ERROR) {
+                conn_free_request(c);
+                c->in.len = 0;
+                respond_bad_request(response_queue_push(&c->out));
+                c->closing = 1;
+                break;
+            }
+            if (rc == HTTP_PARSE_AGAIN) {
+                if (buf_reserve(&c->in, g_config.read_buffer) < 0) return PUMP_CLOSED;
+                ssize_t r = conn_recv(c, c->in.data + c->in.len, c->in.cap - c->in.len);
+                if (r < 0) return PUMP_CLOSED;
+                if (r == 0) return PUMP_BLOCKED;
+                c->in.len += r;
+                c->state = CONN_READ_HEADERS;
+                break;
+            }
+
+            http_request_t *req = &c->rq->req;
+            if (request_too_large(req)) {
+                respond_too_large(response_queue_push(&c->out));
+                conn_free_request(c);
+                c->in.len = 0;
+                c->closing = 1;
+                break;
+            }
+            c->rq->upload = request_upload(req);
+#ifdef HAVE_IO_URING
+            if (c->rq->upload && c->owner->uring) upload_set_io(c->rq->upload, &c->upload_io);
+#endif
+            c->state = CONN_READ_BODY;
+            if (!c->rq->upload && request_proxied(req)) {
+                // Answered now: the body goes upstream as it arrives.
+                response_t *res = response_queue_push(&c->out);
+                res->splice = !conn_is_tls(c);
+                if (!(c->rq->proxy = handle_proxied(req, res))) {
+                    conn_free_request(c);
+                    c->in.len = 0;
+                    c->closing = 1;
+                    break;
+                }
+                c->rq->keep_alive = res->keep_alive;
+            }
+            if (req->chunked) {
+                http_chunked_init(&c->rq->chunked, g_config.max_body);
+                break;
+            }
+            size_t got = c->rq->upload ? http_stream_body(&c->in, req, upload_body_fn, c->rq->upload)
+                       : c->rq->proxy ? http_stream_body(&c->in, req, proxy_body_fn, c->rq->proxy)
+                       : http_take_body(&c->in, req);
+            if (got == (size_t)-1) return PUMP_CLOSED;
+            c->rq->body_received = got;
+            break;
+        }
+
+        case CONN_READ_BODY: {
+            http_request_t *req = &c->rq->req;
+            // Queued file writes hold copies of the body, so reading stops
+            // while too many are in flight, and the upload is only answered
+            // once they are all done.
+            if (c->rq->upload && conn_writes(c) >= WRITES_MAX) return PUMP_BLOCKED;
+            // A proxied body is read no faster than the upstream takes it.
+            proxy_body_t *proxy = c->rq->proxy;
+            c->rq->body_full = proxy && !proxy_body_room(proxy);
+            if (c->rq->body_full) return PUMP_BLOCKED;
+            if (req->chunked) {
+                upload_t *up = c->rq->upload;
+                http_body_fn fn = up ? upload_body_fn : proxy ? proxy_body_fn : NULL;
+                int rc = http_chunked_feed(&c->rq->chunked, &c->in, req, fn,
+                                           up ? (void *)up : proxy);
+                if (rc == HTTP_PARSE_AGAIN) {
+                    if (http_reserve(&c->in, req, g_config.read_buffer) < 0) return PUMP_CLOSED;
+                    ssize_t r = conn_recv(c, c->in.data + c->in.len, c->in.cap - c->in.len);
+                    if (r < 0) return PUMP_CLOSED;
+                    if (r == 0) return PUMP_BLOCKED;
+                    c->in.len += r;
+                    break;
+                }
+                if (rc != HTTP_PARSE_DONE) {
+                    response_t *res = response_queue_push(&c->out);
+                    if (rc == HTTP_PARSE_TOO_LARGE) respond_too_large(res);
+                    else respond_bad_request(res);
+                    conn_free_request(c);
+                    c->in.len = 0;
+                    c->closing = 1;
+                    break;
+                }
+                c->rq->body_received = req->body_len;
+            }
+            size_t want = req->body_len - c->rq->body_received;
+            if (want > 0 && c->rq->upload) {
+                char chunk[HTTP_BODY_CHUNK];
+                ssize_t r = conn_recv(c, chunk, want < sizeof(chunk) ? want : sizeof(chunk));
+                if (r < 0) return PUMP_CLOSED;
+                if (r == 0) return PUMP_BLOCKED;
+                upload_write(c->rq->upload, chunk, r);
+                c->rq->body_received += r;
+                break;
+            }
+            if (want > 0 && proxy) {
+                ssize_t r = conn_feed_proxy(c, proxy, want);
+                if (r < 0) return PUMP_CLOSED;
+                if (r == 0) {
+                    c->rq->body_full = !proxy_body_room(proxy);
+                    return PUMP_BLOCKED;
+                }
+                c->rq->body_received += r;
+                break;
+            }
+            if (want > 0) {
+                ssize_t r = conn_recv(c, req->body + c->rq->body_received, want);
+                if (r < 0) return PUMP_CLOSED;
+                if (r == 0) return PUMP_BLOCKED;
+                c->rq->body_received += r;
+                break;
+            }
+
+            if (c->rq->upload && conn_writes(c) > 0) return PUMP_BLOCKED;
+            if (proxy) {
+                proxy_body_end(proxy, 1);
+                c->rq->proxy = NULL;
+                if (!c->rq->keep_alive) c->closing = 1;
+            } else {
+                response_t *res = response_queue_push(&c->out);
+                res->splice = !conn_is_tls(c);
+                if (!c->rq->upload && conn_upgrade_h2(c, req, res)) {
+                    buf_consume(&c->in, req->head_len);
+                    conn_free_request(c);
+                    return PUMP_H2;
+                }
+                if (c->rq->upload) {
+                    handle_upload(req, c->rq->upload, res);
+                    c->rq->upload = NULL;
+                } else {
+                    handle_request(req, res);
+                }
+                if (!res->keep_alive) c->closing = 1;
+            }
+            buf_consume(&c->in, req->head_len);
+            conn_free_request(c);
+            // A pipelined request that follows gets a head deadline of its own.
+            c->served = 1;
+            if (c->timeout == TIMEOUT_HEAD) c->timeout = TIMEOUT_NONE;
+            c->state = c->in.len ? CONN_READ_HEADERS : CONN_IDLE;
+            break;
+        }
+        }
+    }
+}
+
+// Send what the queue holds, directly or as an io_uring send whose
+// completion resumes the connection. Returns like response_queue_write().
+static int conn_flush(conn_t *c) {
+#ifdef HAVE_TLS
+    if (c->tls) return tls_write_queue(c->tls, &c->out);
+#endif
+#ifdef HAVE_IO_URING
+    if (c->owner->uring) return uring_flush(c);
+#endif
+    return response_queue_write(c->fd, &c->out);
+}
+
+// conn_process() of an HTTP/2 connection: frames are read as long as the
+// session takes them, and its output is queued whenever the queue drains.
+static int conn_process_h2(conn_t *c) {
+    h2_t *s = c->h2;
+    if (c->owner->draining) h2_shutdown(s);
+    for (;;) {
+        while (!c->closing && h2_wants_input(s)) {
+            if (c->in.len > 0) {
+                ssize_t used = h2_feed(s, c->in.data, c->in.len);
+                if (used < 0) {
+                    c->closing = 1;
+                    break;
+                }
+                buf_consume(&c->in, used);
+                if (!h2_wants_input(s)) break;
+            }
+            if (buf_reserve(&c->in, g_config.read_buffer) < 0) goto closed;
+            ssize_t r = conn_recv(c, c->in.data + c->in.len, c->in.cap - c->in.len);
+            if (r < 0) goto closed;
+            if (r == 0) break;
+            c->in.len += r;
+        }
+
+        int more = h2_output(s, &c->out);
+        int r = conn_flush(c);
+        if (r < 0) goto closed;
+        if (r == 0) {
+            if (conn_watch_source(c) < 0 || conn_watch_streams(c) < 0) goto closed;
+            conn_arm(c, TIMEOUT_WRITE);
+            return 0;
+        }
+        if (c->closing || h2_done(s)) goto closed;
+        if (more) continue;
+
+        if (conn_watch_streams(c) < 0) goto closed;
+        switch (h2_waiting(s)) {
+        case H2_IDLE:
+            if (c->in.len == 0) {
+                buf_free(&c->in);
+                response_queue_free(&c->out);
+            }
+            conn_arm(c, c->in.len ? TIMEOUT_BODY : TIMEOUT_IDLE);
+            break;
+        case H2_READING:
+            conn_arm(c, TIMEOUT_BODY);
+            break;
+        case H2_BLOCKED:
+            // On the client's flow control window, as on a slow reader.
+            conn_arm(c, TIMEOUT_WRITE);
+            break;
+        default:
+            conn_arm(c, TIMEOUT_NONE);
+        }
+        return 0;
+    }
+
+closed:
+    conn_close(c);
+    return -1;
+}
+
+// Drive the connection as far as the socket allows. Returns -1 once the
+// connection has been closed and freed.
+static int conn_process(conn_t *c) {
+    if (c->h2) return conn_process_h2(c);
+    for (;;) {
+        int pumped = conn_pump(c);
+        if (pumped == PUMP_CLOSED) goto closed;
+        if (pumped == PUMP_H2) return conn_process_h2(c);
+
+        int r = conn_flush(c);
+        if (r < 0) goto closed;
+        // Sending may have made room for more of a proxied body.
+        if (c->rq && c->rq->body_full && proxy_body_room(c->rq->proxy)) continue;
+        if (r == 0) {
+            // Wait for the socket (EPOLLOUT, or the send in flight), or for
+            // the streamed body's source, which has a timeout of its own.
+            int source = conn_watch_source(c);
+            if (source < 0) goto closed;
+            conn_arm(c, source ? TIMEOUT_NONE : TIMEOUT_WRITE);
+            return 0;
+        }
+        if (c->closing) goto closed;
+        if (pumped == PUMP_FULL) continue;
+
+        if (c->state == CONN_IDLE) {
+            // Idle keep-alive connections hold no buffers; they go back to
+            // this thread's spare lists for the next busy connection.
+            buf_free(&c->in);
+            response_queue_free(&c->out);
+            arena_free(&c->arena);
+        }
+        conn_arm(c, c->state == CONN_READ_BODY ? TIMEOUT_BODY :
+                    c->state == CONN_READ_HEADERS || !c->served ? TIMEOUT_HEAD :
+                    TIMEOUT_IDLE);
+        return 0;
+    }
+
+closed:
+    conn_close(c);
+    return -1;
+}
+
+// Take on an accepted socket. Over its per-address cap the connection is
+// dropped unanswered; under a flood that is cheaper than writing a response.
+static conn_t *conn_accept(reactor_t *r, int fd, uint32_t peer, int tls) {
+    int counted = iplimit_acquire(peer);
+    if (counted < 0) {
+        close(fd);
+        return NULL;
+    }
+    conn_t *c = conn_new(r, fd, peer, counted);
+    if (!c) {
+        if (counted) iplimit_release(peer);
+        close(fd);
+        return NULL;
+    }
+#ifdef HAVE_TLS
+    if (tls) {
+        if (!(c->tls = tls_new(fd))) {
+            conn_close(c);
+            return NULL;
+        }
+        // The handshake starts on whatever the client has sent already.
+        c->readable = 1;
+    }
+#else
+    (void)tls;
+#endif
+    return c;
+}
+
+static void accept_all(reactor_t *r, int listenfd, int tls) {
+    for (;;) {
+        struct sockaddr_in peer;
+        socklen_t len = sizeof(peer);
+        int fd = accept4(listenfd, (struct sockaddr *)&peer, &len,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) perror("accept");
+            return;
+        }
+
+        conn_t *c = conn_accept(r, fd, peer.sin_addr.s_addr, tls);
+        if (!c) continue;
+        struct epoll_event ev = {
+            .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+            .data.ptr = c,
+        };
+        if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            perror("epoll_ctl");
+            conn_close(c);
+            continue;
+        }
+        conn_arm(c, TIMEOUT_HEAD);
+    }
+}
+
+// Closed connections go back to the pool once nothing refers to them.
+static void reap_dead(reactor_t *r) {
+    while (r->dead) {
+        conn_t *c = r->dead;
+        r->dead = c->next;
+        if (r->nfree < CONN_POOL_MAX) {
+            c->next = r->free_conns;
+            r->free_conns = c;
+            r->nfree++;
+        } else {
+            free(c);
+        }
+    }
+}
+
+// Stop accepting and cut short the wait of keep-alive connections for
+// their next request; the others close once their current one is answered.
+static void start_draining(reactor_t *r) {
+    r->draining = 1;
+#ifdef HAVE_IO_URING
+    if (r->uring) uring_stop_accept(r);
+    else
+#endif
+    {
+        epoll_ctl(r->epfd, EPOLL_CTL_DEL, r->listenfd, NULL);
+        if (r->tls_listenfd >= 0) epoll_ctl(r->epfd, EPOLL_CTL_DEL, r->tls_listenfd, NULL);
+    }
+    for (conn_t *c = r->live; c; c = c->live_next)
+        if (c->timeout == TIMEOUT_IDLE) conn_arm(c, TIMEOUT_IDLE);
+}
+
+// The epoll set of the loop on this thread, for reactor_forget().
+static _Thread_local int loop_epfd = -1;
+
+void reactor_forget(int fd) {
+    if (loop_epfd >= 0) epoll_ctl(loop_epfd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+static void epoll_loop(reactor_t *r) {
+    struct epoll_event events[MAX_EVENTS];
+    loop_epfd = r->epfd;
+    for (;;) {
+        int n = epoll_wait(r->epfd, events, MAX_EVENTS, wheel_timeout(&r->wheel, r->now));
+        r->now = wheel_now();
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            int *kind = events[i].data.ptr;
+            if (!kind) {
+                accept_all(r, r->listenfd, 0);
+                continue;
+            }
+            if (*kind == WATCH_TLS_LISTEN) {
+                accept_all(r, r->tls_listenfd, 1);
+                continue;
+            }
+            if (*kind == WATCH_WAKE) {
+                uint64_t count;
+                (void)!read(r->wakefd, &count, sizeof(count));
+                start_draining(r);
+                continue;
+            }
+            if (*kind == WATCH_SOURCE) {
+                // Errors and hangups on a source are the producer's to report.
+                conn_t *c = (conn_t *)((char *)kind - offsetof(conn_t, source_kind));
+                if (!c->dead) conn_process(c);
+                continue;
+            }
+            conn_t *c = (conn_t *)kind;
+            if (c->dead) continue;
+            if (events[i].events & EPOLLERR) {
+                conn_close(c);
+                continue;
+            }
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP))
+                c->readable = 1;
+            conn_process(c);
+        }
+        wheel_advance(&r->wheel, r->now);
+        reap_dead(r);
+        if (r->draining && r->conn_count == 0) break;
+    }
+}
+
+#ifdef HAVE_IO_URING
+
+// ---- io_uring ----
+//
+// The same connections driven by completions: a multishot accept on the
+// listener, one recv at a time per connection into the reactor's provided
+// buffers, gathered sends (the last one of a closing connection linked to
+// its close), polls for a blocked sendfile() or a streamed body's source,
+// and upload file writes. An SQE's user_data is the object it concerns,
+// with the operation in the low bits that malloc's alignment leaves clear.
+
+enum {
+    OP_WRITE, OP_ACCEPT, OP_ACCEPT_TLS, OP_RECV, OP_SEND, OP_POLL, OP_SOURCE, OP_CLOSE, OP_WAKE,
+    OP_IGNORE, OP_STREAM,
+};
+#define OP_MASK 15
+
+static uint64_t op_data(void *p, int op) {
+    return (uint64_t)(uintptr_t)p | op;
+}
+
+// A queued upload write with its copy of the data.
+typedef struct {
+    conn_t *c;
+    size_t len;
+    char data[];
+} file_write_t;
+
+static struct io_uring_sqe *conn_sqe(conn_t *c, int opcode, int op) {
+    struct io_uring_sqe *sqe = uring_sqe(&c->owner->ring);
+    if (!sqe) return NULL;
+    sqe->opcode = opcode;
+    sqe->fd = c->fd;
+    sqe->user_data = op_data(c, op);
+    c->ops++;
+    return sqe;
+}
+
+// An operation on c completed. Returns 0 if c has been closed, retiring
+// it when this was the last one.
+static int conn_op_done(conn_t *c) {
+    c->ops--;
+    if (!c->dead) return 1;
+    if (c->ops == 0) {
+        response_queue_free(&c->out);
+        c->owner->lingering--;
+        c->next = c->owner->dead;
+        c->owner->dead = c;
+    }
+    return 0;
+}
+
+static int uring_file_write(void *arg, int fd, const char *data, size_t len, off_t off) {
+    conn_t *c = arg;
+    file_write_t *w = malloc(sizeof(*w) + len);
+    if (!w) return -1;
+    struct io_uring_sqe *sqe = uring_sqe(&c->owner->ring);
+    if (!sqe) {
+        free(w);
+        return -1;
+    }
+    w->c = c;
+    w->len = len;
+    memcpy(w->data, data, len);
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)w->data;
+    sqe->len = len;
+    sqe->off = off;
+    sqe->user_data = op_data(w, OP_WRITE);
+    c->ops++;
+    c->writes++;
+    return 0;
+}
+
+// Queued behind the writes, which hold the file open until they finish.
+static void uring_file_close(void *arg, int fd) {
+    conn_t *c = arg;
+    struct io_uring_sqe *sqe = uring_sqe(&c->owner->ring);
+    if (!sqe) {
+        close(fd);
+        return;
+    }
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = fd;
+    sqe->user_data = op_data(NULL, OP_IGNORE);
+}
+
+// conn_recv() of io_uring: hands out the received buffer, and once that
+// is used up queues the next recv.
+static ssize_t uring_recv(conn_t *c, void *dst, size_t cap) {
+    uring_bufs_t *bufs = &c->owner->bufs;
+    if (c->rx_id >= 0) {
+        size_t n = c->rx_len - c->rx_off;
+        if (n > cap) n = cap;
+        memcpy(dst, uring_buf(bufs, c->rx_id) + c->rx_off, n);
+        c->rx_off += n;
+        if (c->rx_off == c->rx_len) {
+            uring_buf_put(bufs, c->rx_id);
+            c->rx_id = -1;
+        }
+        return n;
+    }
+    if (c->rx_eof) return -1;
+    if (c->armed & URING_RECV) return 0;
+    if (c->rx_nobufs) {
+        // Data is waiting but every buffer is held: take it directly.
+        c->rx_nobufs = 0;
+        ssize_t r;
+        do {
+            r = read(c->fd, dst, cap);
+        } while (r < 0 && errno == EINTR);
+        if (r > 0) metrics_add(METRIC_BYTES_IN, r);
+        if (r > 0) return r;
+        if (r == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) return -1;
+    }
+    struct io_uring_sqe *sqe = conn_sqe(c, IORING_OP_RECV, OP_RECV);
+    if (!sqe) return -1;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = bufs->group;
+    c->armed |= URING_RECV;
+    return 0;
+}
+
+// conn_flush() of io_uring. In-memory parts go out as one gathered send
+// at a time; file parts keep using sendfile() directly.
+static int uring_flush(conn_t *c) {
+    if (c->armed & URING_SEND) return 0;
+    int n, flags;
+    switch (response_queue_next(&c->out, c->iov, URING_IOV, &n, &flags)) {
+    case RESPONSE_IO_DONE: return 1;
+    case RESPONSE_IO_WAIT: return 0;
+    case RESPONSE_IO_FILE: return response_queue_write(c->fd, &c->out);
+    case RESPONSE_IO_SEND: break;
+    default: return -1;
+    }
+
+    // A closing connection's last bytes carry its close along: MSG_WAITALL
+    // keeps the send from completing short, which would break the link.
+    int last = c->closing && (flags & RESPONSE_IO_LAST);
+    if (uring_reserve(&c->owner->ring, last ? 2 : 1) < 0) return -1;
+    struct io_uring_sqe *sqe = conn_sqe(c, IORING_OP_SENDMSG, OP_SEND);
+    c->msg = (struct msghdr){ .msg_iov = c->iov, .msg_iovlen = n };
+    sqe->addr = (uint64_t)(uintptr_t)&c->msg;
+    sqe->msg_flags = MSG_NOSIGNAL | (flags & RESPONSE_IO_MORE ? MSG_MORE : 0);
+    c->armed |= URING_SEND;
+    if (last) {
+        sqe->msg_flags |= MSG_WAITALL;
+        sqe->flags |= IOSQE_IO_LINK;
+        conn_sqe(c, IORING_OP_CLOSE, OP_CLOSE);
+        c->fd_closing = 1;
+    }
+    return 0;
+}
+
+static int uring_poll(conn_t *c, int fd, short events, int op, int bit) {
+    struct io_uring_sqe *sqe = conn_sqe(c, IORING_OP_POLL_ADD, op);
+    if (!sqe) return -1;
+    sqe->fd = fd;
+    sqe->poll32_events = events | POLLERR | POLLHUP;
+    c->armed |= bit;
+    return 0;
+}
+
+#ifdef HAVE_TLS
+// What conn_recv_tls() waits on: a poll standing in for the recv.
+static int uring_tls_wait(conn_t *c, short events) {
+    if (c->armed & URING_RECV) return 0;
+    return uring_poll(c, c->fd, events, OP_RECV, URING_RECV);
+}
+#endif
+
+// conn_watch_source() of io_uring: a one-shot poll on whatever the queue
+// waits for, unless a send in flight will resume the connection anyway.
+static int uring_watch(conn_t *c) {
+    if (c->armed & URING_SEND) return 0;
+    short events;
+    int fd = response_queue_waiting(&c->out, &events);
+    if (fd < 0) {
+        if (c->armed & URING_POLL) return 0;
+#ifdef HAVE_TLS
+        if (c->tls) return uring_poll(c, c->fd, tls_want(c->tls), OP_POLL, URING_POLL);
+#endif
+        return uring_poll(c, c->fd, POLLOUT, OP_POLL, URING_POLL);
+    }
+    if (c->armed & URING_SOURCE) {
+        // A poll for something else is cancelled first; its completion
+        // comes back here to arm the new one.
+        if (c->source_fd >= 0 && (fd != c->source_fd || events != c->source_events)) {
+            uring_cancel(c, c, OP_SOURCE);
+            c->source_fd = -1;
+        }
+        return 1;
+    }
+    if (uring_poll(c, fd, events, OP_SOURCE, URING_SOURCE) < 0) return -1;
+    c->source_fd = fd;
+    c->source_events = events;
+    return 1;
+}
+
+// conn_watch_streams() of io_uring: a one-shot poll per stream, which
+// holds the stream until it completes.
+static int uring_watch_stream(void *arg, h2_stream_t *st, int fd, short events) {
+    conn_t *c = arg;
+    stream_watch_t *w = malloc(sizeof(*w));
+    if (!w) return -1;
+    struct io_uring_sqe *sqe = conn_sqe(c, IORING_OP_POLL_ADD, OP_STREAM);
+    if (!sqe) {
+        free(w);
+        return -1;
+    }
+    sqe->fd = fd;
+    sqe->poll32_events = events | POLLERR | POLLHUP;
+    sqe->user_data = op_data(w, OP_STREAM);
+    w->c = c;
+    w->st = st;
+    w->next = c->watches;
+    c->watches = w;
+    h2_stream_hold(st);
+    return 0;
+}
+
+static void uring_cancel(conn_t *c, void *p, int op) {
+    struct io_uring_sqe *sqe = uring_sqe(&c->owner->ring);
+    if (!sqe) return;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = op_data(p, op);
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data = op_data(NULL, OP_IGNORE);
+}
+
+// Cancel what is in flight on c and close its socket. Both go through the
+// ring, behind any SQEs on the fd that are not submitted yet.
+static void uring_close(conn_t *c) {
+    if (c->armed & URING_RECV) uring_cancel(c, c, OP_RECV);
+    if (c->armed & URING_SEND) uring_cancel(c, c, OP_SEND);
+    if (c->armed & URING_POLL) uring_cancel(c, c, OP_POLL);
+    if (c->armed & URING_SOURCE) uring_cancel(c, c, OP_SOURCE);
+    for (stream_watch_t *w = c->watches; w; w = w->next) uring_cancel(c, w, OP_STREAM);
+    if (!c->fd_closing) {
+        if (!conn_sqe(c, IORING_OP_CLOSE, OP_CLOSE)) close(c->fd);
+        c->fd_closing = 1;
+    }
+    if (c->rx_id >= 0) {
+        uring_buf_put(&c->owner->bufs, c->rx_id);
+        c->rx_id = -1;
+    }
+}
+
+// A multishot accept on the plain or the TLS listener.
+static int uring_arm_accept(reactor_t *r, int tls) {
+    struct io_uring_sqe *sqe = uring_sqe(&r->ring);
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = tls ? r->tls_listenfd : r->listenfd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = op_data(NULL, tls ? OP_ACCEPT_TLS : OP_ACCEPT);
+    r->accepts++;
+    return 0;
+}
+
+// The multishot accepts are cancelled, and not rearmed while draining.
+static void uring_stop_accept(reactor_t *r) {
+    for (int tls = 0; tls <= (r->tls_listenfd >= 0); tls++) {
+        struct io_uring_sqe *sqe = uring_sqe(&r->ring);
+        if (!sqe) return;
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = op_data(NULL, tls ? OP_ACCEPT_TLS : OP_ACCEPT);
+        sqe->user_data = op_data(NULL, OP_IGNORE);
+    }
+}
+
+// Accepts wait on the listener exclusively: a wakeup goes to one of them.
+// One cancelled after taking it leaves the connection queued, unknown to
+// the next worker sharing the socket, so a draining reactor looks once
+// more and serves whatever is there.
+static void uring_accept_rest(reactor_t *r, int tls) {
+    int listenfd = tls ? r->tls_listenfd : r->listenfd;
+    for (;;) {
+        struct sockaddr_in peer;
+        socklen_t len = sizeof(peer);
+        int fd = accept4(listenfd, (struct sockaddr *)&peer, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            return;
+        }
+        conn_t *c = conn_accept(r, fd, peer.sin_addr.s_addr, tls);
+        if (c) conn_process(c);
+    }
+}
+
+static void uring_accepted(reactor_t *r, int res, unsigned flags, int tls) {
+    // A multishot accept stops on errors such as EMFILE; start it again.
+    if (!(flags & IORING_CQE_F_MORE)) {
+        r->accepts--;
+        if (!r->draining && uring_arm_accept(r, tls) < 0)
+            fprintf(stderr, "reactor %d: cannot rearm accept\n", r->id);
+    }
+    if (res == -ECANCELED && r->draining) {
+        uring_accept_rest(r, tls);
+        return;
+    }
+    if (res < 0) {
+        if (res != -ECONNABORTED && res != -EINTR && res != -ECANCELED)
+            fprintf(stderr, "accept: %s\n", strerror(-res));
+        return;
+    }
+    struct sockaddr_in peer;
+    socklen_t len = sizeof(peer);
+    if (getpeername(res, (struct sockaddr *)&peer, &len) < 0) {
+        close(res);
+        return;
+    }
+    conn_t *c = conn_accept(r, res, peer.sin_addr.s_addr, tls);
+    // Processing queues the first recv and arms the head deadline.
+    if (c) conn_process(c);
+}
+
+static void uring_complete(reactor_t *r, uint64_t data, int res, unsigned flags) {
+    int op = data & OP_MASK;
+    void *p = (void *)(uintptr_t)(data & ~(uint64_t)OP_MASK);
+    conn_t *c = p;
+
+    switch (op) {
+    case OP_ACCEPT:
+    case OP_ACCEPT_TLS:
+        uring_accepted(r, res, flags, op == OP_ACCEPT_TLS);
+        return;
+    case OP_IGNORE:
+        return;
+    case OP_WAKE:
+        start_draining(r);
+        return;
+    case OP_WRITE: {
+        file_write_t *w = p;
+        c = w->c;
+        int failed = res != (int)w->len;
+        free(w);
+        c->writes--;
+        if (!conn_op_done(c)) return;
+        if (failed && c->rq && c->rq->upload) upload_fail(c->rq->upload);
+        conn_process(c);
+        return;
+    }
+    case OP_RECV:
+        c->armed &= ~URING_RECV;
+#ifdef HAVE_TLS
+        // A TLS connection's recv is a poll: the session does the reading.
+        if (c->tls) {
+            c->readable = 1;
+            if (conn_op_done(c)) conn_process(c);
+            return;
+        }
+#endif
+        if (res > 0 && (flags & IORING_CQE_F_BUFFER)) {
+            uint16_t id = flags >> IORING_CQE_BUFFER_SHIFT;
+            if (c->dead) {
+                uring_buf_put(&r->bufs, id);
+            } else {
+                c->rx_id = id;
+                c->rx_off = 0;
+                c->rx_len = res;
+                metrics_add(METRIC_BYTES_IN, res);
+            }
+        } else if (res == -ENOBUFS) {
+            c->rx_nobufs = 1;
+        } else if (res != -ECANCELED) {
+            c->rx_eof = 1;
+        }
+        if (conn_op_done(c)) conn_process(c);
+        return;
+    case OP_SEND:
+        c->armed &= ~URING_SEND;
+        if (!conn_op_done(c)) return;
+        if (res < 0) {
+            conn_close(c);
+            return;
+        }
+        response_queue_sent(&c->out, res);
+        if (c->fd_closing) conn_close(c);
+        else conn_process(c);
+        return;
+    case OP_POLL:
+    case OP_SOURCE:
+        c->armed &= op == OP_POLL ? ~URING_POLL : ~URING_SOURCE;
+        if (conn_op_done(c)) conn_process(c);
+        return;
+    case OP_STREAM: {
+        stream_watch_t *w = p;
+        c = w->c;
+        stream_watch_t **link = &c->watches;
+        while (*link != w) link = &(*link)->next;
+        *link = w->next;
+        h2_stream_woken(w->st);
+        free(w);
+        if (conn_op_done(c)) conn_process(c);
+        return;
+    }
+    case OP_CLOSE:
+        // A close linked to a send that failed or was cancelled is
+        // cancelled in turn.
+        if (res == -ECANCELED) close(c->fd);
+        conn_op_done(c);
+        return;
+    }
+}
+
+static int uring_arm_wake(reactor_t *r) {
+    struct io_uring_sqe *sqe = uring_sqe(&r->ring);
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = r->wakefd;
+    sqe->addr = (uint64_t)(uintptr_t)&r->wake_count;
+    sqe->len = sizeof(r->wake_count);
+    sqe->user_data = op_data(NULL, OP_WAKE);
+    return 0;
+}
+
+static int uring_start(reactor_t *r) {
+    if (uring_init(&r->ring, URING_ENTRIES) < 0) return -1;
+    if (uring_bufs_init(&r->ring, &r->bufs, 0, URING_BUFS, g_config.read_buffer) < 0 ||
+        uring_arm_accept(r, 0) < 0 || (r->tls_listenfd >= 0 && uring_arm_accept(r, 1) < 0) ||
+        uring_arm_wake(r) < 0) {
+        int err = errno;
+        uring_free(&r->ring);
+        uring_bufs_free(&r->bufs);
+        errno = err;
+        return -1;
+    }
+    r->uring = 1;
+    return 0;
+}
+
+static void uring_loop(reactor_t *r) {
+    for (;;) {
+        int n = uring_submit_wait(&r->ring, wheel_timeout(&r->wheel, r->now));
+        r->now = wheel_now();
+        if (n < 0) {
+            perror("io_uring_enter");
+            break;
+        }
+
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_cqe(&r->ring))) {
+            uint64_t data = cqe->user_data;
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+            uring_cqe_seen(&r->ring);
+            uring_complete(r, data, res, flags);
+        }
+        wheel_advance(&r->wheel, r->now);
+        reap_dead(r);
+        // Closed connections' last operations still refer to them, and
+        // the accepts end with a last look at their listener.
+        if (r->draining && r->conn_count == 0 && r->lingering == 0 && r->accepts == 0) break;
+    }
+}
+
+#endif
+
+static void *reactor_loop(void *arg) {
+    reactor_t *r = arg;
+
+    if (r->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(r->cpu, &set);
+        int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (err) fprintf(stderr, "reactor %d: cannot pin to cpu %d: %s\n",
+                         r->id, r->cpu, strerror(err));
+    }
+
+#ifdef HAVE_IO_URING
+    // The ring is set up here, by the only thread that will submit to it.
+    if (g_config.use_uring && uring_start(r) < 0)
+        fprintf(stderr, "reactor %d: io_uring unavailable (%s), using epoll\n",
+                r->id, strerror(errno));
+    if (r->uring) uring_loop(r);
+    else
+#endif
+    epoll_loop(r);
+    // Drained: the thread's spare memory would be lost with it.
+    buf_trim();
+    arena_trim();
+    return NULL;
+}
+
+static int reactor_init(reactor_t *r, int listenfd, int tls_listenfd) {
+    r->listenfd = listenfd;
+    r->tls_listenfd = tls_listenfd;
+    r->now = wheel_now();
+    wheel_init(&r->wheel, r->now);
+
+    r->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (r->epfd < 0) { perror("epoll_create1"); return -1; }
+    r->wakefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (r->wakefd < 0) { perror("eventfd"); return -1; }
+
+    // The listener stays level-triggered so a full accept queue or EMFILE
+    // is retried on the next wakeup instead of being lost.
+    struct epoll_event lev = { .events = EPOLLIN, .data.ptr = NULL };
+    struct epoll_event tev = { .events = EPOLLIN, .data.ptr = (void *)&tls_listen_kind };
+    struct epoll_event wev = { .events = EPOLLIN, .data.ptr = (void *)&wake_kind };
+    if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->listenfd, &lev) < 0 ||
+        (tls_listenfd >= 0 && epoll_ctl(r->epfd, EPOLL_CTL_ADD, tls_listenfd, &tev) < 0) ||
+        epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->wakefd, &wev) < 0) {
+        perror("epoll_ctl");
+        return -1;
+    }
+    return 0;
+}
+
+static reactor_t *reactors;
+static int nreactors;
+
+int reactor_start(const server_config_t *cfg, const int *listeners, const int *tls_listeners) {
+    int n = cfg->threads;
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpu < 1) ncpu = 1;
+
+    reactors = calloc(n, sizeof(*reactors));
+    if (!reactors) return -1;
+
+    for (int i = 0; i < n; i++) {
+        reactors[i].id = i;
+        reactors[i].cpu = cfg->pin_cpus ? (int)(i % ncpu) : -1;
+        if (reactor_init(&reactors[i], listeners[i], tls_listeners ? tls_listeners[i] : -1) < 0)
+            return -1;
+    }
+
+    for (int i = 0; i < n; i++) {
+        int err = pthread_create(&reactors[i].thread, NULL, reactor_loop, &reactors[i]);
+        if (err) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(err));
+            return -1;
+        }
+        nreactors++;
+    }
+    return 0;
+}
+
+void reactor_drain(void) {
+    for (int i = 0; i < nreactors; i++) eventfd_write(reactors[i].wakefd, 1);
+}
+
+int reactor_wait(int timeout_secs) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_secs;
+    for (int i = 0; i < nreactors; i++) {
+        if (timeout_secs <= 0) pthread_join(reactors[i].thread, NULL);
+        else if (pthread_timedjoin_np(reactors[i].thread, NULL, &deadline) != 0) return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,510 @@
+#define _GNU_SOURCE
+
+#include "response.h"
+#include "http.h"
+#include "metrics.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+// Upper bound on iovecs gathered into one sendmsg.
+#define MAX_IOV 64
+
+void response_init(response_t *res) {
+    res->buf = (buffer_t){0};
+    res->parts = res->inline_parts;
+    res->nparts = 0;
+    res->cap_parts = RESPONSE_INLINE_PARTS;
+    res->cur = 0;
+    res->cur_sent = 0;
+    res->file_fd = -1;
+    res->file_owned = 0;
+    res->splice = 0;
+    res->release = NULL;
+    res->release_arg = NULL;
+    res->produce = NULL;
+    res->produce_arg = NULL;
+    res->wait_fd = -1;
+    res->wait_events = 0;
+    res->chunked = 0;
+    res->keep_alive = 0;
+    res->head = 0;
+    res->status = 0;
+    res->ready_at = 0;
+    res->sent = 0;
+    res->access.start = 0;
+}
+
+void response_reset(response_t *res) {
+    accesslog_end(&res->access, res->status, res->sent);
+    if (res->file_fd >= 0 && res->file_owned) close(res->file_fd);
+    if (res->release) res->release(res->release_arg);
+    res->release = NULL;
+    res->release_arg = NULL;
+    res->produce = NULL;
+    res->produce_arg = NULL;
+    res->wait_fd = -1;
+    res->wait_events = 0;
+    res->chunked = 0;
+    res->file_fd = -1;
+    res->file_owned = 0;
+    res->splice = 0;
+    res->buf.len = 0;
+    res->nparts = 0;
+    res->cur = 0;
+    res->cur_sent = 0;
+    res->keep_alive = 0;
+    res->head = 0;
+    res->status = 0;
+    res->ready_at = 0;
+    res->sent = 0;
+}
+
+static response_part_t *add_part(response_t *res, int kind) {
+    if (res->nparts == res->cap_parts) {
+        int cap = res->cap_parts * 2;
+        response_part_t *p;
+        if (res->parts == res->inline_parts) {
+            if ((p = malloc(cap * sizeof(*p))) != NULL)
+                memcpy(p, res->parts, res->nparts * sizeof(*p));
+        } else {
+            p = realloc(res->parts, cap * sizeof(*p));
+        }
+        if (!p) return NULL;
+        res->parts = p;
+        res->cap_parts = cap;
+    }
+    response_part_t *p = &res->parts[res->nparts++];
+    p->kind = kind;
+    p->ptr = NULL;
+    p->off = 0;
+    p->len = 0;
+    return p;
+}
+
+// Owned bytes extend the previous part when it is owned and contiguous.
+static response_part_t *owned_tail(response_t *res) {
+    if (res->nparts > 0) {
+        response_part_t *p = &res->parts[res->nparts - 1];
+        if (p->kind == PART_OWNED && (size_t)p->off + p->len == res->buf.len)
+            return p;
+    }
+    response_part_t *p = add_part(res, PART_OWNED);
+    if (p) p->off = res->buf.len;
+    return p;
+}
+
+int response_append(response_t *res, const void *data, size_t len) {
+    if (len == 0) return 0;
+    response_part_t *p = owned_tail(res);
+    if (!p || buf_append(&res->buf, data, len) < 0) return -1;
+    p->len += len;
+    return 0;
+}
+
+int response_printf(response_t *res, const char *fmt, ...) {
+    response_part_t *p = owned_tail(res);
+    if (!p) return -1;
+    size_t before = res->buf.len;
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if (n < 0 || buf_reserve(&res->buf, n + 1) < 0) return -1;
+    va_start(ap, fmt);
+    vsnprintf(res->buf.data + before, n + 1, fmt, ap);
+    va_end(ap);
+    res->buf.len += n;
+    p->len += n;
+    return 0;
+}
+
+int response_add_segment(response_t *res, const void *data, size_t len) {
+    if (len == 0) return 0;
+    response_part_t *p = add_part(res, PART_BORROWED);
+    if (!p) return -1;
+    p->ptr = data;
+    p->len = len;
+    return 0;
+}
+
+int response_add_file(response_t *res, off_t off, size_t len) {
+    if (len == 0) return 0;
+    response_part_t *p = add_part(res, PART_FILE);
+    if (!p) return -1;
+    p->off = off;
+    p->len = len;
+    return 0;
+}
+
+int response_add_pipe(response_t *res, size_t len) {
+    if (len == 0) return 0;
+    response_part_t *p = add_part(res, PART_PIPE);
+    if (!p) return -1;
+    p->len = len;
+    return 0;
+}
+
+// ---- header builder ----
+
+typedef struct {
+    const char *line;   // "HTTP/1.1 404 Not Found\r\n"
+    size_t line_len;
+    const char *page;   // HTML error body
+    size_t page_len;
+} status_t;
+
+#define STATUS_LINE(code, reason) "HTTP/1.1 " #code " " reason "\r\n"
+#define ERROR_PAGE(code, reason) \
+    "<html><head><title>" #code " " reason "</title></head>" \
+    "<body><h1>" #code " " reason "</h1></body></html>"
+#define STATUS(code, reason) [code] = { \
+    STATUS_LINE(code, reason), sizeof(STATUS_LINE(code, reason)) - 1, \
+    ERROR_PAGE(code, reason), sizeof(ERROR_PAGE(code, reason)) - 1 }
+
+static const status_t statuses[600] = {
+    STATUS(100, "Continue"),
+    STATUS(101, "Switching Protocols"),
+    STATUS(200, "OK"),
+    STATUS(201, "Created"),
+    STATUS(202, "Accepted"),
+    STATUS(204, "No Content"),
+    STATUS(206, "Partial Content"),
+    STATUS(301, "Moved Permanently"),
+    STATUS(302, "Found"),
+    STATUS(303, "See Other"),
+    STATUS(304, "Not Modified"),
+    STATUS(307, "Temporary Redirect"),
+    STATUS(308, "Permanent Redirect"),
+    STATUS(400, "Bad Request"),
+    STATUS(401, "Unauthorized"),
+    STATUS(403, "Forbidden"),
+    STATUS(404, "Not Found"),
+    STATUS(405, "Method Not Allowed"),
+    STATUS(408, "Request Timeout"),
+    STATUS(409, "Conflict"),
+    STATUS(411, "Length Required"),
+    STATUS(412, "Precondition Failed"),
+    STATUS(413, "Content Too Large"),
+    STATUS(414, "URI Too Long"),
+    STATUS(415, "Unsupported Media Type"),
+    STATUS(416, "Range Not Satisfiable"),
+    STATUS(429, "Too Many Requests"),
+    STATUS(431, "Request Header Fields Too Large"),
+    STATUS(500, "Internal Server Error"),
+    STATUS(501, "Not Implemented"),
+    STATUS(502, "Bad Gateway"),
+    STATUS(503, "Service Unavailable"),
+    STATUS(504, "Gateway Timeout"),
+    STATUS(505, "HTTP Version Not Supported"),
+};
+
+static const status_t *status_get(int code) {
+    if (code < 0 || code >= (int)(sizeof(statuses) / sizeof(statuses[0]))) return NULL;
+    return statuses[code].line ? &statuses[code] : NULL;
+}
+
+// "Date: <IMF-fixdate>\r\n", rebuilt when the second changes.
+static _Thread_local time_t date_sec = -1;
+static _Thread_local char date_line[sizeof("Date: \r\n") + HTTP_DATE_MAX];
+static _Thread_local size_t date_len;
+
+int response_date(response_t *res) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    if (ts.tv_sec != date_sec) {
+        char date[HTTP_DATE_MAX];
+        http_format_date(ts.tv_sec, date);
+        size_t n = strlen(date);
+        memcpy(date_line, "Date: ", 6);
+        memcpy(date_line + 6, date, n);
+        memcpy(date_line + 6 + n, "\r\n", 2);
+        date_len = n + 8;
+        date_sec = ts.tv_sec;
+    }
+    return response_append(res, date_line, date_len);
+}
+
+int response_status(response_t *res, int code) {
+    const status_t *st = status_get(code);
+    res->status = code;
+    int rc = st ? response_append(res, st->line, st->line_len)
+                : response_printf(res, "HTTP/1.1 %d \r\n", code);
+    return rc < 0 ? -1 : response_date(res);
+}
+
+int response_header(response_t *res, const char *name, const char *value) {
+    size_t nl = strlen(name);
+    size_t vl = strlen(value);
+    response_part_t *p = owned_tail(res);
+    if (!p || buf_reserve(&res->buf, nl + vl + 4) < 0) return -1;
+    char *d = res->buf.data + res->buf.len;
+    memcpy(d, name, nl);
+    memcpy(d + nl, ": ", 2);
+    memcpy(d + nl + 2, value, vl);
+    memcpy(d + nl + 2 + vl, "\r\n", 2);
+    res->buf.len += nl + vl + 4;
+    p->len += nl + vl + 4;
+    return 0;
+}
+
+int response_content_length(response_t *res, size_t len) {
+    char digits[24];
+    char *d = digits + sizeof(digits);
+    *--d = '\0';
+    do {
+        *--d = '0' + len % 10;
+        len /= 10;
+    } while (len);
+    return response_header(res, "Content-Length", d);
+}
+
+int response_end_headers(response_t *res) {
+    static const char ka[] = "Connection: keep-alive\r\n\r\n";
+    static const char closing[] = "Connection: close\r\n\r\n";
+    return res->keep_alive ? response_append(res, ka, sizeof(ka) - 1)
+                           : response_append(res, closing, sizeof(closing) - 1);
+}
+
+int response_error(response_t *res, int code) {
+    const status_t *st = status_get(code);
+    if (response_status(res, code) < 0) return -1;
+    size_t len = st ? st->page_len : 0;
+    if (len > 0 && response_header(res, "Content-Type", "text/html") < 0) return -1;
+    if (response_content_length(res, len) < 0 || response_end_headers(res) < 0) return -1;
+    return res->head || len == 0 ? 0 : response_add_segment(res, st->page, len);
+}
+
+int response_chunk(response_t *res, const void *data, size_t len) {
+    if (len == 0) return 0; // an empty chunk would end the body
+    if (!res->chunked) return response_append(res, data, len);
+    if (response_printf(res, "%zx\r\n", len) < 0 ||
+        response_append(res, data, len) < 0)
+        return -1;
+    return response_append(res, "\r\n", 2);
+}
+
+int response_chunk_end(response_t *res) {
+    return res->chunked ? response_append(res, "0\r\n\r\n", 5) : 0;
+}
+
+void response_queue_init(response_queue_t *q) {
+    for (int i = 0; i < RESPONSE_QUEUE_MAX; i++) response_init(&q->items[i]);
+    q->first = q->count = 0;
+}
+
+response_t *response_queue_push(response_queue_t *q) {
+    if (q->count == RESPONSE_QUEUE_MAX) return NULL;
+    response_t *res = &q->items[(q->first + q->count++) % RESPONSE_QUEUE_MAX];
+    response_reset(res);
+    return res;
+}
+
+void response_free(response_t *res) {
+    response_reset(res);
+    buf_free(&res->buf);
+    if (res->parts != res->inline_parts) free(res->parts);
+    res->parts = res->inline_parts;
+    res->cap_parts = RESPONSE_INLINE_PARTS;
+}
+
+void response_queue_free(response_queue_t *q) {
+    for (int i = 0; i < RESPONSE_QUEUE_MAX; i++) response_free(&q->items[i]);
+    q->first = q->count = 0;
+}
+
+static response_t *queue_at(response_queue_t *q, unsigned i) {
+    return &q->items[(q->first + i) % RESPONSE_QUEUE_MAX];
+}
+
+static const char *part_ptr(const response_t *res, const response_part_t *p) {
+    return p->kind == PART_OWNED ? res->buf.data + p->off : p->ptr;
+}
+
+// The unsent in-memory parts of the queued responses up to the next file
+// part, as iovecs. *flags gets RESPONSE_IO_MORE when a file part follows
+// and RESPONSE_IO_LAST when the iovecs hold all that is left to send.
+static int gather(response_queue_t *q, struct iovec *iov, int max, int *flags) {
+    int n = 0;
+    *flags = 0;
+    for (unsigned i = 0; i < q->count; i++) {
+        response_t *res = queue_at(q, i);
+        int p;
+        for (p = res->cur; p < res->nparts && n < max; p++) {
+            const response_part_t *part = &res->parts[p];
+            if (part->kind == PART_FILE || part->kind == PART_PIPE) {
+                *flags = RESPONSE_IO_MORE;
+                return n;
+            }
+            size_t skip = p == res->cur ? res->cur_sent : 0;
+            iov[n].iov_base = (char *)part_ptr(res, part) + skip;
+            iov[n].iov_len = part->len - skip;
+            n++;
+        }
+        // Later responses wait for the rest of a streamed one.
+        if (p < res->nparts || res->produce) return n;
+    }
+    *flags = RESPONSE_IO_LAST;
+    return n;
+}
+
+// Account for w bytes of the queue having been sent: gathered parts, or
+// the file part at the front (response_queue_file()).
+static void advance(response_queue_t *q, size_t w) {
+    for (unsigned i = 0; i < q->count && w > 0; i++) {
+        response_t *res = queue_at(q, i);
+        while (res->cur < res->nparts && w > 0) {
+            response_part_t *part = &res->parts[res->cur];
+            size_t left = part->len - res->cur_sent;
+            size_t take = w < left ? w : left;
+            res->cur_sent += take;
+            res->sent += take;
+            w -= take;
+            if (res->cur_sent == part->len) {
+                res->cur++;
+                res->cur_sent = 0;
+            }
+        }
+    }
+}
+
+// Fully sent responses leave the front of the queue.
+static void retire(response_queue_t *q) {
+    while (q->count > 0) {
+        response_t *res = queue_at(q, 0);
+        if (res->cur < res->nparts || res->produce) break;
+        if (res->status) metrics_response(res->status);
+        if (res->ready_at) metrics_observe(PHASE_WRITE, metrics_clock() - res->ready_at);
+        response_reset(res);
+        q->first = (q->first + 1) % RESPONSE_QUEUE_MAX;
+        q->count--;
+    }
+}
+
+// Send the unsent in-memory parts of the queued responses up to the next
+// file part.
+static int write_memory(int fd, response_queue_t *q) {
+    struct iovec iov[MAX_IOV];
+    int flags;
+    int n = gather(q, iov, MAX_IOV, &flags);
+    if (n == 0) return 1;
+
+    // MSG_MORE holds the headers back so they share a segment with the
+    // start of the sendfile body that follows.
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = n };
+    ssize_t w;
+    do {
+        w = sendmsg(fd, &msg, flags & RESPONSE_IO_MORE ? MSG_MORE : 0);
+    } while (w < 0 && errno == EINTR);
+    if (w < 0) return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    metrics_add(METRIC_BYTES_OUT, w);
+    advance(q, w);
+    return 1;
+}
+
+// A file part with sendfile(), or a pipe part with splice().
+static int write_file(int fd, response_t *res) {
+    response_part_t *part = &res->parts[res->cur];
+    while (res->cur_sent < part->len) {
+        off_t off = part->off + res->cur_sent;
+        size_t left = part->len - res->cur_sent;
+        ssize_t s = part->kind == PART_PIPE
+            ? splice(res->file_fd, NULL, fd, NULL, left, SPLICE_F_MOVE | SPLICE_F_NONBLOCK)
+            : sendfile(fd, res->file_fd, &off, left);
+        if (s < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        if (s == 0) return -1; // file shrank underneath us, or the pipe ran dry
+        metrics_add(METRIC_BYTES_OUT, s);
+        res->cur_sent += s;
+        res->sent += s;
+    }
+    res->cur++;
+    res->cur_sent = 0;
+    return 1;
+}
+
+int response_produce(response_t *res) {
+    res->buf.len = 0;
+    res->nparts = 0;
+    res->cur = 0;
+    res->cur_sent = 0;
+    res->wait_fd = -1;
+    int rc = res->produce(res, res->produce_arg);
+    if (rc < 0) return -1;
+    if (rc == RESPONSE_WAIT) return 0;
+    if (rc == RESPONSE_DONE) res->produce = NULL;
+    return 1;
+}
+
+int response_queue_write(int fd, response_queue_t *q) {
+    while (q->count > 0) {
+        response_t *res = queue_at(q, 0);
+        if (res->cur == res->nparts && res->produce) {
+            int r = response_produce(res);
+            if (r <= 0) return r;
+        }
+
+        int r = write_memory(fd, q);
+        if (r <= 0) return r;
+
+        res = queue_at(q, 0);
+        if (res->cur < res->nparts) {
+            int kind = res->parts[res->cur].kind;
+            if (kind != PART_FILE && kind != PART_PIPE) continue; // partial send
+            r = write_file(fd, res);
+            if (r <= 0) return r;
+        }
+
+        retire(q);
+    }
+    return 1;
+}
+
+int response_queue_next(response_queue_t *q, struct iovec *iov, int max, int *n, int *flags) {
+    while (q->count > 0) {
+        response_t *res = queue_at(q, 0);
+        if (res->cur == res->nparts && res->produce) {
+            int r = response_produce(res);
+            if (r < 0) return -1;
+            if (r == 0) return RESPONSE_IO_WAIT;
+        }
+        *n = gather(q, iov, max, flags);
+        if (*n > 0) return RESPONSE_IO_SEND;
+        if (res->cur < res->nparts) return RESPONSE_IO_FILE;
+        retire(q);
+    }
+    return RESPONSE_IO_DONE;
+}
+
+void response_queue_sent(response_queue_t *q, size_t len) {
+    metrics_add(METRIC_BYTES_OUT, len);
+    advance(q, len);
+    retire(q);
+}
+
+int response_queue_file(const response_queue_t *q, off_t *off, size_t *len) {
+    const response_t *res = &q->items[q->first];
+    const response_part_t *part = &res->parts[res->cur];
+    *off = part->off + res->cur_sent;
+    *len = part->len - res->cur_sent;
+    return res->file_fd;
+}
+
+int response_queue_waiting(const response_queue_t *q, short *events) {
+    if (q->count == 0) return -1;
+    const response_t *res = &q->items[q->first];
+    if (!res->produce || res->cur < res->nparts) return -1;
+    *events = res->wait_events;
+    return res->wait_fd;
+}
@@ -1,69 +1,627 @@
-#define _POSIX_C_SOURCE 200809L
-
-#include "router.h"
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <fcntl.h>
-#include <unistd.h>
-#include <sys/stat.h>
-#include <sys/sendfile.h>
-#include <errno.h>
-#include <limits.h>
-
-const char* guess_mime(const char *path) {
-    const char *ext = strrchr(path, '.');
-    if (!ext) return "application/octet-stream";
-    if (strcmp(ext, ".html") == 0) return "text/html";
-    if (strcmp(ext, ".css") == 0) return "text/css";
-    if (strcmp(ext, ".js") == 0) return "application/javascript";
-    if (strcmp(ext, ".png") == 0) return "image/png";
-    if (strcmp(ext, ".jpg") == 0 || strcmp(ext, ".jpeg") == 0) return "image/jpeg";
-    if (strcmp(ext, ".gif") == 0) return "image/gif";
-    if (strcmp(ext, ".txt") == 0) return "text/plain";
-    return "application/octet-stream";
-}
-
-int serve_static(int fd, const char *root, const char *path, int is_head) {
-    char full[PATH_MAX];
-    snprintf(full, sizeof(full), "%s%s", root, path);
-
-    int file_fd = open(full, O_RDONLY);
-    if (file_fd < 0) return -1;
-
-    struct stat st;
-    if (fstat(file_fd, &st) < 0) {
-        close(file_fd);
-        return -1;
-    }
-
-    const char *mime = guess_mime(full);
-
-    char header[512];
-    int n = snprintf(header, sizeof(header),
-                     "HTTP/1.1 200 OK\r\n"
-                     "Content-Length: %ld\r\n"
-                     "Content-Type: %s\r\n"
-                     "Connection: close\r\n"
-                     "\r\n",
-                     st.st_size, mime);
-    (void)write(fd, header, n);
-
-    if (!is_head) {
-        off_t offset = 0;
-        while (offset < st.st_size) {
-            ssize_t sent = sendfile(fd, file_fd, &offset, st.st_size - offset);
-            if (sent <= 0) {
-                if (errno == EINTR) continue;
-                if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                    usleep(1000);
-                    continue;
-                }
-                break;
-            }
-        }
-    }
-
-    close(file_fd);
-    return 0;
-}
+#define _GNU_SOURCE
+
+#include "router.h"
+#include "fdcache.h"
+#include "filecache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <strings.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+
+const char* guess_mime(const char *path) {
+    const char *ext = strrchr(path, '.');
+    if (!ext) return "application/octet-stream";
+    if (strcasecmp(ext, ".html") == 0 || strcasecmp(ext, ".htm") == 0) return "text/html";
+    if (strcasecmp(ext, ".css") == 0) return "text/css";
+    if (strcasecmp(ext, ".js") == 0) return "application/javascript";
+    if (strcasecmp(ext, ".json") == 0) return "application/json";
+    if (strcasecmp(ext, ".png") == 0) return "image/png";
+    if (strcasecmp(ext, ".jpg") == 0 || strcasecmp(ext, ".jpeg") == 0) return "image/jpeg";
+    if (strcasecmp(ext, ".gif") == 0) return "image/gif";
+    if (strcasecmp(ext, ".svg") == 0) return "image/svg+xml";
+    if (strcasecmp(ext, ".ico") == 0) return "image/x-icon";
+    if (strcasecmp(ext, ".webp") == 0) return "image/webp";
+    if (strcasecmp(ext, ".woff2") == 0) return "font/woff2";
+    if (strcasecmp(ext, ".txt") == 0) return "text/plain";
+    if (strcasecmp(ext, ".xml") == 0) return "application/xml";
+    if (strcasecmp(ext, ".pdf") == 0) return "application/pdf";
+    if (strcasecmp(ext, ".wasm") == 0) return "application/wasm";
+    return "application/octet-stream";
+}
+
+int mime_compressible(const char *mime) {
+    return strncmp(mime, "text/", 5) == 0 ||
+           strcmp(mime, "application/javascript") == 0 ||
+           strcmp(mime, "application/json") == 0 ||
+           strcmp(mime, "application/xml") == 0 ||
+           strcmp(mime, "application/wasm") == 0 ||
+           strcmp(mime, "image/svg+xml") == 0;
+}
+
+int path_is_safe(const char *path) {
+    if (path[0] != '/') return 0;
+    for (const char *p = path; (p = strstr(p, "/.")) != NULL; p++) {
+        if (p[2] == '/' || p[2] == '\0') return 0;
+        if (p[2] == '.' && (p[3] == '/' || p[3] == '\0')) return 0;
+    }
+    return 1;
+}
+
+void static_etag(const struct stat *st, char *out, size_t cap) {
+    snprintf(out, cap, "\"%llx-%llx-%llx\"",
+             (unsigned long long)st->st_ino, (unsigned long long)st->st_size,
+             (unsigned long long)st->st_mtim.tv_sec * 1000000000ULL + st->st_mtim.tv_nsec);
+}
+
+// What serve_static() needs to know about a file, whichever cache it came
+// from. Exactly one of cached / file is set; `cached` may be the gzip
+// variant of `ref`, the entry actually holding the reference.
+typedef struct {
+    size_t size;
+    time_t mtime;
+    const char *mime;
+    const char *encoding;
+    int vary;
+    char etag[STATIC_ETAG_MAX];
+    char last_modified[HTTP_DATE_MAX];
+    const filecache_entry_t *cached;
+    const filecache_entry_t *ref;
+    const fdcache_entry_t *file;
+} static_file_t;
+
+typedef struct {
+    size_t start, end;  // inclusive
+} byte_range_t;
+
+#define MAX_RANGES 16
+#define RANGE_BOUNDARY "3d6b6a416f9b5a2c"
+
+static void static_file_release(static_file_t *sf) {
+    if (sf->ref) filecache_release((void *)sf->ref);
+    if (sf->file) fdcache_release((void *)sf->file);
+}
+
+// Does an If-None-Match / If-Range list contain our etag? Weak comparison
+// (W/ prefixes ignored) unless `strong` is set.
+static int etag_matches(const char *list, const char *etag, int strong) {
+    size_t elen = strlen(etag);
+    const char *p = list;
+    while (*p) {
+        while (*p == ' ' || *p == '\t' || *p == ',') p++;
+        if (*p == '*') return 1;
+        int weak = 0;
+        if (p[0] == 'W' && p[1] == '/') {
+            weak = 1;
+            p += 2;
+        }
+        const char *tok = p;
+        while (*p && *p != ',') p++;
+        size_t len = p - tok;
+        while (len > 0 && (tok[len-1] == ' ' || tok[len-1] == '\t')) len--;
+        if (len == elen && memcmp(tok, etag, elen) == 0 && !(strong && weak))
+            return 1;
+    }
+    return 0;
+}
+
+// Whether Accept-Encoding allows `coding`: listed with a non-zero q, or
+// covered by a non-zero "*".
+static int accepts_encoding(const http_request_t *req, const char *coding) {
+    const char *h = http_get_header(req, "Accept-Encoding");
+    if (!h) return 0;
+    size_t clen = strlen(coding);
+    int star = 0;
+    const char *p = h;
+    while (*p) {
+        while (*p == ' ' || *p == '\t' || *p == ',') p++;
+        const char *tok = p;
+        while (*p && *p != ',' && *p != ';' && *p != ' ' && *p != '\t') p++;
+        size_t len = p - tok;
+        int q = 1;
+        while (*p && *p != ',') {
+            if (*p == ';') {
+                const char *v = p + 1;
+                while (*v == ' ' || *v == '\t') v++;
+                if ((v[0] == 'q' || v[0] == 'Q') && v[1] == '=')
+                    q = strtod(v + 2, NULL) > 0;
+            }
+            p++;
+        }
+        if (len == clen && strncasecmp(tok, coding, clen) == 0) return q;
+        if (len == 1 && *tok == '*') star = q;
+    }
+    return star;
+}
+
+// RFC 9110 section 13.2.2: If-None-Match wins over If-Modified-Since.
+static int not_modified(const http_request_t *req, const static_file_t *sf) {
+    const char *inm = http_get_header(req, "If-None-Match");
+    if (inm) return etag_matches(inm, sf->etag, 0);
+    const char *ims = http_get_header(req, "If-Modified-Since");
+    time_t since;
+    return ims && http_parse_date(ims, &since) == 0 && sf->mtime <= since;
+}
+
+// Parse "bytes=a-b, c-, -n". Returns the number of satisfiable ranges, 0 if
+// the header should be ignored, or -1 if nothing in it is satisfiable.
+static int parse_ranges(const char *h, size_t size, byte_range_t *out) {
+    if (strncasecmp(h, "bytes=", 6) != 0) return 0;
+    const char *p = h + 6;
+    int n = 0;
+    int specs = 0;
+    while (*p) {
+        while (*p == ' ' || *p == '\t' || *p == ',') p++;
+        if (!*p) break;
+        if (++specs > MAX_RANGES) return 0; // too fragmented; send it whole
+
+        char *end;
+        unsigned long long first = 0, last = 0;
+        int has_first = 0, has_last = 0;
+        if (*p >= '0' && *p <= '9') {
+            first = strtoull(p, &end, 10);
+            p = end;
+            has_first = 1;
+        }
+        if (*p++ != '-') return 0;
+        if (*p >= '0' && *p <= '9') {
+            last = strtoull(p, &end, 10);
+            p = end;
+            has_last = 1;
+        }
+        while (*p == ' ' || *p == '\t') p++;
+        if ((*p && *p != ',') || (!has_first && !has_last)) return 0;
+        if (has_first && has_last && last < first) return 0;
+
+        byte_range_t r;
+        if (!has_first) {               // suffix: last N bytes
+            if (last == 0 || size == 0) continue;
+            r.start = last >= size ? 0 : size - last;
+            r.end = size - 1;
+        } else {
+            if (first >= size) continue;
+            r.start = first;
+            r.end = !has_last || last >= size ? size - 1 : last;
+        }
+        out[n++] = r;
+    }
+    return n > 0 ? n : (specs > 0 ? -1 : 0);
+}
+
+static void add_body(response_t *res, const static_file_t *sf, size_t off, size_t len) {
+    if (sf->cached) response_add_segment(res, sf->cached->data + off, len);
+    else response_add_file(res, off, len);
+}
+
+// Validators and coding, then Connection and the end of the head.
+static void common_headers(response_t *res, const static_file_t *sf) {
+    if (sf->encoding) response_header(res, "Content-Encoding", sf->encoding);
+    if (sf->vary) response_header(res, "Vary", "Accept-Encoding");
+    response_header(res, "ETag", sf->etag);
+    response_header(res, "Last-Modified", sf->last_modified);
+    response_end_headers(res);
+}
+
+static void serve_ranges(response_t *res, const static_file_t *sf,
+                         const byte_range_t *ranges, int n, int is_head) {
+    if (n == 1) {
+        size_t len = ranges[0].end - ranges[0].start + 1;
+        response_status(res, 206);
+        response_content_length(res, len);
+        response_header(res, "Content-Type", sf->mime);
+        response_printf(res, "Content-Range: bytes %zu-%zu/%zu\r\n",
+                        ranges[0].start, ranges[0].end, sf->size);
+        common_headers(res, sf);
+        if (!is_head) add_body(res, sf, ranges[0].start, len);
+        return;
+    }
+
+    // multipart/byteranges: work out the exact length first.
+    char part_head[MAX_RANGES][160];
+    int part_len[MAX_RANGES];
+    size_t total = 0;
+    for (int i = 0; i < n; i++) {
+        part_len[i] = snprintf(part_head[i], sizeof(part_head[i]),
+                               "\r\n--" RANGE_BOUNDARY "\r\n"
+                               "Content-Type: %s\r\n"
+                               "Content-Range: bytes %zu-%zu/%zu\r\n\r\n",
+                               sf->mime, ranges[i].start, ranges[i].end, sf->size);
+        total += part_len[i] + (ranges[i].end - ranges[i].start + 1);
+    }
+    static const char closing[] = "\r\n--" RANGE_BOUNDARY "--\r\n";
+    total += sizeof(closing) - 1;
+
+    response_status(res, 206);
+    response_content_length(res, total);
+    response_header(res, "Content-Type", "multipart/byteranges; boundary=" RANGE_BOUNDARY);
+    common_headers(res, sf);
+    if (is_head) return;
+    for (int i = 0; i < n; i++) {
+        response_append(res, part_head[i], part_len[i]);
+        add_body(res, sf, ranges[i].start, ranges[i].end - ranges[i].start + 1);
+    }
+    response_append(res, closing, sizeof(closing) - 1);
+}
+
+// Look full + suffix up in the memory cache, then the descriptor cache.
+// `encoding` names the coding of a precompressed sibling.
+static int open_static(const char *full, const char *suffix, const char *mime,
+                       const char *encoding, static_file_t *sf) {
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s%s", full, suffix) >= (int)sizeof(path))
+        return -1;
+
+    memset(sf, 0, sizeof(*sf));
+    sf->cached = filecache_get(path);
+    if (!sf->cached) {
+        sf->file = fdcache_get(path, suffix[0] != '\0');
+        if (!sf->file) return -1;
+        if (!S_ISREG(sf->file->st.st_mode)) {
+            static_file_release(sf);
+            return -1;
+        }
+        // Small enough for memory: load it from the descriptor we hold.
+        if (filecache_fits(sf->file->st.st_size)) {
+            sf->cached = filecache_load(path, sf->file->fd, mime, encoding);
+            if (sf->cached) {
+                fdcache_release((void *)sf->file);
+                sf->file = NULL;
+            }
+        }
+    }
+    sf->ref = sf->cached;
+
+    if (sf->cached) {
+        sf->size = sf->cached->size;
+        sf->mtime = sf->cached->mtime;
+        sf->mime = sf->cached->mime;
+        sf->encoding = sf->cached->encoding;
+        sf->vary = sf->cached->vary;
+        snprintf(sf->etag, sizeof(sf->etag), "%s", sf->cached->etag);
+        snprintf(sf->last_modified, sizeof(sf->last_modified), "%s", sf->cached->last_modified);
+    } else {
+        sf->size = sf->file->st.st_size;
+        sf->mtime = sf->file->st.st_mtime;
+        sf->mime = mime;
+        sf->encoding = encoding;
+        sf->vary = mime_compressible(mime);
+        static_etag(&sf->file->st, sf->etag, sizeof(sf->etag));
+        http_format_date(sf->mtime, sf->last_modified);
+    }
+    return 0;
+}
+
+// Pick the representation: a precompressed .br or .gz sibling, then the
+// cached gzip variant, then the file itself. Only text-like types are
+// negotiated, so binary files never pay for the sibling probes.
+static int select_static(const http_request_t *req, const char *full, static_file_t *sf) {
+    const char *mime = guess_mime(full);
+    if (!mime_compressible(mime))
+        return open_static(full, "", mime, NULL, sf);
+
+    int gzip = accepts_encoding(req, "gzip");
+    if (accepts_encoding(req, "br") && open_static(full, ".br", mime, "br", sf) == 0)
+        return 0;
+    if (gzip && open_static(full, ".gz", mime, "gzip", sf) == 0)
+        return 0;
+    if (open_static(full, "", mime, NULL, sf) < 0)
+        return -1;
+
+    if (gzip && sf->cached && sf->cached->gzip) {
+        sf->cached = sf->cached->gzip;
+        sf->size = sf->cached->size;
+        sf->encoding = sf->cached->encoding;
+        snprintf(sf->etag, sizeof(sf->etag), "%s", sf->cached->etag);
+    }
+    return 0;
+}
+
+int serve_static(response_t *res, const http_request_t *req, const char *root, const char *path) {
+    if (!path_is_safe(path)) return -1;
+
+    char full[PATH_MAX];
+    if (snprintf(full, sizeof(full), "%s%s", root, path) >= (int)sizeof(full))
+        return -1;
+
+    static_file_t sf;
+    if (select_static(req, full, &sf) < 0) return -1;
+    int is_head = http_slice_eq(req->method, "HEAD");
+
+    if (not_modified(req, &sf)) {
+        response_status(res, 304);
+        common_headers(res, &sf);
+        static_file_release(&sf);
+        return 0;
+    }
+
+    // Range applies only when If-Range (if any) still names this version.
+    const char *range = http_get_header(req, "Range");
+    const char *if_range = http_get_header(req, "If-Range");
+    if (range && if_range) {
+        if (if_range[0] == '"' || strncmp(if_range, "W/", 2) == 0) {
+            if (!etag_matches(if_range, sf.etag, 1)) range = NULL;
+        } else if (strcmp(if_range, sf.last_modified) != 0) {
+            range = NULL;
+        }
+    }
+
+    byte_range_t ranges[MAX_RANGES];
+    int n = range ? parse_ranges(range, sf.size, ranges) : 0;
+    if (n < 0) {
+        response_status(res, 416);
+        response_content_length(res, 0);
+        response_printf(res, "Content-Range: bytes */%zu\r\n", sf.size);
+        common_headers(res, &sf);
+        static_file_release(&sf);
+        return 0;
+    }
+
+    if (n > 0) {
+        serve_ranges(res, &sf, ranges, n, is_head);
+    } else if (sf.cached) {
+        // Full hits go out with the pre-built header block.
+        res->status = 200;
+        response_add_segment(res, sf.cached->headers, sf.cached->headers_len);
+        response_date(res);
+        response_end_headers(res);
+        if (!is_head) add_body(res, &sf, 0, sf.size);
+    } else {
+        response_status(res, 200);
+        response_content_length(res, sf.size);
+        response_header(res, "Content-Type", sf.mime);
+        response_header(res, "Accept-Ranges", "bytes");
+        common_headers(res, &sf);
+        if (!is_head) add_body(res, &sf, 0, sf.size);
+    }
+
+    // The response now borrows the cache entry until it is written; file
+    // parts are streamed by response_queue_write() with sendfile.
+    if (sf.cached) {
+        res->release = filecache_release;
+        res->release_arg = (void *)sf.ref;
+    } else {
+        res->file_fd = sf.file->fd;
+        res->release = fdcache_release;
+        res->release_arg = (void *)sf.file;
+    }
+    return 0;
+}
+
+// ---- route table ----
+
+typedef struct route {
+    unsigned methods;
+    route_fn fn;
+    void *arg;
+    int nparams;
+    char *names[ROUTE_MAX_PARAMS];
+    struct route *next;
+} route_t;
+
+// A radix trie node. Static edges are keyed by their first byte; a ":name"
+// segment hangs off `param` and consumes up to the next '/'.
+typedef struct node {
+    char *label;
+    size_t label_len;
+    struct node **children;
+    int nchildren;
+    struct node *param;
+    route_t *exact;     // routes ending here
+    route_t *prefix;    // "/*" routes mounted here
+} node_t;
+
+struct router {
+    node_t root;
+};
+
+static const struct {
+    const char *name;
+    unsigned bit;
+} methods[] = {
+    { "GET", ROUTE_GET }, { "HEAD", ROUTE_HEAD }, { "POST", ROUTE_POST },
+    { "PUT", ROUTE_PUT }, { "DELETE", ROUTE_DELETE }, { "OPTIONS", ROUTE_OPTIONS },
+    { "PATCH", ROUTE_PATCH },
+};
+
+unsigned route_method(http_slice_t method) {
+    for (size_t i = 0; i < sizeof(methods) / sizeof(methods[0]); i++) {
+        if (http_slice_eq(method, methods[i].name)) return methods[i].bit;
+    }
+    return 0;
+}
+
+void route_allow(unsigned mask, char *out, size_t cap) {
+    size_t len = 0;
+    out[0] = '\0';
+    for (size_t i = 0; i < sizeof(methods) / sizeof(methods[0]) && len < cap; i++) {
+        if (!(mask & methods[i].bit)) continue;
+        len += snprintf(out + len, cap - len, "%s%s", len ? ", " : "", methods[i].name);
+    }
+}
+
+router_t *router_new(void) {
+    return calloc(1, sizeof(router_t));
+}
+
+static node_t *node_new(const char *label, size_t len) {
+    node_t *n = calloc(1, sizeof(*n));
+    if (!n) return NULL;
+    n->label = strndup(label, len);
+    n->label_len = len;
+    if (!n->label) {
+        free(n);
+        return NULL;
+    }
+    return n;
+}
+
+// Free a node that never made it into the tree. Its children, if any, are
+// still owned by their old parent.
+static void node_free(node_t *n) {
+    if (!n) return;
+    free(n->label);
+    free(n->children);
+    free(n);
+}
+
+static int node_add_child(node_t *n, node_t *child) {
+    node_t **c = realloc(n->children, (n->nchildren + 1) * sizeof(*c));
+    if (!c) return -1;
+    c[n->nchildren++] = child;
+    n->children = c;
+    return 0;
+}
+
+// Walk or grow the static edges spelling s[0, len) below n, splitting an
+// edge where s diverges from it. Returns the node s ends at.
+static node_t *insert_static(node_t *n, const char *s, size_t len) {
+    while (len > 0) {
+        int i = 0;
+        while (i < n->nchildren && n->children[i]->label[0] != s[0]) i++;
+        if (i == n->nchildren) {
+            node_t *child = node_new(s, len);
+            if (!child || node_add_child(n, child) < 0) {
+                node_free(child);
+                return NULL;
+            }
+            return child;
+        }
+
+        node_t *c = n->children[i];
+        size_t common = 0;
+        while (common < c->label_len && common < len && c->label[common] == s[common])
+            common++;
+        if (common < c->label_len) {
+            node_t *mid = node_new(c->label, common);
+            char *rest = strdup(c->label + common);
+            if (!mid || !rest || node_add_child(mid, c) < 0) {
+                node_free(mid);
+                free(rest);
+                return NULL;
+            }
+            free(c->label);
+            c->label = rest;
+            c->label_len -= common;
+            n->children[i] = mid;
+            c = mid;
+        }
+        n = c;
+        s += common;
+        len -= common;
+    }
+    return n;
+}
+
+static int add_route(route_t **list, route_t *rt) {
+    for (route_t *o = *list; o; o = o->next) {
+        if (o->methods & rt->methods) return -1;
+    }
+    rt->next = *list;
+    *list = rt;
+    return 0;
+}
+
+int router_add(router_t *r, unsigned methods, const char *pattern, route_fn fn, void *arg) {
+    if (pattern[0] != '/' || methods == 0) return -1;
+    route_t *rt = calloc(1, sizeof(*rt));
+    if (!rt) return -1;
+    rt->methods = methods;
+    rt->fn = fn;
+    rt->arg = arg;
+
+    node_t *n = &r->root;
+    const char *p = pattern;
+    for (;;) {
+        // Static text up to the next parameter or wildcard.
+        size_t len = 0;
+        while (p[len] && !(p[len] == ':' && p[len - 1] == '/') &&
+               !(p[len] == '*' && p[len - 1] == '/'))
+            len++;
+        if (len > 0 && !(n = insert_static(n, p, len))) goto fail;
+        p += len;
+
+        if (*p == '\0') {
+            if (add_route(&n->exact, rt) < 0) goto fail;
+            return 0;
+        }
+        if (*p == '*') {
+            if (p[1] != '\0' || add_route(&n->prefix, rt) < 0) goto fail;
+            return 0;
+        }
+
+        // ":name", ending at the next '/'.
+        size_t name_len = strcspn(++p, "/");
+        if (name_len == 0 || rt->nparams == ROUTE_MAX_PARAMS) goto fail;
+        if (!(rt->names[rt->nparams++] = strndup(p, name_len))) goto fail;
+        if (!n->param && !(n->param = node_new("", 0))) goto fail;
+        n = n->param;
+        p += name_len;
+    }
+
+fail:
+    for (int i = 0; i < rt->nparams; i++) free(rt->names[i]);
+    free(rt);
+    return -1;
+}
+
+static const route_t *pick(const route_t *list, unsigned method, route_match_t *m) {
+    for (; list; list = list->next) {
+        m->allowed |= list->methods;
+        if (list->methods & method) return list;
+    }
+    return NULL;
+}
+
+// Depth-first over the candidates in precedence order; p is the part of
+// the path below n.
+static const route_t *search(const node_t *n, const char *p, unsigned method,
+                             route_match_t *m) {
+    const route_t *rt;
+    if (*p == '\0' && (rt = pick(n->exact, method, m))) return rt;
+
+    for (int i = 0; i < n->nchildren; i++) {
+        const node_t *c = n->children[i];
+        if (c->label[0] != *p) continue;
+        if (strncmp(p, c->label, c->label_len) == 0 &&
+            (rt = search(c, p + c->label_len, method, m)))
+            return rt;
+        break;  // edges below one node start with distinct bytes
+    }
+
+    if (n->param && *p && *p != '/' && m->nparams < ROUTE_MAX_PARAMS) {
+        const char *end = strchrnul(p, '/');
+        m->params[m->nparams++].value = (http_slice_t){ p, end - p };
+        if ((rt = search(n->param, end, method, m))) return rt;
+        m->nparams--;
+    }
+
+    if ((rt = pick(n->prefix, method, m))) {
+        m->rest = p - 1;
+        return rt;
+    }
+    return NULL;
+}
+
+int router_match(const router_t *r, unsigned method, const char *path, route_match_t *m) {
+    m->allowed = 0;
+    m->nparams = 0;
+    m->rest = NULL;
+    const route_t *rt = search(&r->root, path, method, m);
+    if (!rt) return m->allowed ? 405 : 404;
+    m->fn = rt->fn;
+    m->arg = rt->arg;
+    for (int i = 0; i < m->nparams; i++) m->params[i].name = rt->names[i];
+    return 0;
+}
+
+http_slice_t route_param(const route_match_t *m, const char *name) {
+    for (int i = 0; i < m->nparams; i++) {
+        if (strcmp(m->params[i].name, name) == 0) return m->params[i].value;
+    }
+    return (http_slice_t){ "", 0 };
+}
@@ -1,328 +1,1058 @@
-#define _POSIX_C_SOURCE 200809L
-
-#include <errno.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <limits.h>
-#include <unistd.h>
-#include <arpa/inet.h>
-#include <sys/select.h>
-#include <sys/socket.h>
-#include <sys/wait.h>
-#include <sys/stat.h>
-#include <netinet/in.h>
-#include <fcntl.h>
-#include "http.h"
-#include "router.h"
-#include "threadpool.h"
-
-#define PORT 8080
-#define BACKLOG 128
-
-ssize_t write_all(int fd, const void *buf, size_t count) {
-    size_t written = 0;
-    while (written < count) {
-        ssize_t r = write(fd, (const char*)buf + written, count - written);
-        if (r < 0) {
-            if (errno == EINTR) continue;
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                // Yield CPU briefly if socket not ready
-                usleep(1000);
-                continue;
-            }
-            return -1;  // permanent error
-        }
-        written += r;
-    }
-    return written;
-}
-
-void log_request(const http_request_t *req) {
-    fprintf(stderr, "%s %s %s", req->method, req->path, req->version);
-    if (req->query_count > 0) {
-        fprintf(stderr, " [");
-        for (int i = 0; i < req->query_count; i++) {
-            if (i > 0) fprintf(stderr, ", ");
-            fprintf(stderr, "%s=%s", req->query[i].key, req->query[i].value);
-        }
-        fprintf(stderr, "]");
-    }
-    fprintf(stderr, "\n");
-}
-
-
-void handle_connection(int fd) {
-    http_request_t req;
-    memset(&req, 0, sizeof(req));
-    int keep_alive = 0;
-
-    do {
-        if (parse_http_request(fd, &req) < 0) {
-            const char *resp = 
-                "HTTP/1.1 400 Bad Request\r\n"
-                "Content-Length: 0\r\n"
-                "Connection: close\r\n\r\n";
-            write(fd, resp, strlen(resp));
-            break;
-        }
-
-        // Check Connection header
-        keep_alive = 0;
-        for (int i = 0; i < req.header_count; i++) {
-            if (strcasecmp(req.headers[i].name, "Connection") == 0 &&
-                strcasecmp(req.headers[i].value, "keep-alive") == 0) {
-                keep_alive = 1;
-                break;
-            }
-        }
-
-        if (strcmp(req.method, "GET") != 0 &&
-            strcmp(req.method, "HEAD") != 0 &&
-            strcmp(req.method, "POST") != 0 &&
-            strcmp(req.method, "DELETE") != 0) {
-            const char *resp = 
-                "HTTP/1.1 400 Bad Request\r\n"
-                "Content-Length: 0\r\n"
-                "Connection: close\r\n\r\n";
-            write(fd, resp, strlen(resp));
-            close(fd);
-            return;
-        }
-
-        if (strcmp(req.path, "/") == 0) {
-            strcpy(req.path, "/index.html");
-        }
-
-        log_request(&req);
-
-        // GET/HEAD
-        if (strcmp(req.method, "GET") == 0 || strcmp(req.method, "HEAD") == 0) {
-            char fullpath[PATH_MAX];
-            snprintf(fullpath, sizeof(fullpath), "www%s", req.path);
-            FILE *f = fopen(fullpath, "rb");
-            if (!f) {
-                const char *resp = 
-                    "HTTP/1.1 404 Not Found\r\n"
-                    "Content-Length: 0\r\n"
-                    "Connection: close\r\n\r\n";
-                write(fd, resp, strlen(resp));
-            } else {
-                fseek(f, 0, SEEK_END);
-                size_t len = ftell(f);
-                fseek(f, 0, SEEK_SET);
-
-                char header[512];
-                int n = snprintf(header, sizeof(header),
-                                 "HTTP/1.1 200 OK\r\n"
-                                 "Content-Length: %zu\r\n"
-                                 "Content-Type: text/html\r\n"
-                                 "Connection: %s\r\n"
-                                 "Set-Cookie: visited=1\r\n\r\n",
-                                 len,
-                                 keep_alive ? "keep-alive" : "close");
-                write(fd, header, n);
-
-                if (strcmp(req.method, "GET") == 0) {
-                    char buf[4096];
-                    size_t r;
-                    while ((r = fread(buf, 1, sizeof(buf), f)) > 0) {
-                        write(fd, buf, r);
-                    }
-                }
-                fclose(f);
-            }
-        }
-
-        // POST handling (including file upload / multipart)
-        else if (strcmp(req.method, "POST") == 0) {
-            const char *ctype = NULL;
-            for (int i = 0; i < req.header_count; i++) {
-                if (strcasecmp(req.headers[i].name, "Content-Type") == 0) {
-                    ctype = req.headers[i].value;
-                    break;
-                }
-            }
-
-            if (ctype && strncmp(ctype, "multipart/form-data;", 20) == 0) {
-                const char *bstr = strstr(ctype, "boundary=");
-                if (!bstr) {
-                    const char *resp = 
-                        "HTTP/1.1 400 Bad Request\r\n"
-                        "Content-Length: 0\r\n"
-                        "Connection: close\r\n\r\n";
-                    write(fd, resp, strlen(resp));
-                } else {
-                    char boundary[128];
-                    snprintf(boundary, sizeof(boundary), "--%s", bstr + 9);
-                    char *pos = req.body;
-                    char *end = req.body + req.body_len;
-                    mkdir("www/uploads", 0755);
-
-                    while (pos < end) {
-                        char *part_start = strstr(pos, boundary);
-                        if (!part_start) break;
-                        part_start += strlen(boundary);
-                        if (strncmp(part_start, "\r\n", 2) == 0) part_start += 2;
-
-                        char *part_end = strstr(part_start, boundary);
-                        if (!part_end) break;
-
-                        char *header_end = strstr(part_start, "\r\n\r\n");
-                        if (!header_end) break;
-                        char *content = header_end + 4;
-
-                        char filename[256] = {0};
-                        char *cd = strstr(part_start, "Content-Disposition:");
-                        if (cd) {
-                            char *fn = strstr(cd, "filename=\"");
-                            if (fn) {
-                                fn += 10;
-                                char *q = strchr(fn, '"');
-                                if (q) *q = 0;
-                                strncpy(filename, fn, sizeof(filename)-1);
-                            }
-                        }
-
-                        size_t content_len = part_end - content;
-                        if (content_len >= 2 && content[content_len - 2] == '\r' &&
-                            content[content_len - 1] == '\n') content_len -= 2;
-
-                        if (filename[0] && content_len > 0) {
-                            char fullpath[PATH_MAX];
-                            snprintf(fullpath, sizeof(fullpath), "www/uploads/%s", filename);
-                            FILE *f = fopen(fullpath, "wb");
-                            if (f) {
-                                fwrite(content, 1, content_len, f);
-                                fclose(f);
-                            }
-                        }
-                        pos = part_end;
-                    }
-
-                    const char *resp = 
-                        "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nConnection: close\r\n\r\nUploaded successfully";
-                    write(fd, resp, strlen(resp));
-                }
-            } else {
-                char header[256];
-                int n = snprintf(header, sizeof(header),
-                                 "HTTP/1.1 200 OK\r\n"
-                                 "Content-Length: %ld\r\n"
-                                 "Content-Type: text/plain\r\n"
-                                 "Connection: %s\r\n\r\n",
-                                 req.body_len,
-                                 keep_alive ? "keep-alive" : "close");
-                write(fd, header, n);
-                write(fd, req.body, req.body_len);
-            }
-        }
-
-        // DELETE
-        else if (strcmp(req.method, "DELETE") == 0) {
-            char full[PATH_MAX];
-            snprintf(full, sizeof(full), "www%s", req.path);
-            if (unlink(full) == 0) {
-                const char *resp = 
-                    "HTTP/1.1 200 OK\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
-                write(fd, resp, strlen(resp));
-            } else {
-                const char *resp = 
-                    "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
-                write(fd, resp, strlen(resp));
-            }
-        }
-
-        free(req.body);
-        req.body = NULL;
-
-    } while (keep_alive);
-
-    close(fd);
-}
-
-int main(void) {
-    int listenfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (listenfd < 0) { perror("socket"); return 1; }
-
-    int flags = fcntl(listenfd, F_GETFL, 0);
-    fcntl(listenfd, F_SETFL, flags | O_NONBLOCK);
-
-    int opt = 1;
-    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-
-    struct sockaddr_in addr = {0};
-    addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = INADDR_ANY;
-    addr.sin_port = htons(PORT);
-
-    if (bind(listenfd, (struct sockaddr*)&addr, sizeof(addr)) < 0) { perror("bind"); return 1; }
-    if (listen(listenfd, BACKLOG) < 0) { perror("listen"); return 1; }
-
-    fprintf(stderr, "Listening on :%d\n", PORT);
-
-    start_workers(8);
-    int clients[1024];
-    int client_count = 0;
-
-    for (;;) {
-        fd_set readfds;
-        FD_ZERO(&readfds);
-        FD_SET(listenfd, &readfds);
-
-        int maxfd = listenfd;
-
-        for (int i = 0; i < client_count; i++) {
-            int fd = clients[i];
-            FD_SET(fd, &readfds);
-            if (fd > maxfd) maxfd = fd;
-        }
-
-        int nready = select(maxfd + 1, &readfds, NULL, NULL, NULL);
-        if (nready < 0) {
-            perror("select");
-            continue;
-        }
-
-        // Accept new connections
-        if (FD_ISSET(listenfd, &readfds)) {
-            struct sockaddr_in cli;
-            socklen_t cli_len = sizeof(cli);
-            int conn = accept(listenfd, (struct sockaddr*)&cli, &cli_len);
-            if (conn >= 0) {
-                fcntl(conn, F_SETFL, O_NONBLOCK);
-                clients[client_count++] = conn;
-            }
-        }
-
-        // Handle ready clients
-        for (int i = 0; i < client_count; i++) {
-            int fd = clients[i];
-            if (!FD_ISSET(fd, &readfds)) continue;
-
-            char tmp;
-            ssize_t r = recv(fd, &tmp, 1, MSG_PEEK);
-
-            if (r == 0) {
-                close(fd);
-                clients[i] = clients[--client_count];
-                i--;
-                continue;
-            }
-
-            if (r < 0 && errno != EWOULDBLOCK && errno != EAGAIN) {
-                close(fd);
-                clients[i] = clients[--client_count];
-                i--;
-                continue;
-            }
-
-            push_conn(fd);
-            clients[i] = clients[--client_count];
-            i--;
-        }
-    }
-
-    close(listenfd);
-    return 0;
-}
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/select.h>
+#include <sys/signalfd.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <fcntl.h>
+#include "arena.h"
+#include "cgi.h"
+#include "fdcache.h"
+#include "filecache.h"
+#include "http.h"
+#include "accesslog.h"
+#include "iplimit.h"
+#include "metrics.h"
+#include "proxy.h"
+#include "reactor.h"
+#include "response.h"
+#include "router.h"
+#include "server.h"
+#include "threadpool.h"
+#ifdef HAVE_TLS
+#include "tls.h"
+#endif
+
+#define PORT 8080
+#define BACKLOG 128
+// How long a new worker gets to start serving before it is given up on.
+#define WORKER_START_MS 30000
+
+static const server_config_t defaults = {
+    .listen_addr = INADDR_ANY,
+    .port = PORT,
+    .backlog = BACKLOG,
+    .threads = 0,
+    .pin_cpus = 0,
+    .use_select = 0,
+#ifdef HAVE_IO_URING
+    .use_uring = 1,
+#endif
+    .root = "www",
+    .queue_cap = 1024,
+    .read_buffer = HTTP_READ_CHUNK,
+    .cache_bytes = 64 << 20,
+    .cache_max_file = 256 << 10,
+    .fd_cache_entries = 1024,
+    .fd_cache_ttl = 5,
+    .max_body = (size_t)1 << 30,
+    .gzip_level = 6,
+    .cgi_timeout = 30,
+    .cgi_max = 16,
+    .fcgi_workers = 2,
+    .header_timeout = 10,
+    .body_timeout = 30,
+    .write_timeout = 30,
+    .keepalive_timeout = 15,
+    .max_conns_per_ip = 64,
+    .http2 = 1,
+    .proxy_timeout = 30,
+    .proxy_keepalive = 32,
+    .proxy_max_fails = 3,
+    .proxy_fail_timeout = 10,
+    .drain_timeout = 30,
+    .access_log = "-",
+    .access_log_block = 0,
+    .tls_addr = INADDR_ANY,
+    .tls_port = 0,
+    .tls_cert = "cert.pem",
+    .tls_key = "key.pem",
+    .tls_tickets = 1,
+    .tls_ktls = 1,
+};
+
+server_config_t g_config;
+_Atomic int g_draining;
+
+// Errors that leave the request stream in an unknown state close the
+// connection.
+static void respond_closing(response_t *res, int status) {
+    res->keep_alive = 0;
+    response_error(res, status);
+}
+
+void respond_bad_request(response_t *res) {
+    respond_closing(res, 400);
+}
+
+void respond_timeout(response_t *res) {
+    respond_closing(res, 408);
+}
+
+// GET/HEAD under a static root (the route's arg).
+static void route_static(http_request_t *req, response_t *res, const route_match_t *m) {
+    if (serve_static(res, req, m->arg, m->rest) < 0) response_error(res, 404);
+}
+
+// POST echo. Multipart bodies with a usable boundary were already taken
+// by handle_upload().
+static void route_post(http_request_t *req, response_t *res, const route_match_t *m) {
+    (void)m;
+    const char *ctype = http_get_header(req, "Content-Type");
+
+    if (ctype && strncasecmp(ctype, "multipart/form-data", 19) == 0) {
+        respond_bad_request(res);
+        return;
+    }
+    response_status(res, 200);
+    // Mirror the framing the client used.
+    if (req->chunked) response_header(res, "Transfer-Encoding", "chunked");
+    else response_content_length(res, req->body_len);
+    response_header(res, "Content-Type", "text/plain");
+    response_end_headers(res);
+    if (req->chunked) {
+        res->chunked = 1;
+        response_chunk(res, req->body, req->body_len);
+        response_chunk_end(res);
+    } else {
+        response_append(res, req->body, req->body_len);
+    }
+}
+
+static void route_delete(http_request_t *req, response_t *res, const route_match_t *m) {
+    (void)req;
+    char full[PATH_MAX];
+    if (path_is_safe(m->rest) &&
+        snprintf(full, sizeof(full), "%s%s", (const char *)m->arg, m->rest) < (int)sizeof(full) &&
+        unlink(full) == 0) {
+        // Neither cache may keep serving what is gone.
+        fdcache_invalidate(full);
+        filecache_invalidate(full);
+        response_status(res, 200);
+        response_content_length(res, 0);
+        response_end_headers(res);
+    } else {
+        response_error(res, 404);
+    }
+}
+
+static void route_cgi(http_request_t *req, response_t *res, const route_match_t *m) {
+    (void)m;
+    int status = cgi_handle(req, res);
+    if (status) response_error(res, status);
+}
+
+// Everything under a proxy mount goes to its upstreams (the route's arg).
+static void route_proxy(http_request_t *req, response_t *res, const route_match_t *m) {
+    int status = proxy_handle(m->arg, req, res, NULL);
+    if (status) response_error(res, status);
+}
+
+// Allocator counters, to confirm steady-state traffic makes no mallocs.
+static void route_alloc_stats(http_request_t *req, response_t *res, const route_match_t *m) {
+    (void)req;
+    (void)m;
+    alloc_stats_t st;
+    alloc_stats(&st);
+    char body[512];
+    int n = snprintf(body, sizeof(body),
+                     "arena_mallocs %lu\n"
+                     "arena_reuses %lu\n"
+                     "buffer_mallocs %lu\n"
+                     "buffer_reuses %lu\n"
+                     "conn_mallocs %lu\n"
+                     "conn_reuses %lu\n",
+                     st.arena_mallocs, st.arena_reuses, st.buffer_mallocs,
+                     st.buffer_reuses, st.conn_mallocs, st.conn_reuses);
+    response_status(res, 200);
+    response_content_length(res, n);
+    response_header(res, "Content-Type", "text/plain");
+    response_header(res, "Cache-Control", "no-store");
+    response_end_headers(res);
+    response_append(res, body, n);
+}
+
+// Worker pool of the select() mode, for its queue depth gauge.
+static threadpool_t *worker_pool;
+
+// Prometheus scrape target.
+static void route_metrics(http_request_t *req, response_t *res, const route_match_t *m) {
+    (void)req;
+    (void)m;
+    metrics_gauges_t g = {
+        .threadpool_queued = worker_pool ? (long)threadpool_queued(worker_pool) : -1,
+    };
+    buffer_t body = {0};
+    if (metrics_render(&body, &g) < 0) {
+        buf_free(&body);
+        response_error(res, 500);
+        return;
+    }
+    response_status(res, 200);
+    response_content_length(res, body.len);
+    response_header(res, "Content-Type", "text/plain; version=0.0.4");
+    response_header(res, "Cache-Control", "no-store");
+    response_end_headers(res);
+    response_append(res, body.data, body.len);
+    buf_free(&body);
+}
+
+static router_t *routes;
+// Under the document root.
+static char upload_dir[PATH_MAX];
+
+static int setup_routes(const server_config_t *cfg) {
+    const char *root = cfg->root;
+    routes = router_new();
+    if (!routes) return -1;
+    int rc = 0;
+    rc |= router_add(routes, ROUTE_GET | ROUTE_HEAD, "/*", route_static, (void *)root);
+    rc |= router_add(routes, ROUTE_POST, "/*", route_post, NULL);
+    rc |= router_add(routes, ROUTE_DELETE, "/*", route_delete, (void *)root);
+    rc |= router_add(routes, ROUTE_GET | ROUTE_HEAD | ROUTE_POST, CGI_PREFIX "*", route_cgi, NULL);
+    rc |= router_add(routes, ROUTE_GET, "/_stats/alloc", route_alloc_stats, NULL);
+    rc |= router_add(routes, ROUTE_GET, "/_stats/metrics", route_metrics, NULL);
+    const unsigned any = ROUTE_GET | ROUTE_HEAD | ROUTE_POST | ROUTE_PUT | ROUTE_DELETE |
+                         ROUTE_OPTIONS | ROUTE_PATCH;
+    for (int i = 0; i < cfg->nproxies; i++) {
+        char pattern[sizeof(cfg->proxies[i].prefix) + 2];
+        snprintf(pattern, sizeof(pattern), "%s/*", cfg->proxies[i].prefix);
+        rc |= router_add(routes, any, cfg->proxies[i].prefix, route_proxy, proxy_group(i));
+        rc |= router_add(routes, any, pattern, route_proxy, proxy_group(i));
+    }
+    return rc;
+}
+
+static void dispatch(http_request_t *req, response_t *res, unsigned method) {
+    if (!method) {
+        respond_bad_request(res);
+        return;
+    }
+
+    if (http_slice_eq(req->path, "/")) {
+        req->path = (http_slice_t){ "/index.html", 11 };
+    }
+
+    route_match_t m;
+    int status = router_match(routes, method, req->path.ptr, &m);
+    if (status == 0) {
+        m.fn(req, res, &m);
+    } else if (status == 405) {
+        char allow[64];
+        route_allow(m.allowed, allow, sizeof(allow));
+        response_status(res, 405);
+        response_header(res, "Allow", allow);
+        response_content_length(res, 0);
+        response_end_headers(res);
+    } else {
+        response_error(res, 404);
+    }
+}
+
+void handle_request(http_request_t *req, response_t *res) {
+    uint64_t start = metrics_clock();
+    accesslog_begin(&res->access, req);
+    res->keep_alive = http_keep_alive(req) && !g_draining;
+    res->head = http_slice_eq(req->method, "HEAD");
+    unsigned method = route_method(req->method);
+    metrics_request(method);
+    dispatch(req, res, method);
+    res->ready_at = metrics_clock();
+    metrics_observe(PHASE_HANDLE, res->ready_at - start);
+}
+
+int request_proxied(const http_request_t *req) {
+    if (!req->chunked && req->body_len == 0) return 0;
+    route_match_t m;
+    unsigned method = route_method(req->method);
+    return method && router_match(routes, method, req->path.ptr, &m) == 0 && m.fn == route_proxy;
+}
+
+proxy_body_t *handle_proxied(http_request_t *req, response_t *res) {
+    uint64_t start = metrics_clock();
+    accesslog_begin(&res->access, req);
+    res->keep_alive = http_keep_alive(req) && !g_draining;
+    res->head = http_slice_eq(req->method, "HEAD");
+    unsigned method = route_method(req->method);
+    metrics_request(method);
+    route_match_t m;
+    proxy_body_t *body = NULL;
+    int status = router_match(routes, method, req->path.ptr, &m) == 0
+        ? proxy_handle(m.arg, req, res, &body) : 500;
+    // The body is not read after an error, so the connection ends with it.
+    if (status) respond_closing(res, status);
+    res->ready_at = metrics_clock();
+    metrics_observe(PHASE_HANDLE, res->ready_at - start);
+    return body;
+}
+
+upload_t *request_upload(const http_request_t *req) {
+    if (!http_slice_eq(req->method, "POST")) return NULL;
+    const char *ctype = http_get_header(req, "Content-Type");
+    if (!ctype || strncasecmp(ctype, "multipart/form-data", 19) != 0) return NULL;
+    // Only where the echo handler is mounted; scripts read their own bodies.
+    route_match_t m;
+    if (router_match(routes, ROUTE_POST, req->path.ptr, &m) != 0 || m.fn != route_post)
+        return NULL;
+    mkdir(upload_dir, 0755);
+    return upload_open(ctype, upload_dir);
+}
+
+void handle_upload(http_request_t *req, upload_t *up, response_t *res) {
+    uint64_t start = metrics_clock();
+    metrics_request(ROUTE_POST);
+    accesslog_begin(&res->access, req);
+    int saved = upload_close(up);
+    if (saved < 0) {
+        respond_bad_request(res);
+        return;
+    }
+    static const char msg[] = "Uploaded successfully";
+    res->keep_alive = http_keep_alive(req) && !g_draining;
+    response_status(res, 200);
+    response_content_length(res, sizeof(msg) - 1);
+    response_header(res, "Content-Type", "text/plain");
+    response_end_headers(res);
+    response_add_segment(res, msg, sizeof(msg) - 1);
+    res->ready_at = metrics_clock();
+    metrics_observe(PHASE_HANDLE, res->ready_at - start);
+}
+
+int request_too_large(const http_request_t *req) {
+    return req->body_len > g_config.max_body;
+}
+
+void respond_too_large(response_t *res) {
+    respond_closing(res, 413);
+}
+
+static int flush_blocking(int fd, response_queue_t *out) {
+    int r;
+    while ((r = response_queue_write(fd, out)) == 0) {
+        // Either the socket is full or a streamed body awaits its source,
+        // which has a timeout of its own.
+        struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+        int wait_fd = response_queue_waiting(out, &pfd.events);
+        int ms = g_config.write_timeout > 0 ? g_config.write_timeout * 1000 : -1;
+        if (wait_fd >= 0) {
+            pfd.fd = wait_fd;
+            ms = -1;
+        } else {
+            pfd.events = POLLOUT;
+        }
+        if (poll(&pfd, 1, ms) == 0) return -1;
+    }
+    return r;
+}
+
+// Blocking per-connection loop used by the select()/thread pool mode.
+void handle_connection(int fd, uint32_t peer) {
+    http_request_t req;
+    http_parser_t parser;
+    arena_t arena = ARENA_INIT;
+    buffer_t in = {0};
+    response_queue_t out;
+    response_queue_init(&out);
+    int keep_alive = 1;
+    req.arena = &arena;
+    req.peer = peer;
+    // A new connection has the head timeout to send its first byte too.
+    http_timeouts_t t = {
+        .idle = g_config.header_timeout * 1000,
+        .head = g_config.header_timeout * 1000,
+        .body = g_config.body_timeout * 1000,
+    };
+
+    while (keep_alive) {
+        // Answer every request already buffered before blocking on the
+        // socket again, so pipelined responses go out in one send.
+        http_parser_init(&parser);
+        if (out.count > 0 &&
+            (out.count == RESPONSE_QUEUE_MAX ||
+             parse_http_request(&parser, in.data, in.len, &req) != HTTP_PARSE_DONE)) {
+            if (flush_blocking(fd, &out) < 0) break;
+        }
+
+        int rc = read_http_request(fd, &in, &parser, &req, &t);
+        if (rc <= 0) {
+            if (rc == HTTP_TIMEOUT) respond_timeout(response_queue_push(&out));
+            else if (rc < 0) respond_bad_request(response_queue_push(&out));
+            break;
+        }
+        t.idle = g_config.keepalive_timeout * 1000;
+
+        response_t *res = response_queue_push(&out);
+        res->splice = 1;
+        if (request_too_large(&req)) {
+            respond_too_large(res);
+            break;
+        }
+        upload_t *up = request_upload(&req);
+        rc = read_http_body(fd, &in, &req, g_config.max_body,
+                            up ? upload_body_fn : NULL, up, &t);
+        if (rc < 0) {
+            if (up) upload_close(up);
+            if (rc == HTTP_PARSE_TOO_LARGE) respond_too_large(res);
+            else if (rc == HTTP_TIMEOUT) respond_timeout(res);
+            else respond_bad_request(res);
+            break;
+        }
+        if (up) handle_upload(&req, up, res);
+        else handle_request(&req, res);
+        keep_alive = res->keep_alive;
+
+        arena_reset(&arena);
+        req.body = NULL;
+        buf_consume(&in, req.head_len);
+    }
+
+    flush_blocking(fd, &out);
+    arena_free(&arena);
+    buf_free(&in);
+    response_queue_free(&out);
+    close(fd);
+}
+
+// Reactors each accept on their own socket of the SO_REUSEPORT group, and
+// sockets opened by a reload join the group of the ones still in use.
+static int open_listener(uint32_t addr, int port, int backlog) {
+    int listenfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listenfd < 0) { perror("socket"); return -1; }
+
+    int flags = fcntl(listenfd, F_GETFL, 0);
+    fcntl(listenfd, F_SETFL, flags | O_NONBLOCK);
+
+    int opt = 1;
+    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        perror("SO_REUSEPORT");
+        close(listenfd);
+        return -1;
+    }
+
+    struct sockaddr_in sa = {0};
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = addr;
+    sa.sin_port = htons(port);
+
+    if (bind(listenfd, (struct sockaddr*)&sa, sizeof(sa)) < 0 ||
+        listen(listenfd, backlog) < 0) {
+        perror("bind/listen");
+        close(listenfd);
+        return -1;
+    }
+    return listenfd;
+}
+
+static const char SERVICE_UNAVAILABLE[] =
+    "HTTP/1.1 503 Service Unavailable\r\n"
+    "Content-Length: 0\r\n"
+    "Retry-After: 1\r\n"
+    "Connection: close\r\n\r\n";
+
+// Accepted connections waiting in select() for their first byte.
+#define MAX_PENDING 1024
+
+// Client address of each connection, for releasing its iplimit slot.
+// select() already keeps this mode's descriptors below FD_SETSIZE.
+static struct {
+    uint32_t addr;
+    int counted;
+} peers[FD_SETSIZE];
+
+// Connections handed to the pool and not finished yet, for the drain.
+static _Atomic int busy_connections;
+
+static void drop_client(int fd) {
+    if (peers[fd].counted) iplimit_release(peers[fd].addr);
+    close(fd);
+    metrics_add(METRIC_CONNS_CLOSED, 1);
+}
+
+static void connection_task(void *arg) {
+    int fd = (int)(intptr_t)arg;
+    // The descriptor number is reused once closed; read its entry first.
+    uint32_t addr = peers[fd].addr;
+    int counted = peers[fd].counted;
+    handle_connection(fd, addr);
+    metrics_add(METRIC_CONNS_CLOSED, 1);
+    if (counted) iplimit_release(addr);
+    atomic_fetch_sub(&busy_connections, 1);
+}
+
+// Shed load instead of stalling the acceptor when workers are saturated.
+static void hand_to_pool(threadpool_t *pool, int fd) {
+    atomic_fetch_add(&busy_connections, 1);
+    if (threadpool_add(pool, connection_task, (void*)(intptr_t)fd) < 0) {
+        atomic_fetch_sub(&busy_connections, 1);
+        (void)!write(fd, SERVICE_UNAVAILABLE, strlen(SERVICE_UNAVAILABLE));
+        drop_client(fd);
+    }
+}
+
+// Tell the master this worker is serving.
+static void worker_ready(int ready_fd) {
+    (void)!write(ready_fd, "", 1);
+    close(ready_fd);
+}
+
+static int run_select(const server_config_t *cfg, int listenfd, int ready_fd) {
+    // SIGTERM and SIGINT are blocked (see main) and read from here instead.
+    sigset_t stop;
+    sigemptyset(&stop);
+    sigaddset(&stop, SIGTERM);
+    sigaddset(&stop, SIGINT);
+    int sigfd = signalfd(-1, &stop, SFD_CLOEXEC);
+    if (sigfd < 0) { perror("signalfd"); return 1; }
+
+    threadpool_t *pool = threadpool_create(cfg->threads, cfg->queue_cap);
+    if (!pool) { perror("threadpool_create"); return 1; }
+    worker_pool = pool;
+    struct {
+        int fd;
+        time_t since;
+    } clients[MAX_PENDING];
+    int client_count = 0;
+    worker_ready(ready_fd);
+
+    for (;;) {
+        fd_set readfds;
+        FD_ZERO(&readfds);
+        FD_SET(listenfd, &readfds);
+        FD_SET(sigfd, &readfds);
+
+        int maxfd = listenfd > sigfd ? listenfd : sigfd;
+
+        for (int i = 0; i < client_count; i++) {
+            int fd = clients[i].fd;
+            FD_SET(fd, &readfds);
+            if (fd > maxfd) maxfd = fd;
+        }
+
+        // Wake once a second while anyone is waiting, to expire them.
+        struct timeval tick = { .tv_sec = 1 };
+        int nready = select(maxfd + 1, &readfds, NULL, NULL, client_count ? &tick : NULL);
+        if (nready < 0) {
+            perror("select");
+            continue;
+        }
+        if (FD_ISSET(sigfd, &readfds)) break;
+        time_t now = time(NULL);
+
+        // Accept new connections
+        if (FD_ISSET(listenfd, &readfds)) {
+            struct sockaddr_in cli;
+            socklen_t cli_len = sizeof(cli);
+            int conn = accept4(listenfd, (struct sockaddr*)&cli, &cli_len, SOCK_CLOEXEC);
+            if (conn >= FD_SETSIZE || (conn >= 0 && client_count == MAX_PENDING)) {
+                (void)!write(conn, SERVICE_UNAVAILABLE, strlen(SERVICE_UNAVAILABLE));
+                close(conn);
+            } else if (conn >= 0) {
+                int counted = iplimit_acquire(cli.sin_addr.s_addr);
+                if (counted < 0) {
+                    close(conn);
+                } else {
+                    peers[conn].addr = cli.sin_addr.s_addr;
+                    peers[conn].counted = counted;
+                    fcntl(conn, F_SETFL, O_NONBLOCK);
+                    clients[client_count].fd = conn;
+                    clients[client_count].since = now;
+                    client_count++;
+                    metrics_add(METRIC_CONNS_OPENED, 1);
+                }
+            }
+        }
+
+        // Handle ready clients
+        for (int i = 0; i < client_count; i++) {
+            int fd = clients[i].fd;
+            if (!FD_ISSET(fd, &readfds)) {
+                // Connected but silent: the head timeout covers this wait.
+                if (g_config.header_timeout > 0 &&
+                    now - clients[i].since >= g_config.header_timeout) {
+                    drop_client(fd);
+                    clients[i] = clients[--client_count];
+                    i--;
+                }
+                continue;
+            }
+
+            char tmp;
+            ssize_t r = recv(fd, &tmp, 1, MSG_PEEK);
+
+            if (r == 0) {
+                drop_client(fd);
+                clients[i] = clients[--client_count];
+                i--;
+                continue;
+            }
+
+            if (r < 0 && errno != EWOULDBLOCK && errno != EAGAIN) {
+                drop_client(fd);
+                clients[i] = clients[--client_count];
+                i--;
+                continue;
+            }
+
+            hand_to_pool(pool, fd);
+            clients[i] = clients[--client_count];
+            i--;
+        }
+    }
+
+    // Draining: connections already accepted are still served, each one
+    // closing after its current request, until the drain timeout.
+    atomic_store(&g_draining, 1);
+    close(sigfd);
+    for (int i = 0; i < client_count; i++) hand_to_pool(pool, clients[i].fd);
+    time_t deadline = time(NULL) + cfg->drain_timeout;
+    while (atomic_load(&busy_connections) > 0 &&
+           (cfg->drain_timeout <= 0 || time(NULL) < deadline))
+        nanosleep(&(struct timespec){ .tv_nsec = 50000000 }, NULL);
+    if (atomic_load(&busy_connections) > 0)
+        fprintf(stderr, "worker %d: connections still open after %ds, closing them\n",
+                (int)getpid(), cfg->drain_timeout);
+    // The pool is left to the exit: its threads may still be blocked on
+    // connections, and idle ones hold nothing that needs cleaning up.
+    return 0;
+}
+
+static int run_reactors(const server_config_t *cfg, const int *listeners,
+                        const int *tls_listeners, int ready_fd) {
+    if (reactor_start(cfg, listeners, tls_listeners) < 0) return 1;
+    worker_ready(ready_fd);
+
+    sigset_t stop;
+    sigemptyset(&stop);
+    sigaddset(&stop, SIGTERM);
+    sigaddset(&stop, SIGINT);
+    int sig;
+    while (sigwait(&stop, &sig) != 0) {}
+
+    atomic_store(&g_draining, 1);
+    reactor_drain();
+    if (reactor_wait(cfg->drain_timeout) < 0)
+        fprintf(stderr, "worker %d: connections still open after %ds, closing them\n",
+                (int)getpid(), cfg->drain_timeout);
+    return 0;
+}
+
+// The sockets listening on one address.
+typedef struct {
+    uint32_t addr;
+    int port;           // 0 = not listening
+    int *fds;
+} listen_set_t;
+
+// The listening sockets of a worker generation, plain and TLS: per
+// address, one for each reactor, or one for select(). The master opens
+// them and every worker inherits them.
+typedef struct {
+    int n;
+    listen_set_t http, tls;
+} listeners_t;
+
+// Whether fd belongs to ls.
+static int listeners_have(const listeners_t *ls, int fd) {
+    for (int i = 0; i < ls->n; i++) {
+        if (ls->http.port && ls->http.fds[i] == fd) return 1;
+        if (ls->tls.port && ls->tls.fds[i] == fd) return 1;
+    }
+    return 0;
+}
+
+// Close the sockets of s that keep does not use as well.
+static void set_close(const listen_set_t *s, int n, const listeners_t *keep) {
+    for (int i = 0; s->port && i < n; i++)
+        if (!keep || !listeners_have(keep, s->fds[i])) close(s->fds[i]);
+}
+
+// n sockets on addr:port: those of cur where the address is unchanged
+// (with the new backlog), and new ones for the rest.
+static int set_open(listen_set_t *s, const listen_set_t *cur, int ncur, int n,
+                    uint32_t addr, int port, int backlog) {
+    s->addr = addr;
+    s->port = port;
+    s->fds = NULL;
+    if (!port) return 0;
+    s->fds = malloc(n * sizeof(*s->fds));
+    if (!s->fds) return -1;
+
+    int kept = 0;
+    if (cur && cur->port == port && cur->addr == addr) {
+        kept = ncur < n ? ncur : n;
+        for (int i = 0; i < kept; i++) {
+            s->fds[i] = cur->fds[i];
+            listen(s->fds[i], backlog);
+        }
+    }
+    for (int i = kept; i < n; i++) {
+        s->fds[i] = open_listener(addr, port, backlog);
+        if (s->fds[i] < 0) {
+            while (--i >= kept) close(s->fds[i]);
+            free(s->fds);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// The sockets cfg needs, reusing those of cur where it can.
+static int listeners_open(listeners_t *ls, const listeners_t *cur, const server_config_t *cfg) {
+    ls->n = cfg->use_select ? 1 : cfg->threads;
+    if (set_open(&ls->http, cur ? &cur->http : NULL, cur ? cur->n : 0, ls->n,
+                 cfg->listen_addr, cfg->port, cfg->backlog) < 0)
+        return -1;
+    if (set_open(&ls->tls, cur ? &cur->tls : NULL, cur ? cur->n : 0, ls->n,
+                 cfg->tls_addr, cfg->tls_port, cfg->backlog) < 0) {
+        set_close(&ls->http, ls->n, cur);
+        free(ls->http.fds);
+        return -1;
+    }
+    return 0;
+}
+
+// Close the sockets of ls that keep does not use as well.
+static void listeners_close(const listeners_t *ls, const listeners_t *keep) {
+    set_close(&ls->http, ls->n, keep);
+    set_close(&ls->tls, ls->n, keep);
+}
+
+static void listeners_free(listeners_t *ls) {
+    free(ls->http.fds);
+    free(ls->tls.fds);
+}
+
+// Everything but the listening sockets is set up in the worker, so each
+// generation starts from a clean slate: caches, metrics, FastCGI pools.
+static int run_worker(const listeners_t *ls, int ready_fd) {
+    const server_config_t *cfg = &g_config;
+    // SIGUSR1 is already blocked, as accesslog_init() wants.
+    if (accesslog_init(cfg->access_log,
+                       cfg->access_log_block ? ACCESSLOG_BLOCK : ACCESSLOG_DROP) < 0) {
+        fprintf(stderr, "access log %s: %s\n", cfg->access_log, strerror(errno));
+        return 1;
+    }
+    iplimit_init(cfg->max_conns_per_ip);
+    filecache_init(cfg->cache_bytes, cfg->cache_max_file, cfg->gzip_level);
+    fdcache_init(cfg->fd_cache_entries, cfg->fd_cache_ttl);
+    if (snprintf(upload_dir, sizeof(upload_dir), "%s/uploads", cfg->root) >= (int)sizeof(upload_dir)) {
+        fprintf(stderr, "document root path too long\n");
+        return 1;
+    }
+    if (cgi_init(cfg->root, cfg) < 0) {
+        perror("cgi_init");
+        return 1;
+    }
+    if (proxy_init(cfg) < 0) {
+        perror("proxy_init");
+        return 1;
+    }
+    if (setup_routes(cfg) < 0) {
+        fprintf(stderr, "invalid route table\n");
+        return 1;
+    }
+#ifdef HAVE_TLS
+    if (cfg->tls_port && tls_init(cfg) < 0) return 1;
+#endif
+
+    int rc = cfg->use_select ? run_select(cfg, ls->http.fds[0], ready_fd)
+                             : run_reactors(cfg, ls->http.fds, ls->tls.fds, ready_fd);
+    cgi_shutdown();
+    accesslog_close();
+    return rc;
+}
+
+// Fork a worker serving cfg on ls, closing the sockets of stale in it, and
+// wait until it is serving. Returns its pid, or -1 if it did not start.
+static pid_t start_worker(const server_config_t *cfg, const listeners_t *ls,
+                          const listeners_t *stale) {
+    int ready[2];
+    if (pipe2(ready, O_CLOEXEC) < 0) {
+        perror("pipe");
+        return -1;
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        close(ready[0]);
+        close(ready[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        close(ready[0]);
+        if (stale) listeners_close(stale, ls);
+        g_config = *cfg;
+        exit(run_worker(ls, ready[1]));
+    }
+
+    close(ready[1]);
+    // The worker writes a byte once it is serving; EOF means it gave up.
+    struct pollfd pfd = { .fd = ready[0], .events = POLLIN };
+    char byte;
+    int ok = poll(&pfd, 1, WORKER_START_MS) == 1 && read(ready[0], &byte, 1) == 1;
+    close(ready[0]);
+    if (!ok) {
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        return -1;
+    }
+    return pid;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-c file] [-m uring|epoll|select] [-p port] [-s port] [-t threads] [-a] [-C mb]\n"
+                    "          [-z level] [-b mb] [-k secs] [-l conns] [-L file] [-W]\n"
+                    "  -c  configuration file, re-read on SIGHUP; flags override it\n"
+                    "  -m  event loop; uring needs a build with URING=1 and is then the default\n"
+                    "  -s  HTTPS port (build with TLS=1), serving cert.pem and key.pem\n"
+                    "  -t  reactors (uring, epoll) or workers (select); default one per CPU\n"
+                    "  -a  pin each reactor thread to a CPU\n"
+                    "  -C  static file cache budget in MB (0 disables)\n"
+                    "  -z  gzip level for cached text files, 1-9 (0 disables)\n"
+                    "  -b  largest accepted request body in MB\n"
+                    "  -k  keep-alive idle timeout in seconds (0 disables)\n"
+                    "  -l  connections per client address (0 = unlimited)\n"
+                    "  -L  access log file, reopened on SIGUSR1 (default: stderr)\n"
+                    "  -W  wait for the access log writer instead of dropping lines\n", prog);
+}
+
+#define OPTIONS "c:m:p:s:t:aC:z:b:k:l:L:Wh"
+
+// Defaults, then the -c file, then the other flags, which win. Run again
+// on every reload. Returns 1 for -h and -1 for bad settings.
+static int build_config(server_config_t *cfg, int argc, char **argv) {
+    *cfg = defaults;
+    const char *file = NULL;
+    int opt_c;
+    opterr = 0;
+    optind = 0;
+    while ((opt_c = getopt(argc, argv, OPTIONS)) != -1)
+        if (opt_c == 'c') file = optarg;
+    if (file && config_load(cfg, file) < 0) return -1;
+
+    opterr = 1;
+    optind = 0;
+    while ((opt_c = getopt(argc, argv, OPTIONS)) != -1) {
+        switch (opt_c) {
+        case 'c':
+            break;
+        case 'm':
+            cfg->use_select = strcmp(optarg, "select") == 0;
+            cfg->use_uring = strcmp(optarg, "uring") == 0;
+            if (!cfg->use_select && !cfg->use_uring && strcmp(optarg, "epoll") != 0) {
+                usage(argv[0]);
+                return -1;
+            }
+#ifndef HAVE_IO_URING
+            if (cfg->use_uring) {
+                fprintf(stderr, "io_uring support is not built in (make URING=1)\n");
+                return -1;
+            }
+#endif
+            break;
+        case 'p':
+            cfg->port = atoi(optarg);
+            break;
+        case 's':
+#ifndef HAVE_TLS
+            fprintf(stderr, "TLS support is not built in (make TLS=1)\n");
+            return -1;
+#endif
+            cfg->tls_port = atoi(optarg);
+            break;
+        case 't':
+            cfg->threads = atoi(optarg);
+            break;
+        case 'a':
+            cfg->pin_cpus = 1;
+            break;
+        case 'C':
+            cfg->cache_bytes = (size_t)strtoul(optarg, NULL, 10) << 20;
+            break;
+        case 'b':
+            cfg->max_body = (size_t)strtoull(optarg, NULL, 10) << 20;
+            break;
+        case 'k':
+            cfg->keepalive_timeout = atoi(optarg);
+            break;
+        case 'l':
+            cfg->max_conns_per_ip = atoi(optarg);
+            break;
+        case 'L':
+            if (strlen(optarg) >= sizeof(cfg->access_log)) {
+                fprintf(stderr, "access log path too long\n");
+                return -1;
+            }
+            strcpy(cfg->access_log, optarg);
+            break;
+        case 'W':
+            cfg->access_log_block = 1;
+            break;
+        case 'z':
+            cfg->gzip_level = atoi(optarg);
+            if (cfg->gzip_level < 0 || cfg->gzip_level > 9) {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return opt_c == 'h' ? 1 : -1;
+        }
+    }
+
+    if (cfg->threads <= 0) {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        cfg->threads = ncpu > 0 ? (int)ncpu : 1;
+    }
+    if (cfg->tls_port && cfg->use_select) {
+        fprintf(stderr, "TLS is served by the uring and epoll event loops only\n");
+        return -1;
+    }
+    if (cfg->tls_port == cfg->port) {
+        fprintf(stderr, "the TLS listener needs a port of its own\n");
+        return -1;
+    }
+    return 0;
+}
+
+static void announce(const char *what, const server_config_t *cfg, pid_t worker) {
+    char addr[INET_ADDRSTRLEN] = "", tls[INET_ADDRSTRLEN + 16] = "";
+    if (cfg->listen_addr != INADDR_ANY) inet_ntop(AF_INET, &cfg->listen_addr, addr, sizeof(addr));
+    if (cfg->tls_port) {
+        char tls_addr[INET_ADDRSTRLEN] = "";
+        if (cfg->tls_addr != INADDR_ANY) inet_ntop(AF_INET, &cfg->tls_addr, tls_addr, sizeof(tls_addr));
+        snprintf(tls, sizeof(tls), ", TLS %s:%d", tls_addr, cfg->tls_port);
+    }
+    fprintf(stderr, "%s %s:%d%s (%s, %d threads, worker %d)\n", what, addr, cfg->port, tls,
+            cfg->use_select ? "select" : cfg->use_uring ? "io_uring" : "epoll",
+            cfg->threads, (int)worker);
+}
+
+// SIGHUP: start a worker on the re-read configuration next to the running
+// one, which the caller then drains. Returns the new worker, or -1 with
+// everything left as it was.
+static pid_t reload(int argc, char **argv, listeners_t *ls) {
+    server_config_t cfg;
+    listeners_t next;
+    if (build_config(&cfg, argc, argv) != 0 || listeners_open(&next, ls, &cfg) < 0) {
+        fprintf(stderr, "reload failed, keeping the running configuration\n");
+        return -1;
+    }
+    pid_t pid = start_worker(&cfg, &next, ls);
+    if (pid < 0) {
+        fprintf(stderr, "reload failed: the new worker did not start\n");
+        listeners_close(&next, ls);
+        listeners_free(&next);
+        return -1;
+    }
+    listeners_close(ls, &next);
+    listeners_free(ls);
+    *ls = next;
+    g_config = cfg;
+    announce("Reloaded, listening on", &g_config, pid);
+    return pid;
+}
+
+// Workers replaced by a reload, still draining.
+#define MAX_DRAINING 64
+
+int main(int argc, char **argv) {
+    int rc = build_config(&g_config, argc, argv);
+    if (rc) return rc > 0 ? 0 : 1;
+
+    // A reactor holds every idle keep-alive connection open at once.
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    // This process only supervises: it holds the listening sockets and
+    // takes its signals synchronously. Workers inherit the mask, so their
+    // threads leave SIGUSR1 to the log writer and SIGTERM to the thread
+    // that drains.
+    sigset_t sigs;
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGHUP);
+    sigaddset(&sigs, SIGTERM);
+    sigaddset(&sigs, SIGINT);
+    sigaddset(&sigs, SIGCHLD);
+    sigaddset(&sigs, SIGUSR1);
+    sigprocmask(SIG_BLOCK, &sigs, NULL);
+
+#ifdef HAVE_TLS
+    if (tls_keys_init() < 0) return 1;
+#endif
+    listeners_t ls;
+    if (listeners_open(&ls, NULL, &g_config) < 0) return 1;
+    pid_t worker = start_worker(&g_config, &ls, NULL);
+    if (worker < 0) return 1;
+    time_t started = time(NULL);
+    announce("Listening on", &g_config, worker);
+
+    pid_t draining[MAX_DRAINING];
+    int ndraining = 0;
+    for (;;) {
+        int sig = sigwaitinfo(&sigs, NULL);
+        if (sig == SIGHUP) {
+            pid_t next = reload(argc, argv, &ls);
+            if (next < 0) continue;
+            kill(worker, SIGTERM);
+            if (ndraining < MAX_DRAINING) draining[ndraining++] = worker;
+            worker = next;
+            started = time(NULL);
+        } else if (sig == SIGUSR1) {
+            kill(worker, SIGUSR1);
+            for (int i = 0; i < ndraining; i++) kill(draining[i], SIGUSR1);
+        } else if (sig == SIGCHLD) {
+            pid_t pid;
+            int status;
+            while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+                for (int i = 0; i < ndraining; i++) {
+                    if (draining[i] == pid) draining[i--] = draining[--ndraining];
+                }
+                if (pid != worker) continue;
+                if (WIFSIGNALED(status))
+                    fprintf(stderr, "worker %d killed by signal %d, restarting\n", (int)pid, WTERMSIG(status));
+                else
+                    fprintf(stderr, "worker %d exited with status %d, restarting\n", (int)pid, WEXITSTATUS(status));
+                // Do not spin on a worker that dies as soon as it starts.
+                if (time(NULL) - started < 1) sleep(1);
+                worker = start_worker(&g_config, &ls, NULL);
+                if (worker < 0) {
+                    fprintf(stderr, "cannot restart the worker\n");
+                    for (int i = 0; i < ndraining; i++) kill(draining[i], SIGTERM);
+                    return 1;
+                }
+                started = time(NULL);
+            }
+        } else if (sig == SIGTERM || sig == SIGINT) {
+            // Graceful shutdown: the workers drain, then everyone exits.
+            kill(worker, SIGTERM);
+            for (int i = 0; i < ndraining; i++) kill(draining[i], SIGTERM);
+            while (wait(NULL) > 0 || errno == EINTR) {}
+            listeners_close(&ls, NULL);
+            listeners_free(&ls);
+            return 0;
+        }
+    }
+}
@@ -1,49 +1,255 @@
-#include <pthread.h>
-#include <stdlib.h>
-#include <unistd.h>
-#include <stdio.h>
-#include "threadpool.h"
-
-#define QUEUE_CAP 1024
-
-static int queue[QUEUE_CAP];
-static int q_head=0, q_tail=0, q_count=0;
-static pthread_mutex_t qlock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t qcond = PTHREAD_COND_INITIALIZER;
-
-void push_conn(int fd) {
-    pthread_mutex_lock(&qlock);
-    while (q_count == QUEUE_CAP) pthread_cond_wait(&qcond, &qlock);
-    queue[q_tail] = fd; q_tail = (q_tail+1)%QUEUE_CAP; q_count++;
-    pthread_cond_signal(&qcond);
-    pthread_mutex_unlock(&qlock);
-}
-
-int pop_conn(void) {
-    pthread_mutex_lock(&qlock);
-    while (q_count == 0) pthread_cond_wait(&qcond, &qlock);
-    int fd = queue[q_head]; q_head=(q_head+1)%QUEUE_CAP; q_count--;
-    pthread_cond_signal(&qcond);
-    pthread_mutex_unlock(&qlock);
-    return fd;
-}
-
-extern void handle_connection(int fd); // implement in server.c
-
-void *worker(void *arg) {
-    (void)arg;
-    while (1) {
-        int fd = pop_conn();
-        handle_connection(fd);
-        close(fd);
-    }
-    return NULL;
-}
-
-void start_workers(int n) {
-    for (int i=0;i<n;i++) {
-        pthread_t t;
-        pthread_create(&t, NULL, worker, NULL);
-        pthread_detach(t);
-    }
-}
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include "threadpool.h"
+
+// Idle polls over every queue before a worker parks on its semaphore.
+#define SPIN_ROUNDS 64
+
+typedef struct {
+    _Atomic size_t seq;
+    void (*func)(void*);
+    void *arg;
+} slot_t;
+
+// Each worker owns a bounded lock-free MPMC ring (Vyukov). Producers
+// enqueue at the tail, the owner dequeues at the head, and idle workers
+// steal from the head of other rings. Head and tail live on separate
+// cache lines so producers and consumers don't false-share.
+typedef struct {
+    _Alignas(64) _Atomic size_t head;
+    _Alignas(64) _Atomic size_t tail;
+    _Alignas(64) slot_t *slots;
+    size_t mask;                // capacity - 1, the capacity a power of two
+    sem_t wake;
+    _Atomic int sleeping;
+    size_t id;
+    pthread_t thread;
+    threadpool_t *pool;
+} worker_t;
+
+struct threadpool {
+    worker_t *workers;
+    size_t num_threads;
+    _Atomic size_t next;        // round-robin target for external producers
+    _Atomic int shutdown;
+};
+
+static _Thread_local worker_t *tl_worker;
+
+static int ring_init(worker_t *w, size_t cap) {
+    w->slots = malloc(cap * sizeof(*w->slots));
+    if (!w->slots) return -1;
+    w->mask = cap - 1;
+    for (size_t i = 0; i < cap; i++)
+        atomic_init(&w->slots[i].seq, i);
+    atomic_init(&w->head, 0);
+    atomic_init(&w->tail, 0);
+    return 0;
+}
+
+static int ring_push(worker_t *w, void (*func)(void*), void *arg) {
+    size_t pos = atomic_load_explicit(&w->tail, memory_order_relaxed);
+    slot_t *slot;
+    for (;;) {
+        slot = &w->slots[pos & w->mask];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&w->tail, &pos, pos + 1,
+                    memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            return -1; // full
+        } else {
+            pos = atomic_load_explicit(&w->tail, memory_order_relaxed);
+        }
+    }
+    slot->func = func;
+    slot->arg = arg;
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+    return 0;
+}
+
+static int ring_pop(worker_t *w, void (**func)(void*), void **arg) {
+    size_t pos = atomic_load_explicit(&w->head, memory_order_relaxed);
+    slot_t *slot;
+    for (;;) {
+        slot = &w->slots[pos & w->mask];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&w->head, &pos, pos + 1,
+                    memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            return -1; // empty
+        } else {
+            pos = atomic_load_explicit(&w->head, memory_order_relaxed);
+        }
+    }
+    *func = slot->func;
+    *arg = slot->arg;
+    atomic_store_explicit(&slot->seq, pos + w->mask + 1, memory_order_release);
+    return 0;
+}
+
+// Own queue first, then steal from the others starting at our neighbour.
+static int find_task(worker_t *self, void (**func)(void*), void **arg) {
+    threadpool_t *pool = self->pool;
+    if (ring_pop(self, func, arg) == 0) return 0;
+    for (size_t i = 1; i < pool->num_threads; i++) {
+        worker_t *victim = &pool->workers[(self->id + i) % pool->num_threads];
+        if (ring_pop(victim, func, arg) == 0) return 0;
+    }
+    return -1;
+}
+
+static int wake_worker(worker_t *w) {
+    if (atomic_exchange(&w->sleeping, 0)) {
+        sem_post(&w->wake);
+        return 1;
+    }
+    return 0;
+}
+
+static void *worker_main(void *arg) {
+    worker_t *self = arg;
+    threadpool_t *pool = self->pool;
+    tl_worker = self;
+
+    for (;;) {
+        void (*func)(void*);
+        void *task_arg;
+        int found = -1;
+        for (int spin = 0; spin < SPIN_ROUNDS && found < 0; spin++) {
+            found = find_task(self, &func, &task_arg);
+            if (found < 0) sched_yield();
+        }
+
+        if (found < 0) {
+            if (atomic_load(&pool->shutdown)) break;
+
+            // Announce we are parking, then look once more so a task pushed
+            // between the scan above and the store below is not missed.
+            atomic_store(&self->sleeping, 1);
+            atomic_thread_fence(memory_order_seq_cst);
+            found = find_task(self, &func, &task_arg);
+            if (found < 0 && !atomic_load(&pool->shutdown)) {
+                while (sem_wait(&self->wake) < 0) {}
+                continue;
+            }
+            // A producer may have already claimed our wakeup; absorb it.
+            if (!atomic_exchange(&self->sleeping, 0))
+                while (sem_wait(&self->wake) < 0) {}
+            if (found < 0) break;
+        }
+
+        func(task_arg);
+    }
+    return NULL;
+}
+
+// Stop and join the first started workers, then free the first ready
+// rings and semaphores and the pool itself.
+static void pool_teardown(threadpool_t *pool, size_t ready, size_t started) {
+    atomic_store(&pool->shutdown, 1);
+    for (size_t i = 0; i < started; i++) {
+        worker_t *w = &pool->workers[i];
+        atomic_store(&w->sleeping, 0);
+        sem_post(&w->wake);
+    }
+    for (size_t i = 0; i < started; i++)
+        pthread_join(pool->workers[i].thread, NULL);
+    for (size_t i = 0; i < ready; i++) {
+        sem_destroy(&pool->workers[i].wake);
+        free(pool->workers[i].slots);
+    }
+    free(pool->workers);
+    free(pool);
+}
+
+threadpool_t *threadpool_create(size_t num_threads, size_t queue_cap) {
+    if (num_threads == 0 || queue_cap == 0) return NULL;
+    size_t cap = 1;
+    while (cap < queue_cap) cap <<= 1;
+    threadpool_t *pool = calloc(1, sizeof(*pool));
+    if (!pool) return NULL;
+    pool->workers = aligned_alloc(64, ((num_threads * sizeof(worker_t) + 63) / 64) * 64);
+    if (!pool->workers) {
+        free(pool);
+        return NULL;
+    }
+    pool->num_threads = num_threads;
+
+    for (size_t i = 0; i < num_threads; i++) {
+        worker_t *w = &pool->workers[i];
+        *w = (worker_t){ .id = i, .pool = pool };
+        if (ring_init(w, cap) < 0 || sem_init(&w->wake, 0, 0) < 0) {
+            int err = errno;
+            free(w->slots);
+            pool_teardown(pool, i, 0);
+            errno = err;
+            return NULL;
+        }
+    }
+    for (size_t i = 0; i < num_threads; i++) {
+        int rc = pthread_create(&pool->workers[i].thread, NULL, worker_main,
+                                &pool->workers[i]);
+        if (rc != 0) {
+            pool_teardown(pool, num_threads, i);
+            errno = rc;
+            return NULL;
+        }
+    }
+    return pool;
+}
+
+int threadpool_add(threadpool_t *pool, void (*func)(void*), void *arg) {
+    if (atomic_load(&pool->shutdown)) return -1;
+
+    // Tasks queued from inside a worker stay local; others are spread
+    // round-robin. A full ring spills to the next one, and only when every
+    // ring is full is the task rejected.
+    size_t start = tl_worker && tl_worker->pool == pool
+        ? tl_worker->id
+        : atomic_fetch_add_explicit(&pool->next, 1, memory_order_relaxed);
+    for (size_t i = 0; i < pool->num_threads; i++) {
+        worker_t *w = &pool->workers[(start + i) % pool->num_threads];
+        if (ring_push(w, func, arg) < 0) continue;
+
+        atomic_thread_fence(memory_order_seq_cst);
+        // Wake the owner if it is parked, else one parked worker to steal it.
+        if (!wake_worker(w)) {
+            for (size_t j = 1; j < pool->num_threads; j++) {
+                if (wake_worker(&pool->workers[(w->id + j) % pool->num_threads]))
+                    break;
+            }
+        }
+        return 0;
+    }
+    return -1;
+}
+
+size_t threadpool_queued(threadpool_t *pool) {
+    size_t n = 0;
+    for (size_t i = 0; i < pool->num_threads; i++) {
+        worker_t *w = &pool->workers[i];
+        size_t head = atomic_load_explicit(&w->head, memory_order_relaxed);
+        size_t tail = atomic_load_explicit(&w->tail, memory_order_relaxed);
+        if (tail > head) n += tail - head;
+    }
+    return n;
+}
+
+void threadpool_destroy(threadpool_t *pool) {
+    if (!pool) return;
+    pool_teardown(pool, pool->num_threads, pool->num_threads);
+}
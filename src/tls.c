@@ -0,0 +1,227 @@
+#define _GNU_SOURCE
+
+#include "tls.h"
+#include "metrics.h"
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <openssl/err.h>
+#include <openssl/rand.h>
+#include <openssl/ssl.h>
+
+// Plaintext handed to SSL_write() at a time: one full record.
+#define TLS_RECORD 16384
+#define TLS_IOV 64
+
+struct tls {
+    SSL *ssl;
+    short want;         // POLLIN or POLLOUT
+    int established;    // handshake done and counted
+    int failed;         // a fatal error: no close_notify
+    int ktls;           // the kernel encrypts what we send
+};
+
+static SSL_CTX *ctx;
+// Name, HMAC and AES keys, as SSL_CTX_set_tlsext_ticket_keys() takes them.
+static unsigned char ticket_keys[80];
+
+// Gathered response bytes, or file data read for a session without kTLS.
+static _Thread_local unsigned char scratch[TLS_RECORD];
+
+int tls_keys_init(void) {
+    if (RAND_bytes(ticket_keys, sizeof(ticket_keys)) != 1) {
+        ERR_print_errors_fp(stderr);
+        return -1;
+    }
+    return 0;
+}
+
+// ALPN: h2 when the client offers it and HTTP/2 is on, else http/1.1.
+static int alpn_select(SSL *ssl, const unsigned char **out, unsigned char *outlen,
+                       const unsigned char *in, unsigned inlen, void *arg) {
+    (void)ssl;
+    (void)arg;
+    static const unsigned char h2[] = "\x02h2\x08http/1.1";
+    static const unsigned char http11[] = "\x08http/1.1";
+    const unsigned char *ours = g_config.http2 ? h2 : http11;
+    unsigned len = g_config.http2 ? sizeof(h2) - 1 : sizeof(http11) - 1;
+    if (SSL_select_next_proto((unsigned char **)out, outlen, ours, len, in, inlen) !=
+        OPENSSL_NPN_NEGOTIATED)
+        return SSL_TLSEXT_ERR_NOACK;
+    return SSL_TLSEXT_ERR_OK;
+}
+
+int tls_init(const server_config_t *cfg) {
+    ctx = SSL_CTX_new(TLS_server_method());
+    if (!ctx) goto fail;
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_options(ctx, SSL_OP_CIPHER_SERVER_PREFERENCE | SSL_OP_NO_RENEGOTIATION);
+    // Writes take what fits in a record and may be retried from another
+    // buffer with the same bytes; idle sessions give their buffers back.
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+                          SSL_MODE_RELEASE_BUFFERS);
+    if (cfg->tls_ktls) SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+    // Without tickets, sessions resume from this worker's own cache.
+    if (cfg->tls_tickets) {
+        if (SSL_CTX_set_tlsext_ticket_keys(ctx, ticket_keys, sizeof(ticket_keys)) != 1) goto fail;
+    } else {
+        SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+    }
+    SSL_CTX_set_session_id_context(ctx, (const unsigned char *)"httpd", 5);
+    SSL_CTX_set_alpn_select_cb(ctx, alpn_select, NULL);
+
+    if (SSL_CTX_use_certificate_chain_file(ctx, cfg->tls_cert) != 1) {
+        fprintf(stderr, "tls_cert %s: ", cfg->tls_cert);
+        goto fail;
+    }
+    if (SSL_CTX_use_PrivateKey_file(ctx, cfg->tls_key, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(ctx) != 1) {
+        fprintf(stderr, "tls_key %s: ", cfg->tls_key);
+        goto fail;
+    }
+    return 0;
+
+fail:
+    ERR_print_errors_fp(stderr);
+    SSL_CTX_free(ctx);
+    ctx = NULL;
+    return -1;
+}
+
+tls_t *tls_new(int fd) {
+    tls_t *t = malloc(sizeof(*t));
+    if (!t) return NULL;
+    t->ssl = SSL_new(ctx);
+    if (!t->ssl || SSL_set_fd(t->ssl, fd) != 1) {
+        SSL_free(t->ssl);
+        free(t);
+        return NULL;
+    }
+    SSL_set_accept_state(t->ssl);
+    t->want = POLLIN;
+    t->established = 0;
+    t->failed = 0;
+    t->ktls = 0;
+    return t;
+}
+
+void tls_free(tls_t *t) {
+    if (t->established && !t->failed) {
+        ERR_clear_error();
+        SSL_shutdown(t->ssl);
+    }
+    SSL_free(t->ssl);
+    free(t);
+}
+
+short tls_want(const tls_t *t) {
+    return t->want;
+}
+
+static void check_established(tls_t *t) {
+    if (t->established || !SSL_is_init_finished(t->ssl)) return;
+    t->established = 1;
+    metrics_add(SSL_session_reused(t->ssl) ? METRIC_TLS_RESUMED : METRIC_TLS_FULL, 1);
+#ifndef OPENSSL_NO_KTLS
+    t->ktls = BIO_get_ktls_send(SSL_get_wbio(t->ssl));
+    if (t->ktls) metrics_add(METRIC_TLS_KTLS, 1);
+#endif
+}
+
+// An operation failed with ret: 0 if it would block, else -1.
+static int blocked(tls_t *t, int ret) {
+    switch (SSL_get_error(t->ssl, ret)) {
+    case SSL_ERROR_WANT_READ:
+        t->want = POLLIN;
+        return 0;
+    case SSL_ERROR_WANT_WRITE:
+        t->want = POLLOUT;
+        return 0;
+    case SSL_ERROR_ZERO_RETURN:
+        return -1;
+    default:
+        if (!t->established) metrics_add(METRIC_TLS_FAILED, 1);
+        t->failed = 1;
+        return -1;
+    }
+}
+
+ssize_t tls_read(tls_t *t, void *buf, size_t cap) {
+    size_t n;
+    ERR_clear_error();
+    int ok = SSL_read_ex(t->ssl, buf, cap, &n);
+    check_established(t);
+    if (ok) return (ssize_t)n;
+    return blocked(t, ok);
+}
+
+// Up to a record's worth of the gathered parts, as one buffer. A part
+// that fills a record by itself is written from where it is.
+static const void *coalesce(const struct iovec *iov, int n, size_t *len) {
+    if (iov[0].iov_len >= TLS_RECORD) {
+        *len = TLS_RECORD;
+        return iov[0].iov_base;
+    }
+    size_t used = 0;
+    for (int i = 0; i < n && used < TLS_RECORD; i++) {
+        size_t take = iov[i].iov_len < TLS_RECORD - used ? iov[i].iov_len : TLS_RECORD - used;
+        memcpy(scratch + used, iov[i].iov_base, take);
+        used += take;
+    }
+    *len = used;
+    return scratch;
+}
+
+// The file part at the front of the queue: straight from the file with
+// kTLS, else read a record's worth and encrypt it here. A write that
+// would block is retried with the same bytes, as OpenSSL requires.
+static int write_file(tls_t *t, response_queue_t *q, size_t *written) {
+    off_t off;
+    size_t len;
+    int fd = response_queue_file(q, &off, &len);
+#ifndef OPENSSL_NO_KTLS
+    if (t->ktls) {
+        ossl_ssize_t s = SSL_sendfile(t->ssl, fd, off, len, 0);
+        if (s <= 0) return s == 0 ? -1 : blocked(t, -1); // 0: file shrank
+        *written = (size_t)s;
+        return 1;
+    }
+#endif
+    if (len > TLS_RECORD) len = TLS_RECORD;
+    ssize_t r = pread(fd, scratch, len, off);
+    if (r <= 0) return -1;
+    int ok = SSL_write_ex(t->ssl, scratch, (size_t)r, written);
+    return ok ? 1 : blocked(t, ok);
+}
+
+int tls_write_queue(tls_t *t, response_queue_t *q) {
+    for (;;) {
+        struct iovec iov[TLS_IOV];
+        int n, flags;
+        size_t written;
+        ERR_clear_error();
+        switch (response_queue_next(q, iov, TLS_IOV, &n, &flags)) {
+        case RESPONSE_IO_DONE:
+            return 1;
+        case RESPONSE_IO_WAIT:
+            return 0;
+        case RESPONSE_IO_SEND: {
+            size_t len;
+            const void *data = coalesce(iov, n, &len);
+            int ok = SSL_write_ex(t->ssl, data, len, &written);
+            if (!ok) return blocked(t, ok);
+            break;
+        }
+        case RESPONSE_IO_FILE: {
+            int r = write_file(t, q, &written);
+            if (r <= 0) return r;
+            break;
+        }
+        default:
+            return -1;
+        }
+        response_queue_sent(q, written);
+    }
+}
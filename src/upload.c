@@ -0,0 +1,276 @@
+#define _GNU_SOURCE
+
+#include "upload.h"
+#include "fdcache.h"
+#include "filecache.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#define MAX_BOUNDARY 70     // RFC 2046
+#define MAX_PART_HEAD 4096
+
+enum {
+    U_PREAMBLE,     // before the first delimiter
+    U_AFTER_DELIM,  // "--" closes the body, CRLF starts a part
+    U_CLOSE_DASH,
+    U_DELIM_LF,
+    U_PART_HEAD,
+    U_PART_BODY,
+    U_EPILOGUE,
+    U_ERROR,
+};
+
+struct upload {
+    int state;
+    char delim[MAX_BOUNDARY + 4];   // "\r\n--" boundary
+    size_t delim_len;
+    size_t carry;                   // delimiter bytes matched at the end of the last piece
+    char head[MAX_PART_HEAD];
+    size_t head_len;
+    int fd;                         // file part being written, or -1
+    off_t off;                      // bytes of it written so far
+    const upload_io_t *io;          // NULL for plain write()
+    char path[PATH_MAX];
+    const char *dir;
+    int saved;
+};
+
+upload_t *upload_open(const char *content_type, const char *dir) {
+    const char *b = strcasestr(content_type, "boundary=");
+    if (!b) return NULL;
+    b += 9;
+    size_t len;
+    if (*b == '"') {
+        const char *q = strchr(++b, '"');
+        if (!q) return NULL;
+        len = q - b;
+    } else {
+        len = strcspn(b, "; \t");
+    }
+    if (len == 0 || len > MAX_BOUNDARY) return NULL;
+    // The delimiter search relies on '\r' only appearing at its start.
+    for (size_t i = 0; i < len; i++)
+        if (b[i] == '\r' || b[i] == '\n') return NULL;
+
+    upload_t *up = malloc(sizeof(*up));
+    if (!up) return NULL;
+    up->state = U_PREAMBLE;
+    up->delim_len = snprintf(up->delim, sizeof(up->delim), "\r\n--%.*s", (int)len, b);
+    up->carry = 2;  // the body start counts as the CRLF before the first delimiter
+    up->head_len = 0;
+    up->fd = -1;
+    up->io = NULL;
+    up->dir = dir;
+    up->saved = 0;
+    return up;
+}
+
+void upload_set_io(upload_t *up, const upload_io_t *io) {
+    up->io = io;
+}
+
+// The part file changed under path: cached copies of it are stale.
+static void forget(const upload_t *up) {
+    fdcache_invalidate(up->path);
+    filecache_invalidate(up->path);
+}
+
+static void close_part(upload_t *up) {
+    if (up->io) up->io->close(up->io->arg, up->fd);
+    else close(up->fd);
+}
+
+static void fail(upload_t *up) {
+    if (up->fd >= 0) {
+        close_part(up);
+        unlink(up->path);
+        forget(up);
+        up->fd = -1;
+    }
+    up->state = U_ERROR;
+}
+
+// Part content (or preamble) bytes.
+static void emit(upload_t *up, const char *p, size_t n) {
+    if (up->state != U_PART_BODY || up->fd < 0) return;
+    if (up->io) {
+        if (up->io->write(up->io->arg, up->fd, p, n, up->off) < 0) fail(up);
+        else up->off += n;
+        return;
+    }
+    while (n > 0) {
+        ssize_t w = write(up->fd, p, n);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            fail(up);
+            return;
+        }
+        p += w;
+        n -= w;
+    }
+}
+
+static void finish_part(upload_t *up) {
+    if (up->fd < 0) return;
+    if (up->io) {
+        // Errors of queued writes come back through upload_fail().
+        close_part(up);
+        up->saved++;
+    } else if (close(up->fd) == 0) {
+        up->saved++;
+    } else {
+        unlink(up->path);
+    }
+    forget(up);
+    up->fd = -1;
+}
+
+// Open the file named by the part's Content-Disposition, if any. Only the
+// last path component of the client's filename is used.
+static void start_part(upload_t *up) {
+    up->head[up->head_len] = '\0';
+    const char *cd = strcasestr(up->head, "Content-Disposition:");
+    const char *fn = cd ? strcasestr(cd, "filename=\"") : NULL;
+    if (!fn) return;
+    fn += 10;
+    const char *end = strchr(fn, '"');
+    const char *eol = strstr(fn, "\r\n");
+    if (!end || (eol && eol < end)) return;
+    for (const char *s = fn; s < end; s++)
+        if (*s == '/' || *s == '\\') fn = s + 1;
+    size_t len = end - fn;
+    if (len == 0 || (len == 1 && fn[0] == '.') || (len == 2 && memcmp(fn, "..", 2) == 0))
+        return;
+
+    if (snprintf(up->path, sizeof(up->path), "%s/%.*s", up->dir, (int)len, fn)
+        >= (int)sizeof(up->path)) {
+        fail(up);
+        return;
+    }
+    up->fd = open(up->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    up->off = 0;
+    if (up->fd < 0) fail(up);
+    else forget(up);
+}
+
+static void on_delimiter(upload_t *up) {
+    finish_part(up);
+    up->state = U_AFTER_DELIM;
+}
+
+// Scan preamble or part content for the delimiter. Returns bytes consumed;
+// stops after a delimiter so the caller can switch states.
+static size_t scan_content(upload_t *up, const char *data, size_t len) {
+    const char *d = up->delim;
+    size_t dl = up->delim_len;
+
+    // Continue a delimiter that straddled the previous piece.
+    if (up->carry > 0) {
+        size_t need = dl - up->carry;
+        size_t n = len < need ? len : need;
+        if (memcmp(data, d + up->carry, n) == 0) {
+            if (n < need) {
+                up->carry += n;
+                return n;
+            }
+            up->carry = 0;
+            on_delimiter(up);
+            return n;
+        }
+        // Not a delimiter after all; '\r' occurs only at delim[0], so no
+        // later part of the held bytes can start one either.
+        size_t held = up->carry;
+        up->carry = 0;
+        emit(up, d, held);
+        if (up->state == U_ERROR) return len;
+    }
+
+    const char *p = data;
+    const char *end = data + len;
+    const char *run = data;
+    while ((p = memchr(p, '\r', end - p)) != NULL) {
+        size_t avail = end - p;
+        size_t n = avail < dl ? avail : dl;
+        if (memcmp(p, d, n) != 0) {
+            p++;
+            continue;
+        }
+        emit(up, run, p - run);
+        if (n < dl) {
+            up->carry = n;
+            return len;
+        }
+        on_delimiter(up);
+        return p + dl - data;
+    }
+    emit(up, run, end - run);
+    return len;
+}
+
+void upload_write(upload_t *up, const char *data, size_t len) {
+    while (len > 0) {
+        size_t used = 1;
+        char ch = *data;
+        switch (up->state) {
+        case U_PREAMBLE:
+        case U_PART_BODY:
+            used = scan_content(up, data, len);
+            break;
+        case U_AFTER_DELIM:
+            if (ch == '-') up->state = U_CLOSE_DASH;
+            else if (ch == '\r') up->state = U_DELIM_LF;
+            else if (ch != ' ' && ch != '\t') fail(up);
+            break;
+        case U_CLOSE_DASH:
+            if (ch == '-') up->state = U_EPILOGUE;
+            else fail(up);
+            break;
+        case U_DELIM_LF:
+            if (ch == '\n') {
+                up->state = U_PART_HEAD;
+                up->head_len = 0;
+            } else {
+                fail(up);
+            }
+            break;
+        case U_PART_HEAD:
+            if (up->head_len == MAX_PART_HEAD - 1) {
+                fail(up);
+                break;
+            }
+            up->head[up->head_len++] = ch;
+            if ((up->head_len == 2 && memcmp(up->head, "\r\n", 2) == 0) ||
+                (up->head_len >= 4 && memcmp(up->head + up->head_len - 4, "\r\n\r\n", 4) == 0)) {
+                up->state = U_PART_BODY;
+                start_part(up);
+            }
+            break;
+        case U_EPILOGUE:
+        case U_ERROR:
+            return;
+        }
+        data += used;
+        len -= used;
+    }
+}
+
+void upload_body_fn(void *up, const char *data, size_t len) {
+    upload_write(up, data, len);
+}
+
+void upload_fail(upload_t *up) {
+    fail(up);
+}
+
+int upload_close(upload_t *up) {
+    if (up->state != U_EPILOGUE) fail(up);
+    int saved = up->state == U_EPILOGUE ? up->saved : -1;
+    free(up);
+    return saved;
+}
@@ -0,0 +1,181 @@
+#define _GNU_SOURCE
+
+#include "uring.h"
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+static int sys_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned submit, unsigned wait, unsigned flags, void *arg, size_t argsz) {
+    return (int)syscall(__NR_io_uring_enter, fd, submit, wait, flags, arg, argsz);
+}
+
+static int sys_register(int fd, unsigned op, void *arg, unsigned n) {
+    return (int)syscall(__NR_io_uring_register, fd, op, arg, n);
+}
+
+#define NEEDED_FEATURES (IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG)
+
+int uring_init(uring_t *u, unsigned entries) {
+    memset(u, 0, sizeof(*u));
+    // Completions are only reaped by the owning thread, so the kernel can
+    // defer its completion work until we wait; older kernels reject that.
+    struct io_uring_params p = {
+        .flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN,
+    };
+    int fd = sys_setup(entries, &p);
+    if (fd < 0 && errno == EINVAL) {
+        memset(&p, 0, sizeof(p));
+        fd = sys_setup(entries, &p);
+    }
+    if (fd < 0) return -1;
+    if ((p.features & NEEDED_FEATURES) != NEEDED_FEATURES) {
+        close(fd);
+        errno = ENOSYS;
+        return -1;
+    }
+    u->fd = fd;
+
+    u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (u->cq_ring_size > u->sq_ring_size) u->sq_ring_size = u->cq_ring_size;
+    u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (u->sq_ring == MAP_FAILED) goto fail;
+    u->cq_ring = u->sq_ring;    // IORING_FEAT_SINGLE_MMAP
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) goto fail;
+
+    char *sq = u->sq_ring;
+    u->sq_head = (unsigned *)(sq + p.sq_off.head);
+    u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *)(sq + p.sq_off.array);
+    u->sq_entries = p.sq_entries;
+    u->sqe_tail = *u->sq_tail;
+    char *cq = u->cq_ring;
+    u->cq_head = (unsigned *)(cq + p.cq_off.head);
+    u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    u->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+
+fail:
+    uring_free(u);
+    return -1;
+}
+
+void uring_free(uring_t *u) {
+    if (u->sqes && u->sqes != MAP_FAILED) munmap(u->sqes, u->sqes_size);
+    if (u->sq_ring && u->sq_ring != MAP_FAILED) munmap(u->sq_ring, u->sq_ring_size);
+    if (u->fd > 0) close(u->fd);
+    memset(u, 0, sizeof(*u));
+}
+
+// Make the SQEs handed out so far visible to the kernel.
+static unsigned publish(uring_t *u) {
+    unsigned tail = *u->sq_tail;
+    unsigned n = u->sqe_tail - tail;
+    for (; tail != u->sqe_tail; tail++) u->sq_array[tail & *u->sq_mask] = tail & *u->sq_mask;
+    atomic_store_explicit((_Atomic unsigned *)u->sq_tail, tail, memory_order_release);
+    return n;
+}
+
+static unsigned sq_room(uring_t *u) {
+    unsigned head = atomic_load_explicit((_Atomic unsigned *)u->sq_head, memory_order_acquire);
+    return u->sq_entries - (u->sqe_tail - head);
+}
+
+int uring_reserve(uring_t *u, unsigned n) {
+    if (sq_room(u) >= n) return 0;
+    unsigned queued = publish(u);
+    while (sys_enter(u->fd, queued, 0, 0, NULL, 0) < 0 && errno == EINTR) {}
+    return sq_room(u) >= n ? 0 : -1;
+}
+
+struct io_uring_sqe *uring_sqe(uring_t *u) {
+    if (uring_reserve(u, 1) < 0) return NULL;
+    struct io_uring_sqe *sqe = &u->sqes[u->sqe_tail++ & *u->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+int uring_submit_wait(uring_t *u, int timeout_ms) {
+    unsigned n = publish(u);
+    struct __kernel_timespec ts = {
+        .tv_sec = timeout_ms / 1000,
+        .tv_nsec = (long long)(timeout_ms % 1000) * 1000000,
+    };
+    struct io_uring_getevents_arg arg = { .ts = timeout_ms >= 0 ? (uint64_t)(uintptr_t)&ts : 0 };
+    int r = sys_enter(u->fd, n, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                      &arg, sizeof(arg));
+    if (r < 0 && (errno == ETIME || errno == EINTR)) return 0;
+    return r;
+}
+
+struct io_uring_cqe *uring_cqe(uring_t *u) {
+    unsigned head = *u->cq_head;
+    if (head == atomic_load_explicit((_Atomic unsigned *)u->cq_tail, memory_order_acquire))
+        return NULL;
+    return &u->cqes[head & *u->cq_mask];
+}
+
+void uring_cqe_seen(uring_t *u) {
+    atomic_store_explicit((_Atomic unsigned *)u->cq_head, *u->cq_head + 1, memory_order_release);
+}
+
+int uring_bufs_init(uring_t *u, uring_bufs_t *b, uint16_t group, unsigned count, unsigned size) {
+    b->count = count;
+    b->size = size;
+    b->group = group;
+    b->ring = mmap(NULL, count * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (b->ring == MAP_FAILED) {
+        b->ring = NULL;
+        return -1;
+    }
+    b->mem = malloc((size_t)count * size);
+    struct io_uring_buf_reg reg = {
+        .ring_addr = (uint64_t)(uintptr_t)b->ring,
+        .ring_entries = count,
+        .bgid = group,
+    };
+    if (!b->mem || sys_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        int err = errno;
+        uring_bufs_free(b);
+        errno = err;
+        return -1;
+    }
+    b->ring->tail = 0;
+    for (unsigned i = 0; i < count; i++) uring_buf_put(b, i);
+    return 0;
+}
+
+void uring_bufs_free(uring_bufs_t *b) {
+    if (b->ring) munmap(b->ring, b->count * sizeof(struct io_uring_buf));
+    free(b->mem);
+    memset(b, 0, sizeof(*b));
+}
+
+char *uring_buf(const uring_bufs_t *b, uint16_t id) {
+    return b->mem + (size_t)id * b->size;
+}
+
+void uring_buf_put(uring_bufs_t *b, uint16_t id) {
+    uint16_t tail = b->ring->tail;
+    struct io_uring_buf *buf = &b->ring->bufs[tail & (b->count - 1)];
+    buf->addr = (uint64_t)(uintptr_t)uring_buf(b, id);
+    buf->len = b->size;
+    buf->bid = id;
+    atomic_store_explicit((_Atomic uint16_t *)&b->ring->tail, tail + 1, memory_order_release);
+}
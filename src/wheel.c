@@ -0,0 +1,123 @@
+#define _GNU_SOURCE
+
+#include "wheel.h"
+#include <time.h>
+
+#define SLOT_MASK (WHEEL_SLOTS - 1)
+#define MAX_DELTA (((uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+uint64_t wheel_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void wheel_init(timer_wheel_t *w, uint64_t now) {
+    for (int l = 0; l < WHEEL_LEVELS; l++)
+        for (int s = 0; s < WHEEL_SLOTS; s++)
+            w->slots[l][s] = NULL;
+    w->tick = now / WHEEL_TICK_MS;
+    w->count = 0;
+}
+
+void wheel_timer_init(wheel_timer_t *t, void (*fn)(wheel_timer_t *t)) {
+    t->next = NULL;
+    t->pprev = NULL;
+    t->expires = 0;
+    t->fn = fn;
+}
+
+static void unlink_timer(wheel_timer_t *t) {
+    *t->pprev = t->next;
+    if (t->next) t->next->pprev = t->pprev;
+    t->next = NULL;
+    t->pprev = NULL;
+}
+
+// File t by how far away it is: level l holds deadlines less than
+// 64^(l+1) ticks ahead, indexed by the matching bits of the deadline. A
+// timer cascading on its own tick lands in the slot about to fire.
+static void place(timer_wheel_t *w, wheel_timer_t *t) {
+    uint64_t delta = t->expires - w->tick;
+    if (delta > MAX_DELTA) {
+        delta = MAX_DELTA;
+        t->expires = w->tick + delta;
+    }
+    int level = 0;
+    while (delta >= (uint64_t)1 << (WHEEL_BITS * (level + 1))) level++;
+    wheel_timer_t **slot =
+        &w->slots[level][(t->expires >> (WHEEL_BITS * level)) & SLOT_MASK];
+    t->next = *slot;
+    if (t->next) t->next->pprev = &t->next;
+    t->pprev = slot;
+    *slot = t;
+}
+
+void wheel_add(timer_wheel_t *w, wheel_timer_t *t, uint64_t when) {
+    if (t->pprev) unlink_timer(t);
+    else w->count++;
+    t->expires = (when + WHEEL_TICK_MS - 1) / WHEEL_TICK_MS;
+    // The current tick's slot has already fired.
+    if (t->expires <= w->tick) t->expires = w->tick + 1;
+    place(w, t);
+}
+
+void wheel_cancel(timer_wheel_t *w, wheel_timer_t *t) {
+    if (!t->pprev) return;
+    unlink_timer(t);
+    w->count--;
+}
+
+// Re-file a coarse slot whose span has just begun.
+static void cascade(timer_wheel_t *w, int level) {
+    wheel_timer_t **slot = &w->slots[level][(w->tick >> (WHEEL_BITS * level)) & SLOT_MASK];
+    wheel_timer_t *t = *slot;
+    *slot = NULL;
+    while (t) {
+        wheel_timer_t *next = t->next;
+        place(w, t);
+        t = next;
+    }
+}
+
+int wheel_timeout(const timer_wheel_t *w, uint64_t now) {
+    if (w->count == 0) return -1;
+    // The next occupied fine slot, else the next cascade.
+    uint64_t due = (w->tick | SLOT_MASK) + 1;
+    for (uint64_t t = w->tick + 1; t < due; t++) {
+        if (w->slots[0][t & SLOT_MASK]) {
+            due = t;
+            break;
+        }
+    }
+    uint64_t at = due * WHEEL_TICK_MS;
+    return at > now ? (int)(at - now) : 0;
+}
+
+void wheel_advance(timer_wheel_t *w, uint64_t now) {
+    uint64_t target = now / WHEEL_TICK_MS;
+    if (w->count == 0) {
+        if (target > w->tick) w->tick = target;
+        return;
+    }
+    while (w->tick < target) {
+        w->tick++;
+        for (int l = 1; l < WHEEL_LEVELS; l++) {
+            if ((w->tick >> (WHEEL_BITS * (l - 1))) & SLOT_MASK) break;
+            cascade(w, l);
+        }
+        // Callbacks only ever arm timers for later ticks, so the slot
+        // drains even if they add or cancel timers.
+        wheel_timer_t **slot = &w->slots[0][w->tick & SLOT_MASK];
+        while (*slot) {
+            wheel_timer_t *t = *slot;
+            unlink_timer(t);
+            w->count--;
+            t->fn(t);
+        }
+        if (w->count == 0) {
+            w->tick = target;
+            break;
+        }
+    }
+}